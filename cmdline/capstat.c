@@ -0,0 +1,460 @@
+/*
+ *  capstat.c
+ *
+ *  Reads a DSI capture, as saved by afpfsd, and prints how long the server
+ *  took over each kind of request.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+
+/*
+ * This understands pcapng with raw IPv4 (what afpfsd writes), or IPv4
+ * over Ethernet, and expects each TCP segment to start with a DSI header,
+ * which is how afpfsd writes them.  A reply is matched to the request it
+ * has the id of, on the same connection, and the time between the two is
+ * the service time.
+ */
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_IPV4 228
+
+#define MAX_INTERFACES 16
+
+#define DSI_HEADER_LEN 16
+#define DSI_CloseSession 1
+#define DSI_Command 2
+#define DSI_GetStatus 3
+#define DSI_OpenSession 4
+#define DSI_Write 6
+
+/* AFP commands, then the DSI requests that aren't AFP commands */
+#define NUM_KINDS (256+8)
+
+struct kind {
+	unsigned long long count;
+	unsigned long long errors;
+	unsigned long long bytes_out;
+	unsigned long long bytes_in;
+	unsigned int * times;
+	unsigned int num_times;
+	unsigned int max_times;
+};
+
+struct pending {
+	uint64_t time;
+	unsigned short kind;
+	unsigned char waiting;
+};
+
+struct connection {
+	uint32_t client_addr, server_addr;
+	uint16_t client_port, server_port;
+	struct pending requests[65536];
+	struct connection * next;
+};
+
+static struct kind kinds[NUM_KINDS];
+static struct connection * connections;
+static int swapped;
+static struct {
+	unsigned int linktype;
+	uint64_t units_per_second;
+} interfaces[MAX_INTERFACES];
+static unsigned int num_interfaces;
+static unsigned long long packets, skipped, unmatched;
+
+static uint32_t get32(uint32_t v)
+{
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t get16(uint16_t v)
+{
+	return swapped ? __builtin_bswap16(v) : v;
+}
+
+static const char * kind_name(unsigned int kind)
+{
+	static const char * dsi_names[] = { "DSI 0", "DSICloseSession",
+		"DSICommand", "DSIGetStatus", "DSIOpenSession", "DSITickle",
+		"DSIWrite", "DSI 7" };
+
+	if (kind<256)
+		return afp_get_command_name(kind);
+	return dsi_names[kind-256];
+}
+
+/* The connection a packet from src to dst is on.  The client is whoever
+ * sends the first request. */
+static struct connection * find_connection(uint32_t src, uint16_t sport,
+	uint32_t dst, uint16_t dport, int request)
+{
+	struct connection * c;
+
+	for (c=connections;c;c=c->next) {
+		if ((c->client_addr==src) && (c->client_port==sport) &&
+			(c->server_addr==dst) && (c->server_port==dport))
+			return c;
+		if ((c->client_addr==dst) && (c->client_port==dport) &&
+			(c->server_addr==src) && (c->server_port==sport))
+			return c;
+	}
+	if (!request) return NULL;
+	if ((c=calloc(1,sizeof(*c)))==NULL) {
+		perror("Allocating");
+		exit(1);
+	}
+	c->client_addr=src; c->client_port=sport;
+	c->server_addr=dst; c->server_port=dport;
+	c->next=connections;
+	connections=c;
+	return c;
+}
+
+static void add_time(struct kind * k, unsigned int us)
+{
+	if (k->num_times==k->max_times) {
+		k->max_times=k->max_times ? k->max_times*2 : 1024;
+		if ((k->times=realloc(k->times,
+			k->max_times*sizeof(unsigned int)))==NULL) {
+			perror("Allocating");
+			exit(1);
+		}
+	}
+	k->times[k->num_times++]=us;
+}
+
+static void dsi_packet(uint64_t time, uint32_t src, uint16_t sport,
+	uint32_t dst, uint16_t dport, unsigned char * p, unsigned int caplen)
+{
+	struct connection * c;
+	struct pending * r;
+	struct kind * k;
+	unsigned short id;
+	unsigned int length, kind;
+	int rc;
+
+	if (caplen<DSI_HEADER_LEN) {
+		skipped++;
+		return;
+	}
+	id=(p[2]<<8)|p[3];
+	rc=(int) ((p[4]<<24)|(p[5]<<16)|(p[6]<<8)|p[7]);
+	length=(p[8]<<24)|(p[9]<<16)|(p[10]<<8)|p[11];
+
+	switch (p[1]) {
+	case DSI_Command:
+	case DSI_Write:
+		/* A reply is the same kind as its request */
+		if (p[0]) {
+			kind=0;
+			break;
+		}
+		if (caplen<=DSI_HEADER_LEN) {
+			skipped++;
+			return;
+		}
+		kind=p[DSI_HEADER_LEN];
+		break;
+	case DSI_CloseSession:
+	case DSI_GetStatus:
+	case DSI_OpenSession:
+		kind=256+p[1];
+		break;
+	default:
+		/* Tickles and attentions get no reply */
+		return;
+	}
+
+	if (p[0]==0) {
+		c=find_connection(src,sport,dst,dport,1);
+		r=&c->requests[id];
+		r->time=time;
+		r->kind=kind;
+		r->waiting=1;
+		kinds[kind].bytes_out+=length;
+		return;
+	}
+
+	if (((c=find_connection(src,sport,dst,dport,0))==NULL) ||
+		(!c->requests[id].waiting)) {
+		unmatched++;
+		return;
+	}
+	r=&c->requests[id];
+	r->waiting=0;
+	k=&kinds[r->kind];
+	k->count++;
+	k->bytes_in+=length;
+	if ((rc!=kFPNoErr) && (rc!=kFPEOFErr))
+		k->errors++;
+	add_time(k,(time>r->time) ? time-r->time : 0);
+}
+
+static void ip_packet(uint64_t time, unsigned char * p, unsigned int caplen)
+{
+	unsigned int ihl, doff;
+	uint32_t src, dst;
+	uint16_t sport, dport;
+
+	if ((caplen<20) || ((p[0]>>4)!=4) || (p[9]!=6)) {
+		skipped++;
+		return;
+	}
+	ihl=(p[0]&0xf)*4;
+	if (caplen<ihl+20) {
+		skipped++;
+		return;
+	}
+	memcpy(&src,p+12,4);
+	memcpy(&dst,p+16,4);
+	p+=ihl; caplen-=ihl;
+	memcpy(&sport,p,2);
+	memcpy(&dport,p+2,2);
+	doff=(p[12]>>4)*4;
+	if (caplen<=doff) return;
+	dsi_packet(time,src,ntohs(sport),dst,ntohs(dport),p+doff,
+		caplen-doff);
+}
+
+static void enhanced_packet(unsigned char * body, unsigned int len)
+{
+	uint32_t v[5];
+	unsigned int interface, caplen;
+	uint64_t ts, time;
+	unsigned char * p;
+
+	if (len<20) return;
+	memcpy(v,body,20);
+	interface=get32(v[0]);
+	ts=((uint64_t) get32(v[1])<<32)|get32(v[2]);
+	caplen=get32(v[3]);
+	if ((interface>=num_interfaces) || (caplen>len-20)) {
+		skipped++;
+		return;
+	}
+	/* In us */
+	time=(interfaces[interface].units_per_second==1000000) ? ts :
+		(uint64_t) ((double) ts*1000000/
+		interfaces[interface].units_per_second);
+	p=body+20;
+	packets++;
+
+	switch (interfaces[interface].linktype) {
+	case LINKTYPE_ETHERNET:
+		if ((caplen<14) || (p[12]!=0x08) || (p[13]!=0x00)) {
+			skipped++;
+			return;
+		}
+		ip_packet(time,p+14,caplen-14);
+		break;
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+		ip_packet(time,p,caplen);
+		break;
+	default:
+		skipped++;
+	}
+}
+
+static void interface_description(unsigned char * body, unsigned int len)
+{
+	uint16_t code, optlen, linktype;
+	unsigned int pos=8, i;
+	uint64_t units=1000000;
+
+	if ((len<8) || (num_interfaces==MAX_INTERFACES)) return;
+	memcpy(&linktype,body,2);
+
+	/* if_tsresol says what the timestamps count */
+	while (pos+4<=len) {
+		memcpy(&code,body+pos,2);
+		memcpy(&optlen,body+pos+2,2);
+		code=get16(code); optlen=get16(optlen);
+		if (code==0) break;
+		if ((code==9) && (optlen>=1) && (pos+5<=len)) {
+			unsigned char r = body[pos+4];
+
+			units=1;
+			if (r&0x80)
+				for (i=0;i<(r&0x7f);i++) units*=2;
+			else
+				for (i=0;i<r;i++) units*=10;
+		}
+		pos+=4+((optlen+3)&~3);
+	}
+	interfaces[num_interfaces].linktype=get16(linktype);
+	interfaces[num_interfaces].units_per_second=units;
+	num_interfaces++;
+}
+
+static int read_capture(FILE * f)
+{
+	uint32_t type, total, magic;
+	unsigned char * body=NULL;
+	unsigned int max=0, len;
+
+	while (fread(&type,4,1,f)==1) {
+		if (fread(&total,4,1,f)!=1) break;
+		if (type==PCAPNG_SHB) {
+			/* The byte order magic comes first, and says how to
+			 * read the lengths, including this one */
+			if (fread(&magic,4,1,f)!=1) break;
+			if (magic==PCAPNG_BYTE_ORDER)
+				swapped=0;
+			else if (magic==__builtin_bswap32(PCAPNG_BYTE_ORDER))
+				swapped=1;
+			else {
+				printf("Not a pcapng file\n");
+				return -1;
+			}
+			num_interfaces=0;
+			total=get32(total);
+			if (total<12) break;
+			if (fseek(f,total-12,SEEK_CUR)) break;
+			continue;
+		}
+		total=get32(total);
+		if (total<12) {
+			printf("Bad block length %u\n",total);
+			return -1;
+		}
+		len=total-12;
+		if (len>max) {
+			max=len;
+			if ((body=realloc(body,max))==NULL) {
+				perror("Allocating");
+				return -1;
+			}
+		}
+		if ((len) && (fread(body,len,1,f)!=1)) break;
+		if (fread(&total,4,1,f)!=1) break;
+
+		switch (get32(type)) {
+		case PCAPNG_IDB:
+			interface_description(body,len);
+			break;
+		case PCAPNG_EPB:
+			enhanced_packet(body,len);
+			break;
+		}
+	}
+	free(body);
+	return 0;
+}
+
+static int compare_uint(const void * a, const void * b)
+{
+	unsigned int x = *(const unsigned int *) a;
+	unsigned int y = *(const unsigned int *) b;
+
+	return (x>y)-(x<y);
+}
+
+static double percentile(struct kind * k, unsigned int permille)
+{
+	unsigned int i;
+
+	i=((unsigned long long) k->num_times*permille+999)/1000;
+	if (i>0) i--;
+	return k->times[i]/1000.0;
+}
+
+static void print_histogram(struct kind * k)
+{
+	unsigned long long counts[33], most=0;
+	unsigned int i, b, width;
+
+	memset(counts,0,sizeof(counts));
+	for (i=0;i<k->num_times;i++) {
+		b=k->times[i] ? 32-__builtin_clz(k->times[i]) : 0;
+		counts[b]++;
+	}
+	for (b=0;b<33;b++)
+		if (counts[b]>most) most=counts[b];
+	for (b=0;b<33;b++) {
+		if (counts[b]==0) continue;
+		width=(counts[b]*50+most-1)/most;
+		printf("        %10u us %8llu ",b ? 1u<<(b-1) : 0,counts[b]);
+		for (i=0;i<width;i++) putchar('#');
+		putchar('\n');
+	}
+}
+
+static void usage(void)
+{
+	printf("afpcapstat [-v] <capture file>\n"
+		"    -v : show the distribution of times for each request\n");
+}
+
+int main(int argc, char * argv[])
+{
+	struct connection * c;
+	struct kind * k;
+	unsigned int i, j, unanswered=0;
+	int verbose=0, opt;
+	FILE * f;
+
+	while ((opt=getopt(argc,argv,"v"))!=-1) {
+		switch (opt) {
+		case 'v':
+			verbose=1;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if (optind!=argc-1) {
+		usage();
+		return -1;
+	}
+	if ((f=fopen(argv[optind],"r"))==NULL) {
+		perror("Opening capture");
+		return -1;
+	}
+	if (read_capture(f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	for (c=connections;c;c=c->next)
+		for (i=0;i<65536;i++)
+			if (c->requests[i].waiting) unanswered++;
+
+	printf("%llu packets, %llu not understood, %llu replies to "
+		"requests not captured, %u requests with no reply\n",
+		packets,skipped,unmatched,unanswered);
+	printf("%-24s %8s %7s %10s %10s %8s %8s %8s %8s %8s\n",
+		"request","count","errors","KB out","KB in",
+		"min ms","p50 ms","p90 ms","p99 ms","max ms");
+	for (j=0;j<NUM_KINDS;j++) {
+		k=&kinds[j];
+		if (k->num_times==0) continue;
+		qsort(k->times,k->num_times,sizeof(unsigned int),compare_uint);
+		printf("%-24s %8llu %7llu %10llu %10llu %8.2f %8.2f %8.2f "
+			"%8.2f %8.2f\n",
+			kind_name(j),k->count,k->errors,
+			k->bytes_out/1024,k->bytes_in/1024,
+			k->times[0]/1000.0,percentile(k,500),percentile(k,900),
+			percentile(k,990),k->times[k->num_times-1]/1000.0);
+		if (verbose)
+			print_histogram(k);
+	}
+	return 0;
+}
@@ -193,7 +193,7 @@ static int connect_volume(const char * volumename)
 		goto error;
 	}
 	vol->mapping= AFP_MAPPING_LOGINIDS;
-	vol->extra_flags |= VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	afp_set_locking(vol,AFP_LOCKING_NONE);
 
 	if (afp_connect_volume(vol,server,mesg,&len,1024 ))
 	{
@@ -1216,7 +1216,8 @@ void cmdline_afp_setup_client(void)
 }
 
 
-int cmdline_afp_setup(int recursive, char * url_string)
+int cmdline_afp_setup(int recursive, char * url_string,
+	struct afp_socket_options * socket_options)
 {
 	struct passwd * passwd;
 
@@ -1224,6 +1225,7 @@ int cmdline_afp_setup(int recursive, char * url_string)
 	if (init_uams()<0) return -1;
 
 	afp_default_url(&url);
+	url.socket_options=*socket_options;
 
 	passwd = getpwuid(getuid());
 	strncpy(url.username, passwd->pw_name,AFP_MAX_USERNAME_LEN);
@@ -1,6 +1,8 @@
 #ifndef CMDLINE_AFP_H_
 #define CMDLINE_AFP_H_
 
+struct afp_socket_options;
+
 int full_url;
 
 int com_connect(char * arg);
@@ -27,6 +29,7 @@ int com_disconnect(char * arg);
 
 void cmdline_afp_exit(void);
 
-int cmdline_afp_setup(int recursive, char * url_string);
+int cmdline_afp_setup(int recursive, char * url_string,
+	struct afp_socket_options * socket_options);
 
 #endif
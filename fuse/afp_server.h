@@ -10,6 +10,8 @@
 #define AFP_SERVER_COMMAND_RESUME 5
 #define AFP_SERVER_COMMAND_PING 6
 #define AFP_SERVER_COMMAND_EXIT 7
+#define AFP_SERVER_COMMAND_STATS 8
+#define AFP_SERVER_COMMAND_CAPTURE 9
 
 #define AFP_SERVER_RESULT_OKAY 1
 #define AFP_SERVER_RESULT_ERROR 2
@@ -35,6 +37,16 @@ struct afp_server_mount_request {
 	unsigned int volume_options;
 	unsigned int map;
 	int changeuid;
+	int receive_thread;
+	unsigned int max_quantum;
+	/* For the shared block cache, or 0 for none */
+	uint64_t cache_size;
+	unsigned int cache_block;
+	/* For keeping file data on disk, or empty for none */
+	char cache_dir[1024];
+	uint64_t cache_dir_size;
+	/* One of AFP_LOCKING_* */
+	unsigned int locking;
 };
 
 struct afp_server_status_request {
@@ -42,6 +54,17 @@ struct afp_server_status_request {
 	char servername[AFP_VOLUME_NAME_LEN];
 };
 
+#define AFP_CAPTURE_START 1
+#define AFP_CAPTURE_STOP 2
+#define AFP_CAPTURE_SAVE 3
+
+struct afp_server_capture_request {
+	char server_name[AFP_SERVER_NAME_LEN];
+	int action;
+	unsigned int snaplen;
+	char path[1024];
+};
+
 struct afp_server_response {
 	char result;
 	unsigned int len;
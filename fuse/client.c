@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <grp.h>
 
 #include "config.h"
@@ -25,6 +26,7 @@
 #define AFPFSD_FILENAME "afpfsd"
 #define DEFAULT_MOUNT_FLAGS (VOLUME_EXTRA_FLAGS_SHOW_APPLEDOUBLE|\
 	VOLUME_EXTRA_FLAGS_NO_LOCKING | VOLUME_EXTRA_FLAGS_IGNORE_UNIXPRIVS)
+#define DEFAULT_LOCKING AFP_LOCKING_NONE
 
 static char outgoing_buffer[MAX_OUTGOING_LENGTH];
 static int outgoing_len=0;
@@ -137,6 +139,44 @@ done:
 }
 
 
+/* Takes a size like 1048576, 1024K or 1M, which may be followed by a ':'
+ * and more.  Returns -1 if it isn't one, or is more than max. */
+static int parse_size(const char * s, unsigned long long max,
+	unsigned long long * size)
+{
+	char * end;
+	unsigned long long n, unit=1;
+
+	if ((*s<'0') || (*s>'9'))
+		return -1;
+	errno=0;
+	n=strtoull(s,&end,10);
+	if (errno)
+		return -1;
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		unit=1024;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		unit=1024*1024;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		unit=1024*1024*1024;
+		end++;
+		break;
+	}
+	if (((*end) && (*end!=':')) || (n>max/unit))
+		return -1;
+	*size=n*unit;
+	return 0;
+}
+
 static void usage(void) 
 {
 	printf(
@@ -155,7 +195,35 @@ static void usage(void)
 "               \"DHCAST128\", \"Client Krb v2\", \"DHX2\" \n\n"
 "         -m, --map <mapname> : use this uid/gid mapping method, one of:\n"
 "               \"Common user directory\", \"Login ids\"\n"
+"         -r, --receivethread : give the server its own receive thread, so\n"
+"               a busy mount can't delay replies for the others\n"
+"         -q, --quantum <size> : read and write up to <size> bytes per\n"
+"               request, eg. 4M, if the server allows it\n"
+"         -S, --socket <options> : tune the connection, with a comma\n"
+"               separated list of nodelay=0, sndbuf=<size>,\n"
+"               rcvbuf=<size>, keepalive=<idle>[:<interval>[:<count>]],\n"
+"               busypoll=<usecs>, bulkshare=<percent>, stripes=<n>,\n"
+"               readahead=<quantums>\n"
+"         -c, --cache <size>[:<blocksize>] : keep up to <size> of file\n"
+"               data, eg. 512M, in blocks of <blocksize> (128K by\n"
+"               default), shared by every mount that has a cache\n"
+"         -d, --cachedir <dir> : keep file data read in <dir>, across\n"
+"               mounts, for reading again\n"
+"         -D, --cachedirsize <size> : keep up to <size> there, 1G by\n"
+"               default\n"
+"         -l, --locking <mode> : when to take byte range locks, one of\n"
+"               none (the default), advisory (when applications lock),\n"
+"               io (around every read and write) or lease (open files\n"
+"               denying others write access, locking only if that fails)\n"
 "    status: get status of the AFP daemon\n\n"
+"    stats [servername] : counts, bytes and latencies for each AFP command\n"
+"                         sent, one line of key=value fields per command\n\n"
+"    capture start <servername> [snaplen] : keep the last DSI packets to\n"
+"                         and from the server, up to <snaplen> bytes of\n"
+"                         each (by default only the headers)\n"
+"    capture stop <servername> : stop keeping them\n"
+"    capture save <servername> <file> : write them out as pcapng, for\n"
+"                         afpcapstat or Wireshark\n\n"
 "    unmount <mountpoint> : unmount\n\n"
 "    suspend <servername> : terminates the connection to the server, but\n"
 "                           maintains the mount.  For laptop suspend/resume\n"
@@ -213,6 +281,67 @@ static int do_status(int argc, char ** argv)
         return 0;
 }
 
+static int do_stats(int argc, char ** argv) 
+{
+	struct afp_server_status_request * req;
+
+	outgoing_len=sizeof(struct afp_server_status_request)+1;
+	req = (void *) outgoing_buffer+1;
+	memset(outgoing_buffer,0,outgoing_len);
+	outgoing_buffer[0]=AFP_SERVER_COMMAND_STATS;
+	if (argc>2)
+		snprintf(req->servername,AFP_VOLUME_NAME_LEN,"%s",argv[2]);
+
+	return 0;
+}
+
+/* afpfsd works from wherever it was started, or from / once it has
+ * daemonized, so a path it is to use has to be made absolute here.
+ * Returns -1 if it doesn't fit in len. */
+static int absolute_path(char * dest, size_t len, const char * path)
+{
+	char cwd[MAXPATHLEN];
+	int n;
+
+	if ((path[0]!='/') && (getcwd(cwd,sizeof(cwd))))
+		n=snprintf(dest,len,"%s/%s",cwd,path);
+	else
+		n=snprintf(dest,len,"%s",path);
+	return ((n<0) || ((size_t) n>=len)) ? -1 : 0;
+}
+
+static int do_capture(int argc, char ** argv) 
+{
+	struct afp_server_capture_request * req;
+
+	outgoing_len=sizeof(struct afp_server_capture_request)+1;
+	req = (void *) outgoing_buffer+1;
+	if (argc<4) {
+		usage();
+		return -1;
+	}
+	memset(req,0,sizeof(*req));
+	snprintf(req->server_name,AFP_SERVER_NAME_LEN,"%s",argv[3]);
+	if (strcmp(argv[2],"start")==0) {
+		req->action=AFP_CAPTURE_START;
+		if (argc>4) req->snaplen=atoi(argv[4]);
+	} else if (strcmp(argv[2],"stop")==0) {
+		req->action=AFP_CAPTURE_STOP;
+	} else if ((strcmp(argv[2],"save")==0) && (argc>4)) {
+		req->action=AFP_CAPTURE_SAVE;
+		if (absolute_path(req->path,sizeof(req->path),argv[4])) {
+			printf("%s is too long a path\n",argv[4]);
+			return -1;
+		}
+	} else {
+		usage();
+		return -1;
+	}
+	outgoing_buffer[0]=AFP_SERVER_COMMAND_CAPTURE;
+
+	return 0;
+}
+
 static int do_resume(int argc, char ** argv) 
 {
 	struct afp_server_resume_request * req;
@@ -271,6 +400,9 @@ static int do_mount(int argc, char ** argv)
 	struct afp_server_mount_request * req;
 	int optnum;
 	unsigned int uam_mask=default_uams_mask();
+	char * p;
+	int locking;
+	unsigned long long size;
 
 	struct option long_options[] = {
 		{"afpversion",1,0,'v'},
@@ -280,6 +412,13 @@ static int do_mount(int argc, char ** argv)
 		{"port",1,0,'o'},
 		{"uam",1,0,'a'},
 		{"map",1,0,'m'},
+		{"receivethread",0,0,'r'},
+		{"quantum",1,0,'q'},
+		{"socket",1,0,'S'},
+		{"cache",1,0,'c'},
+		{"cachedir",1,0,'d'},
+		{"cachedirsize",1,0,'D'},
+		{"locking",1,0,'l'},
 		{0,0,0,0},
 	};
 
@@ -294,10 +433,11 @@ static int do_mount(int argc, char ** argv)
 	outgoing_buffer[0]=AFP_SERVER_COMMAND_MOUNT;
 	req->url.port=548;
 	req->map=AFP_MAPPING_UNKNOWN;
+	req->locking=DEFAULT_LOCKING;
 
         while(1) {
 		optnum++;
-                c = getopt_long(argc,argv,"a:u:m:o:p:v:V:",
+                c = getopt_long(argc,argv,"a:u:m:o:p:q:rS:c:d:D:l:v:V:",
                         long_options,&option_index);
                 if (c==-1) break;
                 switch(c) {
@@ -310,6 +450,50 @@ static int do_mount(int argc, char ** argv)
                 case 'm':
 			req->map=map_string_to_num(optarg);
                         break;
+                case 'r':
+			req->receive_thread=1;
+                        break;
+                case 'q':
+			if (parse_size(optarg,UINT_MAX,&size))
+				goto bad_size;
+			req->max_quantum=size;
+                        break;
+                case 'c':
+			if (parse_size(optarg,~0ULL,&size))
+				goto bad_size;
+			req->cache_size=size;
+			if ((p=strchr(optarg,':'))) {
+				if (parse_size(p+1,UINT_MAX,&size))
+					goto bad_size;
+				req->cache_block=size;
+			}
+                        break;
+                case 'd':
+			if (absolute_path(req->cache_dir,sizeof(req->cache_dir),
+				optarg)) {
+				printf("%s is too long a path\n",optarg);
+				return -1;
+			}
+                        break;
+                case 'D':
+			if (parse_size(optarg,~0ULL,&size))
+				goto bad_size;
+			req->cache_dir_size=size;
+                        break;
+                case 'l':
+			if ((locking=afp_locking_from_string(optarg))<0) {
+				printf("Unknown locking mode %s\n",optarg);
+				return -1;
+			}
+			req->locking=locking;
+                        break;
+                case 'S':
+			if (afp_parse_socket_options(
+				&req->url.socket_options,optarg)) {
+				printf("Unknown socket option in %s\n",optarg);
+				return -1;
+			}
+                        break;
                 case 'u':
                         snprintf(req->url.username,AFP_MAX_USERNAME_LEN,"%s",optarg);
                         break;
@@ -366,6 +550,10 @@ static int do_mount(int argc, char ** argv)
 
 
         return 0;
+
+bad_size:
+	printf("Bad size %s\n",optarg);
+	return -1;
 }
 
 static void mount_afp_usage(void)
@@ -380,7 +568,15 @@ static int handle_mount_afp(int argc, char * argv[])
 	char * urlstring, * mountpoint;
 	char * volpass = NULL;
 	int readonly=0;
-
+	unsigned long long quantum=0;
+	unsigned long long cache_size=0;
+	unsigned long long cache_block=0;
+	char cache_dir[1024]="";
+	unsigned long long cache_dir_size=0;
+	int locking=DEFAULT_LOCKING;
+	struct afp_socket_options socket_options;
+
+	memset(&socket_options,0,sizeof(socket_options));
 	if (argc<2) {
 		mount_afp_usage();
 		return -1;
@@ -419,11 +615,40 @@ static int handle_mount_afp(int argc, char * argv[])
 				}
 				gid=group->gr_gid;
 				changegid=1;
+			} else if (strncmp(command,"quantum=",8)==0) {
+				if (parse_size(command+8,UINT_MAX,&quantum))
+					goto bad_size;
+			} else if (strncmp(command,"cache=",6)==0) {
+				if (parse_size(command+6,~0ULL,&cache_size))
+					goto bad_size;
+			} else if (strncmp(command,"cacheblock=",11)==0) {
+				if (parse_size(command+11,UINT_MAX,
+					&cache_block))
+					goto bad_size;
+			} else if (strncmp(command,"cachedir=",9)==0) {
+				if (absolute_path(cache_dir,sizeof(cache_dir),
+					command+9)) {
+					printf("%s is too long a path\n",
+						command+9);
+					return -1;
+				}
+			} else if (strncmp(command,"cachedirsize=",13)==0) {
+				if (parse_size(command+13,~0ULL,
+					&cache_dir_size))
+					goto bad_size;
+			} else if (strncmp(command,"locking=",8)==0) {
+				if ((locking=afp_locking_from_string(
+					command+8))<0) {
+					printf("Unknown locking mode %s\n",
+						command+8);
+					return -1;
+				}
 			} else if (strcmp(command,"rw")==0) {
 				/* Don't do anything */
 			} else if (strcmp(command,"ro")==0) {
 				readonly=1;
-			} else {
+			} else if (afp_parse_socket_options(&socket_options,
+				command)) {
 				printf("Unknown option %s, skipping\n",command);
 			}
 		
@@ -447,6 +672,12 @@ static int handle_mount_afp(int argc, char * argv[])
 	afp_default_url(&req->url);
 
 	req->changeuid=changeuid;
+	req->max_quantum=quantum;
+	req->cache_size=cache_size;
+	req->cache_block=cache_block;
+	snprintf(req->cache_dir,sizeof(req->cache_dir),"%s",cache_dir);
+	req->cache_dir_size=cache_dir_size;
+	req->locking=locking;
 
 	req->volume_options|=DEFAULT_MOUNT_FLAGS;
 	if (readonly) req->volume_options |= VOLUME_EXTRA_FLAGS_READONLY;
@@ -460,6 +691,7 @@ static int handle_mount_afp(int argc, char * argv[])
 		printf("Could not parse URL\n");
 		return -1;
 	}
+	req->url.socket_options=socket_options;
 	if (strcmp(req->url.password,"-")==0) {
 		char *p = getpass("AFP Password: ");
 		if (p)
@@ -473,6 +705,10 @@ static int handle_mount_afp(int argc, char * argv[])
 		snprintf(req->url.volpassword,9,"%s",volpass);
 
         return 0;
+
+bad_size:
+	printf("Bad size in %s\n",argv[2]);
+	return -1;
 }
 
 static int prepare_buffer(int argc, char * argv[]) 
@@ -491,6 +727,10 @@ static int prepare_buffer(int argc, char * argv[])
 
 	} else if (strncmp(argv[1],"status",6)==0) {
 		return do_status(argc,argv);
+	} else if (strncmp(argv[1],"stats",5)==0) {
+		return do_stats(argc,argv);
+	} else if (strncmp(argv[1],"capture",7)==0) {
+		return do_capture(argc,argv);
 
 	} else if (strncmp(argv[1],"unmount",7)==0) {
 		return do_unmount(argc,argv);
@@ -191,6 +191,7 @@ static void * start_fuse_thread(void * other)
 	const char *fuseargv[200];
 #define mountstring_len (AFP_SERVER_NAME_LEN+1+AFP_VOLUME_NAME_LEN+1)
 	char mountstring[mountstring_len];
+	char quantumstring[64];
 	struct start_fuse_thread_arg * arg = other;
 	struct afp_volume * volume = arg->volume;
 	struct fuse_client * c = arg->client;
@@ -221,6 +222,17 @@ static void * start_fuse_thread(void * other)
 		fuseargc++;
 	}
 
+	/* Let FUSE hand us reads and writes as big as our quantums */
+	if (server->max_quantum>AFP_DEFAULT_QUANTUM) {
+		snprintf(quantumstring,sizeof(quantumstring),
+			"big_writes,max_read=%u,max_write=%u",
+			server->rx_quantum,server->tx_quantum);
+		fuseargv[fuseargc]="-o";
+		fuseargc++;
+		fuseargv[fuseargc]=quantumstring;
+		fuseargc++;
+	}
+
 
 /* #ifdef USE_SINGLE_THREAD */
 	fuseargv[fuseargc]="-s";
@@ -284,6 +296,60 @@ static unsigned char process_suspend(struct fuse_client * c)
 }
 
 
+/* Starts or stops keeping the packets to and from a server, or saves
+ * what has been kept */
+static unsigned char process_capture(struct fuse_client * c)
+{
+	struct afp_server_capture_request * req =(void *)c->incoming_string+1;
+	struct afp_server * s;
+	int ret;
+
+	if ((c->incoming_size-1) < sizeof(struct afp_server_capture_request)) 
+		return AFP_SERVER_RESULT_ERROR;
+	req->server_name[AFP_SERVER_NAME_LEN-1]='\0';
+	req->path[sizeof(req->path)-1]='\0';
+
+	if ((s=find_server_by_name(req->server_name))==NULL) {
+		log_for_client((void *) c,AFPFSD,LOG_ERR,
+			"%s is an unknown server\n",req->server_name);
+		return AFP_SERVER_RESULT_ERROR;
+	}
+
+	switch (req->action) {
+	case AFP_CAPTURE_START:
+		if (afp_capture_start(s,req->snaplen)) {
+			log_for_client((void *) c,AFPFSD,LOG_ERR,
+				"Could not start capturing\n");
+			return AFP_SERVER_RESULT_ERROR;
+		}
+		log_for_client((void *) c,AFPFSD,LOG_NOTICE,
+			"Capturing packets for %s\n",req->server_name);
+		break;
+	case AFP_CAPTURE_STOP:
+		if (afp_capture_stop(s)) {
+			log_for_client((void *) c,AFPFSD,LOG_ERR,
+				"Not capturing for %s\n",req->server_name);
+			return AFP_SERVER_RESULT_ERROR;
+		}
+		log_for_client((void *) c,AFPFSD,LOG_NOTICE,
+			"Stopped capturing for %s\n",req->server_name);
+		break;
+	case AFP_CAPTURE_SAVE:
+		if ((ret=afp_capture_save(s,req->path))<0) {
+			log_for_client((void *) c,AFPFSD,LOG_ERR,
+				"Could not save capture to %s: %s\n",
+				req->path,strerror(errno));
+			return AFP_SERVER_RESULT_ERROR;
+		}
+		log_for_client((void *) c,AFPFSD,LOG_NOTICE,
+			"Saved %d packets to %s\n",ret,req->path);
+		break;
+	default:
+		return AFP_SERVER_RESULT_ERROR;
+	}
+	return AFP_SERVER_RESULT_OKAY;
+}
+
 static int afp_server_reconnect_loud(struct fuse_client * c, struct afp_server * s) 
 {
 	char mesg[1024];
@@ -378,6 +444,16 @@ static unsigned char process_exit(struct fuse_client * c)
 	return AFP_SERVER_RESULT_OKAY;
 }
 
+/* Adds text to what goes back to the client.  Unlike log_for_client(),
+ * this isn't limited to one line's worth, so it is used for status that
+ * can run long. */
+static void client_append(struct fuse_client * c, const char * text)
+{
+	int len = strlen(c->client_string);
+
+	snprintf(c->client_string+len,MAX_CLIENT_RESPONSE-len,"%s",text);
+}
+
 static unsigned char process_status(struct fuse_client * c)
 {
 	struct afp_server * s;
@@ -390,19 +466,48 @@ static unsigned char process_status(struct fuse_client * c)
 
 	afp_status_header(text,&len);
 
-	log_for_client((void *)c,AFPFSD,LOG_INFO,text);
-
-	s=get_server_base();
+	client_append(c,text);
 
 	for (s=get_server_base();s;s=s->next) {
+		/* These are shown under the server they belong to */
+		if (s->stripe_parent) continue;
+		len=sizeof(text);
 		afp_status_server(s,text,&len);
-		log_for_client((void *)c,AFPFSD,LOG_DEBUG,text);
+		client_append(c,text);
 	}
 
 	return AFP_SERVER_RESULT_OKAY;
 
 }
 
+/* The per command counts for each server, or just the one named */
+static unsigned char process_stats(struct fuse_client * c)
+{
+	struct afp_server_status_request * req;
+	struct afp_server * s;
+	char text[MAX_CLIENT_RESPONSE];
+	int len;
+
+	if ((c->incoming_size-1) < sizeof(struct afp_server_status_request)) 
+		return AFP_SERVER_RESULT_ERROR;
+
+	req=(void *) c->incoming_string+1;
+	req->servername[AFP_VOLUME_NAME_LEN-1]='\0';
+
+	for (s=get_server_base();s;s=s->next) {
+		/* These are counted in with the server they belong to */
+		if (s->stripe_parent) continue;
+		if ((req->servername[0]) &&
+			(strcmp(req->servername,s->server_name_printable)))
+			continue;
+		len=sizeof(text);
+		afp_status_commands(s,text,&len);
+		client_append(c,text);
+	}
+
+	return AFP_SERVER_RESULT_OKAY;
+}
+
 static int process_mount(struct fuse_client * c)
 {
 	struct afp_server_mount_request * req;
@@ -453,6 +558,8 @@ static int process_mount(struct fuse_client * c)
 
 	conn_req.url=req->url;
 	conn_req.uam_mask=req->uam_mask;
+	conn_req.receive_thread=req->receive_thread;
+	conn_req.max_quantum=req->max_quantum;
 
 	if ((s=afp_server_full_connect(c,&conn_req))==NULL) {
 		signal_main_thread();
@@ -465,6 +572,21 @@ static int process_mount(struct fuse_client * c)
 	}
 
 	volume->extra_flags|=req->volume_options;
+	afp_set_locking(volume,req->locking);
+
+	if ((req->cache_size) &&
+		((volume->block_cache=afp_block_cache_get(req->cache_size,
+		req->cache_block))==NULL))
+		log_for_client((void *)c,AFPFSD,LOG_WARNING,
+			"Could not set up the block cache\n");
+
+	if ((req->cache_dir[0]) &&
+		((volume->disk_cache=afp_disk_cache_open(volume,req->cache_dir,
+		req->cache_dir_size ? req->cache_dir_size :
+		AFP_DEFAULT_DISK_CACHE))==NULL))
+		log_for_client((void *)c,AFPFSD,LOG_WARNING,
+			"Could not set up the disk cache in %s\n",
+			req->cache_dir);
 
 	volume->mapping=req->map;
 	afp_detect_mapping(volume);
@@ -580,6 +702,12 @@ static void * process_command_thread(void * other)
 	case AFP_SERVER_COMMAND_EXIT: 
 		ret=process_exit(c);
 		break;
+	case AFP_SERVER_COMMAND_STATS: 
+		ret=process_stats(c);
+		break;
+	case AFP_SERVER_COMMAND_CAPTURE: 
+		ret=process_capture(c);
+		break;
 	default:
 		log_for_client((void *)c,AFPFSD,LOG_ERR,"Unknown command\n");
 	}
@@ -35,7 +35,7 @@
 #define STATUS_LEN 1024
 
 
-#define MAX_CLIENT_RESPONSE 2048
+#define MAX_CLIENT_RESPONSE 65536
 
 
 static int debug_mode = 0;
@@ -53,6 +53,8 @@ void fuse_forced_ending_hook(void)
 	int i;
 
 	for (s=get_server_base();s;s=s->next) {
+		/* Stripe sessions go with the server they belong to */
+		if (s->stripe_parent) continue;
 		if (s->connect_state==SERVER_STATE_CONNECTED)
 		for (i=0;i<s->num_volumes;i++) {
 			volume=&s->volumes[i];
@@ -15,7 +15,8 @@
 
 #define HAVE_ARCH_STRUCT_FLOCK
 
-#define FUSE_USE_VERSION 25
+/* 26 for the lock operation */
+#define FUSE_USE_VERSION 26
 
 
 #include "afpfs-ng/afp.h"
@@ -271,6 +272,35 @@ error:
 	return ret;
 }
 
+#if FUSE_USE_VERSION >= 26
+/* These only do anything with advisory locking; otherwise ENOSYS has the
+ * kernel keep the locks to itself */
+static int fuse_lock(const char * path, struct fuse_file_info * fi, int cmd,
+	struct flock * lock)
+{
+	struct afp_volume * volume=
+		(struct afp_volume *)
+		((struct fuse_context *)(fuse_get_context()))->private_data;
+
+	log_fuse_event(AFPFSD,LOG_DEBUG,"*** lock of %s\n",path);
+
+	return ml_lock(volume,path,(void *) fi->fh,cmd,lock);
+}
+#endif
+
+#if FUSE_VERSION >= 29
+static int fuse_flock(const char * path, struct fuse_file_info * fi, int op)
+{
+	struct afp_volume * volume=
+		(struct afp_volume *)
+		((struct fuse_context *)(fuse_get_context()))->private_data;
+
+	log_fuse_event(AFPFSD,LOG_DEBUG,"*** flock of %s\n",path);
+
+	return ml_flock(volume,path,(void *) fi->fh,op);
+}
+#endif
+
 static int fuse_chown(const char * path, uid_t uid, gid_t gid) 
 {
 	int ret;
@@ -455,7 +485,7 @@ static struct afp_volume * global_volume;
 #if FUSE_USE_VERSION < 26
 static void *afp_init(void) {
 #else 
-static void *afp_init(void * o) {
+static void *afp_init(struct fuse_conn_info * conn) {
 #endif
 	struct afp_volume * vol = global_volume;
 
@@ -489,6 +519,12 @@ static struct fuse_operations afp_oper = {
 	.destroy=afp_destroy,
 	.init=afp_init,
 	.statfs=fuse_statfs,
+#if FUSE_USE_VERSION >= 26
+	.lock=fuse_lock,
+#endif
+#if FUSE_VERSION >= 29
+	.flock=fuse_flock,
+#endif
 };
 
 
@@ -22,6 +22,47 @@
 
 typedef enum {TCPIP,AT} e_proto;
 
+/* How to set up the connection to the server.  All zeroes is the default:
+ * TCP_NODELAY on, buffers of AFP_SOCKET_BUFFER_QUANTA quantums unless
+ * the system already gives us more, no keepalive, no busy polling and
+ * AFP_DEFAULT_BULK_SHARE.  bulk_share is the percentage of what we send
+ * that reads and writes get while other requests are waiting too; 100
+ * sends everything in the order it was asked for.  stripes is how many
+ * more sessions to open, for spreading big reads and writes over.
+ * readahead is how many quantum sized reads to keep going ahead of
+ * someone reading a fork from start to end, AFP_DEFAULT_READAHEAD if 0,
+ * unless no_readahead is set. */
+struct afp_socket_options {
+	int nagle;
+	unsigned int sndbuf;
+	unsigned int rcvbuf;
+	unsigned int keepalive_idle;
+	unsigned int keepalive_interval;
+	unsigned int keepalive_count;
+	unsigned int busy_poll;
+	unsigned int bulk_share;
+	unsigned int stripes;
+	unsigned int readahead;
+	int no_readahead;
+};
+
+#define AFP_SOCKET_BUFFER_QUANTA 4
+#define AFP_DEFAULT_BULK_SHARE 75
+#define AFP_MAX_STRIPES 8
+#define AFP_DEFAULT_READAHEAD 8
+#define AFP_MAX_READAHEAD 64
+
+/* Outgoing requests are queued in two classes, so that a stat doesn't
+ * have to wait behind megabytes of writes */
+#define DSI_SEND_META 0
+#define DSI_SEND_BULK 1
+#define DSI_SEND_CLASSES 2
+
+/* Called once an asynchronous request has its reply, with the AFP result
+ * code.  That is ETIMEDOUT if no reply came in time, or kFPNoServer if
+ * the server went away first. */
+typedef void (*afp_completion)(void * context, int rc);
+
 /* afp_url is used to pass locations around */
 struct afp_url {
 	e_proto protocol;
@@ -36,6 +77,7 @@ struct afp_url {
 	int requested_version;
 	char zone[AFP_ZONE_LEN]; /* Only used for Appletalk */
 	char volpassword[9];;
+	struct afp_socket_options socket_options;
 };
 
 struct afp_token {
@@ -54,6 +96,14 @@ struct afp_rx_buffer {
 };
 
 
+/* A byte range lock an application has taken on an open fork */
+struct afp_fork_lock {
+	uint64_t start;
+	/* ~0 for to the end of the fork, however far that goes */
+	uint64_t len;
+	struct afp_fork_lock * next;
+};
+
 struct afp_file_info {
 	unsigned short attributes;
 	unsigned int did;
@@ -78,6 +128,23 @@ struct afp_file_info {
 	unsigned short forkid;
 	struct afp_icon * icon;
 	int eof;
+
+	/* How the fork was opened, and the same fork opened on each of the
+	 * server's stripe sessions, or 0 if it isn't yet */
+	unsigned short accessmode;
+	unsigned short stripe_forkid[AFP_MAX_STRIPES];
+
+	/* Reads already asked for, ahead of where the fork is being read */
+	struct afp_readahead * readahead;
+
+	/* Opened denying others write access, so its reads and writes
+	 * don't need locking */
+	unsigned char lease;
+	/* Locks taken with fcntl() or flock(), in order */
+	struct afp_fork_lock * locks;
+	/* Unlocks sent without waiting for them, and whether one failed */
+	unsigned int unlocks_pending;
+	int unlock_error;
 };
 
 
@@ -89,6 +156,16 @@ struct afp_file_info {
 #define VOLUME_EXTRA_FLAGS_IGNORE_UNIXPRIVS 0x20
 #define VOLUME_EXTRA_FLAGS_READONLY 0x40
 
+/* When byte range locks are taken.  Per I/O locks each read and write's
+ * range around it; with none, and advisory, VOLUME_EXTRA_FLAGS_NO_LOCKING
+ * is set, and only advisory passes on the locks applications take.  A
+ * lease opens forks denying others write access, and only locks reads
+ * and writes of the forks it couldn't open that way. */
+#define AFP_LOCKING_IO 0
+#define AFP_LOCKING_NONE 1
+#define AFP_LOCKING_ADVISORY 2
+#define AFP_LOCKING_LEASE 3
+
 #define AFP_VOLUME_UNMOUNTED 0
 #define AFP_VOLUME_MOUNTED 1
 #define AFP_VOLUME_UNMOUNTING 2
@@ -129,11 +206,38 @@ struct afp_volume {
 		uint64_t force_removed;
 	} did_cache_stats;
 
+	/* File data already read, if the volume was mounted with a cache.
+	 * The cache is shared, the counts are for this volume. */
+	struct afp_block_cache * block_cache;
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t invalidated;
+	} block_cache_stats;
+
+	/* File data kept on local disk, if the volume was mounted with a
+	 * directory for it */
+	struct afp_disk_cache * disk_cache;
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t invalidated;
+		uint64_t evicted;
+	} disk_cache_stats;
+
 	void * priv;  /* This is a private structure for fuse/cmdline, etc */
 	pthread_t thread; /* This is the per-volume thread */
 
 	int mapping;
 
+	/* One of AFP_LOCKING_*, set with afp_set_locking() */
+	unsigned int locking;
+
+	/* The same volume on each of the server's stripe sessions, once
+	 * it has been opened there */
+	struct afp_volume * stripe_volumes[AFP_MAX_STRIPES];
+	pthread_mutex_t stripe_mutex;
+
 };
 
 #define SERVER_STATE_CONNECTED 1
@@ -152,6 +256,10 @@ enum server_type{
 
 
 
+/* This must be a power of two */
+#define DSI_REQUEST_TABLE_SIZE 1024
+#define DSI_REQUEST_POOL_SIZE 128
+
 struct afp_versions {
         char        *av_name;
         int         av_number;
@@ -160,12 +268,31 @@ extern struct afp_versions afp_versions[];
 
 struct afp_server {
 
-	/* Our buffer sizes */
+	/* Our buffer sizes.  tx_quantum is the most the server will take in
+	 * one request, and rx_quantum the most we'll ask for in one read.
+	 * If max_quantum is set, neither goes above it. */
 	unsigned int tx_quantum;
 	unsigned int rx_quantum;
+	unsigned int max_quantum;
 
 	unsigned int tx_delay;
 
+	/* Smoothed round trip time and its mean deviation, in us, which
+	 * request timeouts are worked out from */
+	unsigned int rtt_srtt;
+	unsigned int rtt_var;
+
+	/* What we asked for on the socket, and what we got */
+	struct afp_socket_options socket_options;
+	struct afp_socket_options socket_effective;
+
+	/* Extra sessions to the same server, that big reads and writes
+	 * are spread over.  A stripe session points back to its parent.
+	 * A slot is NULL if that session has gone away. */
+	struct afp_server * stripes[AFP_MAX_STRIPES];
+	unsigned int num_stripes;
+	struct afp_server * stripe_parent;
+
 	/* Connection information */
 	//the linked list returned by getaddrinfo
 	struct addrinfo *address;
@@ -180,8 +307,30 @@ struct afp_server {
 		uint64_t rx_bytes;
 		uint64_t tx_bytes;
 		uint64_t requests_pending;
+		uint64_t request_pool_hits;
+		uint64_t request_pool_exhausted;
+		uint64_t rx_reads;
+		uint64_t rx_wakeups;
+		uint64_t rx_packets;
+		uint64_t rx_max_packets_per_wakeup;
+		uint64_t tx_packets;
+		uint64_t tx_writes;
+		uint64_t requests_timed_out;
+		uint64_t requests_retried;
+		uint64_t late_replies;
+		uint64_t rtt_samples;
+		uint64_t tickles_sent;
+		uint64_t events;
+		uint64_t readahead_requests;
+		uint64_t readahead_bytes;
 	} stats;
 
+	/* Counts and latencies for each AFP command */
+	struct afp_stats * command_stats;
+
+	/* The last packets sent and received, if they're being kept */
+	struct dsi_capture * capture;
+
 	/* General information */
 	char server_name[AFP_SERVER_NAME_LEN];
 	char server_name_utf8[AFP_SERVER_NAME_UTF8_LEN];
@@ -221,24 +370,61 @@ struct afp_server {
 	void * dsi;
 	unsigned int exit_flag;
 
-	/* Our DSI request queue */
-	pthread_mutex_t requestid_mutex;
+	/* Our DSI requests in flight, hashed by request id.  lastrequestid
+	 * is only ever changed atomically. */
 	pthread_mutex_t request_queue_mutex;
 	unsigned short lastrequestid;
-	unsigned short expectedrequestid;
-	struct dsi_request * command_requests;
+	struct dsi_request * request_table[DSI_REQUEST_TABLE_SIZE];
+
+	/* Preallocated requests, and the head of their free list */
+	struct dsi_request * request_pool;
+	uint64_t request_pool_head;
 
 
 	char loginmesg[200];
 	char path_encoding;
 
 	/* This is the data for the incoming buffer */
-	char * incoming_buffer;
-	int data_read;
-	int bufsize;
-
-	/* And this is for the outgoing queue */
-	pthread_mutex_t send_mutex;
+	struct dsi_ring * incoming_ring;
+
+	/* Deadlines for the requests we're waiting on */
+	struct dsi_timer_wheel * timers;
+
+	/* An afpRead reply whose data goes straight into its request's
+	 * buffer, and how much of it we haven't seen yet.  The mutex is held
+	 * while anything is put into a request, so whoever gives up on it
+	 * knows when we're done with its buffer. */
+	struct dsi_request * incoming_request;
+	unsigned int incoming_remaining;
+	pthread_mutex_t incoming_mutex;
+
+	/* Bytes of a reply we have nowhere to put, and are skipping */
+	unsigned int incoming_discard;
+
+	/* If set, read everything that's ready on each wakeup */
+	unsigned char rx_drain;
+	/* Set when we stopped draining with data still waiting */
+	unsigned char rx_more;
+
+	/* Optionally, the server has a thread of its own for receiving.  The
+	 * mutex keeps it from being signalled once it's on its way out. */
+	unsigned char rx_threaded;
+	int rx_thread_running;
+	int rx_thread_stop;
+	pthread_t rx_thread;
+	pthread_mutex_t rx_thread_mutex;
+
+	/* And this is for the outgoing queue.  Packets wait on send_queue
+	 * for their class until the one sender that is flushing writes them
+	 * out, and send_cond is signalled whenever some have gone.
+	 * send_deficit is how many bytes each class may still send before
+	 * it has to let the other go. */
+	pthread_mutex_t send_queue_mutex;
+	pthread_cond_t send_cond;
+	int send_flushing;
+	struct dsi_send_entry * send_queue[DSI_SEND_CLASSES];
+	struct dsi_send_entry * send_queue_tail[DSI_SEND_CLASSES];
+	unsigned int send_deficit[DSI_SEND_CLASSES];
 
 	/* This is for user mapping */
 	struct passwd passwd;
@@ -247,10 +433,8 @@ struct afp_server {
 
 	struct afp_server *next;
 
-	/* These are for DSI attention packets */
+	/* The most we'll take in a DSI attention packet */
 	unsigned int attention_quantum;
-	unsigned int attention_len;
-	char * attention_buffer;
 
 };
 
@@ -273,6 +457,14 @@ struct afp_icon {
 
 #define AFP_DEFAULT_ATTENTION_QUANTUM 1024
 
+/* What we use when the server doesn't give us its request quantum, and
+ * how much we read at a time unless told otherwise.  This is the default
+ * in 10.4.x where x > 7 */
+#define AFP_DEFAULT_QUANTUM (128*1024)
+
+/* The biggest quantum a mount can ask for */
+#define AFP_MAX_QUANTUM (16*1024*1024)
+
 void afp_unixpriv_to_stat(struct afp_file_info *fp,
 	struct stat *stat);
 
@@ -292,10 +484,14 @@ struct afp_volume * find_volume_by_name(struct afp_server * server,
 struct afp_connection_request {
         unsigned int uam_mask;
 	struct afp_url url;
+	int receive_thread;
+	unsigned int max_quantum;
 };
 
 void afp_default_url(struct afp_url *url);
 int afp_parse_url(struct afp_url * url, const char * toparse, int verbose);
+int afp_parse_socket_options(struct afp_socket_options * options,
+	const char * toparse);
 void afp_print_url(struct afp_url * url);
 int afp_url_validate(char * url_string, struct afp_url * valid_url);
 
@@ -308,6 +504,29 @@ int afp_detect_mapping(struct afp_volume * volume);
 
 int afp_status_header(char * text, int * len);
 int afp_status_server(struct afp_server * s,char * text, int * len);
+int afp_status_commands(struct afp_server * s,char * text, int * len);
+
+int afp_capture_start(struct afp_server * s, unsigned int snaplen);
+int afp_capture_stop(struct afp_server * s);
+int afp_capture_save(struct afp_server * s, const char * path);
+
+#define AFP_DEFAULT_CACHE_BLOCK (128*1024)
+
+struct afp_block_cache * afp_block_cache_get(uint64_t size,
+	unsigned int block_size);
+void afp_block_cache_usage(struct afp_block_cache * c, uint64_t * size,
+	uint64_t * used, unsigned int * block_size);
+
+void afp_set_locking(struct afp_volume * volume, unsigned int locking);
+const char * afp_locking_name(unsigned int locking);
+int afp_locking_from_string(const char * name);
+
+#define AFP_DEFAULT_DISK_CACHE (1024*1024*1024ULL)
+
+struct afp_disk_cache * afp_disk_cache_open(struct afp_volume * volume,
+	const char * dir, uint64_t size);
+void afp_disk_cache_usage(struct afp_disk_cache * c, const char ** path,
+	uint64_t * size, uint64_t * used, unsigned int * files);
 
 
 struct afp_server * afp_server_full_connect(void * priv, struct afp_connection_request * req);
@@ -315,6 +534,8 @@ struct afp_server * afp_server_full_connect(void * priv, struct afp_connection_r
 void * just_end_it_now(void *other);
 void add_fd_and_signal(int fd);
 void loop_disconnect(struct afp_server *s);
+void loop_forget_server(struct afp_server *s);
+void loop_wake_server(struct afp_server *s);
 void afp_wait_for_started_loop(void);
 
 
@@ -434,6 +655,10 @@ int afp_getfiledirparms(struct afp_volume *volume, unsigned int did,
 	unsigned int filebitmap, unsigned int dirbitmap, const char * pathname,
 	struct afp_file_info *fp);
 
+int afp_getfiledirparms_async(struct afp_volume *volume, unsigned int did, 
+	unsigned int filebitmap, unsigned int dirbitmap, const char * pathname,
+	struct afp_file_info *fp, afp_completion completion, void * context);
+
 int afp_enumerate(struct afp_volume * volume, 
 	unsigned int dirid, 
 	unsigned int filebitmap, unsigned int dirbitmap, 
@@ -450,10 +675,20 @@ int afp_enumerateext2(struct afp_volume * volume,
         char * path,
 	struct afp_file_info ** file_p);
 
+int afp_enumerateext2_async(struct afp_volume * volume, 
+	unsigned int dirid, 
+	unsigned int filebitmap, unsigned int dirbitmap, 
+        unsigned short reqcount,
+        unsigned long startindex,
+        char * path,
+	struct afp_file_info ** file_p,
+	afp_completion completion, void * context);
+
 int afp_openfork(struct afp_volume * volume,
         unsigned char forktype,
         unsigned int dirid,
         unsigned short accessmode,
+        unsigned short bitmap,
         char * filename, 
 	struct afp_file_info *fp);
 
@@ -465,6 +700,11 @@ int afp_readext(struct afp_volume * volume, unsigned short forkid,
                 uint64_t offset,
                 uint64_t count, struct afp_rx_buffer * rx);
 
+int afp_readext_async(struct afp_volume * volume, unsigned short forkid,
+                uint64_t offset,
+                uint64_t count, struct afp_rx_buffer * rx,
+                afp_completion completion, void * context);
+
 int afp_getvolparms(struct afp_volume * volume, unsigned short bitmap);
 
 
@@ -485,6 +725,11 @@ int afp_writeext(struct afp_volume * volume, unsigned short forkid,
         uint64_t offset, uint64_t reqcount,
         char * data, uint64_t * written);
 
+int afp_writeext_async(struct afp_volume * volume, unsigned short forkid,
+        uint64_t offset, uint64_t reqcount,
+        char * data, uint64_t * written,
+        afp_completion completion, void * context);
+
 int afp_flushfork(struct afp_volume * volume, unsigned short forkid);
 
 int afp_closefork(struct afp_volume * volume, unsigned short forkid);
@@ -517,6 +762,13 @@ int afp_byterangelockext(struct afp_volume * volume,
         uint64_t offset,
         uint64_t len, uint64_t *generated_offset);
 
+int afp_byterangelockext_async(struct afp_volume * volume,
+        unsigned char flag,
+        unsigned short forkid,
+        uint64_t offset,
+        uint64_t len, uint64_t *generated_offset,
+        afp_completion completion, void * context);
+
 int afp_moveandrename(struct afp_volume *volume,
 	unsigned int src_did,
 	unsigned int dst_did,
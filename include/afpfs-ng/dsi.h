@@ -4,6 +4,14 @@
 
 #include "afpfs-ng/afp.h"
 
+/* A deadline on the server's timer wheel, in ticks */
+struct dsi_timer
+{
+        uint64_t deadline;
+        struct dsi_timer * next;
+        struct dsi_timer ** pprev;
+};
+
 struct dsi_request
 {
         unsigned short requestid;
@@ -15,6 +23,19 @@ struct dsi_request
         pthread_mutex_t waiting_mutex;
         struct dsi_request * next;
         int return_code;
+        unsigned char from_pool;
+        unsigned int pool_next;
+        afp_completion completion;
+        void * completion_context;
+        struct dsi_timer timer;
+        int timed_out;
+        uint64_t sent;
+        unsigned int attempt;
+        unsigned int bytes_out;
+        unsigned int bytes_in;
+        /* Set by whoever completes a request nobody waits for */
+        int completed;
+        int refs;
 };
 
 int dsi_receive(struct afp_server * server, void * data, int size);
@@ -23,12 +44,35 @@ int dsi_getstatus(struct afp_server * server);
 int dsi_opensession(struct afp_server *server);
 
 int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned char subcommand, void ** other);
+int dsi_send_data(struct afp_server *server, char * msg, int size,
+	char * data, unsigned int datasize,
+	int wait,unsigned char subcommand, void ** other);
+int dsi_send_async(struct afp_server *server, char * msg, int size,
+	char * data, unsigned int datasize,
+	unsigned char subcommand, void ** other,
+	afp_completion completion, void * context);
 struct dsi_session * dsi_create(struct afp_server *server);
 int dsi_restart(struct afp_server *server);
 int dsi_recv(struct afp_server * server);
+void dsi_expire_requests(struct afp_server * server);
+
+int dsi_setup_request_pool(struct afp_server * server);
+void dsi_free_request_pool(struct afp_server * server);
+struct dsi_request * dsi_get_request(struct afp_server * server);
+void dsi_put_request(struct afp_server * server, struct dsi_request * r);
+
+void dsi_add_to_request_queue(struct afp_server *server,
+	struct dsi_request *toadd);
+int dsi_remove_from_request_queue(struct afp_server *server,
+	struct dsi_request *toremove);
+struct dsi_request * dsi_find_request(struct afp_server *server,
+	unsigned short request_id);
 
 #define DSI_BLOCK_TIMEOUT -1
 #define DSI_DONT_WAIT 0
+/* Until there's a round trip time to go by, these are the timeouts.  After
+ * that, the timeout comes from the round trip time, but those above the
+ * default stay as a floor. */
 #define DSI_DEFAULT_TIMEOUT 5
 //a spun down time capsule can take up to 20 secs to
 //wake up and reply to a mount request
@@ -5,7 +5,7 @@
 #include <unistd.h>
 #include <syslog.h>
 
-#define MAX_CLIENT_RESPONSE 2048
+#define MAX_CLIENT_RESPONSE 65536
 
 
 enum loglevels {
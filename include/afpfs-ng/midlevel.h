@@ -17,6 +17,14 @@ int ml_read(struct afp_volume * volume, const char *path,
 	char *buf, size_t size, off_t offset,
 	struct afp_file_info *fp, int * eof);
 
+struct flock;
+
+int ml_lock(struct afp_volume * volume, const char * path,
+	struct afp_file_info * fp, int cmd, struct flock * lock);
+
+int ml_flock(struct afp_volume * volume, const char * path,
+	struct afp_file_info * fp, int op);
+
 int ml_chmod(struct afp_volume * vol, const char * path, mode_t mode);
 
 int ml_unlink(struct afp_volume * vol, const char *path);
@@ -19,17 +19,27 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "afpfs-ng/afp_protocol.h"
 #include "afpfs-ng/libafpclient.h"
 #include "server.h"
 #include "afpfs-ng/dsi.h"
 #include "dsi_protocol.h"
+#include "dsi_ring.h"
+#include "dsi_timer.h"
+#include "dsi_event.h"
 #include "afpfs-ng/utils.h"
 #include "afp_replies.h"
 #include "afp_internal.h"
 #include "did.h"
 #include "forklist.h"
+#include "stripe.h"
+#include "afp_stats.h"
+#include "dsi_capture.h"
+#include "block_cache.h"
+#include "disk_cache.h"
 #include "afpfs-ng/codepage.h"
 
 struct afp_versions      afp_versions[] = {
@@ -155,19 +165,18 @@ static int afp_blank_reply(struct afp_server *server, char * buf, unsigned int s
 }
 
 /* Handle a reply packet */
-int afp_reply(unsigned short subcommand, struct afp_server * server, void * other) 
+int afp_reply(unsigned short subcommand, struct afp_server * server,
+	char * buf, unsigned int size, void * other) 
 {
 	int ret=0;
 
 	/* No AFP packet is valid if it is smaller than a DSI header. */
 
-	if (server->data_read<sizeof(struct dsi_header))
+	if (size<sizeof(struct dsi_header))
 		return -1;
 
 	if (afp_replies[subcommand]) {
-		ret=(*afp_replies[subcommand])(server,
-			server->incoming_buffer,
-			server->data_read, other);
+		ret=(*afp_replies[subcommand])(server,buf,size,other);
 	} else {
 		log_for_client(NULL,AFPFSD,LOG_WARNING,
 			"AFP subcommand %d not supported\n",subcommand);
@@ -203,6 +212,7 @@ struct afp_server * find_server_by_signature(char * signature)
 	struct afp_server * s;
 
 	for (s=get_server_base();s;s=s->next) {
+		if (s->stripe_parent) continue;
 		if (memcmp(s->signature,signature,AFP_SIGNATURE_LEN)==0) {
 			return s;
 		}
@@ -214,6 +224,7 @@ struct afp_server * find_server_by_name(char * name)
 {
 	struct afp_server * s;
 	for (s=get_server_base(); s; s=s->next) {
+		if (s->stripe_parent) continue;
 		if (strcmp(s->server_name_utf8,name)==0) return s;
 		if (strcmp(s->server_name,name)==0) return s;
 	}
@@ -226,6 +237,7 @@ struct afp_server * find_server_by_address(struct addrinfo *address)
     struct afp_server *s;
 
 	for (s=server_base;s;s=s->next) {
+        if (s->stripe_parent) continue;
         if (s->used_address != NULL && s->used_address->ai_addr != NULL &&
 			address != NULL && address->ai_addr != NULL &&
 			bcmp(&s->used_address->ai_addr, &address->ai_addr, 
@@ -261,6 +273,35 @@ int afp_unmount_all_volumes(struct afp_server * server)
 	return 0;
 }
 
+static const char * afp_locking_names[] = {
+	"io", "none", "advisory", "lease", NULL
+};
+
+void afp_set_locking(struct afp_volume * volume, unsigned int locking)
+{
+	volume->locking=locking;
+	if ((locking==AFP_LOCKING_NONE) || (locking==AFP_LOCKING_ADVISORY))
+		volume->extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	else
+		volume->extra_flags&=~VOLUME_EXTRA_FLAGS_NO_LOCKING;
+}
+
+const char * afp_locking_name(unsigned int locking)
+{
+	if (locking>AFP_LOCKING_LEASE) return "unknown";
+	return afp_locking_names[locking];
+}
+
+int afp_locking_from_string(const char * name)
+{
+	int i;
+
+	for (i=0;afp_locking_names[i];i++)
+		if (strcasecmp(name,afp_locking_names[i])==0)
+			return i;
+	return -1;
+}
+
 
 int afp_unmount_volume(struct afp_volume * volume)
 {
@@ -283,6 +324,8 @@ int afp_unmount_volume(struct afp_volume * volume)
 
 	free_entire_did_cache(volume);
 	remove_fork_list(volume);
+	block_cache_forget_volume(volume);
+	disk_cache_close(volume);
 	if (volume->dtrefnum) afp_closedt(server,volume->dtrefnum);
 	volume->dtrefnum=0;
 
@@ -310,6 +353,7 @@ void afp_free_server(struct afp_server ** sp)
 	struct dsi_request * p, *next;
 	struct afp_volume * volumes;
 	struct afp_server * server;
+	int i;
 
 	if (sp==NULL) return;
 	
@@ -317,19 +361,36 @@ void afp_free_server(struct afp_server ** sp)
 
 	if (!server) return;
 
-	for (p=server->command_requests;p;) {
-		log_for_client(NULL,AFPFSD,LOG_NOTICE,"FSLeft in queue: %p, id: %d command: %d\n",                p,p->requestid,p->subcommand);
-		next=p->next;
-		free(p);
-		p=next;
-	}
+	dsi_event_cancel(server);
 
 	volumes=server->volumes;
 
 	loop_disconnect(server);
+	loop_forget_server(server);
+
+	for (i=0;i<DSI_REQUEST_TABLE_SIZE;i++) {
+		for (p=server->request_table[i];p;) {
+			/* Nobody is waiting on a logout sent on our way out */
+			if ((p->wait) || (p->completion))
+				log_for_client(NULL,AFPFSD,LOG_NOTICE,"FSLeft in queue: %p, id: %d command: %d\n",                p,p->requestid,p->subcommand);
+			next=p->next;
+			if ((p->completion) &&
+				(__sync_bool_compare_and_swap(&p->completed,0,1)))
+				p->completion(p->completion_context,kFPNoServer);
+			dsi_put_request(server,p);
+			p=next;
+		}
+		server->request_table[i]=NULL;
+	}
+	dsi_free_request_pool(server);
 
-	if (server->incoming_buffer) free(server->incoming_buffer);
-	if (server->attention_buffer) free(server->attention_buffer);
+	if (server->incoming_ring) {
+		dsi_ring_free(server->incoming_ring);
+		free(server->incoming_ring);
+	}
+	if (server->timers) free(server->timers);
+	afp_stats_free(server->command_stats);
+	dsi_capture_free(server->capture);
 	if (volumes) free(volumes);
 
 	free(server);
@@ -342,16 +403,27 @@ int afp_server_remove(struct afp_server *s)
 	
 	struct dsi_request * p;
 	struct afp_server *s2;
+	int i;
 
 
 	if (s==NULL) 
 		goto out;
 
-	for (p=s->command_requests;p;p=p->next) {
-		pthread_mutex_lock(&p->waiting_mutex);
-		p->done_waiting=1;
-		pthread_cond_signal(&p->waiting_cond);
-		pthread_mutex_unlock(&p->waiting_mutex);
+	/* A server takes its stripe sessions with it */
+	for (i=0;i<s->num_stripes;i++) {
+		if (s->stripes[i]==NULL) continue;
+		afp_logout(s->stripes[i],DSI_DONT_WAIT);
+		afp_server_remove(s->stripes[i]);
+	}
+	stripe_detach(s);
+
+	for (i=0;i<DSI_REQUEST_TABLE_SIZE;i++) {
+		for (p=s->request_table[i];p;p=p->next) {
+			pthread_mutex_lock(&p->waiting_mutex);
+			p->done_waiting=1;
+			pthread_cond_signal(&p->waiting_cond);
+			pthread_mutex_unlock(&p->waiting_mutex);
+		}
 	}
 
 	if (s==server_base) {
@@ -383,13 +455,30 @@ struct afp_server * afp_server_init(struct addrinfo * address)
 	memset((void *) s, 0, sizeof(*s));
 	s->exit_flag = 0;
 	s->path_encoding=kFPUTF8Name;  /* This is a default */
+	s->rx_drain=1;
 	s->next=NULL;
-	s->bufsize=4096;
-	s->incoming_buffer=malloc(s->bufsize);
+	if ((s->incoming_ring=malloc(sizeof(struct dsi_ring)))==NULL) {
+		free(s);
+		return NULL;
+	}
+	if (dsi_ring_init(s->incoming_ring,DSI_RING_SIZE)) {
+		free(s->incoming_ring);
+		free(s);
+		return NULL;
+	}
+	if (((s->timers=malloc(sizeof(struct dsi_timer_wheel)))==NULL) ||
+		((s->command_stats=afp_stats_new())==NULL) ||
+		(dsi_setup_request_pool(s))) {
+		if (s->timers) free(s->timers);
+		afp_stats_free(s->command_stats);
+		dsi_ring_free(s->incoming_ring);
+		free(s->incoming_ring);
+		free(s);
+		return NULL;
+	}
+	dsi_timer_wheel_init(s->timers);
 
 	s->attention_quantum=AFP_DEFAULT_ATTENTION_QUANTUM;
-	s->attention_buffer=malloc(s->attention_quantum);
-	s->attention_len=0;
 
 	s->connect_state=SERVER_STATE_DISCONNECTED;
 	s->address = address;
@@ -654,14 +743,102 @@ int afp_server_reconnect(struct afp_server * s, char * mesg,
 }
 
 
+/* Buffers default to a few quantums, but we never make them smaller than
+ * what the system gives us anyway */
+static void afp_set_socket_buffer(int fd, int option, unsigned int size,
+	unsigned int quantum)
+{
+	int current;
+	socklen_t len = sizeof(current);
+
+	if (size==0) {
+		size=AFP_SOCKET_BUFFER_QUANTA*quantum;
+		if ((getsockopt(fd,SOL_SOCKET,option,&current,&len)==0) &&
+			(current>=(int) size))
+			return;
+	}
+	setsockopt(fd,SOL_SOCKET,option,&size,sizeof(size));
+}
+
+static unsigned int afp_get_socket_option(int fd, int level, int option)
+{
+	int value=0;
+	socklen_t len = sizeof(value);
+
+	getsockopt(fd,level,option,&value,&len);
+	return value;
+}
+
+/* Sets up a new socket the way the mount asked for.  This is done before
+ * connect(), since the receive buffer decides the window scaling. */
+static void afp_server_set_socket_options(struct afp_server * server)
+{
+	struct afp_socket_options * o = &server->socket_options;
+	struct afp_socket_options * e = &server->socket_effective;
+	unsigned int quantum = max(server->rx_quantum,AFP_DEFAULT_QUANTUM);
+	int fd = server->fd, one = 1, value;
+
+	if (!o->nagle)
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+	afp_set_socket_buffer(fd,SO_SNDBUF,o->sndbuf,quantum);
+	afp_set_socket_buffer(fd,SO_RCVBUF,o->rcvbuf,quantum);
+
+	if (o->keepalive_idle) {
+		setsockopt(fd,SOL_SOCKET,SO_KEEPALIVE,&one,sizeof(one));
+		value=o->keepalive_idle;
+		setsockopt(fd,IPPROTO_TCP,TCP_KEEPIDLE,&value,sizeof(value));
+		if ((value=o->keepalive_interval))
+			setsockopt(fd,IPPROTO_TCP,TCP_KEEPINTVL,
+				&value,sizeof(value));
+		if ((value=o->keepalive_count))
+			setsockopt(fd,IPPROTO_TCP,TCP_KEEPCNT,
+				&value,sizeof(value));
+	}
+#ifdef SO_BUSY_POLL
+	if (o->busy_poll) {
+		value=o->busy_poll;
+		if (setsockopt(fd,SOL_SOCKET,SO_BUSY_POLL,&value,sizeof(value)))
+			log_for_client(NULL,AFPFSD,LOG_WARNING,
+				"Could not set busy polling, %s\n",
+				strerror(errno));
+	}
+#endif
+
+	/* Now see what we really got */
+	memset(e,0,sizeof(*e));
+	e->nagle=!afp_get_socket_option(fd,IPPROTO_TCP,TCP_NODELAY);
+	e->sndbuf=afp_get_socket_option(fd,SOL_SOCKET,SO_SNDBUF);
+	e->rcvbuf=afp_get_socket_option(fd,SOL_SOCKET,SO_RCVBUF);
+	if (afp_get_socket_option(fd,SOL_SOCKET,SO_KEEPALIVE)) {
+		e->keepalive_idle=
+			afp_get_socket_option(fd,IPPROTO_TCP,TCP_KEEPIDLE);
+		e->keepalive_interval=
+			afp_get_socket_option(fd,IPPROTO_TCP,TCP_KEEPINTVL);
+		e->keepalive_count=
+			afp_get_socket_option(fd,IPPROTO_TCP,TCP_KEEPCNT);
+	}
+#ifdef SO_BUSY_POLL
+	e->busy_poll=afp_get_socket_option(fd,SOL_SOCKET,SO_BUSY_POLL);
+#endif
+	e->bulk_share=o->bulk_share ? o->bulk_share : AFP_DEFAULT_BULK_SHARE;
+	if (!o->no_readahead)
+		e->readahead=o->readahead ? o->readahead : AFP_DEFAULT_READAHEAD;
+}
+
 int afp_server_connect(struct afp_server *server, int full)
 {
 	int 	error = 0;
-	struct 	timeval t1, t2;
 	struct 	addrinfo *address;
 	char	log_msg[64];
 	char	ip_addr[INET6_ADDRSTRLEN];
 
+	/* There's no telling how much the server will send us in one read,
+	 * so we simply don't ask for more than this */
+	if (server->max_quantum>AFP_MAX_QUANTUM)
+		server->max_quantum=AFP_MAX_QUANTUM;
+	server->rx_quantum=server->max_quantum ? 
+		server->max_quantum : AFP_DEFAULT_QUANTUM;
+
 	address = server->address;
    	while (address) 
 	{
@@ -689,6 +866,7 @@ int afp_server_connect(struct afp_server *server, int full)
 
         if (server->fd >= 0) 
 		{
+		    afp_server_set_socket_options(server);
         	    if (connect(server->fd, address->ai_addr, address->ai_addrlen) == 0)
         	        break;
         	    close(server->fd);
@@ -715,26 +893,14 @@ int afp_server_connect(struct afp_server *server, int full)
 		return 0;
 	}
 
-	/* Get the status, and calculate the transmit time.  We use this to
-	* calculate our rx quantum. */
-	gettimeofday(&t1,NULL);
-
+	/* Get the status.  Its reply is the first round trip time we have
+	 * to work out timeouts from. */
 	if ((error=dsi_getstatus(server))!=0) 
 		goto error;
-	gettimeofday(&t2,NULL);
 
         afp_server_identify(server);
 
-	if ((t2.tv_sec - t1.tv_sec) > 0)
-		server->tx_delay= (t2.tv_sec - t1.tv_sec) * 1000;
-	else
-		server->tx_delay= (t2.tv_usec - t1.tv_usec) / 1000;
-
-	/* Calculate the quantum based on our tx_delay and a threshold */
-	/* For now, we'll just set a default */
-	/* This is the default in 10.4.x where x > 7 */
-	server->rx_quantum = 128 * 1024;
-
+	server->tx_delay=server->rtt_srtt/1000;
 
 	return 0;
 error:
@@ -0,0 +1,168 @@
+/*
+ *  afp_stats.c
+ *
+ *  How many of each AFP command we've sent, and how long they took.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "afpfs-ng/afp_protocol.h"
+#include "afp_stats.h"
+
+/*
+ * Latencies go into a log-linear histogram, like HdrHistogram's: under
+ * AFP_STATS_SUB us each value has its own bucket, and past that every
+ * power of two is split into AFP_STATS_SUB buckets.  That keeps any
+ * percentile worked out from it to within an eighth of the real value,
+ * in a couple of KB per command.
+ *
+ * Every thread that finishes requests (the receiving threads, and the
+ * callers waiting on replies) counts into one of several shards, picked
+ * the first time it records anything, so they don't all fight over the
+ * same cache lines.  Reading the stats adds the shards up.  A command's
+ * counters are only allocated once it has been used.
+ */
+
+static __thread unsigned int afp_stats_my_shard;
+static unsigned int afp_stats_next_shard;
+
+static unsigned int afp_stats_shard_index(void)
+{
+	if (afp_stats_my_shard==0)
+		afp_stats_my_shard=
+			__sync_add_and_fetch(&afp_stats_next_shard,1);
+	return afp_stats_my_shard%AFP_STATS_SHARDS;
+}
+
+static unsigned int afp_stats_bucket(uint64_t us)
+{
+	unsigned int e, b;
+
+	if (us<AFP_STATS_SUB)
+		return us;
+	e=63-__builtin_clzll(us);
+	b=(e-AFP_STATS_SUB_BITS+1)*AFP_STATS_SUB+
+		((us>>(e-AFP_STATS_SUB_BITS))&(AFP_STATS_SUB-1));
+	if (b>=AFP_STATS_BUCKETS) b=AFP_STATS_BUCKETS-1;
+	return b;
+}
+
+/* The smallest latency that goes into bucket */
+uint64_t afp_stats_bucket_low(unsigned int bucket)
+{
+	if (bucket<AFP_STATS_SUB)
+		return bucket;
+	return (uint64_t) (AFP_STATS_SUB+bucket%AFP_STATS_SUB)<<
+		(bucket/AFP_STATS_SUB-1);
+}
+
+struct afp_stats * afp_stats_new(void)
+{
+	struct afp_stats * stats;
+
+	if (posix_memalign((void **) &stats,64,sizeof(*stats)))
+		return NULL;
+	memset(stats,0,sizeof(*stats));
+	return stats;
+}
+
+void afp_stats_free(struct afp_stats * stats)
+{
+	unsigned int i, j;
+
+	if (!stats) return;
+	for (i=0;i<AFP_STATS_SHARDS;i++)
+		for (j=0;j<AFP_STATS_COMMANDS;j++)
+			free(stats->shards[i].commands[j]);
+	free(stats);
+}
+
+/* Counts one reply to command, which took us to come back.  bytes_out is
+ * what the request carried and bytes_in what the reply did. */
+void afp_stats_record(struct afp_stats * stats, unsigned char command,
+	int rc, unsigned int bytes_out, unsigned int bytes_in, uint64_t us)
+{
+	struct afp_command_stats ** slot, * c;
+	uint64_t max;
+
+	if (!stats) return;
+	slot=&stats->shards[afp_stats_shard_index()].commands[command];
+	if ((c=*slot)==NULL) {
+		if ((c=calloc(1,sizeof(*c)))==NULL)
+			return;
+		/* Someone else on the same shard may have got there first */
+		if (!__sync_bool_compare_and_swap(slot,NULL,c)) {
+			free(c);
+			c=*slot;
+		}
+	}
+
+	__sync_fetch_and_add(&c->count,1);
+	if ((rc!=kFPNoErr) && (rc!=kFPEOFErr))
+		__sync_fetch_and_add(&c->errors,1);
+	__sync_fetch_and_add(&c->bytes_out,bytes_out);
+	__sync_fetch_and_add(&c->bytes_in,bytes_in);
+	__sync_fetch_and_add(&c->buckets[afp_stats_bucket(us)],1);
+	while (us>(max=c->max_us))
+		if (__sync_bool_compare_and_swap(&c->max_us,max,us))
+			break;
+}
+
+/* Adds c into total */
+void afp_stats_add(struct afp_command_stats * total,
+	struct afp_command_stats * c)
+{
+	unsigned int b;
+
+	total->count+=c->count;
+	total->errors+=c->errors;
+	total->bytes_in+=c->bytes_in;
+	total->bytes_out+=c->bytes_out;
+	if (c->max_us>total->max_us)
+		total->max_us=c->max_us;
+	for (b=0;b<AFP_STATS_BUCKETS;b++)
+		total->buckets[b]+=c->buckets[b];
+}
+
+/* Adds up the shards for command into total.  Returns 0 if command has
+ * never been sent. */
+int afp_stats_get(struct afp_stats * stats, unsigned char command,
+	struct afp_command_stats * total)
+{
+	struct afp_command_stats * c;
+	unsigned int i;
+
+	memset(total,0,sizeof(*total));
+	if (!stats) return 0;
+	for (i=0;i<AFP_STATS_SHARDS;i++)
+		if ((c=stats->shards[i].commands[command]))
+			afp_stats_add(total,c);
+	return total->count>0;
+}
+
+/* The latency, in us, that permille thousandths of the replies came back
+ * within.  It is the top of the bucket the percentile falls in, but never
+ * more than the slowest reply there has been. */
+uint64_t afp_stats_percentile(struct afp_command_stats * c,
+	unsigned int permille)
+{
+	uint64_t total=0, want, seen=0, top;
+	unsigned int b;
+
+	for (b=0;b<AFP_STATS_BUCKETS;b++)
+		total+=c->buckets[b];
+	if (total==0) return 0;
+	want=(total*permille+999)/1000;
+	if (want==0) want=1;
+	for (b=0;b<AFP_STATS_BUCKETS;b++) {
+		seen+=c->buckets[b];
+		if (seen>=want)
+			break;
+	}
+	if (b+1>=AFP_STATS_BUCKETS)
+		return c->max_us;
+	top=afp_stats_bucket_low(b+1)-1;
+	return (top<c->max_us) ? top : c->max_us;
+}
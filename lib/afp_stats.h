@@ -0,0 +1,49 @@
+#ifndef __AFP_STATS_H_
+#define __AFP_STATS_H_
+
+#include <stdint.h>
+
+/* One slot for every AFP command code */
+#define AFP_STATS_COMMANDS 256
+
+/* Each power of two of latency, in us, is split into this many buckets,
+ * so a bucket is never more than 1/8th wider than the values in it */
+#define AFP_STATS_SUB_BITS 3
+#define AFP_STATS_SUB (1<<AFP_STATS_SUB_BITS)
+
+/* Enough buckets for anything up to about an hour */
+#define AFP_STATS_BUCKETS 240
+
+/* Threads are spread over this many copies of the counters */
+#define AFP_STATS_SHARDS 8
+
+struct afp_command_stats {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t max_us;
+	uint64_t buckets[AFP_STATS_BUCKETS];
+};
+
+struct afp_stats_shard {
+	struct afp_command_stats * commands[AFP_STATS_COMMANDS];
+} __attribute__((aligned(64)));
+
+struct afp_stats {
+	struct afp_stats_shard shards[AFP_STATS_SHARDS];
+};
+
+struct afp_stats * afp_stats_new(void);
+void afp_stats_free(struct afp_stats * stats);
+void afp_stats_record(struct afp_stats * stats, unsigned char command,
+	int rc, unsigned int bytes_out, unsigned int bytes_in, uint64_t us);
+void afp_stats_add(struct afp_command_stats * total,
+	struct afp_command_stats * c);
+int afp_stats_get(struct afp_stats * stats, unsigned char command,
+	struct afp_command_stats * total);
+uint64_t afp_stats_bucket_low(unsigned int bucket);
+uint64_t afp_stats_percentile(struct afp_command_stats * c,
+	unsigned int permille);
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include "afpfs-ng/afp.h"
 
 void afp_default_url(struct afp_url *url)
@@ -11,6 +12,84 @@ void afp_default_url(struct afp_url *url)
 	url->port=548;
 }
 
+/* Takes a size like 262144, 256K or 1M.  Returns -1 if it isn't one, or
+ * is too big for a socket buffer. */
+static int parse_size(const char * s, unsigned int * size)
+{
+	char * end;
+	unsigned long long n, unit=1;
+
+	if ((*s<'0') || (*s>'9'))
+		return -1;
+	errno=0;
+	n=strtoull(s,&end,10);
+	if (errno)
+		return -1;
+
+	if ((*end=='k') || (*end=='K')) unit=1024;
+	else if ((*end=='m') || (*end=='M')) unit=1024*1024;
+	if (unit>1) end++;
+	if ((*end) || (n>INT_MAX/unit))
+		return -1;
+	*size=n*unit;
+	return 0;
+}
+
+/* Parses comma separated socket options, eg. "nodelay=0,sndbuf=4M,
+ * keepalive=60:10:5,busypoll=50,bulkshare=90,stripes=3,readahead=16".  Returns -1 at
+ * the first one we don't know. */
+int afp_parse_socket_options(struct afp_socket_options * options,
+	const char * toparse)
+{
+	char option[256];
+	const char * p = toparse, * q;
+	size_t len;
+
+	while ((p) && (*p)) {
+		if ((q=strchr(p,','))) len=q-p;
+		else len=strlen(p);
+		if (len>=sizeof(option)) return -1;
+		memcpy(option,p,len);
+		option[len]='\0';
+		p=q ? q+1 : NULL;
+
+		if (strcmp(option,"nodelay")==0)
+			options->nagle=0;
+		else if (strncmp(option,"nodelay=",8)==0)
+			options->nagle=(strtol(option+8,NULL,10)==0);
+		else if (strncmp(option,"sndbuf=",7)==0) {
+			if (parse_size(option+7,&options->sndbuf))
+				return -1;
+		} else if (strncmp(option,"rcvbuf=",7)==0) {
+			if (parse_size(option+7,&options->rcvbuf))
+				return -1;
+		} else if (strncmp(option,"keepalive=",10)==0) {
+			options->keepalive_interval=0;
+			options->keepalive_count=0;
+			sscanf(option+10,"%u:%u:%u",&options->keepalive_idle,
+				&options->keepalive_interval,
+				&options->keepalive_count);
+		} else if (strncmp(option,"busypoll=",9)==0)
+			options->busy_poll=strtoul(option+9,NULL,10);
+		else if (strncmp(option,"bulkshare=",10)==0) {
+			options->bulk_share=strtoul(option+10,NULL,10);
+			if ((options->bulk_share<1) || (options->bulk_share>100))
+				return -1;
+		} else if (strncmp(option,"stripes=",8)==0) {
+			options->stripes=strtoul(option+8,NULL,10);
+			if (options->stripes>AFP_MAX_STRIPES)
+				return -1;
+		} else if (strncmp(option,"readahead=",10)==0) {
+			options->readahead=strtoul(option+10,NULL,10);
+			options->no_readahead=(options->readahead==0);
+			if (options->readahead>AFP_MAX_READAHEAD)
+				return -1;
+		} else
+			return -1;
+	}
+	return 0;
+}
+
 static int check_servername (char * servername) 
 {
 	if (strchr(servername,'/')) return -1;
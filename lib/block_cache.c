@@ -0,0 +1,391 @@
+/*
+ *  block_cache.c
+ *
+ *  Keeping file data that has already been read, for reading again.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/utils.h"
+#include "block_cache.h"
+
+/*
+ * There's one cache for the whole process, shared by every volume mounted
+ * with one, so that its size is a limit on all of them together.  It
+ * holds fixed size blocks of file data, looked up by volume, file id
+ * (the CNID) and block number.  Blocks are spread over BLOCK_CACHE_SHARDS
+ * shards by a hash of that, each with its own lock, hash table and LRU
+ * list, and a share of the size.
+ *
+ * Each block remembers the modification date and size the file had when
+ * it was read, as the fork being read through saw them when it was
+ * opened.  A block is only used for a fork that saw the same, so a file
+ * changed on the server is read again from the next open on, the way
+ * NFS does it.  Writes through a fork throw away the blocks they touch,
+ * and truncating a file throws away all of it.
+ *
+ * A block is only kept whole: the part of a read at either end that
+ * doesn't cover a block isn't kept, except the last block of the file,
+ * if the read got to the end of it.
+ */
+
+struct block_cache_entry {
+	struct block_cache_entry * hash_next;
+	struct block_cache_entry * lru_prev;
+	struct block_cache_entry * lru_next;
+	struct afp_volume * volume;
+	unsigned int fileid;
+	uint64_t block;
+	/* What the file looked like when this was read */
+	unsigned int modification_date;
+	uint64_t file_size;
+	/* Less than the block size only for the end of the file */
+	unsigned int size;
+	char data[];
+};
+
+struct block_cache_shard {
+	pthread_mutex_t mutex;
+	struct block_cache_entry ** buckets;
+	unsigned int nbuckets;
+	/* Most recently used first */
+	struct block_cache_entry * lru_head;
+	struct block_cache_entry * lru_tail;
+	uint64_t used;
+	uint64_t max;
+};
+
+struct afp_block_cache {
+	unsigned int block_size;
+	uint64_t size;
+	struct block_cache_shard shards[BLOCK_CACHE_SHARDS];
+};
+
+static struct afp_block_cache * block_cache = NULL;
+static pthread_mutex_t block_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int block_cache_hash(struct afp_volume * volume,
+	unsigned int fileid, uint64_t block)
+{
+	uint64_t h = ((uintptr_t) volume>>4)^((uint64_t) fileid<<24)^block;
+
+	h^=h>>33;
+	h*=0xff51afd7ed558ccdULL;
+	h^=h>>33;
+	return h;
+}
+
+static void block_cache_set_size(struct afp_block_cache * c, uint64_t size)
+{
+	struct block_cache_shard * shard;
+	unsigned int i;
+
+	c->size=size;
+	for (i=0;i<BLOCK_CACHE_SHARDS;i++) {
+		shard=&c->shards[i];
+		pthread_mutex_lock(&shard->mutex);
+		shard->max=size/BLOCK_CACHE_SHARDS;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/* Returns the cache, made size bytes if it is smaller.  The block size
+ * is whatever the first one to ask for the cache wanted. */
+struct afp_block_cache * afp_block_cache_get(uint64_t size,
+	unsigned int block_size)
+{
+	struct afp_block_cache * c;
+	struct block_cache_shard * shard;
+	unsigned int i, blocks;
+
+	if (block_size==0) block_size=AFP_DEFAULT_CACHE_BLOCK;
+
+	pthread_mutex_lock(&block_cache_mutex);
+	if ((c=block_cache)) {
+		if (size>c->size)
+			block_cache_set_size(c,size);
+		goto out;
+	}
+	if ((c=calloc(1,sizeof(*c)))==NULL)
+		goto out;
+	c->block_size=block_size;
+	c->size=size;
+
+	/* About one block to a bucket when it's full */
+	blocks=size/block_size/BLOCK_CACHE_SHARDS;
+	for (i=0;i<BLOCK_CACHE_SHARDS;i++) {
+		shard=&c->shards[i];
+		pthread_mutex_init(&shard->mutex,NULL);
+		for (shard->nbuckets=64;shard->nbuckets<blocks;)
+			shard->nbuckets<<=1;
+		shard->buckets=calloc(shard->nbuckets,
+			sizeof(shard->buckets[0]));
+		if (shard->buckets==NULL) {
+			while (i>0)
+				free(c->shards[--i].buckets);
+			free(c);
+			c=NULL;
+			goto out;
+		}
+		shard->max=size/BLOCK_CACHE_SHARDS;
+	}
+	block_cache=c;
+out:
+	pthread_mutex_unlock(&block_cache_mutex);
+	return c;
+}
+
+void afp_block_cache_usage(struct afp_block_cache * c, uint64_t * size,
+	uint64_t * used, unsigned int * block_size)
+{
+	unsigned int i;
+
+	*size=c->size;
+	*block_size=c->block_size;
+	*used=0;
+	for (i=0;i<BLOCK_CACHE_SHARDS;i++)
+		*used+=c->shards[i].used;
+}
+
+int block_cache_wanted(struct afp_volume * volume, struct afp_file_info * fp)
+{
+	/* Locks say someone else may be writing, unless the fork has a
+	 * lease.  A fork opened O_SYNC or O_DIRECT wants to see the server
+	 * every time. */
+	return ((volume->block_cache) && (fp->fileid) &&
+		(fp->modification_date) && (!fp->sync) &&
+		((volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) ||
+		(fp->lease)));
+}
+
+#define fork_size(fp) ((fp)->resource ? (fp)->resourcesize : (fp)->size)
+
+/* The hash of an entry is worked out again when it is unlinked, so that
+ * entries don't have to carry it */
+static struct block_cache_shard * block_cache_shard(
+	struct afp_block_cache * c, struct afp_volume * volume,
+	unsigned int fileid, uint64_t block, unsigned int * bucket)
+{
+	unsigned int h = block_cache_hash(volume,fileid,block);
+	struct block_cache_shard * shard = &c->shards[h%BLOCK_CACHE_SHARDS];
+
+	*bucket=(h/BLOCK_CACHE_SHARDS)&(shard->nbuckets-1);
+	return shard;
+}
+
+/* All of these are called with the shard's mutex held */
+static void block_cache_lru_unlink(struct block_cache_shard * shard,
+	struct block_cache_entry * e)
+{
+	if (e->lru_prev) e->lru_prev->lru_next=e->lru_next;
+	else shard->lru_head=e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev=e->lru_prev;
+	else shard->lru_tail=e->lru_prev;
+}
+
+static void block_cache_lru_push(struct block_cache_shard * shard,
+	struct block_cache_entry * e)
+{
+	e->lru_prev=NULL;
+	e->lru_next=shard->lru_head;
+	if (shard->lru_head) shard->lru_head->lru_prev=e;
+	else shard->lru_tail=e;
+	shard->lru_head=e;
+}
+
+static void block_cache_remove(struct afp_block_cache * c,
+	struct block_cache_shard * shard, struct block_cache_entry * e)
+{
+	struct block_cache_entry ** p;
+	unsigned int bucket;
+
+	block_cache_shard(c,e->volume,e->fileid,e->block,&bucket);
+	for (p=&shard->buckets[bucket];*p;p=&(*p)->hash_next)
+		if (*p==e) {
+			*p=e->hash_next;
+			break;
+		}
+	block_cache_lru_unlink(shard,e);
+	shard->used-=e->size;
+	free(e);
+}
+
+static struct block_cache_entry * block_cache_find(
+	struct block_cache_shard * shard, unsigned int bucket,
+	struct afp_volume * volume, unsigned int fileid, uint64_t block)
+{
+	struct block_cache_entry * e;
+
+	for (e=shard->buckets[bucket];e;e=e->hash_next)
+		if ((e->block==block) && (e->fileid==fileid) &&
+			(e->volume==volume))
+			return e;
+	return NULL;
+}
+
+/* Copies out as much of the read as there are blocks for, from offset
+ * on.  Returns how much that was, and sets eof if it got to the end of
+ * the file. */
+size_t block_cache_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof)
+{
+	struct afp_block_cache * c = volume->block_cache;
+	struct block_cache_shard * shard;
+	struct block_cache_entry * e;
+	uint64_t o = offset, block;
+	unsigned int bucket, start;
+	size_t copied=0, len;
+	int last;
+
+	while (copied<size) {
+		block=o/c->block_size;
+		start=o%c->block_size;
+		shard=block_cache_shard(c,volume,fp->fileid,block,&bucket);
+		pthread_mutex_lock(&shard->mutex);
+		e=block_cache_find(shard,bucket,volume,fp->fileid,block);
+		if ((e) && ((e->modification_date!=fp->modification_date) ||
+			(e->file_size!=fork_size(fp)))) {
+			/* The file has changed since */
+			block_cache_remove(c,shard,e);
+			__sync_fetch_and_add(
+				&volume->block_cache_stats.invalidated,1);
+			e=NULL;
+		}
+		if (e==NULL) {
+			pthread_mutex_unlock(&shard->mutex);
+			__sync_fetch_and_add(&volume->block_cache_stats.misses,
+				1);
+			break;
+		}
+		block_cache_lru_unlink(shard,e);
+		block_cache_lru_push(shard,e);
+		len=0;
+		if (start<e->size) {
+			len=min(e->size-start,size-copied);
+			memcpy(buf+copied,e->data+start,len);
+		}
+		/* Only the end of the file is a short block */
+		last=((start+len>=e->size) && (e->size<c->block_size));
+		pthread_mutex_unlock(&shard->mutex);
+		__sync_fetch_and_add(&volume->block_cache_stats.hits,1);
+
+		copied+=len;
+		o+=len;
+		if (last) {
+			*eof=1;
+			break;
+		}
+	}
+	return copied;
+}
+
+/* Keeps the whole blocks in what was just read from the server */
+void block_cache_fill(struct afp_volume * volume, struct afp_file_info * fp,
+	const char * buf, size_t size, off_t offset, int eof)
+{
+	struct afp_block_cache * c = volume->block_cache;
+	struct block_cache_shard * shard;
+	struct block_cache_entry * e;
+	uint64_t o, end = offset+size, block, skip;
+	unsigned int bucket, len;
+
+	skip=(c->block_size-offset%c->block_size)%c->block_size;
+	for (o=offset+skip;o<end;o+=len) {
+		block=o/c->block_size;
+		len=min(c->block_size,end-o);
+		if ((len<c->block_size) && (!eof))
+			break;
+
+		shard=block_cache_shard(c,volume,fp->fileid,block,&bucket);
+		pthread_mutex_lock(&shard->mutex);
+		if ((e=block_cache_find(shard,bucket,volume,fp->fileid,block)))
+			block_cache_remove(c,shard,e);
+		while ((shard->lru_tail) && (shard->used+len>shard->max))
+			block_cache_remove(c,shard,shard->lru_tail);
+		if ((shard->used+len>shard->max) ||
+			((e=malloc(sizeof(*e)+len))==NULL)) {
+			pthread_mutex_unlock(&shard->mutex);
+			break;
+		}
+		e->volume=volume;
+		e->fileid=fp->fileid;
+		e->block=block;
+		e->modification_date=fp->modification_date;
+		e->file_size=fork_size(fp);
+		e->size=len;
+		memcpy(e->data,buf+(o-offset),len);
+		e->hash_next=shard->buckets[bucket];
+		shard->buckets[bucket]=e;
+		block_cache_lru_push(shard,e);
+		shard->used+=len;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/* Drops every block that matches, by going through the whole cache */
+static void block_cache_sweep(struct afp_block_cache * c,
+	struct afp_volume * volume, int whole_volume, unsigned int fileid,
+	uint64_t first, uint64_t last)
+{
+	struct block_cache_shard * shard;
+	struct block_cache_entry * e, * next;
+	unsigned int i;
+
+	for (i=0;i<BLOCK_CACHE_SHARDS;i++) {
+		shard=&c->shards[i];
+		pthread_mutex_lock(&shard->mutex);
+		for (e=shard->lru_head;e;e=next) {
+			next=e->lru_next;
+			if ((e->volume!=volume) || ((!whole_volume) &&
+				((e->fileid!=fileid) || (e->block<first) ||
+				(e->block>last))))
+				continue;
+			block_cache_remove(c,shard,e);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/* Throws away the blocks a write, or a truncate, goes over */
+void block_cache_invalidate(struct afp_volume * volume,
+	struct afp_file_info * fp, off_t offset, uint64_t size)
+{
+	struct afp_block_cache * c = volume->block_cache;
+	struct block_cache_shard * shard;
+	struct block_cache_entry * e;
+	uint64_t first, last, block;
+	unsigned int bucket;
+
+	if ((c==NULL) || (fp->fileid==0) || (size==0)) return;
+
+	first=offset/c->block_size;
+	if (size>~0ULL-offset)
+		last=~0ULL;
+	else
+		last=(offset+size-1)/c->block_size;
+
+	/* A few blocks are quicker to look up than to go looking for */
+	if (last-first>=1024) {
+		block_cache_sweep(c,volume,0,fp->fileid,first,last);
+		return;
+	}
+	for (block=first;block<=last;block++) {
+		shard=block_cache_shard(c,volume,fp->fileid,block,&bucket);
+		pthread_mutex_lock(&shard->mutex);
+		if ((e=block_cache_find(shard,bucket,volume,fp->fileid,block)))
+			block_cache_remove(c,shard,e);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/* Called as the volume is unmounted */
+void block_cache_forget_volume(struct afp_volume * volume)
+{
+	if (volume->block_cache)
+		block_cache_sweep(volume->block_cache,volume,1,0,0,0);
+	volume->block_cache=NULL;
+}
@@ -0,0 +1,18 @@
+#ifndef __BLOCK_CACHE_H_
+#define __BLOCK_CACHE_H_
+
+#include "afpfs-ng/afp.h"
+
+/* Blocks are spread over this many LRU lists, each with its own lock */
+#define BLOCK_CACHE_SHARDS 16
+
+int block_cache_wanted(struct afp_volume * volume, struct afp_file_info * fp);
+size_t block_cache_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof);
+void block_cache_fill(struct afp_volume * volume, struct afp_file_info * fp,
+	const char * buf, size_t size, off_t offset, int eof);
+void block_cache_invalidate(struct afp_volume * volume,
+	struct afp_file_info * fp, off_t offset, uint64_t size);
+void block_cache_forget_volume(struct afp_volume * volume);
+
+#endif
@@ -18,6 +18,7 @@
 #include "users.h"
 #include "afpfs-ng/libafpclient.h"
 #include "server.h"
+#include "stripe.h"
 
 
 
@@ -57,7 +58,6 @@ struct afp_server * afp_server_full_connect (void * priv, struct afp_connection_
 	char server_name[AFP_SERVER_NAME_LEN];
         char server_name_utf8[AFP_SERVER_NAME_UTF8_LEN];
         char server_name_printable[AFP_SERVER_NAME_UTF8_LEN];
-	unsigned int rx_quantum;
 	char icon[AFP_SERVER_ICON_LEN];
 
 	if ((address = afp_get_address(priv,req->url.servername, req->url.port)) == NULL)
@@ -91,14 +91,15 @@ struct afp_server * afp_server_full_connect (void * priv, struct afp_connection_
 		AFP_SERVER_NAME_UTF8_LEN);
 	memcpy(server_name_printable,&tmpserver->server_name_printable,
 		AFP_SERVER_NAME_UTF8_LEN);
-	rx_quantum=tmpserver->rx_quantum;
-
 	afp_server_remove(tmpserver);
 
 	s=find_server_by_signature(signature);
 
 	if (!s) {
 		s = afp_server_init(address);
+		s->rx_threaded=req->receive_thread;
+		s->max_quantum=req->max_quantum;
+		s->socket_options=req->url.socket_options;
 
 		if (afp_server_connect(s,0) !=0) {
 			log_for_client(priv,AFPFSD,LOG_ERR,
@@ -131,7 +132,6 @@ struct afp_server * afp_server_full_connect (void * priv, struct afp_connection_
                         AFP_SERVER_NAME_UTF8_LEN);
 		memcpy(s->machine_type,machine_type,AFP_MACHINETYPE_LEN);
 		memcpy(s->icon,icon,AFP_SERVER_ICON_LEN);
-		s->rx_quantum=rx_quantum;
 	} 
 have_server:
 
@@ -145,6 +145,9 @@ have_server:
 	else 
 		s->server_type=AFPFS_SERVER_TYPE_UNKNOWN;
 
+	if ((s->socket_options.stripes) && (s->num_stripes==0))
+		afp_server_open_stripes(priv,s);
+
 	return s;
 error:
 	if ((s) && (!something_is_mounted(s))) { /* FIXME */
@@ -0,0 +1,714 @@
+/*
+ *  disk_cache.c
+ *
+ *  Keeping file data that has been read on local disk, across mounts.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/utils.h"
+#include "disk_cache.h"
+
+/*
+ * A mount can be given a directory to keep what it reads in, so that a
+ * file read once doesn't have to be fetched again, even after the volume
+ * has been unmounted and mounted again.  Under the directory, each
+ * volume gets one of its own, named for the server's signature and the
+ * volume's name, and in that each fork read has a sparse file, named for
+ * its CNID and modification date, holding the ranges of it read so far.
+ *
+ * The ranges each file has are kept in memory, along with the date and
+ * size the fork had when they were read, and written out to an index
+ * file in the volume's directory when it is unmounted.  The index is
+ * removed as it is read back, so if we don't get as far as unmounting,
+ * the next mount finds none and starts again; data files that aren't in
+ * the index are deleted then.  A lock file stops two mounts from using
+ * the same directory at once.
+ *
+ * A fork's ranges are only used while the fork, as opened, has the date
+ * and size they were read with, and opening a fork that has changed
+ * throws them away.  Writes and truncation through the mount do the
+ * same.  When the ranges kept come to more than the mount's size, whole
+ * files are thrown away, least recently used first; a fork bigger than
+ * that size isn't kept at all.
+ */
+
+struct disk_cache_extent {
+	uint64_t start;
+	uint64_t end;
+};
+
+struct disk_cache_entry {
+	struct disk_cache_entry * hash_next;
+	struct disk_cache_entry * lru_prev;
+	struct disk_cache_entry * lru_next;
+	unsigned int fileid;
+	unsigned int resource;
+	/* What the fork looked like when this was read */
+	unsigned int modification_date;
+	uint64_t file_size;
+	/* What of it is in the file, in order, none touching */
+	struct disk_cache_extent * extents;
+	unsigned int nextents;
+	unsigned int maxextents;
+	uint64_t bytes;
+	/* Reads and writes of the file going on without the lock */
+	unsigned int busy;
+	/* Thrown away while busy, for the last of those to free */
+	int gone;
+	/* Written to since the mount, so to be synced before the index */
+	int dirty;
+};
+
+/* One of these to a fork in the index, followed by its extents */
+struct disk_cache_record {
+	uint32_t fileid;
+	uint32_t modification_date;
+	uint32_t resource;
+	uint32_t nextents;
+	uint64_t file_size;
+};
+
+struct afp_disk_cache {
+	pthread_mutex_t mutex;
+	char path[PATH_MAX];
+	int lock_fd;
+	uint64_t size;
+	uint64_t used;
+	struct disk_cache_entry ** buckets;
+	unsigned int nbuckets;
+	unsigned int nentries;
+	/* Most recently used first */
+	struct disk_cache_entry * lru_head;
+	struct disk_cache_entry * lru_tail;
+	struct afp_volume * volume;
+};
+
+#define fork_size(fp) ((fp)->resource ? (fp)->resourcesize : (fp)->size)
+
+/* The longest name we give anything in a volume's directory */
+#define DISK_CACHE_NAME_MAX sizeof("/ffffffff-ffffffff.rsrc")
+
+/* afp_disk_cache_open() leaves room for this, but should it not fit, the
+ * path is left empty, so whatever is done with it fails */
+static void disk_cache_file(struct afp_disk_cache * c,
+	struct disk_cache_entry * e, char * path)
+{
+	if (snprintf(path,PATH_MAX,"%s/%08x-%08x%s",c->path,e->fileid,
+		e->modification_date,e->resource ? ".rsrc" : "")>=PATH_MAX)
+		path[0]='\0';
+}
+
+static unsigned int disk_cache_hash(struct afp_disk_cache * c,
+	unsigned int fileid, unsigned int resource)
+{
+	return ((fileid*2+resource)*2654435761U)&(c->nbuckets-1);
+}
+
+static struct disk_cache_entry * disk_cache_find(struct afp_disk_cache * c,
+	unsigned int fileid, unsigned int resource)
+{
+	struct disk_cache_entry * e;
+
+	for (e=c->buckets[disk_cache_hash(c,fileid,resource)];e;
+		e=e->hash_next)
+		if ((e->fileid==fileid) && (e->resource==resource))
+			return e;
+	return NULL;
+}
+
+/* All of these are called with the mutex held */
+static void disk_cache_lru_unlink(struct afp_disk_cache * c,
+	struct disk_cache_entry * e)
+{
+	if (e->lru_prev) e->lru_prev->lru_next=e->lru_next;
+	else c->lru_head=e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev=e->lru_prev;
+	else c->lru_tail=e->lru_prev;
+}
+
+static void disk_cache_lru_push(struct afp_disk_cache * c,
+	struct disk_cache_entry * e)
+{
+	e->lru_prev=NULL;
+	e->lru_next=c->lru_head;
+	if (c->lru_head) c->lru_head->lru_prev=e;
+	else c->lru_tail=e;
+	c->lru_head=e;
+}
+
+/* Puts it in the hash table, and at the front of the LRU list if it was
+ * just used, or the end as the index is read back */
+static void disk_cache_link(struct afp_disk_cache * c,
+	struct disk_cache_entry * e, int recent)
+{
+	struct disk_cache_entry ** buckets, * x, * next;
+	unsigned int i, h, nbuckets;
+
+	/* Kept to about one to a bucket */
+	if (c->nentries>=c->nbuckets) {
+		nbuckets=c->nbuckets*2;
+		if ((buckets=calloc(nbuckets,sizeof(buckets[0])))) {
+			for (i=0;i<c->nbuckets;i++)
+				for (x=c->buckets[i];x;x=next) {
+					next=x->hash_next;
+					h=((x->fileid*2+x->resource)*
+						2654435761U)&(nbuckets-1);
+					x->hash_next=buckets[h];
+					buckets[h]=x;
+				}
+			free(c->buckets);
+			c->buckets=buckets;
+			c->nbuckets=nbuckets;
+		}
+	}
+	h=disk_cache_hash(c,e->fileid,e->resource);
+	e->hash_next=c->buckets[h];
+	c->buckets[h]=e;
+	c->nentries++;
+	c->used+=e->bytes;
+
+	if (recent) {
+		disk_cache_lru_push(c,e);
+		return;
+	}
+	e->lru_next=NULL;
+	e->lru_prev=c->lru_tail;
+	if (c->lru_tail) c->lru_tail->lru_next=e;
+	else c->lru_head=e;
+	c->lru_tail=e;
+}
+
+static void disk_cache_free_entry(struct disk_cache_entry * e)
+{
+	free(e->extents);
+	free(e);
+}
+
+/* Throws the fork's file away, leaving the entry for whoever is busy
+ * with it to free */
+static void disk_cache_remove(struct afp_disk_cache * c,
+	struct disk_cache_entry * e)
+{
+	struct disk_cache_entry ** p;
+	char path[PATH_MAX];
+
+	for (p=&c->buckets[disk_cache_hash(c,e->fileid,e->resource)];*p;
+		p=&(*p)->hash_next)
+		if (*p==e) {
+			*p=e->hash_next;
+			break;
+		}
+	disk_cache_lru_unlink(c,e);
+	c->nentries--;
+	c->used-=e->bytes;
+
+	disk_cache_file(c,e,path);
+	unlink(path);
+	if (e->busy)
+		e->gone=1;
+	else
+		disk_cache_free_entry(e);
+}
+
+static void disk_cache_unbusy(struct disk_cache_entry * e)
+{
+	if ((--e->busy==0) && (e->gone))
+		disk_cache_free_entry(e);
+}
+
+static void disk_cache_evict(struct afp_disk_cache * c)
+{
+	struct disk_cache_entry * e, * prev;
+
+	for (e=c->lru_tail;(e) && (c->used>c->size);e=prev) {
+		prev=e->lru_prev;
+		if (e->busy) continue;
+		disk_cache_remove(c,e);
+		c->volume->disk_cache_stats.evicted++;
+	}
+}
+
+/* Returns the extent with offset in it, if there is one */
+static struct disk_cache_extent * disk_cache_extent(
+	struct disk_cache_entry * e, uint64_t offset)
+{
+	unsigned int low=0, high=e->nextents, mid;
+
+	while (low<high) {
+		mid=(low+high)/2;
+		if (offset<e->extents[mid].start)
+			high=mid;
+		else if (offset>=e->extents[mid].end)
+			low=mid+1;
+		else
+			return &e->extents[mid];
+	}
+	return NULL;
+}
+
+/* Adds start to end to what the file has, joining it up with whatever it
+ * touches.  Returns how many bytes that added. */
+static uint64_t disk_cache_add_extent(struct disk_cache_entry * e,
+	uint64_t start, uint64_t end)
+{
+	struct disk_cache_extent * x;
+	unsigned int i, j;
+	uint64_t had=0;
+
+	for (i=0;(i<e->nextents) && (e->extents[i].end<start);i++);
+	for (j=i;(j<e->nextents) && (e->extents[j].start<=end);j++) {
+		had+=e->extents[j].end-e->extents[j].start;
+		start=min(start,e->extents[j].start);
+		end=max(end,e->extents[j].end);
+	}
+
+	if (i==j) {
+		if (e->nextents==e->maxextents) {
+			x=realloc(e->extents,(e->maxextents+8)*sizeof(*x));
+			if (x==NULL) return 0;
+			e->extents=x;
+			e->maxextents+=8;
+		}
+		memmove(&e->extents[i+1],&e->extents[i],
+			(e->nextents-i)*sizeof(*x));
+		e->nextents++;
+	} else if (j>i+1) {
+		memmove(&e->extents[i+1],&e->extents[j],
+			(e->nextents-j)*sizeof(*x));
+		e->nextents-=j-i-1;
+	}
+	e->extents[i].start=start;
+	e->extents[i].end=end;
+	e->bytes+=end-start-had;
+	return end-start-had;
+}
+
+static int disk_cache_mkdir(const char * path)
+{
+	if ((mkdir(path,0700)) && (errno!=EEXIST))
+		return -1;
+	return 0;
+}
+
+/* Reads back what the last mount left, and removes the index, so that
+ * it's only there while it's right */
+static void disk_cache_load(struct afp_disk_cache * c)
+{
+	struct disk_cache_record r;
+	struct disk_cache_entry * e;
+	char path[PATH_MAX], magic[8];
+	struct stat st;
+	unsigned int i;
+	FILE * f;
+
+	if ((snprintf(path,sizeof(path),"%s/index",c->path)>=
+		(int) sizeof(path)) || ((f=fopen(path,"r"))==NULL))
+		return;
+	unlink(path);
+	if ((fread(magic,sizeof(magic),1,f)!=1) ||
+		(memcmp(magic,DISK_CACHE_MAGIC,sizeof(magic))!=0))
+		goto out;
+
+	while (fread(&r,sizeof(r),1,f)==1) {
+		if ((r.nextents==0) || (r.nextents>1<<20))
+			break;
+		if ((e=calloc(1,sizeof(*e)))==NULL)
+			break;
+		e->fileid=r.fileid;
+		e->modification_date=r.modification_date;
+		e->resource=r.resource;
+		e->file_size=r.file_size;
+		e->nextents=e->maxextents=r.nextents;
+		if (((e->extents=malloc(r.nextents*sizeof(e->extents[0])))
+			==NULL) ||
+			(fread(e->extents,sizeof(e->extents[0]),r.nextents,f)
+			!=r.nextents)) {
+			disk_cache_free_entry(e);
+			break;
+		}
+		for (i=0;i<e->nextents;i++)
+			e->bytes+=e->extents[i].end-e->extents[i].start;
+
+		/* Only the first for a fork counts, and only with its file */
+		disk_cache_file(c,e,path);
+		if ((disk_cache_find(c,e->fileid,e->resource)) ||
+			(stat(path,&st)) ||
+			((uint64_t) st.st_size<e->extents[e->nextents-1].end)) {
+			disk_cache_free_entry(e);
+			continue;
+		}
+		disk_cache_link(c,e,0);
+	}
+out:
+	fclose(f);
+}
+
+/* Deletes whatever data files aren't in the index */
+static void disk_cache_clean(struct afp_disk_cache * c)
+{
+	struct disk_cache_entry * e;
+	struct dirent * d;
+	char path[PATH_MAX];
+	unsigned int fileid, modification_date;
+	int n;
+	DIR * dir;
+
+	if ((dir=opendir(c->path))==NULL)
+		return;
+	while ((d=readdir(dir))) {
+		if ((strcmp(d->d_name,"lock")==0) || (d->d_name[0]=='.'))
+			continue;
+		if (sscanf(d->d_name,"%8x-%8x%n",&fileid,&modification_date,
+			&n)==2) {
+			e=disk_cache_find(c,fileid,
+				strcmp(d->d_name+n,".rsrc")==0);
+			if ((e) && (e->modification_date==modification_date) &&
+				(d->d_name[n]=='\0' || e->resource))
+				continue;
+		}
+		if (snprintf(path,sizeof(path),"%s/%s",c->path,d->d_name)<
+			(int) sizeof(path))
+			unlink(path);
+	}
+	closedir(dir);
+}
+
+/* Sets up the cache for a volume that has just been mounted, in its own
+ * directory under dir, and up to size bytes */
+struct afp_disk_cache * afp_disk_cache_open(struct afp_volume * volume,
+	const char * dir, uint64_t size)
+{
+	struct afp_server * server = volume->server;
+	struct afp_disk_cache * c;
+	char path[PATH_MAX], name[AFP_VOLUME_NAME_UTF8_LEN*3];
+	unsigned int i, len=0;
+	const unsigned char * p;
+
+	if ((c=calloc(1,sizeof(*c)))==NULL)
+		return NULL;
+	pthread_mutex_init(&c->mutex,NULL);
+	c->size=size;
+	c->volume=volume;
+	c->lock_fd=-1;
+	c->nbuckets=256;
+	if ((c->buckets=calloc(c->nbuckets,sizeof(c->buckets[0])))==NULL)
+		goto error;
+
+	/* The server's signature, or if it doesn't have one, its name */
+	for (i=0;i<AFP_SIGNATURE_LEN;i++)
+		if (server->signature[i]) break;
+	if (i<AFP_SIGNATURE_LEN)
+		for (i=0;i<AFP_SIGNATURE_LEN;i++)
+			len+=sprintf(name+len,"%02x",
+				(unsigned char) server->signature[i]);
+	else
+		snprintf(name,sizeof(name),"%.*s",(int) sizeof(name)-1,
+			server->server_name_printable);
+	if (snprintf(path,sizeof(path),"%s/%s",dir,name)>=(int) sizeof(path))
+		goto too_long;
+
+	/* Volume names can have anything in them but a colon */
+	for (len=0,p=(unsigned char *) volume->volume_name_printable;
+		(*p) && (len<sizeof(name)-4);p++) {
+		if ((*p=='/') || (*p=='%') || (*p<' ') ||
+			((*p=='.') && (len==0)))
+			len+=sprintf(name+len,"%%%02x",*p);
+		else
+			name[len++]=*p;
+	}
+	name[len]='\0';
+
+	if ((disk_cache_mkdir(dir)) || (disk_cache_mkdir(path)))
+		goto error;
+	/* Leave room for the names of what goes in it */
+	if (snprintf(c->path,sizeof(c->path),"%s/%s",path,name)>=
+		(int) (sizeof(c->path)-DISK_CACHE_NAME_MAX))
+		goto too_long;
+	if (disk_cache_mkdir(c->path))
+		goto error;
+
+	if (snprintf(path,sizeof(path),"%s/lock",c->path)>=(int) sizeof(path))
+		goto too_long;
+	if ((c->lock_fd=open(path,O_RDWR|O_CREAT,0600))<0)
+		goto error;
+	if (flock(c->lock_fd,LOCK_EX|LOCK_NB)) {
+		log_for_client(NULL,AFPFSD,LOG_WARNING,
+			"%s is in use by another mount\n",c->path);
+		goto error;
+	}
+
+	disk_cache_load(c);
+	disk_cache_clean(c);
+	disk_cache_evict(c);
+	return c;
+
+too_long:
+	log_for_client(NULL,AFPFSD,LOG_ERR,
+		"The cache directory %s is too long a path\n",dir);
+error:
+	if (c->lock_fd>=0) close(c->lock_fd);
+	free(c->buckets);
+	pthread_mutex_destroy(&c->mutex);
+	free(c);
+	return NULL;
+}
+
+void afp_disk_cache_usage(struct afp_disk_cache * c, const char ** path,
+	uint64_t * size, uint64_t * used, unsigned int * files)
+{
+	*path=c->path;
+	*size=c->size;
+	*used=c->used;
+	*files=c->nentries;
+}
+
+int disk_cache_wanted(struct afp_volume * volume, struct afp_file_info * fp)
+{
+	/* The same goes as for the block cache */
+	return ((volume->disk_cache) && (fp->fileid) &&
+		(fp->modification_date) && (!fp->sync) &&
+		((volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) ||
+		(fp->lease)));
+}
+
+/* Returns the fork's entry, if it's still good for the fork as it was
+ * opened, and otherwise throws it away */
+static struct disk_cache_entry * disk_cache_check(struct afp_volume * volume,
+	struct afp_file_info * fp)
+{
+	struct afp_disk_cache * c = volume->disk_cache;
+	struct disk_cache_entry * e;
+
+	if ((e=disk_cache_find(c,fp->fileid,fp->resource ? 1 : 0))==NULL)
+		return NULL;
+	if ((e->modification_date==fp->modification_date) &&
+		(e->file_size==fork_size(fp)))
+		return e;
+	disk_cache_remove(c,e);
+	volume->disk_cache_stats.invalidated++;
+	return NULL;
+}
+
+/* Called as a fork is opened, so that a changed file is let go of
+ * straight away */
+void disk_cache_open(struct afp_volume * volume, struct afp_file_info * fp)
+{
+	struct afp_disk_cache * c = volume->disk_cache;
+
+	pthread_mutex_lock(&c->mutex);
+	disk_cache_check(volume,fp);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/* Copies out as much of the read as the file has, from offset on, up to
+ * where that runs out.  Returns how much that was, and sets eof if it
+ * got to the end of the fork. */
+size_t disk_cache_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof)
+{
+	struct afp_disk_cache * c = volume->disk_cache;
+	struct disk_cache_entry * e;
+	struct disk_cache_extent * x;
+	char path[PATH_MAX];
+	ssize_t n=0;
+	size_t len;
+	int fd;
+
+	pthread_mutex_lock(&c->mutex);
+	if ((e=disk_cache_check(volume,fp))==NULL)
+		goto miss;
+	if ((uint64_t) offset>=e->file_size) {
+		pthread_mutex_unlock(&c->mutex);
+		*eof=1;
+		return 0;
+	}
+	if ((x=disk_cache_extent(e,offset))==NULL)
+		goto miss;
+	len=min(x->end-offset,size);
+	e->busy++;
+	disk_cache_lru_unlink(c,e);
+	disk_cache_lru_push(c,e);
+	disk_cache_file(c,e,path);
+	pthread_mutex_unlock(&c->mutex);
+
+	if ((fd=open(path,O_RDONLY))>=0) {
+		n=pread(fd,buf,len,offset);
+		close(fd);
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	disk_cache_unbusy(e);
+	if (n<=0)
+		goto miss;
+	volume->disk_cache_stats.hits++;
+	pthread_mutex_unlock(&c->mutex);
+
+	if ((uint64_t) offset+n>=fork_size(fp))
+		*eof=1;
+	return n;
+
+miss:
+	volume->disk_cache_stats.misses++;
+	pthread_mutex_unlock(&c->mutex);
+	return 0;
+}
+
+/* Keeps what was just read from the server */
+void disk_cache_fill(struct afp_volume * volume, struct afp_file_info * fp,
+	const char * buf, size_t size, off_t offset)
+{
+	struct afp_disk_cache * c = volume->disk_cache;
+	struct disk_cache_entry * e;
+	char path[PATH_MAX];
+	ssize_t n=-1;
+	int fd;
+
+	/* More than the fork had when it was opened means it has changed.
+	 * A fork bigger than the whole cache would only push everything
+	 * else out, and then itself, so it is left to the server. */
+	if ((size==0) || (offset+size>fork_size(fp)) ||
+		(fork_size(fp)>c->size))
+		return;
+
+	pthread_mutex_lock(&c->mutex);
+	if ((e=disk_cache_check(volume,fp))==NULL) {
+		if ((e=calloc(1,sizeof(*e)))==NULL)
+			goto out;
+		e->fileid=fp->fileid;
+		e->resource=fp->resource ? 1 : 0;
+		e->modification_date=fp->modification_date;
+		e->file_size=fork_size(fp);
+		/* In case one was left behind */
+		disk_cache_file(c,e,path);
+		unlink(path);
+		disk_cache_link(c,e,1);
+	}
+	e->busy++;
+	disk_cache_file(c,e,path);
+	pthread_mutex_unlock(&c->mutex);
+
+	if ((fd=open(path,O_WRONLY|O_CREAT,0600))>=0) {
+		n=pwrite(fd,buf,size,offset);
+		close(fd);
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	if ((!e->gone) && (n==(ssize_t) size)) {
+		c->used+=disk_cache_add_extent(e,offset,offset+size);
+		e->dirty=1;
+		disk_cache_lru_unlink(c,e);
+		disk_cache_lru_push(c,e);
+	}
+	disk_cache_unbusy(e);
+	disk_cache_evict(c);
+out:
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/* Throws away everything of a fork that is being written to, or
+ * truncated */
+void disk_cache_invalidate(struct afp_volume * volume,
+	struct afp_file_info * fp)
+{
+	struct afp_disk_cache * c = volume->disk_cache;
+	struct disk_cache_entry * e;
+
+	if ((c==NULL) || (fp->fileid==0)) return;
+
+	pthread_mutex_lock(&c->mutex);
+	if ((e=disk_cache_find(c,fp->fileid,fp->resource ? 1 : 0))) {
+		disk_cache_remove(c,e);
+		volume->disk_cache_stats.invalidated++;
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/* Makes sure the data is on disk before the index that says it is */
+static int disk_cache_sync(struct afp_disk_cache * c,
+	struct disk_cache_entry * e)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	if (!e->dirty) return 0;
+	disk_cache_file(c,e,path);
+	if ((fd=open(path,O_WRONLY))<0)
+		return -1;
+	ret=fdatasync(fd);
+	close(fd);
+	return ret;
+}
+
+static void disk_cache_save(struct afp_disk_cache * c)
+{
+	struct disk_cache_record r;
+	struct disk_cache_entry * e;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE * f;
+
+	if ((snprintf(path,sizeof(path),"%s/index",c->path)>=
+		(int) sizeof(path)) ||
+		(snprintf(tmp,sizeof(tmp),"%s/index.tmp",c->path)>=
+		(int) sizeof(tmp)) ||
+		((f=fopen(tmp,"w"))==NULL))
+		return;
+	fwrite(DISK_CACHE_MAGIC,8,1,f);
+
+	/* Most recently used first, so it comes back in the same order */
+	for (e=c->lru_head;e;e=e->lru_next) {
+		if ((e->nextents==0) || (disk_cache_sync(c,e)))
+			continue;
+		memset(&r,0,sizeof(r));
+		r.fileid=e->fileid;
+		r.modification_date=e->modification_date;
+		r.resource=e->resource;
+		r.nextents=e->nextents;
+		r.file_size=e->file_size;
+		fwrite(&r,sizeof(r),1,f);
+		fwrite(e->extents,sizeof(e->extents[0]),e->nextents,f);
+	}
+	if ((fflush(f)) || (fdatasync(fileno(f))) || (ferror(f))) {
+		fclose(f);
+		unlink(tmp);
+		return;
+	}
+	fclose(f);
+	rename(tmp,path);
+}
+
+/* Called as the volume is unmounted, once its forks are closed */
+void disk_cache_close(struct afp_volume * volume)
+{
+	struct afp_disk_cache * c = volume->disk_cache;
+	struct disk_cache_entry * e, * next;
+
+	if (c==NULL) return;
+	volume->disk_cache=NULL;
+
+	pthread_mutex_lock(&c->mutex);
+	disk_cache_save(c);
+	for (e=c->lru_head;e;e=next) {
+		next=e->lru_next;
+		disk_cache_free_entry(e);
+	}
+	pthread_mutex_unlock(&c->mutex);
+
+	close(c->lock_fd);
+	free(c->buckets);
+	pthread_mutex_destroy(&c->mutex);
+	free(c);
+}
@@ -0,0 +1,19 @@
+#ifndef __DISK_CACHE_H_
+#define __DISK_CACHE_H_
+
+#include "afpfs-ng/afp.h"
+
+/* What the index file starts with; one from anything else is ignored */
+#define DISK_CACHE_MAGIC "AFPDC001"
+
+int disk_cache_wanted(struct afp_volume * volume, struct afp_file_info * fp);
+void disk_cache_open(struct afp_volume * volume, struct afp_file_info * fp);
+size_t disk_cache_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof);
+void disk_cache_fill(struct afp_volume * volume, struct afp_file_info * fp,
+	const char * buf, size_t size, off_t offset);
+void disk_cache_invalidate(struct afp_volume * volume,
+	struct afp_file_info * fp);
+void disk_cache_close(struct afp_volume * volume);
+
+#endif
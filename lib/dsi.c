@@ -9,21 +9,31 @@
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <signal.h>
 #include <iconv.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "afpfs-ng/utils.h"
 #include "afpfs-ng/dsi.h"
 #include "afpfs-ng/afp.h"
 #include "afpfs-ng/uams_def.h"
 #include "dsi_protocol.h"
+#include "dsi_ring.h"
+#include "dsi_timer.h"
+#include "dsi_rtt.h"
+#include "dsi_event.h"
+#include "afp_stats.h"
+#include "dsi_capture.h"
 #include "afpfs-ng/libafpclient.h"
 #include "afp_internal.h"
 #include "afp_replies.h"
@@ -31,27 +41,50 @@
 /* define this in order to get reams of DSI debugging information */
 #undef DEBUG_DSI
 
-static int dsi_remove_from_request_queue(struct afp_server *server,
-	struct dsi_request *toremove);
+/* How many reads we'll do for one server before going back to the main
+ * loop, so that one busy server can't starve the others */
+#define DSI_DRAIN_MAX_READS 64
+
+/* Should the thread receiving for a server never get round to failing a
+ * request, whoever waits on it gives up this long after its deadline */
+#define DSI_WAIT_BACKSTOP_MS (DSI_DEFAULT_TIMEOUT*1000)
+
+/* The most packets we'll put in one sendmsg() */
+#define DSI_SEND_BATCH 32
+
+/* A packet waiting to be sent.  It lives on the stack of the thread
+ * sending it, which doesn't return until done is set. */
+struct dsi_send_entry {
+	struct iovec iov[2];
+	int iovcnt;
+	unsigned int size;
+	int done;
+	int error;
+	struct dsi_send_entry * next;
+};
+
 int convert_utf8dec_to_utf8pre(const char *src, int src_len,
 	char * dest, int dest_len);
 int convert_utf8pre_to_utf8dec(const char * src, int src_len, 
 	char * dest, int dest_len);
 
+/* Hands out request ids without a lock.  Each caller gets the value its
+ * own increment made, so no two requests in flight can share an id, and
+ * the request is tagged with that, never with lastrequestid, which may
+ * have moved on by then.  An unsigned short wraps from 65535 to 0 by
+ * itself. */
+static unsigned short dsi_next_requestid(struct afp_server * server)
+{
+	return __sync_add_and_fetch(&server->lastrequestid,1);
+}
+
 /* This sets up a DSI header. */
 void dsi_setup_header(struct afp_server * server, struct dsi_header * header, char command) 
 {
 
 	memset(header,0, sizeof(struct dsi_header));
 
-	pthread_mutex_lock(&server->requestid_mutex);
-	if (server->lastrequestid == 65535) server->lastrequestid = 0;
-	else server->lastrequestid++;
-	server->expectedrequestid = server->lastrequestid;
-
-	pthread_mutex_unlock(&server->requestid_mutex);
-
-	header->requestid = htons(server->lastrequestid);
+	header->requestid = htons(dsi_next_requestid(server));
 
 	header->command = command;
 
@@ -78,29 +111,32 @@ int dsi_getstatus(struct afp_server * server)
 	return ret;
 }
 
-int dsi_sendtickle(struct afp_server *server)
-{
-	struct dsi_header  header;
-	dsi_setup_header(server,&header,DSI_DSITickle);
-	dsi_send(server,(char *) &header,sizeof(struct dsi_header),1,
-		DSI_DONT_WAIT,NULL);
-	return 0;
-}
-
 int dsi_opensession(struct afp_server *server)
 {
 	struct {
 		struct dsi_header dsi_header  __attribute__((__packed__));
-		uint8_t flags;
-		uint8_t length;
-		uint32_t rx_quantum ;
+		uint8_t attention_type;
+		uint8_t attention_length;
+		uint32_t attention_quantum;
+		uint8_t quantum_type;
+		uint8_t quantum_length;
+		uint32_t rx_quantum;
 	} __attribute__((__packed__)) dsi_opensession_header;
 
+	/* Until the server tells us otherwise */
+	server->tx_quantum=AFP_DEFAULT_QUANTUM;
+	if ((server->max_quantum) && (server->tx_quantum>server->max_quantum))
+		server->tx_quantum=server->max_quantum;
+
 	dsi_setup_header(server,&dsi_opensession_header.dsi_header,DSI_DSIOpenSession);
-	/* Advertize our rx quantum */
-	dsi_opensession_header.flags=1; 
-	dsi_opensession_header.length=sizeof(unsigned int);
-	dsi_opensession_header.rx_quantum=htonl(server->attention_quantum);
+	/* Advertize our attention and rx quantums */
+	dsi_opensession_header.attention_type=DSI_OPTION_ATTENTION_QUANTUM;
+	dsi_opensession_header.attention_length=sizeof(uint32_t);
+	dsi_opensession_header.attention_quantum=
+		htonl(server->attention_quantum);
+	dsi_opensession_header.quantum_type=DSI_OPTION_SERVER_QUANTUM;
+	dsi_opensession_header.quantum_length=sizeof(uint32_t);
+	dsi_opensession_header.rx_quantum=htonl(server->rx_quantum);
 
 	dsi_send(server,(char *) &dsi_opensession_header,
 		sizeof(dsi_opensession_header),1,DSI_BLOCK_TIMEOUT,NULL);
@@ -139,29 +175,218 @@ static int check_incoming_dsi_message(struct afp_server * server, void * data, i
 }
 */
 
-static int dsi_remove_from_request_queue(struct afp_server *server,
+/* Requests come out of a per-server pool whose condition variables and
+ * mutexes are set up once, when the server is created.  The free list is a
+ * lock-free stack; its head packs a generation count in the upper 32 bits
+ * and (index+1) of the top request in the lower 32 bits, so a request that
+ * is popped and pushed back between our read and our compare-and-swap
+ * can't be mistaken for an unchanged list.  When the pool runs dry we fall
+ * back to malloc. */
+
+#define POOL_INDEX(x) ((unsigned int) ((x) & 0xffffffff))
+#define POOL_HEAD(gen,index) ((((uint64_t) (gen)+1)<<32) | (index))
+
+int dsi_setup_request_pool(struct afp_server * server)
+{
+	struct dsi_request * r;
+	int i;
+
+	if ((server->request_pool=calloc(DSI_REQUEST_POOL_SIZE,
+		sizeof(struct dsi_request)))==NULL)
+		return -1;
+
+	for (i=0;i<DSI_REQUEST_POOL_SIZE;i++) {
+		r=&server->request_pool[i];
+		pthread_cond_init(&r->waiting_cond,NULL);
+		pthread_mutex_init(&r->waiting_mutex,NULL);
+		r->from_pool=1;
+		r->pool_next=(i+1<DSI_REQUEST_POOL_SIZE) ? i+2 : 0;
+	}
+	server->request_pool_head=POOL_HEAD(0,1);
+	return 0;
+}
+
+void dsi_free_request_pool(struct afp_server * server)
+{
+	int i;
+
+	if (server->request_pool==NULL) return;
+
+	for (i=0;i<DSI_REQUEST_POOL_SIZE;i++) {
+		pthread_cond_destroy(&server->request_pool[i].waiting_cond);
+		pthread_mutex_destroy(&server->request_pool[i].waiting_mutex);
+	}
+	free(server->request_pool);
+	server->request_pool=NULL;
+	server->request_pool_head=0;
+}
+
+struct dsi_request * dsi_get_request(struct afp_server * server)
+{
+	struct dsi_request * r;
+	uint64_t head;
+	unsigned int index;
+
+	do {
+		head=server->request_pool_head;
+		if ((index=POOL_INDEX(head))==0) 
+			goto exhausted;
+		r=&server->request_pool[index-1];
+	} while (!__sync_bool_compare_and_swap(&server->request_pool_head,
+		head,POOL_HEAD(head>>32,r->pool_next)));
+
+	__sync_fetch_and_add(&server->stats.request_pool_hits,1);
+
+	r->pool_next=0;
+	goto reset;
+
+exhausted:
+	__sync_fetch_and_add(&server->stats.request_pool_exhausted,1);
+
+	if ((r=malloc(sizeof(struct dsi_request))) == NULL) 
+		return NULL;
+	memset(r,0,sizeof(struct dsi_request));
+	pthread_cond_init(&r->waiting_cond,NULL);
+	pthread_mutex_init(&r->waiting_mutex,NULL);
+
+reset:
+	r->requestid=0;
+	r->subcommand=0;
+	r->other=NULL;
+	r->wait=0;
+	r->done_waiting=0;
+	r->next=NULL;
+	r->return_code=0;
+	r->completion=NULL;
+	r->completion_context=NULL;
+	r->timer.pprev=NULL;
+	r->timed_out=0;
+	r->sent=0;
+	r->attempt=0;
+	r->bytes_out=0;
+	r->bytes_in=0;
+	r->completed=0;
+	r->refs=1;
+	return r;
+}
+
+void dsi_put_request(struct afp_server * server, struct dsi_request * r)
+{
+	uint64_t head;
+	unsigned int index;
+
+	if (!r->from_pool) {
+		pthread_cond_destroy(&r->waiting_cond);
+		pthread_mutex_destroy(&r->waiting_mutex);
+		free(r);
+		return;
+	}
+
+	index=(r-server->request_pool)+1;
+	do {
+		head=server->request_pool_head;
+		r->pool_next=POOL_INDEX(head);
+	} while (!__sync_bool_compare_and_swap(&server->request_pool_head,
+		head,POOL_HEAD(head>>32,index)));
+}
+
+/* A request nobody waits for is held by the request table and, until its
+ * packet is out, by the thread sending it, since it can time out while
+ * still queued behind other sends.  It goes back once both are done. */
+static void dsi_release_request(struct afp_server * server,
+	struct dsi_request * r)
+{
+	if (__sync_sub_and_fetch(&r->refs,1)==0)
+		dsi_put_request(server,r);
+}
+
+/* Stops putting a reply into its request's buffer, and skips whatever is
+ * left of it instead.  Call with the incoming_mutex held.  The request
+ * is returned, and the caller drops the receive side's ref on it. */
+static struct dsi_request * dsi_detach_incoming(struct afp_server * server)
+{
+	struct dsi_request * request = server->incoming_request;
+
+	server->incoming_discard=server->incoming_remaining;
+	server->incoming_remaining=0;
+	server->incoming_request=NULL;
+	return request;
+}
+
+/* Fails a request that has gone well past its deadline without the
+ * thread receiving for the server failing it, as it would if it were
+ * stuck.  A reply that comes in after this is thrown away, and once we
+ * have the incoming_mutex nothing more goes into the request's buffer. */
+static void dsi_abandon_request(struct afp_server * server,
+	struct dsi_request * r)
+{
+	log_for_client(NULL,AFPFSD,LOG_WARNING,
+		"Gave up waiting for request %d, %s\n",r->requestid,
+		afp_get_command_name(r->subcommand));
+	pthread_mutex_lock(&server->incoming_mutex);
+	pthread_mutex_lock(&server->request_queue_mutex);
+	r->timed_out=1;
+	r->return_code=ETIMEDOUT;
+	pthread_mutex_unlock(&server->request_queue_mutex);
+	if (r==server->incoming_request)
+		dsi_release_request(server,dsi_detach_incoming(server));
+	pthread_mutex_unlock(&server->incoming_mutex);
+	r->done_waiting=1;
+	server->stats.requests_timed_out++;
+}
+
+/* Counts a request that has had its reply, or has timed out */
+static void dsi_request_stats(struct afp_server * server,
+	struct dsi_request * r)
+{
+	if (r->sent==0) return;
+	afp_stats_record(server->command_stats,r->subcommand,r->return_code,
+		r->bytes_out,r->bytes_in,dsi_rtt_now()-r->sent);
+}
+
+/* The request table is indexed by the low bits of the DSI request id.  Since
+ * ids are handed out sequentially, any window of fewer than 
+ * DSI_REQUEST_TABLE_SIZE outstanding requests lands in distinct slots, so 
+ * insert, lookup and retire are all constant time.  Colliding ids are simply
+ * chained off the slot. */
+
+#define dsi_request_slot(id) ((id) & (DSI_REQUEST_TABLE_SIZE-1))
+
+void dsi_add_to_request_queue(struct afp_server *server,
+	struct dsi_request *toadd)
+{
+	struct dsi_request ** slot;
+
+	pthread_mutex_lock(&server->request_queue_mutex);
+	slot=&server->request_table[dsi_request_slot(toadd->requestid)];
+	toadd->next=*slot;
+	*slot=toadd;
+	server->stats.requests_pending++;
+	pthread_mutex_unlock(&server->request_queue_mutex);
+}
+
+int dsi_remove_from_request_queue(struct afp_server *server,
 	struct dsi_request *toremove)
 {
 
-	struct dsi_request *p, *prev=NULL;
+	struct dsi_request *p, **prev;
 	#ifdef DEBUG_DSI
 	printf("*** removing %d, %s\n",toremove->requestid, 
 		afp_get_command_name(toremove->subcommand));
 	#endif
 	if (!server_still_valid(server)) return -1;
+	dsi_timer_cancel(server->timers,&toremove->timer);
 	pthread_mutex_lock(&server->request_queue_mutex);
-	for (p=server->command_requests;p;p=p->next) {
+	prev=&server->request_table[dsi_request_slot(toremove->requestid)];
+	for (p=*prev;p;p=p->next) {
 		if (p==toremove) {
-			if (prev==NULL)
-				server->command_requests=p->next;
-			else
-				prev->next = p->next;
+			*prev=p->next;
 			server->stats.requests_pending--;
-			free(p);
 			pthread_mutex_unlock(&server->request_queue_mutex);
+			dsi_release_request(server,p);
 			return 0;
 		}
-		prev=p;
+		prev=&p->next;
 	}
 
 	pthread_mutex_unlock(&server->request_queue_mutex);
@@ -175,7 +400,248 @@ static int dsi_remove_from_request_queue(struct afp_server *server,
 }
 
 
+/* Writes out the whole of an iovec, coping with short writes and signals.
+ * The iovec is modified along the way.  A server that has gone away is an
+ * error, not a SIGPIPE. */
+
+static int dsi_writev_all(int fd, struct iovec * iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg,0,sizeof(msg));
+	while (iovcnt>0) {
+		msg.msg_iov=iov;
+		msg.msg_iovlen=iovcnt;
+		if ((ret=sendmsg(fd,&msg,MSG_NOSIGNAL))<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		while ((iovcnt>0) && (ret>=(ssize_t) iov->iov_len)) {
+			ret-=iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt>0) {
+			iov->iov_base=(char *) iov->iov_base+ret;
+			iov->iov_len-=ret;
+		}
+	}
+	return 0;
+}
+
+/* Reads and writes are bulk, everything else goes ahead of them, unless
+ * the mount wants everything sent in order */
+static int dsi_send_class(struct afp_server * server, unsigned char subcommand)
+{
+	if (server->socket_effective.bulk_share>=100)
+		return DSI_SEND_META;
+	switch (subcommand) {
+	case afpRead:
+	case afpReadExt:
+	case afpWrite:
+	case afpWriteExt:
+		return DSI_SEND_BULK;
+	}
+	return DSI_SEND_META;
+}
+
+/* Writes out the send queues, up to DSI_SEND_BATCH packets per sendmsg(),
+ * until mine has gone.  Each packet is marked done and its sender woken.
+ * The caller holds send_queue_mutex, which is dropped while writing, and
+ * is the only one flushing.
+ *
+ * While one thread is writing, the others queue up behind it and the
+ * flusher sends them all at once.  A lone sender flushes straight away,
+ * so nothing is ever delayed.  The flusher stops as soon as its own
+ * packet is out and one of the others takes over, so nobody is kept
+ * writing everyone else's packets for long.
+ *
+ * While both classes are waiting, they take turns by deficit round robin:
+ * each round the bulk class is given bulk_share percent of a quantum to
+ * spend, and the metadata class the rest, and each sends what it can
+ * afford.  A class on its own sends about a quantum per sendmsg(), so
+ * anything queued behind it never waits for more than that. */
+
+static void dsi_send_flush(struct afp_server * server,
+	struct dsi_send_entry * mine)
+{
+	struct dsi_send_entry * batch[DSI_SEND_BATCH], * e;
+	struct iovec iov[2*DSI_SEND_BATCH];
+	unsigned int packets, iovcnt, i, c, waiting, round, share, bulk;
+	uint64_t bytes;
+	int error;
+
+	share=server->socket_effective.bulk_share;
+	if ((share==0) || (share>100)) share=AFP_DEFAULT_BULK_SHARE;
+	round=max(server->tx_quantum,AFP_DEFAULT_QUANTUM);
+	bulk=max(round/100*share,1);
+
+	while (!mine->done) {
+		waiting=(server->send_queue[DSI_SEND_META]!=NULL)+
+			(server->send_queue[DSI_SEND_BULK]!=NULL);
+		packets=0; iovcnt=0; bytes=0;
+		for (c=0;c<DSI_SEND_CLASSES;c++) {
+			if (server->send_queue[c]==NULL) continue;
+			if (waiting>1)
+				server->send_deficit[c]+=(c==DSI_SEND_BULK) ?
+					bulk : max(round-bulk,1);
+			while (((e=server->send_queue[c])) &&
+				(packets<DSI_SEND_BATCH)) {
+				if (waiting>1) {
+					if (e->size>server->send_deficit[c])
+						break;
+					server->send_deficit[c]-=e->size;
+				} else if ((packets>0) && (bytes+e->size>round))
+					break;
+				server->send_queue[c]=e->next;
+				memcpy(&iov[iovcnt],e->iov,
+					e->iovcnt*sizeof(struct iovec));
+				iovcnt+=e->iovcnt;
+				bytes+=e->size;
+				batch[packets++]=e;
+			}
+			if (server->send_queue[c]==NULL) {
+				server->send_queue_tail[c]=NULL;
+				server->send_deficit[c]=0;
+			}
+		}
+		/* Otherwise nobody could afford anything this round */
+		if (packets==0) continue;
+		pthread_mutex_unlock(&server->send_queue_mutex);
+
+		if (server->capture)
+			for (i=0;i<packets;i++)
+				dsi_capture_packet(server->capture,
+					DSI_CAPTURE_OUT,batch[i]->iov,
+					batch[i]->iovcnt,batch[i]->size);
+
+		error=0;
+		if (dsi_writev_all(server->fd,iov,iovcnt)<0)
+			error=errno;
+		else
+			server->stats.tx_bytes+=bytes;
+		server->stats.tx_packets+=packets;
+		server->stats.tx_writes++;
+
+		/* Once done is set, the entry may be gone */
+		pthread_mutex_lock(&server->send_queue_mutex);
+		for (i=0;i<packets;i++) {
+			batch[i]->error=error;
+			batch[i]->done=1;
+		}
+		pthread_cond_broadcast(&server->send_cond);
+	}
+}
+
+/* Queues entry to go out, and waits until it has.  Returns -1 if it
+ * couldn't be written. */
+static int dsi_send_packet(struct afp_server * server,
+	struct dsi_send_entry * entry, int class)
+{
+	entry->done=0;
+	entry->error=0;
+	entry->next=NULL;
+
+	pthread_mutex_lock(&server->send_queue_mutex);
+	if (server->send_queue_tail[class])
+		server->send_queue_tail[class]->next=entry;
+	else
+		server->send_queue[class]=entry;
+	server->send_queue_tail[class]=entry;
+	while (!entry->done) {
+		if (server->send_flushing) {
+			pthread_cond_wait(&server->send_cond,
+				&server->send_queue_mutex);
+			continue;
+		}
+		server->send_flushing=1;
+		dsi_send_flush(server,entry);
+		server->send_flushing=0;
+		/* Anyone still queued needs a new flusher */
+		if ((server->send_queue[DSI_SEND_META]) ||
+			(server->send_queue[DSI_SEND_BULK]))
+			pthread_cond_broadcast(&server->send_cond);
+	}
+	pthread_mutex_unlock(&server->send_queue_mutex);
+
+	if (entry->error) {
+		if ((entry->error==EPIPE) || (entry->error==EBADF)) {
+			/* The server has closed the connection */
+			server->connect_state=SERVER_STATE_DISCONNECTED;
+		} else {
+			errno=entry->error;
+			perror("writing to server");
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/* A tickle gets no reply, so it needs no request, no place in the request
+ * table and no deadline.  Only its id changes from one to the next. */
+int dsi_sendtickle(struct afp_server *server)
+{
+	struct dsi_header header;
+	struct dsi_send_entry entry;
+
+	if (!server_still_valid(server) || server->fd==0)
+		return -1;
+
+	dsi_setup_header(server,&header,DSI_DSITickle);
+	entry.iov[0].iov_base=&header;
+	entry.iov[0].iov_len=sizeof(header);
+	entry.iovcnt=1;
+	entry.size=sizeof(header);
+	server->stats.tickles_sent++;
+	return dsi_send_packet(server,&entry,DSI_SEND_META);
+}
+
+static int dsi_send_request(struct afp_server *server, char * msg, int size,
+	char * data, unsigned int datasize,
+	int wait,unsigned char subcommand, void ** other,
+	afp_completion completion, void * context);
+
 int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned char subcommand, void ** other) 
+{
+	return dsi_send_request(server,msg,size,NULL,0,wait,subcommand,other,
+		NULL,NULL);
+}
+
+/* dsi_send_data() is dsi_send() with a separate data payload that follows
+ * the header in msg.  Both are handed to the kernel in one sendmsg(), so
+ * the caller's data never gets copied into a packet buffer.  This is what
+ * DSIWrite uses. */
+
+int dsi_send_data(struct afp_server *server, char * msg, int size,
+	char * data, unsigned int datasize,
+	int wait,unsigned char subcommand, void ** other) 
+{
+	return dsi_send_request(server,msg,size,data,datasize,wait,subcommand,
+		other,NULL,NULL);
+}
+
+/* dsi_send_async() returns as soon as the packet has been sent.  When the
+ * reply comes in, it is parsed into other as usual and then completion is
+ * called with context and the AFP return code.  The completion runs on
+ * the thread that receives for the server, so it must not block, and
+ * other must stay valid until then.  If the packet can't be sent, -1 is
+ * returned and completion is never called; otherwise it is called exactly
+ * once, even if the request times out before it has gone out. */
+
+int dsi_send_async(struct afp_server *server, char * msg, int size,
+	char * data, unsigned int datasize,
+	unsigned char subcommand, void ** other,
+	afp_completion completion, void * context)
+{
+	return dsi_send_request(server,msg,size,data,datasize,DSI_DONT_WAIT,
+		subcommand,other,completion,context);
+}
+
+static int dsi_send_request(struct afp_server *server, char * msg, int size,
+	char * data, unsigned int datasize,
+	int wait,unsigned char subcommand, void ** other,
+	afp_completion completion, void * context)
 {
 	/* For wait:
 	 * -1: wait forever
@@ -183,43 +649,51 @@ int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned c
 	 * x>n: wait for N seconds */
 
 	struct dsi_header  *header = (struct dsi_header *) msg;
-	struct dsi_request * new_request, *p;
-	int rc=0;
-	struct timespec ts;
-	struct timeval tv;
- 	header->length=htonl(size-sizeof(struct dsi_header));
+	struct dsi_request * new_request;
+	int rc=0, class;
+	unsigned int payload=size+datasize, attempt=0, timeout=0;
+	struct dsi_send_entry entry;
+ 	header->length=htonl(size+datasize-sizeof(struct dsi_header));
 
 	if (!server_still_valid(server) || server->fd==0)
 		return -1;
 
 	afp_wait_for_started_loop();
 
+	if (((subcommand==afpRead) || (subcommand==afpReadExt)) && (other))
+		payload+=((struct afp_rx_buffer *) other)->maxsize;
+
+again:
 	/* Add request to the queue */
-	if ((new_request=malloc(sizeof(struct dsi_request))) == NULL) {
+	if ((new_request=dsi_get_request(server)) == NULL) {
 		log_for_client(NULL,AFPFSD,LOG_ERR,
 			"Could not allocate for new request\n");
 		return -1;
 	}
-	memset(new_request,0,sizeof(struct dsi_request));
-	new_request->requestid=server->lastrequestid;
+	new_request->requestid=ntohs(header->requestid);
 	new_request->subcommand=subcommand;
 	new_request->other=other;
 	new_request->wait=wait;
-	new_request->next=NULL;
-      	new_request->done_waiting=0;
-
-	pthread_mutex_lock(&server->request_queue_mutex);
-	if (server->command_requests==NULL) {
-		server->command_requests=new_request;
-	} else {
-		for (p=server->command_requests;p->next;p=p->next);
-		p->next=new_request;
+	new_request->completion=completion;
+	new_request->completion_context=context;
+	new_request->attempt=attempt;
+	new_request->sent=dsi_rtt_now();
+	new_request->bytes_out=size+datasize;
+	if ((completion) || (wait==0))
+		new_request->refs++;
+
+	dsi_add_to_request_queue(server,new_request);
+
+	/* The deadline has to be set before the request goes out, since the
+	 * reply could be handled before we get any further.  Nothing with a
+	 * completion is sent again, so its one try is also its last. */
+	if ((completion) || (wait>0)) {
+		timeout=dsi_rtt_timeout(server,subcommand,
+			(completion ? DSI_DEFAULT_TIMEOUT : wait),payload,
+			(completion ? DSI_RTT_RETRIES : attempt));
+		if (dsi_timer_add(server->timers,&new_request->timer,timeout))
+			loop_wake_server(server);
 	}
-	server->stats.requests_pending++;
-	pthread_mutex_unlock(&server->request_queue_mutex);
-
-	pthread_cond_init(&new_request->waiting_cond,NULL);
-	pthread_mutex_init(&new_request->waiting_mutex,NULL);
 
 	if (server->connect_state==SERVER_STATE_DISCONNECTED) {
 		char mesg[1024];
@@ -231,91 +705,80 @@ int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned c
 
 	}
 
-	pthread_mutex_lock(&server->send_mutex);
+	entry.iov[0].iov_base=msg;
+	entry.iov[0].iov_len=size;
+	entry.iovcnt=1;
+	if (datasize) {
+		entry.iov[1].iov_base=data;
+		entry.iov[1].iov_len=datasize;
+		entry.iovcnt++;
+	}
+	entry.size=size+datasize;
+	class=dsi_send_class(server,subcommand);
+
 	#ifdef DEBUG_DSI
 	printf("*** Sending %d, %s\n",ntohs(header->requestid),
 		afp_get_command_name(new_request->subcommand));
 	#endif
-	if (write(server->fd,msg,size)<0) {
-		if ((errno==EPIPE) || (errno==EBADF)) {
-			/* The server has closed the connection */
-			server->connect_state=SERVER_STATE_DISCONNECTED;
-			return -1;
-
+	rc=dsi_send_packet(server,&entry,class);
+
+	/* The reply may already have been handled, so new_request is no
+	 * longer ours to look at.  Whoever handles it retires it.  If the
+	 * send failed, and it hasn't already timed out and been completed,
+	 * it is ours to retire, and the caller's to complete. */
+	if ((completion) || (wait==0)) {
+		if (rc) {
+			if (__sync_bool_compare_and_swap(
+				&new_request->completed,0,1))
+				dsi_remove_from_request_queue(server,
+					new_request);
+			else
+				rc=0;
 		}
-		perror("writing to server");
-		rc=-1;
-		pthread_mutex_unlock(&server->send_mutex);
-		goto out;
+		dsi_release_request(server,new_request);
+		return rc;
 	}
-	server->stats.tx_bytes+=size;
-	pthread_mutex_unlock(&server->send_mutex);
+	if (rc) goto out;
 
 	#ifdef DEBUG_DSI
 	printf("=== Waiting for response for %d %s\n",
 		new_request->requestid,
 		afp_get_command_name(new_request->subcommand));
 	#endif
-	if (new_request->wait<0) {
-
-		/* Wait forever */
-		#ifdef DEBUG_DSI
-		printf("=== Waiting forever for %d, %s\n",
-			new_request->requestid,
-			afp_get_command_name(new_request->subcommand));
-		#endif
-
-		pthread_mutex_lock(&new_request->waiting_mutex);
-
-		if (new_request->done_waiting==0)
-			rc=pthread_cond_wait( 
-				&new_request->waiting_cond, 
-					&new_request->waiting_mutex );
-
-		pthread_mutex_unlock(&new_request->waiting_mutex);
-
-	} else if (new_request->wait>0) {
-		/* wait for new_request->wait seconds */
-
-		#ifdef DEBUG_DSI
-		printf("=== Waiting for %d %s, for %ds\n",
-			new_request->requestid,
-			afp_get_command_name(new_request->subcommand),
-			new_request->wait);
-		#endif
+	/* If there's a deadline, the thread receiving for the server
+	 * fails the request once it passes, and wakes us up with
+	 * ETIMEDOUT */
+	#ifdef DEBUG_DSI
+	printf("=== Waiting for %d %s, for %ds\n",
+		new_request->requestid,
+		afp_get_command_name(new_request->subcommand),
+		new_request->wait);
+	#endif
 
-		gettimeofday(&tv,NULL);
-		ts.tv_sec=tv.tv_sec;
-		ts.tv_sec+=new_request->wait;
-		ts.tv_nsec=tv.tv_usec *1000;
-		if (new_request->wait==0) {
-			#ifdef DEBUG_DSI
-			printf("=== Changing my mind, no longer waiting for %d\n",
-				new_request->requestid);
-			#endif
-			goto skip;
-		}
-		pthread_mutex_lock(&new_request->waiting_mutex);
-		if (new_request->done_waiting==0) 
-			rc=pthread_cond_timedwait( 
-				&new_request->waiting_cond, 
-				&new_request->waiting_mutex,&ts);
-		pthread_mutex_unlock(&new_request->waiting_mutex);
-
-		if (rc==ETIMEDOUT) {
-/* FIXME: should handle this case properly */
-			#ifdef DEBUG_DSI
-			printf("=== Timedout for %d\n",
-				new_request->requestid);
-			#endif
-			goto out;
-		}
+	pthread_mutex_lock(&new_request->waiting_mutex);
+	if (wait<0) {
+		while (new_request->done_waiting==0)
+			pthread_cond_wait(&new_request->waiting_cond,
+				&new_request->waiting_mutex);
 	} else {
-                /* Don't wait */
-		#ifdef DEBUG_DSI
-		printf("=== Skipping wait altogether for %d\n",new_request->requestid);
-		#endif
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME,&ts);
+		timeout+=DSI_WAIT_BACKSTOP_MS;
+		ts.tv_sec+=timeout/1000;
+		ts.tv_nsec+=(long) (timeout%1000)*1000000;
+		if (ts.tv_nsec>=1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec-=1000000000;
+		}
+		while ((new_request->done_waiting==0) &&
+			(pthread_cond_timedwait(&new_request->waiting_cond,
+			&new_request->waiting_mutex,&ts)!=ETIMEDOUT))
+			;
+		if (new_request->done_waiting==0)
+			dsi_abandon_request(server,new_request);
 	}
+	pthread_mutex_unlock(&new_request->waiting_mutex);
 	#ifdef DEBUG_DSI
 	printf("=== Done waiting for %d %s, waiting for %ds,"
 		" return %d, DSI return %d\n",
@@ -324,20 +787,36 @@ int dsi_send(struct afp_server *server, char * msg, int size,int wait,unsigned c
 		new_request->wait, 
 		rc,new_request->return_code);
 	#endif
-skip:
 	rc=new_request->return_code;
+	dsi_request_stats(server,new_request);
+
+	/* Anything that only reads can just be asked for again, under a
+	 * new id so that a late reply to the first try isn't taken for it */
+	if ((new_request->timed_out) && (wait>0) &&
+		(attempt<DSI_RTT_RETRIES) && (dsi_rtt_idempotent(subcommand)) &&
+		(server->connect_state!=SERVER_STATE_DISCONNECTED)) {
+		dsi_remove_from_request_queue(server,new_request);
+		header->requestid=htons(dsi_next_requestid(server));
+		if ((subcommand==afpRead) || (subcommand==afpReadExt))
+			((struct afp_rx_buffer *) other)->size=0;
+		attempt++;
+		server->stats.requests_retried++;
+		log_for_client(NULL,AFPFSD,LOG_NOTICE,
+			"Sending %s again, as request %d\n",
+			afp_get_command_name(subcommand),ntohs(header->requestid));
+		goto again;
+	}
 out:
 	dsi_remove_from_request_queue(server,new_request);
 	return rc;
 }
 
-int dsi_command_reply(struct afp_server* server,unsigned short subcommand, void * other) {
+int dsi_command_reply(struct afp_server* server,unsigned short subcommand,
+	char * buf, unsigned int size, void * other) {
 
-	int ret = 0;
-
-	if (server->data_read<sizeof(struct dsi_header)) {
+	if (size<sizeof(struct dsi_header)) {
 		log_for_client(NULL,AFPFSD,LOG_WARNING,
-		"Got a short reply command, I am just ignoring it. size: %d\n",server->data_read);
+		"Got a short reply command, I am just ignoring it. size: %d\n",size);
 		return -1;
 	}
 
@@ -348,37 +827,32 @@ int dsi_command_reply(struct afp_server* server,unsigned short subcommand, void
 		return -1;
 	}
 
-	if ((subcommand==afpRead) || ( subcommand==afpReadExt)) {
-		struct afp_rx_buffer * buf = other;
-		#ifdef DEBUG_DSI
-		printf("=== read() for afpRead, %d bytes\n",buf->maxsize-buf->size);
-		#endif
-		if ((ret=read(server->fd,buf->data+buf->size,
-			buf->maxsize-buf->size))<0) {
-			return -1;
-		}
-		server->stats.rx_bytes+=ret;
-		if (ret==0) {
-			return -1;
-		}
-		server->data_read+=ret;
-	}
-
-	ret = afp_reply(subcommand,server,other);
-	return ret;
+	return afp_reply(subcommand,server,buf,size,other);
 }
 
 
-void dsi_opensession_reply(struct afp_server * server) {
-
-	struct {
-		uint8_t flags ;
-		uint8_t length ;
-		uint32_t tx_quantum;
-	}  __attribute__((__packed__)) * dsi_opensession_header = (void *) 
-		server->incoming_buffer + sizeof(struct dsi_header);
-
-	server->tx_quantum = ntohl(dsi_opensession_header->tx_quantum);
+void dsi_opensession_reply(struct afp_server * server, char * buf,
+	unsigned int size) {
+
+	/* The reply is a list of options, each a type, a length and then
+	 * the value */
+	unsigned char * p = (unsigned char *) buf + sizeof(struct dsi_header);
+	unsigned char * end = (unsigned char *) buf + size;
+	uint32_t quantum;
+
+	for (;(p+2<=end) && (p+2+p[1]<=end);p+=2+p[1]) {
+		if ((p[0]!=DSI_OPTION_SERVER_QUANTUM) || 
+			(p[1]!=sizeof(quantum)))
+			continue;
+		memcpy(&quantum,p+2,sizeof(quantum));
+		quantum=ntohl(quantum);
+		if (quantum==0) continue;
+		/* We never send more than the server will take, but we can
+		 * choose to send less */
+		if ((server->max_quantum) && (quantum>server->max_quantum))
+			quantum=server->max_quantum;
+		server->tx_quantum=quantum;
+	}
 
 }
 
@@ -437,7 +911,8 @@ static int dsi_parse_uams(struct afp_server * server, char * msg)
 /* The parsing of the return for DSI GetStatus is the same as for 
  * AFP GetSrvrInfo (which we don't yet support) */
 
-void dsi_getstatus_reply(struct afp_server * server) 
+void dsi_getstatus_reply(struct afp_server * server, char * buf,
+	unsigned int size) 
 {
 	/* Todo: check for buffer overruns */
 
@@ -453,7 +928,7 @@ void dsi_getstatus_reply(struct afp_server * server)
 		uint16_t uams_offset;
 		uint16_t icon_offset;
 		uint16_t flags ;
-	} __attribute__((__packed__)) * reply1 = (void *) server->incoming_buffer;
+	} __attribute__((__packed__)) * reply1 = (void *) buf;
 
 	struct reply2 {
 		uint16_t signature_offset;
@@ -462,13 +937,13 @@ void dsi_getstatus_reply(struct afp_server * server)
 		uint16_t utf8servername_offset;
 	} __attribute__((__packed__)) * reply2;
 
-	if (server->data_read < (sizeof(*reply1) + sizeof(*reply2))) {
+	if (size < (sizeof(*reply1) + sizeof(*reply2))) {
 		log_for_client(NULL,AFPFSD,LOG_ERR,
 			"Got incomplete data for getstatus\n");
 		return ;
 	}
 
-	data = (char * ) server->incoming_buffer + sizeof(struct dsi_header);
+	data = buf + sizeof(struct dsi_header);
 
 	/* First, get the fixed portion */
 	p=data + ntohs(reply1->machine_offset);
@@ -487,7 +962,7 @@ void dsi_getstatus_reply(struct afp_server * server)
 	}
 	server->flags=ntohs(reply1->flags);
 
-	p=(void *)((unsigned long) server->incoming_buffer + sizeof(*reply1));
+	p=buf + sizeof(*reply1);
 	p+=copy_from_pascal(server->server_name,p,AFP_SERVER_NAME_LEN)+1;
 
 	/* Now work our way through the variable bits */
@@ -560,31 +1035,19 @@ void dsi_getstatus_reply(struct afp_server * server)
 }
 
 
+/* This runs on an event worker.  Unmounting the last volume takes the
+ * server with it, so there's nothing left to disconnect. */
 void dsi_incoming_closesession(struct afp_server *server)
 {
-	afp_unmount_all_volumes(server);
-	loop_disconnect(server);
-}
-
-void dsi_incoming_tickle(struct afp_server * server) 
-{
-	struct dsi_header  header;
-
-	dsi_setup_header(server,&header,DSI_DSITickle);
-	dsi_send(server,(char *) &header,sizeof(struct dsi_header),0,
-		DSI_DONT_WAIT,NULL);
-
+	if (afp_unmount_all_volumes(server)==0)
+		loop_disconnect(server);
 }
 
-
-void * dsi_incoming_attention(void * other)
+/* This runs on an event worker, since sending the message request means
+ * waiting for its reply.  flags is only there if has_flags is set. */
+void dsi_incoming_attention(struct afp_server * server,
+	unsigned short requestid, int has_flags, unsigned short flags)
 {
-	struct afp_server * server = other;
-	struct {
-		struct dsi_header header __attribute__((__packed__));
-		uint16_t flags ;
-	} __attribute__((__packed__)) *packet = (void *) server->attention_buffer;
-	unsigned short flags;
 	char mesg[AFP_LOGINMESG_LEN];
 	unsigned char shutdown=0;
 	unsigned char mins=0;
@@ -603,9 +1066,7 @@ void * dsi_incoming_attention(void * other)
 
 	*/
 
-	if (ntohl(packet->header.length)>=2) {
-		flags=ntohs(packet->flags);
-
+	if (has_flags) {
 		if (flags&AFPATTN_MESG)
 			checkmessage=1;
 		if (flags&(AFPATTN_CRASH|AFPATTN_SHUTDOWN))
@@ -625,12 +1086,10 @@ void * dsi_incoming_attention(void * other)
 
 	if (shutdown) {
 		log_for_client(NULL,AFPFSD,LOG_ERR,
-			"Got a shutdown notice in packet %d, going down in %d mins\n",ntohs(packet->header.requestid),mins);
+			"Got a shutdown notice in packet %d, going down in %d mins\n",requestid,mins);
 		loop_disconnect(server);
 		server->connect_state=SERVER_STATE_DISCONNECTED;
-		return NULL;
 	}
-	return NULL;
 }
 
 
@@ -638,158 +1097,191 @@ struct dsi_request * dsi_find_request(struct afp_server *server,
 	unsigned short request_id)
 {
 
-	struct dsi_request *p, *prev=NULL;
+	struct dsi_request *p;
 
 	pthread_mutex_lock(&server->request_queue_mutex);
-	for (p=server->command_requests;p;p=p->next) {
-		if (request_id==p->requestid) {
+	for (p=server->request_table[dsi_request_slot(request_id)];p;p=p->next) {
+		/* Once a request has timed out, its reply is of no use */
+		if ((request_id==p->requestid) && (!p->timed_out)) {
+			/* The caller lets go of it with dsi_release_request */
+			__sync_add_and_fetch(&p->refs,1);
 			pthread_mutex_unlock(&server->request_queue_mutex);
 			return p;
 		}
-		prev=p;
 	}
 	pthread_mutex_unlock(&server->request_queue_mutex);
 
 	return NULL;
 }
 
-int dsi_recv(struct afp_server * server) 
+/* Wakes up whoever is waiting on a request we've got the reply for.  A
+ * caller that waits counts the request itself, on its own thread. */
+static void dsi_request_done(struct afp_server * server,
+	struct dsi_request * request)
 {
-	struct dsi_header * header = (void *) server->incoming_buffer;
-	struct dsi_request * request=NULL;
-	int rc;
-        int amount_to_read=0;
-	int ret;
-	unsigned char runt_packet=0;
-	/* Make sure we have at least one  header */
-	if ((amount_to_read=sizeof(struct dsi_header)-server->data_read)>0) {
+	#ifdef DEBUG_DSI
+	printf("<<< Found request %d, %s\n",request->requestid,
+		afp_get_command_name(request->subcommand));
+	#endif
+	dsi_timer_cancel(server->timers,&request->timer);
+	if ((request->completion) || (request->wait==0)) {
+		/* The sender got to it first, as sending it failed */
+		if (!__sync_bool_compare_and_swap(&request->completed,0,1))
+			return;
+		dsi_request_stats(server,request);
+	}
+	if (request->completion) {
+		/* Retire the request first, so that whoever is called back
+		 * sees it gone */
+		afp_completion completion = request->completion;
+		void * context = request->completion_context;
+		int rc = request->return_code;
+
+		dsi_remove_from_request_queue(server,request);
+		completion(context,rc);
+	} else if (request->wait) {
 		#ifdef DEBUG_DSI
-		printf("<<< read() for dsi, %d bytes\n",amount_to_read);
+		printf("<<< Signalling %d, returning %d\n",request->requestid,request->return_code);
 		#endif
-		ret = read(server->fd,server->incoming_buffer+server->data_read,
-			amount_to_read);
-		if (ret<0) {
-			perror("dsi_recv");
-			return -1;
-		}
-		if (ret==0) {
-			return -1;
-		}
-		server->stats.rx_bytes+=ret;
-		server->data_read+=ret;
-		if ((server->data_read==sizeof(struct dsi_header)) && 
-			(ntohl(header->length)==0)) {
-			goto gotenough;
-			}
-		return 0;
-			/* We'll get the rest of the packet next time */
-	}
-gotenough:
-	/* At this point, we have just the header */
-	/* Figure out what it is a reply to */
-	request = dsi_find_request(server,ntohs(header->requestid));
-	if (!request && (header->flags==DSI_REPLY)) {
-		log_for_client(NULL,AFPFSD,LOG_ERR,
-			"I have no idea what this is a reply to, id %d.\n",
-			ntohs(header->requestid));
-			runt_packet=1;
-			server->stats.runt_packets++;
-	}
-	if (request) request->return_code=ntohl(header->return_code.error_code);
-
-	/* If it is a read, read in as much as we can */
-	if ((request) && 
-		((request->subcommand==afpRead) || 
-		(request->subcommand==afpReadExt))) {
-		struct afp_rx_buffer * buf = request->other;
-		int newmax=buf->maxsize-buf->size;
-
-		if (((server->data_read==sizeof(struct dsi_header)) &&
-			(ntohl(header->length)==0))) {
-				server->data_read=0;
-				goto out;
-			}
+		pthread_mutex_lock(&request->waiting_mutex);
+		request->wait=0;
+		request->done_waiting=1;
+		pthread_cond_signal(&request->waiting_cond);
+		pthread_mutex_unlock(&request->waiting_mutex);
+	} else {
+		dsi_remove_from_request_queue(server,request);
+	}
+}
 
-		if ((!buf) || (!buf->maxsize)) {
-			log_for_client(NULL,AFPFSD,LOG_ERR,
-				"No buffer allocated for incoming data\n");
-			return -1;
-		}
-		if (newmax>ntohl(header->length)-buf->size)
-			newmax=ntohl(header->length)-buf->size;
+/* Fails every request whose deadline has passed.  This runs on the thread
+ * that receives for the server, so a request can't time out while its
+ * reply is half way into the caller's buffer.  Whatever is left of that
+ * reply gets thrown away instead. */
+void dsi_expire_requests(struct afp_server * server)
+{
+	struct dsi_timer * t, * next;
+	struct dsi_request * request, * incoming;
 
-		#ifdef DEBUG_DSI
-		printf("<<< read() in response to a request, %d bytes\n",newmax);
-		#endif
-		ret = read(server->fd,buf->data+buf->size,
-			newmax);
-		if (ret<0) {
-			return -1;
-		}
-		if (ret==0) {
-			return -1;
-		}
-		server->stats.rx_bytes+=ret;
-		buf->size+=ret;
-
-		/* Check to see if we've read enough */
-		if (ntohl(header->length)==buf->size) {
-			char * tmpbuf;
-			int size_to_copy=server->data_read
-				-sizeof(struct dsi_header);
-			if (size_to_copy==0) {
-				server->data_read=0;
-				goto out;
-			} else if (size_to_copy<0) goto error;
-
-
-			/* Okay, so there is a buffer we have to shift */
-			if ((tmpbuf=malloc(size_to_copy))==NULL) {
-				log_for_client(NULL,AFPFSD,LOG_ERR,
-					"Problem allocating memory for dsi_recv of size %d",size_to_copy);
-				goto error;
-			}
+	for (t=dsi_timer_expire(server->timers);t;t=next) {
+		next=t->next;
+		request=(void *) ((char *) t-offsetof(struct dsi_request,timer));
+		log_for_client(NULL,AFPFSD,LOG_WARNING,
+			"Request %d, %s, timed out\n",request->requestid,
+			afp_get_command_name(request->subcommand));
+		incoming=NULL;
+		pthread_mutex_lock(&server->incoming_mutex);
+		if (request==server->incoming_request)
+			incoming=dsi_detach_incoming(server);
+		pthread_mutex_unlock(&server->incoming_mutex);
+		request->timed_out=1;
+		request->return_code=ETIMEDOUT;
+		server->stats.requests_timed_out++;
+		dsi_request_done(server,request);
+		if (incoming) dsi_release_request(server,incoming);
+	}
+}
 
-			memcpy(tmpbuf,
-				server->incoming_buffer+
-				sizeof(struct dsi_header), 
-				size_to_copy);
-			memcpy(server->incoming_buffer,tmpbuf,
-				size_to_copy);
-			server->data_read=size_to_copy;
-			free(tmpbuf);
-		} else return 0;
-	} else {
-		/* Okay, so it isn't a response to an afpRead or afpReadExt */
+/* Reads up to max bytes from the server into p.  Returns how many bytes
+ * were read, 0 if nothing was ready (with MSG_DONTWAIT) and -1 if the
+ * connection is gone. */
+static int dsi_recv_some(struct afp_server * server, char * p,
+	unsigned int max, int flags)
+{
+	int ret;
 
-		if (((server->data_read==sizeof(struct dsi_header)) &&
-			(ntohl(header->length)==0))) 
-				goto process_packet;
+	#ifdef DEBUG_DSI
+	printf("<<< recv() for dsi, %d bytes\n",max);
+	#endif
+	ret = recv(server->fd,p,max,flags);
+	server->stats.rx_reads++;
+	if (ret<0) {
+		if ((errno==EAGAIN) || (errno==EWOULDBLOCK) || (errno==EINTR))
+			return 0;
+		perror("dsi_recv");
+		return -1;
+	}
+	if (ret==0) {
+		return -1;
+	}
+	server->stats.rx_bytes+=ret;
+	return ret;
+}
 
-		amount_to_read=min(ntohl(header->length),server->bufsize);
-		#ifdef DEBUG_DSI
-		printf("<<< read() of rest of AFP, %d bytes\n",amount_to_read);
-		#endif
-		ret = read(server->fd, (void *)
-		(((unsigned long) server->incoming_buffer)+server->data_read),
-			amount_to_read);
-		if (ret<0) return -1;
-		if (ret==0) {
-			return -1;
-		}
-		server->stats.rx_bytes+=ret;
-		server->data_read+=ret;
+/* Reads up to max bytes from the server into the receive ring */
+static int dsi_ring_read(struct afp_server * server, unsigned int max,
+	int flags)
+{
+	struct dsi_ring * ring = server->incoming_ring;
+	unsigned int len;
+	char * p;
+	int ret;
 
-		if (server->data_read<(ntohl(header->length)+sizeof(*header)))
-			return 0;
+	p=dsi_ring_space(ring,&len);
+	if (len>max) len=max;
+	if ((ret=dsi_recv_some(server,p,len,flags))>0)
+		dsi_ring_produce(ring,ret);
+	return ret;
+}
+
+/* The data of an afpRead or afpReadExt reply goes into the buffer of the
+ * request.  This accounts for len bytes of it having arrived there, with
+ * the incoming_mutex held.  Once we have them all, the request is
+ * returned for dsi_read_finish. */
+static struct dsi_request * dsi_read_data_arrived(struct afp_server * server,
+	unsigned int len)
+{
+	struct afp_rx_buffer * buf = server->incoming_request->other;
+
+	buf->size+=len;
+	server->incoming_remaining-=len;
+
+	if ((server->incoming_remaining>0) && (buf->size<buf->maxsize))
+		return NULL;
+
+	/* Anything the buffer has no room for gets thrown away */
+	return dsi_detach_incoming(server);
+}
+
+/* Finishes a read that has all its data, after the incoming_mutex has
+ * been let go, as whoever we wake up may be about to take it */
+static void dsi_read_finish(struct afp_server * server,
+	struct dsi_request * request)
+{
+	if (request==NULL) return;
+	dsi_request_done(server,request);
+	dsi_release_request(server,request);
+	server->stats.rx_packets++;
+}
+
+/* Reads afpRead data straight into the request's buffer, so it never goes
+ * through the ring. */
+static int dsi_recv_read_data(struct afp_server * server, int flags)
+{
+	struct dsi_request * done = NULL;
+	struct afp_rx_buffer * buf;
+	int ret=0;
+
+	pthread_mutex_lock(&server->incoming_mutex);
+	/* The request may have been given up on since we last looked */
+	if (server->incoming_request) {
+		buf=server->incoming_request->other;
+		ret=dsi_recv_some(server,buf->data+buf->size,
+			min(buf->maxsize-buf->size,server->incoming_remaining),
+			flags);
+		if (ret>0)
+			done=dsi_read_data_arrived(server,ret);
 	}
-	if (runt_packet) 
-		goto after_processing;
+	pthread_mutex_unlock(&server->incoming_mutex);
+	dsi_read_finish(server,done);
+	return ret;
+}
+
+/* Handles one complete DSI packet, which is at buf in the receive ring */
+static int dsi_process_packet(struct afp_server * server,
+	struct dsi_request * request, char * buf, unsigned int size)
+{
+	struct dsi_header * header = (void *) buf;
 
-process_packet:
-	/* At this point, we have a full DSI packet
-	   (or, for an afpRead, just the header and the data's been
-	    dumped in the preallocated buffer */
 	#ifdef DEBUG_DSI
 	printf("<<< Handling %d\n",ntohs(header->requestid));
 	#endif
@@ -797,102 +1289,274 @@ process_packet:
 	switch (header->command) {
 
 	case DSI_DSICloseSession:
-		dsi_incoming_closesession(server);
+		/* Unmounting waits on replies only we can read */
+		dsi_event_post(server,DSI_EVENT_CLOSESESSION,0,0,0);
 		break;
 	case DSI_DSIGetStatus:
-		dsi_getstatus_reply(server);
+		dsi_getstatus_reply(server,buf,size);
 		break;
 	case DSI_DSIOpenSession:
-		dsi_opensession_reply(server);
+		dsi_opensession_reply(server,buf,size);
 		break;
 	case DSI_DSITickle:
-		dsi_incoming_tickle(server);
+		/* Answered from an event worker, since sending can block
+		 * while the server waits for us to read */
+		dsi_event_post(server,DSI_EVENT_TICKLE,0,0,0);
 		break;
 	case DSI_DSIWrite:
 	case DSI_DSICommand:
-		if (!runt_packet) 
-		dsi_command_reply(server, request->subcommand,request->other);
+		if (request)
+			dsi_command_reply(server, request->subcommand,
+				buf,size,request->other);
 		break;
 	case DSI_DSIAttention:
-		{
-			pthread_t thread;
-			memcpy( server->attention_buffer,
-				server->incoming_buffer,
-				server->data_read);
-			server->attention_len=server->data_read;
-			pthread_create(&thread,NULL,
-				dsi_incoming_attention,server);
-		}
+		/* All there is to an attention is two bytes of flags, so
+		 * those are all that's kept */
+		if (size>=sizeof(struct dsi_header)+sizeof(uint16_t)) {
+			uint16_t flags;
+
+			memcpy(&flags,buf+sizeof(struct dsi_header),
+				sizeof(flags));
+			dsi_event_post(server,DSI_EVENT_ATTENTION,
+				ntohs(header->requestid),1,ntohs(flags));
+		} else
+			dsi_event_post(server,DSI_EVENT_ATTENTION,
+				ntohs(header->requestid),0,0);
 		break;
 	default:
 		log_for_client(NULL,AFPFSD,LOG_ERR,
 			"Unknown DSI command %i\n",header->command);
-		goto error;
+		return -1;
 
 	}
-after_processing:
-	if  (server->data_read==ntohl(header->length)+sizeof(*header)) {
-		/* The most common case */
-		server->data_read=0;
-	} else {
-		unsigned int size_to_copy=
-			server->data_read-
-			(ntohl(header->length)+sizeof(*header));
-		char * tmpbuf;
-
-		if (size_to_copy<ntohl(header->length)) {
-			/* This could be replaced with memmove, as it handles
-			 * overlaps */
-			memcpy( server->incoming_buffer,
-				server->incoming_buffer+ntohl(header->length),
-				size_to_copy);
-		} else {
-			/* This is more complicated, we need an tmp buf */
-			if ((tmpbuf=malloc(size_to_copy))==NULL) {
+	return 0;
+}
+
+/* Keeps the packet at the front of the ring, or as much of it as has
+ * come in, if packets are being captured */
+static void dsi_capture_incoming(struct afp_server * server,
+	unsigned int length)
+{
+	struct dsi_ring * ring = server->incoming_ring;
+	struct iovec iov;
+
+	if (!server->capture) return;
+	iov.iov_base=dsi_ring_data(ring);
+	iov.iov_len=min(dsi_ring_used(ring),length+sizeof(struct dsi_header));
+	dsi_capture_packet(server->capture,DSI_CAPTURE_IN,&iov,1,
+		length+sizeof(struct dsi_header));
+}
+
+/* Dispatches every complete DSI packet in the ring.  Returns -1 if the
+ * connection should be dropped. */
+static int dsi_dispatch(struct afp_server * server)
+{
+	struct dsi_ring * ring = server->incoming_ring;
+	struct dsi_header * header;
+	struct dsi_request * request;
+	unsigned int length, len;
+
+	while (1) {
+		pthread_mutex_lock(&server->incoming_mutex);
+		if (server->incoming_request) {
+			/* Read data that came in behind its header */
+			struct afp_rx_buffer * buf =
+				server->incoming_request->other;
+
+			len=min(dsi_ring_used(ring),
+				min(buf->maxsize-buf->size,
+				server->incoming_remaining));
+			if (len==0) {
+				pthread_mutex_unlock(&server->incoming_mutex);
+				break;
+			}
+			memcpy(buf->data+buf->size,dsi_ring_data(ring),len);
+			dsi_ring_consume(ring,len);
+			request=dsi_read_data_arrived(server,len);
+			pthread_mutex_unlock(&server->incoming_mutex);
+			dsi_read_finish(server,request);
+			continue;
+		}
+		pthread_mutex_unlock(&server->incoming_mutex);
+
+		if (server->incoming_discard) {
+			len=min(dsi_ring_used(ring),server->incoming_discard);
+			if (len==0) break;
+			dsi_ring_consume(ring,len);
+			server->incoming_discard-=len;
+			continue;
+		}
+
+		if (dsi_ring_used(ring)<sizeof(struct dsi_header))
+			break;
+
+		header = (void *) dsi_ring_data(ring);
+		length = ntohl(header->length);
+		request = dsi_find_request(server,ntohs(header->requestid));
+
+		/* Whoever is waiting can't give up on the request while we
+		 * have this, so it stays theirs only if they haven't yet */
+		pthread_mutex_lock(&server->incoming_mutex);
+		if ((request) && (request->timed_out)) {
+			dsi_release_request(server,request);
+			request=NULL;
+		}
+		if (request) request->bytes_in=length;
+
+		/* If it is a read, the data goes to the caller's buffer */
+		if ((request) && (header->flags==DSI_REPLY) &&
+			((request->subcommand==afpRead) || 
+			(request->subcommand==afpReadExt))) {
+			struct afp_rx_buffer * buf = request->other;
+
+			dsi_capture_incoming(server,length);
+			request->return_code=
+				ntohl(header->return_code.error_code);
+			dsi_ring_consume(ring,sizeof(struct dsi_header));
+			if ((length>0) && ((!buf) || (!buf->maxsize))) {
+				pthread_mutex_unlock(&server->incoming_mutex);
+				dsi_release_request(server,request);
 				log_for_client(NULL,AFPFSD,LOG_ERR,
-					"Problem allocating memory for dsi_recv of size %d",size_to_copy);
-				goto error;
+					"No buffer allocated for incoming data\n");
+				return -1;
+			}
+			/* Our ref on the request goes with it */
+			if (length>0) {
+				server->incoming_request=request;
+				server->incoming_remaining=length;
+				request=NULL;
 			}
+			pthread_mutex_unlock(&server->incoming_mutex);
+			dsi_read_finish(server,request);
+			continue;
+		}
 
-			memcpy(tmpbuf,
-				server->incoming_buffer+ntohl(header->length),
-				size_to_copy);
+		/* A reply we're not waiting for, most likely because it
+		 * came too late, is skipped without being read in whole */
+		if ((!request) && (header->flags==DSI_REPLY)) {
+			pthread_mutex_unlock(&server->incoming_mutex);
+			log_for_client(NULL,AFPFSD,LOG_WARNING,
+				"I have no idea what this is a reply to, id %d.\n",
+				ntohs(header->requestid));
+			dsi_capture_incoming(server,length);
+			dsi_ring_consume(ring,sizeof(struct dsi_header));
+			server->incoming_discard=length;
+			server->stats.late_replies++;
+			server->stats.rx_packets++;
+			continue;
+		}
 
-			memcpy(server->incoming_buffer,tmpbuf,size_to_copy);
-			free(tmpbuf);
+		if (length>ring->size-sizeof(struct dsi_header)) {
+			if (request) request->return_code=kFPMiscErr;
+			pthread_mutex_unlock(&server->incoming_mutex);
+			log_for_client(NULL,AFPFSD,LOG_ERR,
+				"DSI packet of %u bytes is too big, skipping it\n",
+				length);
+			dsi_capture_incoming(server,length);
+			dsi_ring_consume(ring,sizeof(struct dsi_header));
+			server->incoming_discard=length;
+			if (request) {
+				dsi_request_done(server,request);
+				dsi_release_request(server,request);
+			}
+			continue;
 		}
-		server->data_read-=size_to_copy;
-	}
-			
-out:
 
-	rc=ntohl(header->return_code.error_code);
-	if (request) {
-		#ifdef DEBUG_DSI
-		printf("<<< Found request %d, %s\n",request->requestid,
-			afp_get_command_name(request->subcommand));
-		#endif
-		if (request->wait) {
+		/* Everything else is parsed in place, so we need all of it */
+		if (dsi_ring_used(ring)<length+sizeof(struct dsi_header)) {
+			pthread_mutex_unlock(&server->incoming_mutex);
+			if (request) dsi_release_request(server,request);
+			break;
+		}
+		dsi_capture_incoming(server,length);
+
+		if (request) {
+			request->return_code=
+				ntohl(header->return_code.error_code);
+			dsi_rtt_reply(server,request);
+		}
+		if (dsi_process_packet(server,request,(char *) header,
+			length+sizeof(struct dsi_header))) {
 			#ifdef DEBUG_DSI
-			printf("<<< Signalling %d, returning %d or %d\n",request->requestid,request->return_code,rc);
+			printf("returning from dsi_recv with an error\n");
 			#endif
-			pthread_mutex_lock(&request->waiting_mutex);
-			request->wait=0;
-			request->done_waiting=1;
-			pthread_cond_signal(&request->waiting_cond);
-			pthread_mutex_unlock(&request->waiting_mutex);
-		} else {
-			dsi_remove_from_request_queue(server,request);
+			pthread_mutex_unlock(&server->incoming_mutex);
+			if (request) dsi_release_request(server,request);
+			return -1;
+		}
+		pthread_mutex_unlock(&server->incoming_mutex);
+		dsi_ring_consume(ring,length+sizeof(struct dsi_header));
+		if (request) {
+			dsi_request_done(server,request);
+			dsi_release_request(server,request);
 		}
+		server->stats.rx_packets++;
 	}
 	return 0;
-error:
-	#ifdef DEBUG_DSI
-	printf("returning from dsi_recv with an error\n");
-	#endif
-	return -1;
+}
+
+/* Reads whatever the socket has, as long as there's room for it, and
+ * handles every packet that is complete before going back to sleep. */
+static int dsi_recv_drain(struct afp_server * server)
+{
+	struct dsi_ring * ring = server->incoming_ring;
+	int ret, reads;
+
+	for (reads=0;reads<DSI_DRAIN_MAX_READS;reads++) {
+		if ((server->incoming_request) && (dsi_ring_used(ring)==0))
+			ret=dsi_recv_read_data(server,MSG_DONTWAIT);
+		else
+			ret=dsi_ring_read(server,ring->size,MSG_DONTWAIT);
+		if (ret<0) return -1;
+		if (ret==0) break;
+		if (dsi_dispatch(server)<0) return -1;
+	}
+	server->rx_more=(reads==DSI_DRAIN_MAX_READS);
+	return 0;
+}
 
+/* Reads no more than what is left of the packet we're in the middle of.
+ * This is one read per trip through the main loop. */
+static int dsi_recv_one(struct afp_server * server)
+{
+	struct dsi_ring * ring = server->incoming_ring;
+	struct dsi_header * header;
+	unsigned int used = dsi_ring_used(ring);
+	unsigned int want;
+	int ret;
 
+	if (server->incoming_request)
+		ret=dsi_recv_read_data(server,0);
+	else {
+		if (server->incoming_discard)
+			want=server->incoming_discard;
+		else if (used<sizeof(struct dsi_header))
+			want=sizeof(struct dsi_header)-used;
+		else {
+			header = (void *) dsi_ring_data(ring);
+			want=ntohl(header->length)+sizeof(struct dsi_header)-used;
+		}
+		ret=dsi_ring_read(server,want,0);
+	}
+	if (ret<0) return -1;
+	if (ret==0) return 0;
+	return dsi_dispatch(server);
 }
 
+int dsi_recv(struct afp_server * server) 
+{
+	uint64_t packets = server->stats.rx_packets;
+	int ret;
+
+	if (server->rx_drain)
+		ret=dsi_recv_drain(server);
+	else
+		ret=dsi_recv_one(server);
+	if (ret<0) return -1;
 
+	server->stats.rx_wakeups++;
+	packets=server->stats.rx_packets-packets;
+	if (packets>server->stats.rx_max_packets_per_wakeup)
+		server->stats.rx_max_packets_per_wakeup=packets;
+	return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ *  dsi_capture.c
+ *
+ *  Keeps the last DSI packets sent and received, and saves them as pcapng.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/libafpclient.h"
+#include "afpfs-ng/utils.h"
+#include "dsi_capture.h"
+#include "dsi_rtt.h"
+
+/*
+ * Capturing is switched on and off while the server is in use.  Packets
+ * go into a ring of fixed size slots: a sender or the receiving thread
+ * takes the next slot with an atomic add, and marks it complete once it
+ * has filled it, so nobody ever waits on anybody else.  Saving copies
+ * each slot out and checks the mark again afterwards, so a slot that was
+ * written over while it was being copied is skipped rather than saved
+ * half old and half new.
+ *
+ * Once a server has a ring it keeps it until it is freed, since there's
+ * no telling if a sender is still writing into it.
+ *
+ * The file has each DSI packet in a TCP segment of its own, with made up
+ * IP and TCP headers around it, so Wireshark takes it apart as DSI.
+ */
+
+int afp_capture_start(struct afp_server * s, unsigned int snaplen)
+{
+	struct dsi_capture * c;
+	struct timespec ts;
+
+	if (snaplen<DSI_CAPTURE_HEADER) snaplen=DSI_CAPTURE_HEADER;
+	if (snaplen>DSI_CAPTURE_MAX_SNAPLEN) snaplen=DSI_CAPTURE_MAX_SNAPLEN;
+
+	if ((c=s->capture)==NULL) {
+		if ((c=calloc(1,sizeof(*c)))==NULL)
+			return -1;
+		c->snaplen=snaplen;
+		c->slot_size=(sizeof(struct dsi_capture_slot)+snaplen+7)&~7;
+		c->num_slots=max(DSI_CAPTURE_MEMORY/c->slot_size,
+			DSI_CAPTURE_MIN_SLOTS);
+		if ((c->slots=calloc(c->num_slots,c->slot_size))==NULL) {
+			free(c);
+			return -1;
+		}
+		if (!__sync_bool_compare_and_swap(&s->capture,NULL,c)) {
+			dsi_capture_free(c);
+			c=s->capture;
+		}
+	}
+	if (c->snaplen!=snaplen)
+		log_for_client(NULL,AFPFSD,LOG_NOTICE,
+			"Already capturing %u bytes of each packet, "
+			"not %u\n",c->snaplen,snaplen);
+
+	clock_gettime(CLOCK_REALTIME,&ts);
+	c->clock_offset=(int64_t) ts.tv_sec*1000000+ts.tv_nsec/1000-
+		(int64_t) dsi_rtt_now();
+	c->active=1;
+	return 0;
+}
+
+int afp_capture_stop(struct afp_server * s)
+{
+	if (s->capture==NULL) return -1;
+	s->capture->active=0;
+	return 0;
+}
+
+void dsi_capture_free(struct dsi_capture * c)
+{
+	if (!c) return;
+	free(c->slots);
+	free(c);
+}
+
+/* Keeps what there's room for of a packet of len bytes, made up of iov */
+void dsi_capture_packet(struct dsi_capture * c, int dir,
+	struct iovec * iov, int iovcnt, unsigned int len)
+{
+	struct dsi_capture_slot * slot;
+	unsigned int caplen=0, n;
+	uint64_t seq;
+	int i;
+
+	if ((!c) || (!c->active)) return;
+
+	seq=__sync_fetch_and_add(&c->head,1);
+	slot=(void *) (c->slots+(seq%c->num_slots)*c->slot_size);
+	slot->seq=0;
+	__sync_synchronize();
+	slot->time=dsi_rtt_now();
+	slot->len=len;
+	slot->dir=dir;
+	for (i=0;(i<iovcnt) && (caplen<c->snaplen);i++) {
+		n=min(iov[i].iov_len,c->snaplen-caplen);
+		memcpy(slot->data+caplen,iov[i].iov_base,n);
+		caplen+=n;
+	}
+	slot->caplen=caplen;
+	__sync_synchronize();
+	slot->seq=seq+1;
+}
+
+/* pcapng, with raw IPv4 packets in it */
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define LINKTYPE_RAW 101
+
+#define CAPTURE_FRAMING 40
+
+struct capture_ends {
+	uint32_t addr[2];
+	uint16_t port[2];
+	uint32_t seq[2];
+};
+
+/* Where we and the server are, or something like it if it isn't IPv4 */
+static void capture_find_ends(struct afp_server * s, struct capture_ends * e)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+
+	e->addr[DSI_CAPTURE_OUT]=htonl(0xc0000201);
+	e->addr[DSI_CAPTURE_IN]=htonl(0xc0000202);
+	e->port[DSI_CAPTURE_OUT]=htons(49152);
+	e->port[DSI_CAPTURE_IN]=htons(548);
+	e->seq[DSI_CAPTURE_OUT]=e->seq[DSI_CAPTURE_IN]=1;
+
+	len=sizeof(sin);
+	if ((s->fd>0) && (getsockname(s->fd,(void *) &sin,&len)==0) &&
+		(sin.sin_family==AF_INET)) {
+		e->addr[DSI_CAPTURE_OUT]=sin.sin_addr.s_addr;
+		e->port[DSI_CAPTURE_OUT]=sin.sin_port;
+	}
+	len=sizeof(sin);
+	if ((s->fd>0) && (getpeername(s->fd,(void *) &sin,&len)==0) &&
+		(sin.sin_family==AF_INET)) {
+		e->addr[DSI_CAPTURE_IN]=sin.sin_addr.s_addr;
+		e->port[DSI_CAPTURE_IN]=sin.sin_port;
+	}
+}
+
+static uint16_t capture_ip_checksum(unsigned char * p, unsigned int len)
+{
+	uint32_t sum=0;
+	unsigned int i;
+
+	for (i=0;i<len;i+=2)
+		sum+=(p[i]<<8)|p[i+1];
+	while (sum>>16)
+		sum=(sum&0xffff)+(sum>>16);
+	return htons(~sum);
+}
+
+/* The IP and TCP headers for a packet of len bytes going dir */
+static void capture_frame(struct capture_ends * e, int dir, uint64_t seq,
+	unsigned int len, unsigned char * f)
+{
+	int from = dir==DSI_CAPTURE_IN ? DSI_CAPTURE_IN : DSI_CAPTURE_OUT;
+	int to = !from;
+	uint16_t v16;
+	uint32_t v32;
+
+	memset(f,0,CAPTURE_FRAMING);
+	f[0]=0x45;
+	/* Too big for IP, so leave it to be worked out from the frame */
+	v16=(len+CAPTURE_FRAMING>0xffff) ? 0 : htons(len+CAPTURE_FRAMING);
+	memcpy(f+2,&v16,2);
+	v16=htons(seq);
+	memcpy(f+4,&v16,2);
+	f[6]=0x40;
+	f[8]=64;
+	f[9]=IPPROTO_TCP;
+	memcpy(f+12,&e->addr[from],4);
+	memcpy(f+16,&e->addr[to],4);
+	v16=capture_ip_checksum(f,20);
+	memcpy(f+10,&v16,2);
+
+	memcpy(f+20,&e->port[from],2);
+	memcpy(f+22,&e->port[to],2);
+	v32=htonl(e->seq[from]);
+	memcpy(f+24,&v32,4);
+	v32=htonl(e->seq[to]);
+	memcpy(f+28,&v32,4);
+	f[32]=5<<4;
+	f[33]=0x18;
+	v16=htons(0xffff);
+	memcpy(f+34,&v16,2);
+
+	e->seq[from]+=len;
+}
+
+static int capture_write_block(FILE * f, uint32_t type, void * body,
+	unsigned int len, void * data, unsigned int datalen)
+{
+	static const char pad[4];
+	uint32_t total;
+	unsigned int padding = (4-(datalen&3))&3;
+
+	total=12+len+datalen+padding;
+	if ((fwrite(&type,4,1,f)!=1) || (fwrite(&total,4,1,f)!=1) ||
+		(fwrite(body,len,1,f)!=1) ||
+		((datalen) && (fwrite(data,datalen,1,f)!=1)) ||
+		((padding) && (fwrite(pad,padding,1,f)!=1)) ||
+		(fwrite(&total,4,1,f)!=1))
+		return -1;
+	return 0;
+}
+
+/* Writes out what is in the ring to path.  Returns how many packets were
+ * saved, or -1 with errno set. */
+int afp_capture_save(struct afp_server * s, const char * path)
+{
+	struct dsi_capture * c = s->capture;
+	struct dsi_capture_slot * slot, * copy;
+	struct capture_ends ends;
+	struct {
+		uint32_t magic;
+		uint16_t major, minor;
+		int64_t section_length;
+	} __attribute__((packed)) shb = { PCAPNG_BYTE_ORDER, 1, 0, -1 };
+	struct {
+		uint16_t linktype, reserved;
+		uint32_t snaplen;
+	} idb = { LINKTYPE_RAW, 0, 0 };
+	struct {
+		uint32_t interface;
+		uint32_t time_high, time_low;
+		uint32_t caplen, len;
+		unsigned char frame[CAPTURE_FRAMING];
+	} epb;
+	uint64_t head, seq, time;
+	int saved=0, err;
+	FILE * f;
+
+	if (c==NULL) {
+		errno=ENOENT;
+		return -1;
+	}
+	if ((copy=malloc(c->slot_size))==NULL)
+		return -1;
+	if ((f=fopen(path,"w"))==NULL) {
+		free(copy);
+		return -1;
+	}
+	capture_find_ends(s,&ends);
+	if ((capture_write_block(f,PCAPNG_SHB,&shb,sizeof(shb),NULL,0)) ||
+		(capture_write_block(f,PCAPNG_IDB,&idb,sizeof(idb),NULL,0)))
+		goto error;
+
+	head=c->head;
+	seq=(head>c->num_slots) ? head-c->num_slots : 0;
+	for (;seq<head;seq++) {
+		slot=(void *) (c->slots+(seq%c->num_slots)*c->slot_size);
+		if (slot->seq!=seq+1) continue;
+		memcpy(copy,slot,c->slot_size);
+		__sync_synchronize();
+		if (slot->seq!=seq+1) continue;
+
+		time=copy->time+c->clock_offset;
+		epb.interface=0;
+		epb.time_high=time>>32;
+		epb.time_low=time;
+		epb.caplen=CAPTURE_FRAMING+copy->caplen;
+		epb.len=CAPTURE_FRAMING+copy->len;
+		capture_frame(&ends,copy->dir,seq,copy->len,epb.frame);
+		if (capture_write_block(f,PCAPNG_EPB,&epb,sizeof(epb),
+			copy->data,copy->caplen))
+			goto error;
+		saved++;
+	}
+	free(copy);
+	if (fclose(f))
+		return -1;
+	return saved;
+
+error:
+	err=errno;
+	fclose(f);
+	free(copy);
+	errno=err;
+	return -1;
+}
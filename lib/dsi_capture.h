@@ -0,0 +1,49 @@
+#ifndef __DSI_CAPTURE_H_
+#define __DSI_CAPTURE_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include "afpfs-ng/afp.h"
+
+/* How much the ring for a server takes up, which is about 100,000
+ * packets with only headers kept.  Older packets are written over. */
+#define DSI_CAPTURE_MEMORY (8*1024*1024)
+#define DSI_CAPTURE_MIN_SLOTS 64
+
+/* Enough of each packet for its DSI header and the AFP command */
+#define DSI_CAPTURE_HEADER 20
+
+/* The most of each packet that can be kept */
+#define DSI_CAPTURE_MAX_SNAPLEN 65536
+
+#define DSI_CAPTURE_OUT 0
+#define DSI_CAPTURE_IN 1
+
+struct dsi_capture_slot {
+	/* One more than the packet's place in the capture, once it is all
+	 * there, and 0 while it is being written */
+	uint64_t seq;
+	uint64_t time;
+	uint32_t len;
+	uint32_t caplen;
+	uint32_t dir;
+	uint32_t pad;
+	char data[];
+};
+
+struct dsi_capture {
+	volatile int active;
+	unsigned int snaplen;
+	unsigned int slot_size;
+	unsigned int num_slots;
+	/* Added to the monotonic clock to get the time of day, in us */
+	int64_t clock_offset;
+	uint64_t head;
+	char * slots;
+};
+
+void dsi_capture_packet(struct dsi_capture * c, int dir,
+	struct iovec * iov, int iovcnt, unsigned int len);
+void dsi_capture_free(struct dsi_capture * c);
+
+#endif
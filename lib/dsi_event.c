@@ -0,0 +1,164 @@
+/*
+ *  dsi_event.c
+ *
+ *  Workers for the DSI packets a server sends us unasked.
+ *
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/libafpclient.h"
+#include "dsi_protocol.h"
+#include "dsi_event.h"
+
+/*
+ * A tickle from the server has to be answered with one of ours, an
+ * attention may need the server's message fetched, which means waiting
+ * for a reply, and a CloseSession means unmounting every volume, which
+ * means waiting for a good many.  None of it can be done on the thread
+ * receiving for the server: it would be waiting on itself for the reply,
+ * and even sending can block while the server waits for us to read.  So
+ * the receiving thread only queues an event, and a few workers, started
+ * the first time they're needed, do the rest.
+ *
+ * A tickle or CloseSession that is already waiting for a server covers
+ * any more that come in for it, so those aren't queued.
+ */
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t idle;
+	struct dsi_event queue[DSI_EVENT_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+	pthread_t threads[DSI_EVENT_WORKERS];
+	struct afp_server * busy[DSI_EVENT_WORKERS];
+	unsigned int running;
+} dsi_events = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+#define dsi_event_at(i) \
+	(&dsi_events.queue[(dsi_events.head+(i))%DSI_EVENT_QUEUE_SIZE])
+
+static void * dsi_event_worker(void * other)
+{
+	unsigned int me = (long) other;
+	struct dsi_event e;
+
+	pthread_mutex_lock(&dsi_events.mutex);
+	while (1) {
+		while (dsi_events.count==0)
+			pthread_cond_wait(&dsi_events.cond,&dsi_events.mutex);
+		e=*dsi_event_at(0);
+		dsi_events.head=(dsi_events.head+1)%DSI_EVENT_QUEUE_SIZE;
+		dsi_events.count--;
+		dsi_events.busy[me]=e.server;
+		pthread_mutex_unlock(&dsi_events.mutex);
+
+		switch (e.type) {
+		case DSI_EVENT_TICKLE:
+			dsi_sendtickle(e.server);
+			break;
+		case DSI_EVENT_ATTENTION:
+			dsi_incoming_attention(e.server,e.requestid,
+				e.has_flags,e.flags);
+			break;
+		case DSI_EVENT_CLOSESESSION:
+			dsi_incoming_closesession(e.server);
+			break;
+		}
+
+		pthread_mutex_lock(&dsi_events.mutex);
+		dsi_events.busy[me]=NULL;
+		pthread_cond_broadcast(&dsi_events.idle);
+	}
+	return NULL;
+}
+
+/* Called with the mutex held */
+static void dsi_event_start_workers(void)
+{
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	for (;dsi_events.running<DSI_EVENT_WORKERS;dsi_events.running++)
+		if (pthread_create(&dsi_events.threads[dsi_events.running],
+			&attr,dsi_event_worker,
+			(void *) (long) dsi_events.running)) {
+			log_for_client(NULL,AFPFSD,LOG_ERR,
+				"Could not start an event worker\n");
+			break;
+		}
+	pthread_attr_destroy(&attr);
+}
+
+/* Queues an event for server, from the thread receiving for it.  This
+ * never blocks for longer than it takes to take a lock. */
+int dsi_event_post(struct afp_server * server, int type,
+	unsigned short requestid, int has_flags, unsigned short flags)
+{
+	struct dsi_event * e;
+	unsigned int i;
+
+	pthread_mutex_lock(&dsi_events.mutex);
+	if (dsi_events.running<DSI_EVENT_WORKERS)
+		dsi_event_start_workers();
+	if (type!=DSI_EVENT_ATTENTION)
+		for (i=0;i<dsi_events.count;i++) {
+			e=dsi_event_at(i);
+			if ((e->server==server) && (e->type==type))
+				goto out;
+		}
+	if ((dsi_events.running==0) ||
+		(dsi_events.count==DSI_EVENT_QUEUE_SIZE)) {
+		pthread_mutex_unlock(&dsi_events.mutex);
+		log_for_client(NULL,AFPFSD,LOG_WARNING,
+			"Too many DSI events waiting, dropping one\n");
+		return -1;
+	}
+	e=dsi_event_at(dsi_events.count);
+	e->server=server;
+	e->type=type;
+	e->requestid=requestid;
+	e->has_flags=has_flags;
+	e->flags=flags;
+	dsi_events.count++;
+	server->stats.events++;
+	pthread_cond_signal(&dsi_events.cond);
+out:
+	pthread_mutex_unlock(&dsi_events.mutex);
+	return 0;
+}
+
+/* Throws away whatever is queued for server, and waits for any event for
+ * it that is being handled, so that server can be freed.  A worker that
+ * frees its own server doesn't wait on itself. */
+void dsi_event_cancel(struct afp_server * server)
+{
+	unsigned int i, kept=0, busy;
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock(&dsi_events.mutex);
+	for (i=0;i<dsi_events.count;i++)
+		if (dsi_event_at(i)->server!=server)
+			*dsi_event_at(kept++)=*dsi_event_at(i);
+	dsi_events.count=kept;
+
+	do {
+		busy=0;
+		for (i=0;i<dsi_events.running;i++)
+			if ((dsi_events.busy[i]==server) &&
+				(!pthread_equal(dsi_events.threads[i],self)))
+				busy=1;
+		if (busy)
+			pthread_cond_wait(&dsi_events.idle,&dsi_events.mutex);
+	} while (busy);
+	pthread_mutex_unlock(&dsi_events.mutex);
+}
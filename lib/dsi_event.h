@@ -0,0 +1,28 @@
+#ifndef __DSI_EVENT_H_
+#define __DSI_EVENT_H_
+
+#include "afpfs-ng/afp.h"
+
+/* This many threads handle events for every server there is */
+#define DSI_EVENT_WORKERS 2
+
+/* Events beyond this many waiting are dropped */
+#define DSI_EVENT_QUEUE_SIZE 64
+
+#define DSI_EVENT_TICKLE 0
+#define DSI_EVENT_ATTENTION 1
+#define DSI_EVENT_CLOSESESSION 2
+
+struct dsi_event {
+	struct afp_server * server;
+	int type;
+	unsigned short requestid;
+	int has_flags;
+	unsigned short flags;
+};
+
+int dsi_event_post(struct afp_server * server, int type,
+	unsigned short requestid, int has_flags, unsigned short flags);
+void dsi_event_cancel(struct afp_server * server);
+
+#endif
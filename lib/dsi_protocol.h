@@ -15,6 +15,11 @@
 #define DSI_DSIWrite 6
 #define DSI_DSIAttention 8
 
+/* Options in DSIOpenSession */
+#define DSI_OPTION_SERVER_QUANTUM 0x0
+#define DSI_OPTION_ATTENTION_QUANTUM 0x1
+#define DSI_OPTION_REPLAY_CACHE_SIZE 0x2
+
 
 
 struct dsi_header {
@@ -30,6 +35,10 @@ struct dsi_header {
 };
 
 void dsi_setup_header(struct afp_server * server, struct dsi_header * header, char command);
+int dsi_sendtickle(struct afp_server *server);
+void dsi_incoming_closesession(struct afp_server *server);
+void dsi_incoming_attention(struct afp_server * server,
+	unsigned short requestid, int has_flags, unsigned short flags);
 
 
 #endif
@@ -0,0 +1,129 @@
+/*
+ *  dsi_ring.c
+ *
+ *  A receive ring for DSI packets.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "dsi_ring.h"
+
+static int dsi_ring_shared_fd(unsigned int size)
+{
+	int fd;
+#ifdef HAVE_MEMFD_CREATE
+	fd=memfd_create("afpfs-dsi-ring",MFD_CLOEXEC);
+#else
+	char name[64];
+	static unsigned int count=0;
+
+	snprintf(name,sizeof(name),"/afpfs-dsi-ring-%d-%u",
+		getpid(),__sync_fetch_and_add(&count,1));
+	fd=shm_open(name,O_RDWR|O_CREAT|O_EXCL,0600);
+	if (fd>=0) shm_unlink(name);
+#endif
+	if (fd<0) return -1;
+	if (ftruncate(fd,size)<0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int dsi_ring_map_mirrored(struct dsi_ring * ring)
+{
+	char * base;
+	int fd;
+
+	if ((fd=dsi_ring_shared_fd(ring->size))<0)
+		return -1;
+
+	/* Reserve twice the size, then put the same pages in both halves */
+	base=mmap(NULL,2*ring->size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if (base==MAP_FAILED) goto error;
+
+	if ((mmap(base,ring->size,PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED) ||
+		(mmap(base+ring->size,ring->size,PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED)) {
+		munmap(base,2*ring->size);
+		goto error;
+	}
+	close(fd);
+	ring->base=base;
+	ring->mirrored=1;
+	return 0;
+error:
+	close(fd);
+	return -1;
+}
+
+int dsi_ring_init(struct dsi_ring * ring, unsigned int size)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	memset(ring,0,sizeof(*ring));
+	if (pagesize>0)
+		size=(size+pagesize-1) & ~(pagesize-1);
+	ring->size=size;
+
+	if (dsi_ring_map_mirrored(ring)==0)
+		return 0;
+
+	if ((ring->base=malloc(size))==NULL)
+		return -1;
+	return 0;
+}
+
+void dsi_ring_free(struct dsi_ring * ring)
+{
+	if (ring->base==NULL) return;
+	if (ring->mirrored)
+		munmap(ring->base,2*ring->size);
+	else
+		free(ring->base);
+	ring->base=NULL;
+}
+
+/* Returns where the next bytes from the socket go, and in len how many
+ * will fit there. */
+char * dsi_ring_space(struct dsi_ring * ring, unsigned int * len)
+{
+	if (ring->mirrored) {
+		*len=ring->size-dsi_ring_used(ring);
+		return ring->base+ring->tail;
+	}
+
+	if ((ring->tail==ring->size) && (ring->head>0)) {
+		memmove(ring->base,ring->base+ring->head,dsi_ring_used(ring));
+		ring->tail-=ring->head;
+		ring->head=0;
+	}
+	*len=ring->size-ring->tail;
+	return ring->base+ring->tail;
+}
+
+void dsi_ring_produce(struct dsi_ring * ring, unsigned int len)
+{
+	ring->tail+=len;
+}
+
+void dsi_ring_consume(struct dsi_ring * ring, unsigned int len)
+{
+	ring->head+=len;
+	if (ring->head==ring->tail) {
+		ring->head=ring->tail=0;
+	} else if ((ring->mirrored) && (ring->head>=ring->size)) {
+		ring->head-=ring->size;
+		ring->tail-=ring->size;
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef __DSI_RING_H_
+#define __DSI_RING_H_
+
+/* This must be a multiple of the page size */
+#define DSI_RING_SIZE (128*1024)
+
+/*
+ * The receive ring.  When it is mirrored, the same pages are mapped twice
+ * back to back, so any span of up to 'size' bytes starting at base+head is
+ * contiguous, even if it wraps.  Packets can then be parsed in place and
+ * leftover bytes never have to be moved.
+ *
+ * If the mirror can't be set up, the ring is a plain buffer and whatever is
+ * left at the head is moved down once the tail hits the end.
+ */
+struct dsi_ring {
+	char * base;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+	int mirrored;
+};
+
+#define dsi_ring_used(ring) ((ring)->tail-(ring)->head)
+#define dsi_ring_data(ring) ((ring)->base+(ring)->head)
+
+int dsi_ring_init(struct dsi_ring * ring, unsigned int size);
+void dsi_ring_free(struct dsi_ring * ring);
+char * dsi_ring_space(struct dsi_ring * ring, unsigned int * len);
+void dsi_ring_produce(struct dsi_ring * ring, unsigned int len);
+void dsi_ring_consume(struct dsi_ring * ring, unsigned int len);
+
+#endif
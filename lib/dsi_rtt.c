@@ -0,0 +1,144 @@
+/*
+ *  dsi_rtt.c
+ *
+ *  Round trip time estimates, and the request timeouts that come from them.
+ *
+ */
+
+#include <time.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/dsi.h"
+#include "afpfs-ng/utils.h"
+#include "dsi_rtt.h"
+
+/*
+ * This is the estimator TCP uses for its retransmit timer (RFC 6298): a
+ * smoothed round trip time, and a smoothed mean deviation from it, with
+ * the timeout at four deviations past the average, or twice the average,
+ * whichever is more.  On a LAN that comes out well under a second, so a
+ * server that has gone away is noticed quickly, and over a slow link or
+ * to a disk that is spinning up, it grows to fit.
+ *
+ * Only replies to small requests are timed, since the time a read or a
+ * write takes is mostly the time to move its data.  Nor is a request that
+ * has been sent more than once, since there's no telling which of them
+ * the reply is to.  Every sample comes from the thread receiving for the
+ * server, so there is only ever one writer.
+ */
+
+/* Microseconds on the monotonic clock */
+uint64_t dsi_rtt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+void dsi_rtt_sample(struct afp_server * server, unsigned int us)
+{
+	unsigned int delta;
+
+	if (server->stats.rtt_samples++==0) {
+		server->rtt_srtt=us;
+		server->rtt_var=us/2;
+		return;
+	}
+	delta=(server->rtt_srtt>us) ? server->rtt_srtt-us : us-server->rtt_srtt;
+	server->rtt_var=(3*(uint64_t) server->rtt_var+delta)/4;
+	server->rtt_srtt=(7*(uint64_t) server->rtt_srtt+us)/8;
+}
+
+/* Called as the reply to request comes in */
+void dsi_rtt_reply(struct afp_server * server, struct dsi_request * request)
+{
+	if ((request->sent==0) || (request->attempt>0))
+		return;
+	switch (request->subcommand) {
+	case afpRead:
+	case afpReadExt:
+	case afpWrite:
+	case afpWriteExt:
+		return;
+	}
+	dsi_rtt_sample(server,dsi_rtt_now()-request->sent);
+}
+
+/* The timeout for a small request, in ms.  The margin over the average is
+ * never less than the average itself, since a server that has always
+ * answered in the same time can still be slow on a busy disk. */
+unsigned int dsi_rtt_rto(struct afp_server * server)
+{
+	uint64_t ms;
+
+	ms=((uint64_t) server->rtt_srtt+
+		max(4*(uint64_t) server->rtt_var,server->rtt_srtt)+999)/1000;
+	if (ms<DSI_RTT_MIN_TIMEOUT) ms=DSI_RTT_MIN_TIMEOUT;
+	if (ms>DSI_RTT_MAX_TIMEOUT) ms=DSI_RTT_MAX_TIMEOUT;
+	return ms;
+}
+
+/* Requests that only read can be sent again if they time out, since doing
+ * one twice is no different from doing it once */
+int dsi_rtt_idempotent(unsigned char subcommand)
+{
+	switch (subcommand) {
+	case afpEnumerate:
+	case afpEnumerateExt:
+	case afpEnumerateExt2:
+	case afpFlush:
+	case afpFlushFork:
+	case afpGetForkParms:
+	case afpGetSrvrInfo:
+	case afpGetSrvrParms:
+	case afpGetVolParms:
+	case afpMapID:
+	case afpMapName:
+	case afpRead:
+	case afpReadExt:
+	case afpGetFileDirParms:
+	case afpGetUserInfo:
+	case afpGetSrvrMsg:
+	case afpGetIcon:
+	case afpGetIconInfo:
+	case afpGetComment:
+	case afpGetExtAttr:
+	case afpListExtAttrs:
+		return 1;
+	}
+	return 0;
+}
+
+/* How long, in ms, to give a request before it times out.  wait is the
+ * timeout the caller asked for, in seconds, which is used as it is until
+ * there is a round trip time to go by.  payload is how many bytes the
+ * request and its reply carry.  attempt is how many times the request has
+ * been sent before, out of DSI_RTT_RETRIES. */
+unsigned int dsi_rtt_timeout(struct afp_server * server,
+	unsigned char subcommand, int wait, unsigned int payload,
+	unsigned int attempt)
+{
+	unsigned int fixed = wait*1000;
+	uint64_t ms;
+
+	if (server->stats.rtt_samples==0)
+		ms=fixed;
+	else {
+		ms=dsi_rtt_rto(server);
+		/* A request that can't be sent again never gets less time
+		 * than it used to, nor does one the caller knows will be
+		 * slow, like a login to a server that has to spin up */
+		if ((!dsi_rtt_idempotent(subcommand)) ||
+			(wait>DSI_DEFAULT_TIMEOUT))
+			ms=max(ms,fixed);
+	}
+	if (attempt>0)
+		ms=max(ms,min(ms<<min(attempt,16),DSI_RTT_MAX_TIMEOUT));
+	/* The early tries can fail fast, but the last one waits as long as
+	 * the caller asked, so it never gives up any sooner than it did */
+	if (attempt>=DSI_RTT_RETRIES)
+		ms=max(ms,fixed);
+	return ms+(uint64_t) payload*1000/(DSI_RTT_MIN_RATE*1024);
+}
@@ -0,0 +1,29 @@
+#ifndef __DSI_RTT_H_
+#define __DSI_RTT_H_
+
+#include <stdint.h>
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/dsi.h"
+
+/* The bounds on a timeout worked out from the round trip time, in ms */
+#define DSI_RTT_MIN_TIMEOUT 500
+#define DSI_RTT_MAX_TIMEOUT 60000
+
+/* Requests and replies that carry data get time to move it at this many
+ * KB/s on top of the round trip */
+#define DSI_RTT_MIN_RATE 256
+
+/* How many more times a request that only reads is sent after it times
+ * out, each time waiting twice as long */
+#define DSI_RTT_RETRIES 2
+
+uint64_t dsi_rtt_now(void);
+void dsi_rtt_sample(struct afp_server * server, unsigned int us);
+void dsi_rtt_reply(struct afp_server * server, struct dsi_request * request);
+unsigned int dsi_rtt_rto(struct afp_server * server);
+unsigned int dsi_rtt_timeout(struct afp_server * server,
+	unsigned char subcommand, int wait, unsigned int payload,
+	unsigned int attempt);
+int dsi_rtt_idempotent(unsigned char subcommand);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ *  dsi_timer.c
+ *
+ *  A timer wheel for DSI request deadlines.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "dsi_timer.h"
+
+#define dsi_timer_slot(wheel,tick) \
+	(&(wheel)->slots[(tick) & (DSI_TIMER_SLOTS-1)])
+
+/* Milliseconds on the monotonic clock, so that setting the time of day
+ * doesn't make requests time out early or late */
+uint64_t dsi_timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+void dsi_timer_wheel_init(struct dsi_timer_wheel * wheel)
+{
+	memset(wheel,0,sizeof(*wheel));
+	pthread_mutex_init(&wheel->mutex,NULL);
+	wheel->last_add=dsi_timer_now();
+	wheel->last_tick=wheel->last_add/DSI_TIMER_TICK_MS;
+}
+
+static void dsi_timer_unlink(struct dsi_timer_wheel * wheel,
+	struct dsi_timer * timer)
+{
+	*timer->pprev=timer->next;
+	if (timer->next) timer->next->pprev=timer->pprev;
+	timer->pprev=NULL;
+	wheel->count--;
+}
+
+/* Starts timer, to go off in ms.  Returns 1 if whoever runs the wheel is
+ * asleep with no timeout and needs waking up to see it. */
+int dsi_timer_add(struct dsi_timer_wheel * wheel, struct dsi_timer * timer,
+	unsigned int ms)
+{
+	struct dsi_timer ** slot;
+	uint64_t now = dsi_timer_now();
+	int wake=0;
+
+	pthread_mutex_lock(&wheel->mutex);
+	timer->deadline=(now+ms+DSI_TIMER_TICK_MS-1)/DSI_TIMER_TICK_MS;
+	if (timer->deadline<=wheel->last_tick)
+		timer->deadline=wheel->last_tick+1;
+	slot=dsi_timer_slot(wheel,timer->deadline);
+	timer->next=*slot;
+	if (*slot) (*slot)->pprev=&timer->next;
+	timer->pprev=slot;
+	*slot=timer;
+	wheel->count++;
+	wheel->last_add=now;
+	if (wheel->sleeping) {
+		wheel->sleeping=0;
+		wake=1;
+	}
+	pthread_mutex_unlock(&wheel->mutex);
+	return wake;
+}
+
+/* It's fine to cancel a timer that has already gone off */
+void dsi_timer_cancel(struct dsi_timer_wheel * wheel,
+	struct dsi_timer * timer)
+{
+	pthread_mutex_lock(&wheel->mutex);
+	if (timer->pprev)
+		dsi_timer_unlink(wheel,timer);
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/* Takes every timer that is due off the wheel, and returns them linked
+ * through next */
+struct dsi_timer * dsi_timer_expire(struct dsi_timer_wheel * wheel)
+{
+	struct dsi_timer * expired = NULL, * t, * next;
+	uint64_t now = dsi_timer_now()/DSI_TIMER_TICK_MS;
+	uint64_t tick;
+
+	pthread_mutex_lock(&wheel->mutex);
+	if ((wheel->count==0) || (now<=wheel->last_tick)) {
+		if (now>wheel->last_tick) wheel->last_tick=now;
+		pthread_mutex_unlock(&wheel->mutex);
+		return NULL;
+	}
+	/* Past one turn, every slot has been gone by */
+	tick=wheel->last_tick+1;
+	if (now-tick>=DSI_TIMER_SLOTS)
+		tick=now-DSI_TIMER_SLOTS+1;
+	for (;tick<=now;tick++) {
+		for (t=*dsi_timer_slot(wheel,tick);t;t=next) {
+			next=t->next;
+			if (t->deadline>now) continue;
+			dsi_timer_unlink(wheel,t);
+			t->next=expired;
+			expired=t;
+		}
+	}
+	wheel->last_tick=now;
+	pthread_mutex_unlock(&wheel->mutex);
+	return expired;
+}
+
+/* How long, in ms, whoever runs the wheel may sleep before calling
+ * dsi_timer_expire() again.  -1 means it can sleep for as long as it
+ * likes, because dsi_timer_add() will ask for it to be woken. */
+int dsi_timer_timeout(struct dsi_timer_wheel * wheel)
+{
+	struct dsi_timer * t;
+	uint64_t now = dsi_timer_now();
+	uint64_t tick, first=0;
+	int ret;
+
+	pthread_mutex_lock(&wheel->mutex);
+	if (wheel->count==0) {
+		/* Stay awake for a while after the last request, so that a
+		 * steady trickle of them doesn't need waking every time */
+		if (now-wheel->last_add>=DSI_TIMER_IDLE_MS) {
+			wheel->sleeping=1;
+			ret=-1;
+		} else
+			ret=DSI_TIMER_TICK_MS;
+		pthread_mutex_unlock(&wheel->mutex);
+		return ret;
+	}
+	for (tick=wheel->last_tick+1;
+		(tick<=wheel->last_tick+DSI_TIMER_SLOTS) && (!first);tick++)
+		for (t=*dsi_timer_slot(wheel,tick);t;t=t->next)
+			if (t->deadline==tick) {
+				first=tick;
+				break;
+			}
+	/* Nothing within a turn, so check back after one */
+	if (!first)
+		first=wheel->last_tick+DSI_TIMER_SLOTS;
+	pthread_mutex_unlock(&wheel->mutex);
+
+	if (first*DSI_TIMER_TICK_MS<=now)
+		return 0;
+	return first*DSI_TIMER_TICK_MS-now;
+}
@@ -0,0 +1,46 @@
+#ifndef __DSI_TIMER_H_
+#define __DSI_TIMER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "afpfs-ng/dsi.h"
+
+/* Deadlines are rounded up to a whole tick */
+#define DSI_TIMER_TICK_MS 100
+
+/* This must be a power of two */
+#define DSI_TIMER_SLOTS 64
+
+/* With nothing pending for this long, whoever runs the wheel may sleep
+ * without a timeout, and has to be woken when a timer is added */
+#define DSI_TIMER_IDLE_MS 5000
+
+/*
+ * A hashed timer wheel.  Each timer goes in the slot for the tick it
+ * expires on, so adding and cancelling are constant time, and expiring
+ * only looks at the slots for the ticks that have gone by.  A timer more
+ * than a turn of the wheel away just stays in its slot until its tick
+ * really comes around.
+ *
+ * The wheel is only ever expired by one thread, the one that receives
+ * for the server, while timers can be added and cancelled from anywhere.
+ */
+struct dsi_timer_wheel {
+	pthread_mutex_t mutex;
+	struct dsi_timer * slots[DSI_TIMER_SLOTS];
+	uint64_t last_tick;
+	uint64_t last_add;
+	unsigned int count;
+	int sleeping;
+};
+
+uint64_t dsi_timer_now(void);
+void dsi_timer_wheel_init(struct dsi_timer_wheel * wheel);
+int dsi_timer_add(struct dsi_timer_wheel * wheel, struct dsi_timer * timer,
+	unsigned int ms);
+void dsi_timer_cancel(struct dsi_timer_wheel * wheel,
+	struct dsi_timer * timer);
+struct dsi_timer * dsi_timer_expire(struct dsi_timer_wheel * wheel);
+int dsi_timer_timeout(struct dsi_timer_wheel * wheel);
+
+#endif
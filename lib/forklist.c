@@ -15,6 +15,10 @@
 #include <stdlib.h>
 #include <pthread.h>
 
+#include "stripe.h"
+#include "readahead.h"
+#include "lowlevel.h"
+
 void add_opened_fork(struct afp_volume * volume, struct afp_file_info * fp)
 {
 
@@ -58,6 +62,10 @@ void remove_fork_list(struct afp_volume * volume)
 	for (p=volume->open_forks;p;p=next) 
 	{
 		next=p->largelist_next;
+		readahead_free(p);
+		ll_forget_locks(p);
+		ll_wait_unlocks(p);
+		stripe_close_forks(volume,p);
 		afp_flushfork(volume,p->forkid);
 		afp_closefork(volume,p->forkid);
 
@@ -5,6 +5,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -15,10 +16,20 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include "afpfs-ng/afp.h"
+#include <config.h>
 #include "afpfs-ng/dsi.h"
 #include "afpfs-ng/utils.h"
+#include "dsi_timer.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #define SIGNAL_TO_USE SIGUSR2
 
@@ -28,8 +39,8 @@ static pthread_t ending_thread;
 static pthread_t main_thread = (pthread_t)NULL;
 
 static int loop_started=0;
-static pthread_cond_t loop_started_condition;
-static pthread_mutex_t loop_started_mutex;
+static pthread_cond_t loop_started_condition = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t loop_started_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 void trigger_exit(void)
@@ -55,9 +66,137 @@ void termination_handler(int signum)
 
 #define max(a,b) (((a)>(b)) ? (a) : (b))
 
-static fd_set rds;
 static int max_fd=0;
 
+/* Counts trips round the main loop, so that anyone freeing a server can
+ * wait until the loop can't be holding on to it any more */
+static unsigned long loop_passes=0;
+static int loop_forgetting=0;
+static pthread_cond_t loop_pass_condition = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t loop_pass_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void loop_pass(void)
+{
+	__sync_add_and_fetch(&loop_passes,1);
+	if (loop_forgetting) {
+		pthread_mutex_lock(&loop_pass_mutex);
+		pthread_cond_broadcast(&loop_pass_condition);
+		pthread_mutex_unlock(&loop_pass_mutex);
+	}
+}
+
+static struct afp_server * find_server_by_fd(int fd)
+{
+	struct afp_server * s;
+
+	for (s=get_server_base();s;s=s->next)
+		if ((s->fd==fd) && (s->connect_state==SERVER_STATE_CONNECTED))
+			return s;
+	return NULL;
+}
+
+#ifdef USE_EPOLL
+
+/*
+ * With epoll, each fd carries its own user data.  For a server that's the
+ * afp_server itself.  Anything else (the wakeup eventfd, the command fd)
+ * is stored as the fd shifted up with the low bit set; a server pointer
+ * is always aligned, so its low bit never is.
+ */
+
+#define LOOP_MAX_EVENTS 64
+
+#define loop_tag_fd(fd) ((((uint64_t) (fd))<<1) | 1)
+#define loop_is_tagged(data) ((data).u64 & 1)
+#define loop_tagged_fd(data) ((int) ((data).u64>>1))
+
+static int epoll_fd=-1;
+static int wakeup_fd=-1;
+
+/* The events the loop is working through, so that a server freed from
+ * inside the loop can be struck off the ones still to come */
+static struct epoll_event * loop_events;
+static int loop_event, loop_nevents;
+static pthread_once_t loop_once = PTHREAD_ONCE_INIT;
+
+static void loop_setup(void)
+{
+	struct epoll_event ev;
+
+	if ((epoll_fd=epoll_create1(EPOLL_CLOEXEC))<0) {
+		perror("epoll_create1");
+		return;
+	}
+	if ((wakeup_fd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC))<0) {
+		perror("eventfd");
+		return;
+	}
+	memset(&ev,0,sizeof(ev));
+	ev.events=EPOLLIN;
+	ev.data.u64=loop_tag_fd(wakeup_fd);
+	epoll_ctl(epoll_fd,EPOLL_CTL_ADD,wakeup_fd,&ev);
+}
+
+/* Servers are edge triggered, since dsi_recv() reads until the socket is
+ * empty.  Other fds are level triggered, as scan_extra_fds only deals
+ * with one thing at a time. */
+static void add_fd(int fd)
+{
+	struct epoll_event ev;
+	struct afp_server * s;
+
+	pthread_once(&loop_once,loop_setup);
+
+	memset(&ev,0,sizeof(ev));
+	if ((s=find_server_by_fd(fd))) {
+		ev.events=EPOLLIN|EPOLLET;
+		ev.data.ptr=s;
+	} else {
+		ev.events=EPOLLIN;
+		ev.data.u64=loop_tag_fd(fd);
+		if ((fd+1) > max_fd) max_fd=fd+1;
+	}
+	if (epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&ev)<0) {
+		if (errno==EEXIST)
+			epoll_ctl(epoll_fd,EPOLL_CTL_MOD,fd,&ev);
+		else
+			perror("epoll_ctl");
+	}
+}
+
+static void rm_fd(int fd)
+{
+	/* Client fds are never added, so this may well fail */
+	epoll_ctl(epoll_fd,EPOLL_CTL_DEL,fd,NULL);
+}
+
+/* With edge triggering we won't hear about this server again until more
+ * data comes in.  Modifying the fd makes epoll look at it afresh, so if
+ * there's still something to read we'll get another event. */
+static void rearm_server(struct afp_server * s)
+{
+	struct epoll_event ev;
+
+	memset(&ev,0,sizeof(ev));
+	ev.events=EPOLLIN|EPOLLET;
+	ev.data.ptr=s;
+	epoll_ctl(epoll_fd,EPOLL_CTL_MOD,s->fd,&ev);
+}
+
+void signal_main_thread(void)
+{
+	uint64_t one=1;
+
+	pthread_once(&loop_once,loop_setup);
+	if (write(wakeup_fd,&one,sizeof(one))<0) {
+		/* The counter is already non-zero, which is just as good */
+	}
+}
+
+#else
+
+static fd_set rds;
+
 static void add_fd(int fd)
 {
 	FD_SET(fd,&rds);
@@ -84,6 +223,8 @@ void signal_main_thread(void)
 		pthread_kill(main_thread,SIGNAL_TO_USE);
 }
 
+#endif
+
 static int ending=0;
 void * just_end_it_now(void * ignore)
 {
@@ -96,10 +237,139 @@ void * just_end_it_now(void * ignore)
 	return NULL;
 }
 
+/*
+ * A server with rx_threaded set doesn't go through the main loop at all.
+ * It has a thread of its own that sleeps on its socket and runs
+ * dsi_recv(), so waiting callers are woken straight from there, and a big
+ * read from one server never holds up the replies from another.
+ */
+static void * server_receive_thread(void * other)
+{
+	struct afp_server * s = other;
+	struct pollfd pfd;
+	struct timespec ts;
+	sigset_t sigmask, orig_sigmask;
+	int ret, timeout;
+
+	/* We're woken with a signal when a request needs a deadline and we
+	 * have no timeout.  It is only let through while we're in ppoll(),
+	 * so one sent just before can't be missed. */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask,SIGNAL_TO_USE);
+	pthread_sigmask(SIG_BLOCK,&sigmask,&orig_sigmask);
+	sigdelset(&orig_sigmask,SIGNAL_TO_USE);
+
+	while (!s->rx_thread_stop) {
+		pfd.fd=s->fd;
+		pfd.events=POLLIN;
+		pfd.revents=0;
+		timeout=dsi_timer_timeout(s->timers);
+		ts.tv_sec=timeout/1000;
+		ts.tv_nsec=(timeout%1000)*1000000;
+		ret=ppoll(&pfd,1,(timeout<0) ? NULL : &ts,&orig_sigmask);
+		if ((ret<0) && (errno!=EINTR))
+			break;
+		if ((s->rx_thread_stop) || (pfd.revents & POLLNVAL))
+			break;
+		dsi_expire_requests(s);
+		if (ret<=0) continue;
+		if (dsi_recv(s)==-1) {
+			/* If someone else is already stopping us, leave the
+			 * rest to them */
+			loop_disconnect(s);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void start_receive_thread(struct afp_server * s)
+{
+	if (s->rx_thread_running) return;
+
+	signal(SIGNAL_TO_USE,termination_handler);
+	s->rx_thread_stop=0;
+	if (pthread_create(&s->rx_thread,NULL,server_receive_thread,s)) {
+		log_for_client(NULL,AFPFSD,LOG_ERR,
+			"Could not start a receive thread, "
+			"using the main loop instead\n");
+		s->rx_threaded=0;
+		add_fd(s->fd);
+		return;
+	}
+	pthread_mutex_lock(&s->rx_thread_mutex);
+	s->rx_thread_running=1;
+	pthread_mutex_unlock(&s->rx_thread_mutex);
+}
+
+/* Returns 0 if the receive thread is stopped, or -1 if someone else got
+ * there first */
+static int stop_receive_thread(struct afp_server * s)
+{
+	if (!__sync_bool_compare_and_swap(&s->rx_thread_stop,0,1))
+		return -1;
+
+	/* Once we have the mutex, nobody is signalling the thread, and
+	 * nobody will now that it's stopping */
+	pthread_mutex_lock(&s->rx_thread_mutex);
+	pthread_mutex_unlock(&s->rx_thread_mutex);
+
+	/* This wakes up the poll() or recv() it's sleeping in */
+	shutdown(s->fd,SHUT_RDWR);
+	if (pthread_equal(pthread_self(),s->rx_thread))
+		pthread_detach(s->rx_thread);
+	else
+		pthread_join(s->rx_thread,NULL);
+	pthread_mutex_lock(&s->rx_thread_mutex);
+	s->rx_thread_running=0;
+	pthread_mutex_unlock(&s->rx_thread_mutex);
+	return 0;
+}
+
+/* Wakes up whoever receives for the server, so that it notices a new
+ * request deadline.  A receive thread that is stopping has no need to. */
+void loop_wake_server(struct afp_server * s)
+{
+	int threaded;
+
+	pthread_mutex_lock(&s->rx_thread_mutex);
+	if (((threaded=s->rx_thread_running)) && (!s->rx_thread_stop))
+		pthread_kill(s->rx_thread,SIGNAL_TO_USE);
+	pthread_mutex_unlock(&s->rx_thread_mutex);
+	if (!threaded)
+		signal_main_thread();
+}
+
+/* Expires request deadlines for every server the main loop receives for,
+ * and returns how long it may sleep before it has to do that again, in
+ * ms, or -1 for as long as it likes. */
+static int loop_expire_requests(void)
+{
+	struct afp_server * s;
+	int timeout=-1, t;
+
+	for (s=get_server_base();s;s=s->next) {
+		if ((s->rx_thread_running) || (s->timers==NULL))
+			continue;
+		if (s->connect_state==SERVER_STATE_CONNECTED)
+			dsi_expire_requests(s);
+		t=dsi_timer_timeout(s->timers);
+		if ((t>=0) && ((timeout<0) || (t<timeout)))
+			timeout=t;
+	}
+	return timeout;
+}
+
 /*This is a hack to handle a problem where the first pthread_kill doesnt' work*/
 static unsigned char firsttime=0; 
 void add_fd_and_signal(int fd)
 {
+	struct afp_server * s = find_server_by_fd(fd);
+
+	if ((s) && (s->rx_threaded)) {
+		start_receive_thread(s);
+		return;
+	}
 	add_fd(fd);
 	signal_main_thread();
 	if (!firsttime) {
@@ -121,7 +391,14 @@ void loop_disconnect(struct afp_server *s)
         if (s->connect_state!=SERVER_STATE_CONNECTED)
                 return;
 
-        rm_fd_and_signal(s->fd);
+	if (s->rx_thread_running) {
+		if (stop_receive_thread(s)<0)
+			return;
+	} else {
+	        rm_fd_and_signal(s->fd);
+		/* The loop may be reading from it right now */
+		loop_forget_server(s);
+	}
 
 	/* Handle disconnect */
         close(s->fd);
@@ -130,6 +407,41 @@ void loop_disconnect(struct afp_server *s)
 	s->need_resume=1;
 }
 
+/* Makes sure the main loop is done with a server that is about to be
+ * freed.  It has to be disconnected first, so no new events come in for
+ * it; then either we're the loop, and strike it off the events still to
+ * be dealt with, or we wait for the loop to go round once. */
+void loop_forget_server(struct afp_server * s)
+{
+	unsigned long pass;
+#ifdef USE_EPOLL
+	int i;
+#endif
+
+	if ((main_thread==(pthread_t)NULL) || (exit_program==2))
+		return;
+
+	if (pthread_equal(pthread_self(),main_thread)) {
+#ifdef USE_EPOLL
+		for (i=loop_event+1;i<loop_nevents;i++)
+			if ((!loop_is_tagged(loop_events[i].data)) &&
+				(loop_events[i].data.ptr==s))
+				loop_events[i].data.ptr=NULL;
+#endif
+		return;
+	}
+
+	pass=loop_passes;
+	pthread_mutex_lock(&loop_pass_mutex);
+	loop_forgetting++;
+	signal_main_thread();
+	while ((loop_passes==pass) && (exit_program!=2))
+		pthread_cond_wait(&loop_pass_condition,&loop_pass_mutex);
+	loop_forgetting--;
+	pthread_mutex_unlock(&loop_pass_mutex);
+}
+
+#ifndef USE_EPOLL
 static int process_server_fds(fd_set * set, int max_fd, int ** onfd)
 {
 
@@ -150,6 +462,7 @@ static int process_server_fds(fd_set * set, int max_fd, int ** onfd)
 	}
 	return 0;
 }
+#endif
 
 static void deal_with_server_signals(fd_set *set, int * max_fd) 
 {
@@ -164,7 +477,10 @@ void afp_wait_for_started_loop(void)
 {
 	if (loop_started) return;
 
-	pthread_cond_wait(&loop_started_condition,&loop_started_mutex);
+	pthread_mutex_lock(&loop_started_mutex);
+	while (!loop_started)
+		pthread_cond_wait(&loop_started_condition,&loop_started_mutex);
+	pthread_mutex_unlock(&loop_started_mutex);
 
 }
 
@@ -184,6 +500,102 @@ int afp_main_quick_startup(pthread_t * thread)
 	return 0;
 }
 
+static void set_loop_started(void)
+{
+	pthread_mutex_lock(&loop_started_mutex);
+	loop_started=1;
+	pthread_cond_broadcast(&loop_started_condition);
+	pthread_mutex_unlock(&loop_started_mutex);
+	if (libafpclient->loop_started) 
+		libafpclient->loop_started();
+}
+
+#ifdef USE_EPOLL
+
+static void process_extra_fd(int command_fd, int fd)
+{
+	fd_set set;
+
+	/* The hook still wants an fd_set, so make one with just this fd */
+	if ((!libafpclient->scan_extra_fds) || (fd>=FD_SETSIZE))
+		return;
+	FD_ZERO(&set);
+	FD_SET(fd,&set);
+	libafpclient->scan_extra_fds(command_fd,&set,&max_fd);
+}
+
+int afp_main_loop(int command_fd) {
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	struct afp_server * s;
+	uint64_t count;
+	int i, n, fd, timeout;
+
+	main_thread=pthread_self();
+
+	pthread_once(&loop_once,loop_setup);
+	if ((epoll_fd<0) || (wakeup_fd<0))
+		return -1;
+
+	if (command_fd>=0) 
+		add_fd(command_fd);
+
+	signal(SIGTERM,termination_handler);
+	signal(SIGINT,termination_handler);
+	loop_events=events;
+	while(1) {
+
+		loop_nevents=0;
+		loop_pass();
+		timeout=loop_expire_requests();
+		if ((timeout<0) || (timeout>30000)) timeout=30000;
+		n=epoll_wait(epoll_fd,events,LOOP_MAX_EVENTS,
+			loop_started ? timeout : 0);
+			if (exit_program==2) break;
+			if (exit_program==1) {
+				pthread_create(&ending_thread,NULL,just_end_it_now,NULL);
+			}
+		if (n<0) {
+			if (errno==EINTR)
+				deal_with_server_signals(NULL,&max_fd);
+			continue;
+		}
+		if (n==0) {
+			/* Timeout */
+			if (loop_started==0)
+				set_loop_started();
+			continue;
+		}
+		loop_nevents=n;
+		for (i=0;i<n;i++) {
+			loop_event=i;
+			if (loop_is_tagged(events[i].data)) {
+				fd=loop_tagged_fd(events[i].data);
+				if (fd==wakeup_fd) {
+					if (read(wakeup_fd,&count,sizeof(count))<0) {
+						/* Nothing to do, it's nonblocking */
+					}
+				} else
+					process_extra_fd(command_fd,fd);
+				continue;
+			}
+			/* It may have been disconnected since the event came */
+			if (((s=events[i].data.ptr)==NULL) ||
+				(s->connect_state!=SERVER_STATE_CONNECTED))
+				continue;
+			if (dsi_recv(s)==-1) {
+				loop_disconnect(s);
+				continue;
+			}
+			if ((s->rx_more) || (!s->rx_drain))
+				rearm_server(s);
+		}
+	}
+
+	return -1;
+
+}
+
+#else
 
 int afp_main_loop(int command_fd) {
 	fd_set ords, oeds;
@@ -191,6 +603,7 @@ int afp_main_loop(int command_fd) {
 	int ret;
 	int fderrors=0;
 	sigset_t sigmask, orig_sigmask;
+	int timeout;
 
 	main_thread=pthread_self();
 
@@ -209,11 +622,14 @@ int afp_main_loop(int command_fd) {
 	signal(SIGINT,termination_handler);
 	while(1) {
 
+		loop_pass();
 		ords=rds;
 		oeds=rds;
+		timeout=loop_expire_requests();
+		if ((timeout<0) || (timeout>30000)) timeout=30000;
 		if (loop_started) {
-			tv.tv_sec=30;
-			tv.tv_nsec=0;
+			tv.tv_sec=timeout/1000;
+			tv.tv_nsec=(timeout%1000)*1000000;
 		} else {
 			tv.tv_sec=0;
 			tv.tv_nsec=0;
@@ -243,12 +659,8 @@ int afp_main_loop(int command_fd) {
 		fderrors=0;
 		if (ret==0) {
 			/* Timeout */
-			if (loop_started==0) {
-				loop_started=1;
-				pthread_cond_signal(&loop_started_condition);
-				if (libafpclient->loop_started) 
-					libafpclient->loop_started();
-			}
+			if (loop_started==0)
+				set_loop_started();
 		} else {
 			int * onfd;
 			fderrors=0;
@@ -270,3 +682,4 @@ int afp_main_loop(int command_fd) {
 
 }
 
+#endif
@@ -14,6 +14,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #ifdef __linux__
 #include <asm/fcntl.h>
 #else
@@ -27,6 +28,10 @@
 #include "lib/forklist.h"
 #include "did.h"
 #include "users.h"
+#include "stripe.h"
+#include "readahead.h"
+#include "block_cache.h"
+#include "disk_cache.h"
 
 static void set_nonunix_perms(unsigned int * mode, struct afp_file_info *fp) 
 {
@@ -36,22 +41,31 @@ static void set_nonunix_perms(unsigned int * mode, struct afp_file_info *fp)
 		*mode = 0600 | S_IFREG;
 }
 
+/* Locks or unlocks a range, whichever the version has.  A len of ~0
+ * goes to the end of the fork, however far that is. */
+static int ll_byterangelock(struct afp_volume * volume, unsigned char flag,
+	unsigned short forkid, uint64_t offset, uint64_t len)
+{
+	uint64_t generated_offset;
+	uint32_t generated_offset32;
+
+	if (volume->server->using_version->av_number < 30) 
+		return afp_byterangelock(volume,flag,forkid,offset,
+			(len==~0ULL) ? 0xffffffff : len,&generated_offset32);
+	return afp_byterangelockext(volume,flag,forkid,offset,len,
+		&generated_offset);
+}
+
 int ll_handle_unlocking(struct afp_volume * volume,unsigned short forkid,
 	uint64_t offset, uint64_t sizetorequest)
 {
-	uint64_t generated_offset;
 	int rc;
 
 	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) 
 		return 0;
 
-	if (volume->server->using_version->av_number < 30) 
-		rc=afp_byterangelock(volume,ByteRangeLock_Unlock,
-				forkid,offset, sizetorequest,
-				(uint32_t *) &generated_offset);
-	else 
-		rc=afp_byterangelockext(volume,ByteRangeLock_Unlock,
-				forkid,offset, sizetorequest,&generated_offset);
+	rc=ll_byterangelock(volume,ByteRangeLock_Unlock,forkid,offset,
+		sizetorequest);
 	switch(rc) {
 		case kFPNoErr:
 			break;
@@ -64,44 +78,300 @@ int ll_handle_unlocking(struct afp_volume * volume,unsigned short forkid,
 	return 0;
 }
 
-int ll_handle_locking(struct afp_volume * volume,unsigned short forkid, 
-	uint64_t offset, uint64_t sizetorequest)
+/* Unlocks don't have to be waited for: nothing we do next depends on
+ * them, and the server handles a session's requests in order, so the
+ * next lock on the range comes after it.  Each one sent is counted
+ * against the fork, so that closing it can wait for the replies, and if
+ * one fails, the next read or write on the fork, or closing it, says so. */
+
+static pthread_mutex_t ll_unlock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ll_unlock_cond = PTHREAD_COND_INITIALIZER;
+
+struct ll_unlock {
+	struct afp_file_info * fp;
+	uint64_t generated_offset;
+};
+
+/* This runs on the thread receiving for the session */
+static void ll_unlock_done(void * context, int rc)
 {
+	struct ll_unlock * u = context;
+
+	pthread_mutex_lock(&ll_unlock_mutex);
+	if (rc!=kFPNoErr)
+		u->fp->unlock_error=1;
+	u->fp->unlocks_pending--;
+	pthread_cond_broadcast(&ll_unlock_cond);
+	pthread_mutex_unlock(&ll_unlock_mutex);
+	free(u);
+}
 
-#define MAX_LOCKTRYCOUNT 10
+int ll_handle_unlocking_async(struct afp_volume * volume,
+	struct afp_file_info * fp, uint64_t offset, uint64_t sizetorequest)
+{
+	struct ll_unlock * u;
 
+	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) 
+		return 0;
+
+	/* AFP 2.x has no way of sending it but waiting */
+	if ((volume->server->using_version->av_number < 30) ||
+		((u=malloc(sizeof(*u)))==NULL))
+		return ll_handle_unlocking(volume,fp->forkid,offset,
+			sizetorequest);
+	u->fp=fp;
+
+	pthread_mutex_lock(&ll_unlock_mutex);
+	fp->unlocks_pending++;
+	pthread_mutex_unlock(&ll_unlock_mutex);
+
+	if (afp_byterangelockext_async(volume,ByteRangeLock_Unlock,
+		fp->forkid,offset,sizetorequest,&u->generated_offset,
+		ll_unlock_done,u))
+		ll_unlock_done(u,-1);
+	return 0;
+}
+
+/* Returns -1 if an unlock sent on the fork since we last asked failed */
+int ll_unlock_error(struct afp_file_info * fp)
+{
+	int error;
+
+	pthread_mutex_lock(&ll_unlock_mutex);
+	error=fp->unlock_error;
+	fp->unlock_error=0;
+	pthread_mutex_unlock(&ll_unlock_mutex);
+	return error ? -1 : 0;
+}
+
+/* Called as the fork is closed, since the replies point at it */
+int ll_wait_unlocks(struct afp_file_info * fp)
+{
+	pthread_mutex_lock(&ll_unlock_mutex);
+	while (fp->unlocks_pending>0)
+		pthread_cond_wait(&ll_unlock_cond,&ll_unlock_mutex);
+	pthread_mutex_unlock(&ll_unlock_mutex);
+	return ll_unlock_error(fp);
+}
+
+/* How long to keep trying for, as it used to be ten tries a second apart */
+#define MAX_LOCKWAIT (10*1000000)
+
+/* Waits before trying a lock again, a little longer each time, up to a
+ * second.  Returns how long it waited, in microseconds. */
+static unsigned int ll_lock_backoff(unsigned int try)
+{
+	unsigned int wait = 10000<<min(try,7);
+
+	if (wait>1000000) wait=1000000;
+	usleep(wait);
+	return wait;
+}
+
+int ll_handle_locking(struct afp_volume * volume,unsigned short forkid, 
+	uint64_t offset, uint64_t sizetorequest)
+{
 	int rc=0;
-	int try=0;
-	uint64_t generated_offset;
+	unsigned int try=0, waited=0;
 
 	if (volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) 
 		return 0;
 
-	while (try<MAX_LOCKTRYCOUNT) {
-		try++;
-		if (volume->server->using_version->av_number < 30) 
-			rc=afp_byterangelock(volume,ByteRangeLock_Lock,
-				forkid,offset, sizetorequest,
-				(uint32_t *) &generated_offset);
-		else 
-			rc=afp_byterangelockext(volume,ByteRangeLock_Lock,
-				forkid,offset, sizetorequest,&generated_offset);
+	while (1) {
+		rc=ll_byterangelock(volume,ByteRangeLock_Lock,forkid,offset,
+			sizetorequest);
 		switch(rc) {
 		case kFPNoErr:
-			goto done;
+			return 0;
 		case kFPNoMoreLocks: /* Max num of locks on server */
 		case kFPLockErr:  /*Some or all of the requested range is locked
 				    by another user. */
-
-			sleep(1);
+			if (waited>=MAX_LOCKWAIT)
+				return -1;
+			waited+=ll_lock_backoff(try++);
 			break;
 		default:
 			return -1;
 		}
 	}
-done:
+}
+
+/* Advisory locks, taken by applications with fcntl() or flock().
+ *
+ * AFP locks are exclusive, and held by a fork rather than a process, so
+ * shared locks are taken as exclusive ones, and two processes with the
+ * file open through the same fork share its locks.  A fork can't lock a
+ * range that overlaps one it has locked already, and can only unlock
+ * exactly what it locked, so the ranges it holds are kept, in order,
+ * and only the gaps between them are locked, and a range that is partly
+ * unlocked is unlocked whole, and what is left of it locked again. */
+
+#define lock_end(start,len) (((len)==~0ULL) ? ~0ULL : (start)+(len))
+
+static int ll_lock_add(struct afp_file_info * fp, uint64_t start,
+	uint64_t len)
+{
+	struct afp_fork_lock * l, ** p;
+
+	if ((l=malloc(sizeof(*l)))==NULL)
+		return -1;
+	l->start=start;
+	l->len=len;
+	for (p=&fp->locks;(*p) && ((*p)->start<start);p=&(*p)->next);
+	l->next=*p;
+	*p=l;
+	return 0;
+}
+
+static void ll_lock_remove(struct afp_file_info * fp, struct afp_fork_lock * l)
+{
+	struct afp_fork_lock ** p;
+
+	for (p=&fp->locks;*p;p=&(*p)->next)
+		if (*p==l) {
+			*p=l->next;
+			free(l);
+			return;
+		}
+}
+
+/* Locks one range the fork doesn't hold any of, waiting if asked to.
+ * The wait is bounded, since it holds up whoever called us, and with
+ * FUSE single threaded that's everyone; giving up looks like a signal,
+ * which callers of F_SETLKW and flock() are ready for. */
+static int ll_lock_one(struct afp_volume * volume, struct afp_file_info * fp,
+	uint64_t start, uint64_t len, int wait)
+{
+	unsigned int try=0, waited=0;
+
+	while (1) {
+		switch (ll_byterangelock(volume,ByteRangeLock_Lock,
+			fp->forkid,start,len)) {
+		case kFPNoErr:
+			if (ll_lock_add(fp,start,len)) {
+				ll_byterangelock(volume,ByteRangeLock_Unlock,
+					fp->forkid,start,len);
+				return -ENOLCK;
+			}
+			return 0;
+		case kFPLockErr:
+			if (!wait)
+				return -EAGAIN;
+			if (waited>=MAX_LOCKWAIT)
+				return -EINTR;
+			waited+=ll_lock_backoff(try++);
+			break;
+		case kFPNoMoreLocks:
+			return -ENOLCK;
+		default:
+			return -EIO;
+		}
+	}
+}
+
+/* Unlocks start to start+len (or the end), of whatever the fork has */
+int ll_unlock_range(struct afp_volume * volume, struct afp_file_info * fp,
+	uint64_t start, uint64_t len)
+{
+	struct afp_fork_lock * l, * next;
+	uint64_t end = lock_end(start,len), lstart, lend, llen;
+	int ret=0;
+
+	for (l=fp->locks;l;l=next) {
+		next=l->next;
+		lstart=l->start;
+		llen=l->len;
+		lend=lock_end(lstart,llen);
+		if ((lend<=start) || (lstart>=end))
+			continue;
+		if (ll_byterangelock(volume,ByteRangeLock_Unlock,fp->forkid,
+			lstart,llen)!=kFPNoErr)
+			ret=-EIO;
+		ll_lock_remove(fp,l);
+		/* Keep what was outside the range */
+		if ((lstart<start) &&
+			(ll_lock_one(volume,fp,lstart,start-lstart,0)))
+			ret=-EIO;
+		if ((lend>end) && (ll_lock_one(volume,fp,end,
+			(llen==~0ULL) ? ~0ULL : lend-end,0)))
+			ret=-EIO;
+	}
+	return ret;
+}
+
+/* Locks start to start+len (or the end), or whatever of it the fork
+ * doesn't have already.  On failure, nothing more is locked than was. */
+int ll_lock_range(struct afp_volume * volume, struct afp_file_info * fp,
+	uint64_t start, uint64_t len, int wait)
+{
+	struct afp_fork_lock * l;
+	uint64_t end = lock_end(start,len), o=start, lend;
+	uint64_t done[2*64];
+	unsigned int ndone=0, i;
+	int ret;
 
+	for (l=fp->locks;(l) && (o<end);l=l->next) {
+		lend=lock_end(l->start,l->len);
+		if (lend<=o) continue;
+		if (l->start>=end) break;
+		if (l->start>o) {
+			if (ndone==sizeof(done)/sizeof(done[0]))
+				goto too_many;
+			if ((ret=ll_lock_one(volume,fp,o,l->start-o,wait)))
+				goto undo;
+			done[ndone++]=o;
+			done[ndone++]=l->start-o;
+		}
+		o=lend;
+	}
+	if (o<end) {
+		if (ndone==sizeof(done)/sizeof(done[0]))
+			goto too_many;
+		if ((ret=ll_lock_one(volume,fp,o,
+			(len==~0ULL) ? ~0ULL : end-o,wait)))
+			goto undo;
+	}
 	return 0;
+
+too_many:
+	ret=-ENOLCK;
+undo:
+	for (i=0;i<ndone;i+=2)
+		ll_unlock_range(volume,fp,done[i],done[i+1]);
+	return ret;
+}
+
+/* Finds out whether start to start+len could be locked, returning 0 if
+ * so, or -EAGAIN if someone else has some of it */
+int ll_test_range(struct afp_volume * volume, struct afp_file_info * fp,
+	uint64_t start, uint64_t len)
+{
+	switch (ll_byterangelock(volume,ByteRangeLock_Lock,fp->forkid,
+		start,len)) {
+	case kFPNoErr:
+		ll_byterangelock(volume,ByteRangeLock_Unlock,fp->forkid,
+			start,len);
+		return 0;
+	case kFPRangeOverlap:
+		/* Some of it is ours, and ours don't count against us */
+		return 0;
+	case kFPLockErr:
+		return -EAGAIN;
+	default:
+		return -EIO;
+	}
+}
+
+/* The server lets go of the locks as the fork is closed */
+void ll_forget_locks(struct afp_file_info * fp)
+{
+	struct afp_fork_lock * l, * next;
+
+	for (l=fp->locks;l;l=next) {
+		next=l->next;
+		free(l);
+	}
+	fp->locks=NULL;
 }
 
 
@@ -185,6 +455,7 @@ int ll_open(struct afp_volume * volume, const char *path, int flags,
 
 	int ret, dsi_ret,rc;
 	int create_file=0;
+	unsigned short bitmap;
 	//char converted_path[AFP_MAX_PATH];
 	unsigned char aflags = AFP_OPENFORK_ALLOWREAD;
 
@@ -269,9 +540,20 @@ int ll_open(struct afp_volume * volume, const char *path, int flags,
 	}
 
 
+	/* If no one else can write to it, it doesn't need locking */
+	if (volume->locking==AFP_LOCKING_LEASE)
+		aflags|=AFP_OPENFORK_DENYWRITE;
+
+	/* What the block cache checks its blocks of the file against */
+	bitmap=kFPNodeIDBit|kFPModDateBit;
+	if (volume->server->using_version->av_number<30)
+		bitmap|=(fp->resource ? kFPRsrcForkLenBit : kFPDataForkLenBit);
+	else
+		bitmap|=(fp->resource ?
+			kFPExtRsrcForkLenBit : kFPExtDataForkLenBit);
 try_again:
 	dsi_ret=afp_openfork(volume,fp->resource?1:0,fp->did,
-		aflags,fp->basename,fp);
+		aflags,bitmap,fp->basename,fp);
 
 	switch (dsi_ret) {
 	case kFPAccessDenied:
@@ -298,8 +580,14 @@ try_again:
 	case kFPTooManyFilesOpen:
 		ret=EMFILE;
 		goto error;
-	case kFPVolLocked:
 	case kFPDenyConflict:
+		/* Someone has it open for writing, so no lease */
+		if (aflags & AFP_OPENFORK_DENYWRITE) {
+			aflags&=~AFP_OPENFORK_DENYWRITE;
+			goto try_again;
+		}
+		/* fall through */
+	case kFPVolLocked:
 	case kFPMiscErr:
 	case kFPBitmapErr:
 	case -1:
@@ -313,12 +601,19 @@ try_again:
 		goto error;
 	}
 
+	fp->accessmode=aflags;
+	fp->lease=(aflags & AFP_OPENFORK_DENYWRITE) ? 1 : 0;
 	add_opened_fork(volume, fp);
 
+	if (disk_cache_wanted(volume,fp))
+		disk_cache_open(volume,fp);
+
 	if ((flags & O_TRUNC) && (!create_file)) {
 
 		/* This is the case where we want to truncate the 
 		   the file and it already exists. */
+		block_cache_invalidate(volume,fp,0,~0ULL);
+		disk_cache_invalidate(volume,fp);
 		if ((ret=ll_zero_file(volume,fp->forkid,fp->resource)))
 			goto error;
 	}
@@ -334,31 +629,88 @@ int ll_read(struct afp_volume * volume,
 	char *buf, size_t size, off_t offset,
 	struct afp_file_info *fp, int * eof)
 {
-	int bytesleft=size;
-	int totalsize=0;
+	int totalsize=0, cached=0, stored=0;
 	int ret=0;
-	int rc;
-	unsigned int bufsize=min(volume->server->rx_quantum,size);
+	int rc=kFPNoErr;
+	unsigned int rx_quantum=volume->server->rx_quantum;
 	struct afp_rx_buffer buffer;
 
 	*eof=0;
 
-	buffer.data = buf;
-	buffer.maxsize=bufsize;
-	buffer.size=0;
+	if (ll_unlock_error(fp)) {
+		ret=EIO;
+		goto error;
+	}
+
 	/* Lock the range */
-	if (ll_handle_locking(volume, fp->forkid,offset,size)) {
+	if ((!fp->lease) &&
+		(ll_handle_locking(volume, fp->forkid,offset,size))) {
 		/* There was an irrecoverable error when locking */
 		ret=EBUSY;
 		goto error;
 	}
 
-	if (volume->server->using_version->av_number < 30)
-		rc=afp_read(volume, fp->forkid,offset,size,&buffer);
-	else
-		rc=afp_readext(volume, fp->forkid,offset,size,&buffer);
+	/* Whatever we have already, or read ahead, doesn't have to be asked
+	 * for */
+	if (block_cache_wanted(volume,fp)) {
+		cached=totalsize=block_cache_read(volume,fp,buf,size,offset,
+			eof);
+		if (*eof) rc=kFPEOFErr;
+	}
+	if ((rc==kFPNoErr) && (totalsize<size) &&
+		(disk_cache_wanted(volume,fp))) {
+		totalsize+=disk_cache_read(volume,fp,buf+totalsize,
+			size-totalsize,offset+totalsize,eof);
+		if (*eof) rc=kFPEOFErr;
+	}
+	stored=totalsize;
+	if ((rc==kFPNoErr) && (totalsize<size) &&
+		(readahead_wanted(volume,fp))) {
+		totalsize+=readahead_read(volume,fp,buf+totalsize,
+			size-totalsize,offset+totalsize,eof);
+		if (*eof) rc=kFPEOFErr;
+	}
+
+	/* Big reads are spread over the stripe sessions, if there are any.
+	 * Whatever they leave undone, the loop below picks up. */
+	if ((rc==kFPNoErr) &&
+		(stripe_wanted(volume,fp,size-totalsize,rx_quantum))) {
+		size_t done;
 
-	if (ll_handle_unlocking(volume, fp->forkid,offset,size)) {
+		rc=stripe_transfer(volume,fp,buf+totalsize,size-totalsize,
+			offset+totalsize,rx_quantum,0,&done);
+		totalsize+=done;
+	}
+
+	/* Never ask for more than rx_quantum at once */
+	while ((totalsize<size) && (rc==kFPNoErr)) {
+		buffer.data=buf+totalsize;
+		buffer.maxsize=min(rx_quantum,size-totalsize);
+		buffer.size=0;
+		if (volume->server->using_version->av_number < 30)
+			rc=afp_read(volume, fp->forkid,offset+totalsize,
+				buffer.maxsize,&buffer);
+		else
+			rc=afp_readext(volume, fp->forkid,offset+totalsize,
+				buffer.maxsize,&buffer);
+		totalsize+=buffer.size;
+		if ((rc!=kFPNoErr) || (buffer.size<buffer.maxsize))
+			break;
+	}
+
+	/* If it all came from the caches, there's nothing to read ahead of */
+	if ((totalsize>cached) && (block_cache_wanted(volume,fp)))
+		block_cache_fill(volume,fp,buf+cached,totalsize-cached,
+			offset+cached,(rc==kFPEOFErr) ||
+			((rc==kFPNoErr) && (totalsize<size)));
+	if ((totalsize>stored) && (disk_cache_wanted(volume,fp)))
+		disk_cache_fill(volume,fp,buf+stored,totalsize-stored,
+			offset+stored);
+	if ((totalsize>stored) && (readahead_wanted(volume,fp)))
+		readahead_advance(volume,fp,offset,totalsize);
+
+	if ((!fp->lease) &&
+		(ll_handle_unlocking_async(volume,fp,offset,size))) {
 		/* Somehow, we couldn't unlock the range. */
 		ret=EIO;
 		goto error;
@@ -381,8 +733,6 @@ int ll_read(struct afp_volume * volume,
 		break;
 	}
 
-	bytesleft-=buffer.size;
-	totalsize+=buffer.size;
 	return totalsize;
 error:
 	return -ret;
@@ -638,15 +988,32 @@ int ll_write(struct afp_volume * volume,
 
 	if (!fp) return -EBADF;
 
+	readahead_invalidate(fp,offset,size);
+	block_cache_invalidate(volume,fp,offset,size);
+	disk_cache_invalidate(volume,fp);
+
+	if (ll_unlock_error(fp)) {
+		err=EIO;
+		goto error;
+	}
+
 	/* Get a lock */
-	if (ll_handle_locking(volume, fp->forkid,offset,size)) {
+	if ((!fp->lease) &&
+		(ll_handle_locking(volume, fp->forkid,offset,size))) {
 		/* There was an irrecoverable error when locking */
-		ret=EBUSY;
+		err=EBUSY;
 		goto error;
 	}
 
-	ret=0;
-	while (*totalwritten < size) {
+	/* The same goes for big writes */
+	ret=kFPNoErr;
+	if (stripe_wanted(volume,fp,size,max_packet_size)) {
+		ret=stripe_transfer(volume,fp,(char *) data,size,offset,
+			max_packet_size,1,totalwritten);
+		o=*totalwritten;
+	}
+
+	while ((ret==kFPNoErr) && (*totalwritten < size)) {
 		sizetowrite=max_packet_size;
 		if ((size-*totalwritten)<max_packet_size)
 			sizetowrite=size-*totalwritten;
@@ -659,29 +1026,36 @@ int ll_write(struct afp_volume * volume,
 			ret=afp_writeext(volume, fp->forkid,
 				offset+o,sizetowrite,
 				(char *) data+o,&ignored);
-		ret=0;
+		if (ret!=kFPNoErr)
+			break;
 		*totalwritten+=sizetowrite;
-		switch(ret) {
-		case kFPAccessDenied:
-			err=EACCES;
-			goto error;
-		case kFPDiskFull:
-			err=ENOSPC;
-			goto error;
-		case kFPLockErr:
-		case kFPMiscErr:
-		case kFPParamErr:
-			err=EINVAL;
-			goto error;
-		}
 		o+=sizetowrite;
 	}
-	if (ll_handle_unlocking(volume, fp->forkid,offset,size)) {
+
+	/* Whatever happened, the range is ours to let go of */
+	if ((!fp->lease) &&
+		(ll_handle_unlocking_async(volume,fp,offset,size))) {
 		/* Somehow, we couldn't unlock the range. */
-		ret=EIO;
+		err=EIO;
 		goto error;
 	}
-	return 0;
+	switch(ret) {
+	case kFPNoErr:
+		return 0;
+	case kFPAccessDenied:
+		err=EACCES;
+		break;
+	case kFPDiskFull:
+		err=ENOSPC;
+		break;
+	case kFPLockErr:
+	case kFPMiscErr:
+	case kFPParamErr:
+		err=EINVAL;
+		break;
+	default:
+		err=EIO;
+	}
 
 error:
 	return -err;
@@ -21,9 +21,22 @@ int ll_read(struct afp_volume * volume,
 int ll_handle_unlocking(struct afp_volume * volume,unsigned short forkid,
 	uint64_t offset, uint64_t sizetorequest);
 
+int ll_handle_unlocking_async(struct afp_volume * volume,
+	struct afp_file_info * fp, uint64_t offset, uint64_t sizetorequest);
+int ll_unlock_error(struct afp_file_info * fp);
+int ll_wait_unlocks(struct afp_file_info * fp);
+
 int ll_handle_locking(struct afp_volume * volume,unsigned short forkid,
 	uint64_t offset, uint64_t sizetorequest);
 
+int ll_lock_range(struct afp_volume * volume, struct afp_file_info * fp,
+	uint64_t start, uint64_t len, int wait);
+int ll_unlock_range(struct afp_volume * volume, struct afp_file_info * fp,
+	uint64_t start, uint64_t len);
+int ll_test_range(struct afp_volume * volume, struct afp_file_info * fp,
+	uint64_t start, uint64_t len);
+void ll_forget_locks(struct afp_file_info * fp);
+
 int ll_write(struct afp_volume * volume,
 	const char *data, size_t size, off_t offset,
 	struct afp_file_info * fp, size_t * totalwritten);
@@ -18,11 +18,9 @@
 #include <stdlib.h>
 #include <sys/time.h>
 
-#ifdef __linux__
-#include <asm/fcntl.h>
-#else
+/* Not <asm/fcntl.h>, whose struct flock isn't the one fcntl() takes */
 #include <fcntl.h>
-#endif
+#include <sys/file.h>
 
 
 #include "users.h"
@@ -35,6 +33,10 @@
 #include "forklist.h"
 #include "uams.h"
 #include "lowlevel.h"
+#include "stripe.h"
+#include "readahead.h"
+#include "block_cache.h"
+#include "disk_cache.h"
 
 
 #define min(a,b) (((a)<(b)) ? (a) : (b))
@@ -415,6 +417,65 @@ int ml_read(struct afp_volume * volume, const char *path,
 }
 
 
+/* fcntl() locks on an open fork, if the volume passes them on */
+int ml_lock(struct afp_volume * volume, const char * path,
+	struct afp_file_info * fp, int cmd, struct flock * lock)
+{
+	uint64_t start, len;
+	int ret;
+
+	if (volume->locking!=AFP_LOCKING_ADVISORY)
+		return -ENOSYS;
+	if ((!fp) || (fp->resource))
+		return -EBADF;
+	if ((lock->l_whence!=SEEK_SET) || (lock->l_start<0))
+		return -EINVAL;
+
+	start=lock->l_start;
+	if (lock->l_len>0)
+		len=lock->l_len;
+	else if (lock->l_len==0)
+		len=~0ULL;
+	else
+		return -EINVAL;
+
+	switch (cmd) {
+	case F_GETLK:
+		if (lock->l_type==F_UNLCK)
+			return 0;
+		if ((ret=ll_test_range(volume,fp,start,len))==0)
+			lock->l_type=F_UNLCK;
+		else if (ret==-EAGAIN) {
+			/* We can't tell who has it, nor whether shared */
+			lock->l_type=F_WRLCK;
+			lock->l_pid=0;
+			ret=0;
+		}
+		return ret;
+	case F_SETLK:
+	case F_SETLKW:
+		if (lock->l_type==F_UNLCK)
+			return ll_unlock_range(volume,fp,start,len);
+		return ll_lock_range(volume,fp,start,len,cmd==F_SETLKW);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* flock() locks, which are of the whole fork */
+int ml_flock(struct afp_volume * volume, const char * path,
+	struct afp_file_info * fp, int op)
+{
+	if (volume->locking!=AFP_LOCKING_ADVISORY)
+		return -ENOSYS;
+	if ((!fp) || (fp->resource))
+		return -EBADF;
+
+	if (op & LOCK_UN)
+		return ll_unlock_range(volume,fp,0,~0ULL);
+	return ll_lock_range(volume,fp,0,~0ULL,!(op & LOCK_NB));
+}
+
 int ml_chmod(struct afp_volume * vol, const char * path, mode_t mode) 
 {
 /*
@@ -660,6 +721,12 @@ int ml_close(struct afp_volume * volume, const char * path,
 		return appledouble_close(volume,fp);
 	}
 
+	readahead_free(fp);
+	ll_forget_locks(fp);
+	/* It still has to be closed, but whoever closes it hears of it */
+	if (ll_wait_unlocks(fp))
+		ret=EIO;
+	stripe_close_forks(volume,fp);
 	switch(afp_closefork(volume,fp->forkid)) {
 		case kFPNoErr:
 			break;
@@ -774,7 +841,7 @@ int ml_readlink(struct afp_volume * vol, const char * path,
 
 	/* Open the fork */
 	rc=afp_openfork(vol,0, dirid, 
-		AFP_OPENFORK_ALLOWWRITE|AFP_OPENFORK_ALLOWREAD,
+		AFP_OPENFORK_ALLOWWRITE|AFP_OPENFORK_ALLOWREAD,0,
 		basename,&fp);
 	switch (rc) {
 	case kFPAccessDenied:
@@ -1014,6 +1081,8 @@ int ml_truncate(struct afp_volume * vol, const char * path, off_t offset)
 		return ret;
 	};
 
+	block_cache_invalidate(vol,fp,0,~0ULL);
+	disk_cache_invalidate(vol,fp);
 	if ((ret=ll_zero_file(vol,fp->forkid,0)))
 		goto out;
 
@@ -1154,7 +1223,7 @@ int ml_symlink(struct afp_volume *vol, const char * path1, const char * path2)
 	/* Open the fork */
 	rc=afp_openfork(vol,0,
 		dirid2,
-		AFP_OPENFORK_ALLOWWRITE|AFP_OPENFORK_ALLOWREAD,
+		AFP_OPENFORK_ALLOWWRITE|AFP_OPENFORK_ALLOWREAD,0,
 		basename2,&fp);
 	switch (ret) {
 	case kFPAccessDenied:
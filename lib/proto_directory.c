@@ -368,14 +368,15 @@ int afp_enumerate(
 	return rc;
 }
 
-int afp_enumerateext2(
+static int enumerateext2_send(
 	struct afp_volume * volume, 
 	unsigned int dirid, 
 	unsigned int filebitmap, unsigned int dirbitmap,
 	unsigned short reqcount, 
 	unsigned long startindex,
 	char * pathname,
-	struct afp_file_info ** file_p)
+	struct afp_file_info ** file_p,
+	afp_completion completion, void * context)
 {
 	struct {
 		struct dsi_header dsi_header __attribute__((__packed__));
@@ -422,6 +423,14 @@ int afp_enumerateext2(
 	unixpath_to_afppath(server,path);
 
 	
+	if (completion) {
+		/* The list is only there once the completion has been called */
+		*file_p = NULL;
+		rc=dsi_send_async(server, (char *) data,len,NULL,0,
+			afpEnumerateExt2,(void **) file_p,completion,context);
+		free(data);
+		return rc;
+	}
 	rc=dsi_send(server, (char *) data,len,DSI_DEFAULT_TIMEOUT,
 		afpEnumerateExt2,(void **) &files);
 
@@ -430,3 +439,30 @@ int afp_enumerateext2(
 	return rc;
 
 }
+
+int afp_enumerateext2(
+	struct afp_volume * volume, 
+	unsigned int dirid, 
+	unsigned int filebitmap, unsigned int dirbitmap,
+	unsigned short reqcount, 
+	unsigned long startindex,
+	char * pathname,
+	struct afp_file_info ** file_p)
+{
+	return enumerateext2_send(volume,dirid,filebitmap,dirbitmap,
+		reqcount,startindex,pathname,file_p,NULL,NULL);
+}
+
+int afp_enumerateext2_async(
+	struct afp_volume * volume, 
+	unsigned int dirid, 
+	unsigned int filebitmap, unsigned int dirbitmap,
+	unsigned short reqcount, 
+	unsigned long startindex,
+	char * pathname,
+	struct afp_file_info ** file_p,
+	afp_completion completion, void * context)
+{
+	return enumerateext2_send(volume,dirid,filebitmap,dirbitmap,
+		reqcount,startindex,pathname,file_p,completion,context);
+}
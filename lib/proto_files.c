@@ -232,10 +232,11 @@ int afp_read_reply(struct afp_server *server, char * buf, unsigned int size,void
 	return 0;
 }
 
-int afp_readext(struct afp_volume * volume, unsigned short forkid, 
+static int readext_send(struct afp_volume * volume, unsigned short forkid, 
 		uint64_t offset, 
 		uint64_t count,
-		struct afp_rx_buffer * rx)
+		struct afp_rx_buffer * rx,
+		afp_completion completion, void * context)
 {
 	int rc;
 	struct {
@@ -253,12 +254,34 @@ int afp_readext(struct afp_volume * volume, unsigned short forkid,
 	readext_packet.forkrefnum=htons(forkid);
 	readext_packet.offset=hton64(offset);
 	readext_packet.reqcount=hton64(count);
+	if (completion)
+		return dsi_send_async(volume->server, (char *) &readext_packet,
+			sizeof(readext_packet), NULL, 0,
+			afpReadExt, (void *) rx, completion, context);
 	rc=dsi_send(volume->server, (char *) &readext_packet,
 		sizeof(readext_packet), DSI_DEFAULT_TIMEOUT, 
 		afpReadExt, (void *) rx);
 	return rc;
 }
 
+int afp_readext(struct afp_volume * volume, unsigned short forkid, 
+		uint64_t offset, 
+		uint64_t count,
+		struct afp_rx_buffer * rx)
+{
+	return readext_send(volume,forkid,offset,count,rx,NULL,NULL);
+}
+
+int afp_readext_async(struct afp_volume * volume, unsigned short forkid, 
+		uint64_t offset, 
+		uint64_t count,
+		struct afp_rx_buffer * rx,
+		afp_completion completion, void * context)
+{
+	return readext_send(volume,forkid,offset,count,rx,
+		completion,context);
+}
+
 int afp_readext_reply(struct afp_server *server, char * buf, unsigned int size, void * other)
 {
 	struct afp_rx_buffer * rx = other;
@@ -310,8 +333,8 @@ int afp_getfiledirparms_reply(struct afp_server *server, char * buf, unsigned in
 }
 
 
-int afp_getfiledirparms(struct afp_volume *volume, unsigned int did, unsigned int filebitmap, unsigned int dirbitmap, const char * pathname,
-	struct afp_file_info *fpp)
+static int getfiledirparms_send(struct afp_volume *volume, unsigned int did, unsigned int filebitmap, unsigned int dirbitmap, const char * pathname,
+	struct afp_file_info *fpp, afp_completion completion, void * context)
 {
 	struct {
 		struct dsi_header dsi_header __attribute__((__packed__));
@@ -347,14 +370,32 @@ int afp_getfiledirparms(struct afp_volume *volume, unsigned int did, unsigned in
 	copy_path(server,path,pathname,strlen(pathname));
 	unixpath_to_afppath(server,path);
 
-	ret=dsi_send(server, (char *) getfiledirparms,len,DSI_DEFAULT_TIMEOUT, 
-		afpGetFileDirParms,(void *) fpp);
+	if (completion)
+		ret=dsi_send_async(server, (char *) getfiledirparms,len,NULL,0,
+			afpGetFileDirParms,(void *) fpp,completion,context);
+	else
+		ret=dsi_send(server, (char *) getfiledirparms,len,
+			DSI_DEFAULT_TIMEOUT,afpGetFileDirParms,(void *) fpp);
 
 	free(msg);
 	
 	return ret;
 }
 
+int afp_getfiledirparms(struct afp_volume *volume, unsigned int did, unsigned int filebitmap, unsigned int dirbitmap, const char * pathname,
+	struct afp_file_info *fpp)
+{
+	return getfiledirparms_send(volume,did,filebitmap,dirbitmap,pathname,
+		fpp,NULL,NULL);
+}
+
+int afp_getfiledirparms_async(struct afp_volume *volume, unsigned int did, unsigned int filebitmap, unsigned int dirbitmap, const char * pathname,
+	struct afp_file_info *fpp, afp_completion completion, void * context)
+{
+	return getfiledirparms_send(volume,did,filebitmap,dirbitmap,pathname,
+		fpp,completion,context);
+}
+
 int afp_createfile(struct afp_volume * volume, unsigned char flag, 
 	unsigned int did, 
 	char * pathname)
@@ -404,34 +445,21 @@ int afp_write(struct afp_volume * volume, unsigned short forkid,
 		uint16_t forkid;
 		uint32_t offset;
 		uint32_t reqcount;
-	}  __attribute__((__packed__)) * request_packet;
+	}  __attribute__((__packed__)) request_packet;
 	struct afp_server * server = volume->server;
 
-	unsigned int len = sizeof(*request_packet)+
-		reqcount;
-	int ret;
-	char * dataptr, * msg;
-
-	if ((msg = malloc(len))==NULL) 
-		return -1;
-
-	request_packet =(void *) msg;
-	dataptr=msg+(sizeof(*request_packet));
-	memcpy(dataptr,data,reqcount);
-	dsi_setup_header(server,&request_packet->dsi_header,DSI_DSIWrite);
-	request_packet->dsi_header.return_code.data_offset=htonl(sizeof(*request_packet)-sizeof(struct dsi_header));
+	/* The data goes out straight from the caller's buffer */
+	dsi_setup_header(server,&request_packet.dsi_header,DSI_DSIWrite);
+	request_packet.dsi_header.return_code.data_offset=htonl(sizeof(request_packet)-sizeof(struct dsi_header));
 	/* For writing data, set the offset correctly */
-	request_packet->command=afpWrite;
-	request_packet->flag=0;  /* we'll always do this from the start */
-	request_packet->forkid=htons(forkid);
-	request_packet->offset=htonl(offset);
-	request_packet->reqcount=htonl(reqcount);
-	ret=dsi_send(server, (char *) request_packet,len,DSI_DEFAULT_TIMEOUT, 
+	request_packet.command=afpWrite;
+	request_packet.flag=0;  /* we'll always do this from the start */
+	request_packet.forkid=htons(forkid);
+	request_packet.offset=htonl(offset);
+	request_packet.reqcount=htonl(reqcount);
+	return dsi_send_data(server, (char *) &request_packet,
+		sizeof(request_packet),data,reqcount,DSI_DEFAULT_TIMEOUT, 
 		afpWrite,(void *) written);
-
-	free(msg);
-	
-	return ret;
 }
 
 
@@ -452,9 +480,10 @@ int afp_write_reply(struct afp_server *server, char * buf, unsigned int size,
 	return 0;
 }
 
-int afp_writeext(struct afp_volume * volume, unsigned short forkid,
+static int writeext_send(struct afp_volume * volume, unsigned short forkid,
 	uint64_t offset, uint64_t reqcount, 
-	char * data,uint64_t * written)
+	char * data,uint64_t * written,
+	afp_completion completion, void * context)
 {
 	struct {
 		struct dsi_header dsi_header __attribute__((__packed__));
@@ -463,34 +492,42 @@ int afp_writeext(struct afp_volume * volume, unsigned short forkid,
 		uint16_t forkid;
 		uint64_t offset;
 		uint64_t reqcount;
-	}  __attribute__((__packed__)) * request_packet;
+	}  __attribute__((__packed__)) request_packet;
 	struct afp_server * server = volume->server;
 
-	unsigned int len = sizeof(*request_packet)+
-		reqcount;
-	int ret;
-	char * dataptr, * msg;
-
-	if ((msg = malloc(len))==NULL) 
-		return -1;
-
-	request_packet =(void *) msg;
-	dataptr=msg+(sizeof(*request_packet));
-	memcpy(dataptr,data,reqcount);
-	dsi_setup_header(server,&request_packet->dsi_header,DSI_DSIWrite);
-	request_packet->dsi_header.return_code.data_offset=htonl(sizeof(*request_packet)-sizeof(struct dsi_header));
+	/* The data goes out straight from the caller's buffer */
+	dsi_setup_header(server,&request_packet.dsi_header,DSI_DSIWrite);
+	request_packet.dsi_header.return_code.data_offset=htonl(sizeof(request_packet)-sizeof(struct dsi_header));
 	/* For writing data, set the offset correctly */
-	request_packet->command=afpWriteExt;
-	request_packet->flag=0;  /* we'll always do this from the start */
-	request_packet->forkid=htons(forkid);
-	request_packet->offset=hton64(offset);
-	request_packet->reqcount=hton64(reqcount);
-	ret=dsi_send(server, (char *) request_packet,len,DSI_DEFAULT_TIMEOUT, 
+	request_packet.command=afpWriteExt;
+	request_packet.flag=0;  /* we'll always do this from the start */
+	request_packet.forkid=htons(forkid);
+	request_packet.offset=hton64(offset);
+	request_packet.reqcount=hton64(reqcount);
+	if (completion)
+		return dsi_send_async(server, (char *) &request_packet,
+			sizeof(request_packet),data,reqcount,
+			afpWriteExt,(void *) written,completion,context);
+	return dsi_send_data(server, (char *) &request_packet,
+		sizeof(request_packet),data,reqcount,DSI_DEFAULT_TIMEOUT, 
 		afpWriteExt,(void *) written);
+}
 
-	free(msg);
-	
-	return ret;
+int afp_writeext(struct afp_volume * volume, unsigned short forkid,
+	uint64_t offset, uint64_t reqcount, 
+	char * data,uint64_t * written)
+{
+	return writeext_send(volume,forkid,offset,reqcount,data,written,
+		NULL,NULL);
+}
+
+int afp_writeext_async(struct afp_volume * volume, unsigned short forkid,
+	uint64_t offset, uint64_t reqcount, 
+	char * data,uint64_t * written,
+	afp_completion completion, void * context)
+{
+	return writeext_send(volume,forkid,offset,reqcount,data,written,
+		completion,context);
 }
 
 
@@ -14,6 +14,7 @@
 #include "afpfs-ng/utils.h"
 #include "dsi_protocol.h"
 #include "afpfs-ng/afp_protocol.h"
+#include "afp_replies.h"
 
 int afp_setforkparms(struct afp_volume * volume,
 	unsigned short forkid, unsigned short bitmap, unsigned long len)
@@ -110,8 +111,10 @@ int afp_openfork_reply(struct afp_server *server, char * buf, unsigned int size,
 		uint16_t forkid;
 	}  __attribute__((__packed__)) * afp_openfork_reply_packet = (void *) buf;
 	struct afp_file_info * fp=x;
+	struct afp_file_info params;
 	/* For convenience... */
 	struct dsi_header * header = &afp_openfork_reply_packet->header;
+	unsigned short bitmap;
 
 	if ((header->return_code.error_code==kFPNoErr) || 
 	 	(header->return_code.error_code==kFPDenyConflict)) {
@@ -121,8 +124,25 @@ int afp_openfork_reply(struct afp_server *server, char * buf, unsigned int size,
 			return -1;
 		}
 		fp->forkid=ntohs(afp_openfork_reply_packet->forkid);
+
+		/* Only what the caller can use of the parameters asked for
+		 * is kept */
+		bitmap=ntohs(afp_openfork_reply_packet->bitmap);
+		if ((bitmap) && (size>sizeof(*afp_openfork_reply_packet))) {
+			parse_reply_block(server,
+				buf+sizeof(*afp_openfork_reply_packet),
+				size-sizeof(*afp_openfork_reply_packet),
+				0,bitmap,0,&params);
+			if (bitmap & kFPNodeIDBit)
+				fp->fileid=params.fileid;
+			if (bitmap & kFPModDateBit)
+				fp->modification_date=params.modification_date;
+			if (bitmap & (kFPDataForkLenBit|kFPExtDataForkLenBit))
+				fp->size=params.size;
+			if (bitmap & (kFPRsrcForkLenBit|kFPExtRsrcForkLenBit))
+				fp->resourcesize=params.resourcesize;
+		}
 	}
-	/* We end up ignoring the reply bitmap */
 
 
 	return 0;
@@ -132,6 +152,7 @@ int afp_openfork(struct afp_volume * volume,
 	unsigned char forktype,
 	unsigned int dirid, 
 	unsigned short accessmode,
+	unsigned short bitmap,
 	char * filename,
 	struct afp_file_info * fp)
 {
@@ -160,7 +181,7 @@ int afp_openfork(struct afp_volume * volume,
 	dsi_setup_header(server,&afp_openfork_request->dsi_header,DSI_DSICommand);
 	afp_openfork_request->command=afpOpenFork;
 	afp_openfork_request->forktype=forktype ? AFP_FORKTYPE_RESOURCE : AFP_FORKTYPE_DATA;
-	afp_openfork_request->bitmap=0;  
+	afp_openfork_request->bitmap=htons(bitmap);
 	afp_openfork_request->volid=htons(volume->volid);
 	afp_openfork_request->dirid=htonl(dirid);
 	afp_openfork_request->accessmode=htons(accessmode);
@@ -218,11 +239,12 @@ int afp_byterangelock_reply(struct afp_server *server, char * buf, unsigned int
 	return reply->header.return_code.error_code;
 }
 
-int afp_byterangelockext(struct afp_volume * volume,
+static int byterangelockext_send(struct afp_volume * volume,
 	unsigned char flag,
 	unsigned short forkid, 
 	uint64_t offset,
-	uint64_t len, uint64_t *generated_offset) 
+	uint64_t len, uint64_t *generated_offset,
+	afp_completion completion, void * context)
 {
 	struct {
 		struct dsi_header dsi_header __attribute__((__packed__));
@@ -240,12 +262,37 @@ int afp_byterangelockext(struct afp_volume * volume,
 	request.forkid=htons(forkid);
 	request.offset=hton64(offset);
 	request.len=hton64(len);
+	if (completion)
+		return dsi_send_async(volume->server, (char *) &request,
+			sizeof(request),NULL,0,afpByteRangeLockExt,
+			(void *) generated_offset,completion,context);
 	rc=dsi_send(volume->server, (char *) &request,
 		sizeof(request),DSI_DEFAULT_TIMEOUT,
 		afpByteRangeLockExt,(void *) generated_offset);
 	return rc;
 }
 
+int afp_byterangelockext(struct afp_volume * volume,
+	unsigned char flag,
+	unsigned short forkid, 
+	uint64_t offset,
+	uint64_t len, uint64_t *generated_offset) 
+{
+	return byterangelockext_send(volume,flag,forkid,offset,len,
+		generated_offset,NULL,NULL);
+}
+
+int afp_byterangelockext_async(struct afp_volume * volume,
+	unsigned char flag,
+	unsigned short forkid, 
+	uint64_t offset,
+	uint64_t len, uint64_t *generated_offset,
+	afp_completion completion, void * context)
+{
+	return byterangelockext_send(volume,flag,forkid,offset,len,
+		generated_offset,completion,context);
+}
+
 int afp_byterangelockext_reply(struct afp_server *server, char * buf, unsigned int size, void * x)
 {
 	struct {
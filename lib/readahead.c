@@ -0,0 +1,308 @@
+/*
+ *  readahead.c
+ *
+ *  Reading ahead of someone reading a fork from start to end.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/utils.h"
+#include "readahead.h"
+
+/*
+ * FUSE hands us reads of 128k at most, and ll_read() sends each one and
+ * waits for it, so someone copying a big file gets one read's worth of
+ * data per round trip however fast the link is.  Once a fork has been
+ * read from where the last read ended READAHEAD_TRIGGER times, we keep a
+ * window of quantum sized ReadExt requests going ahead of the reader,
+ * each into a buffer of its own, and the reads that follow are copied
+ * out of those.  A read anywhere else stops the window moving until the
+ * reads are sequential again; what was already read stays, in case the
+ * reader comes back to it.
+ *
+ * The buffers belong to the fork they were read through.  Writes through
+ * that fork throw away whatever they overlap.  Writes through another
+ * fork, or by someone else, aren't seen, just as they wouldn't be by the
+ * kernel's page cache.
+ */
+
+enum {
+	READAHEAD_FREE,
+	READAHEAD_READING,
+	READAHEAD_DONE,
+};
+
+struct readahead_slot {
+	struct afp_readahead * ra;
+	struct afp_rx_buffer rx;
+	uint64_t offset;
+	int state;
+	/* Written over while it was being read */
+	int stale;
+	int rc;
+};
+
+struct afp_readahead {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int window;
+	unsigned int quantum;
+	/* Slots with a request out */
+	unsigned int reading;
+	unsigned int sequential;
+	/* Where the last read ended */
+	uint64_t next;
+	/* Where the fork ends, as far as we know, or ~0 */
+	uint64_t end;
+	struct readahead_slot slots[];
+};
+
+int readahead_wanted(struct afp_volume * volume, struct afp_file_info * fp)
+{
+	/* We don't take byte range locks for reads we make up ourselves,
+	 * which is fine if no one else can be writing */
+	return ((volume->server->socket_effective.readahead>0) &&
+		(volume->server->using_version->av_number>=30) &&
+		((volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) ||
+		(fp->lease)));
+}
+
+static struct afp_readahead * readahead_get(struct afp_volume * volume,
+	struct afp_file_info * fp)
+{
+	struct afp_readahead * ra;
+	unsigned int i, window=volume->server->socket_effective.readahead;
+
+	if ((ra=fp->readahead))
+		return ra;
+	if ((ra=calloc(1,sizeof(*ra)+window*sizeof(ra->slots[0])))==NULL)
+		return NULL;
+	pthread_mutex_init(&ra->mutex,NULL);
+	pthread_cond_init(&ra->cond,NULL);
+	ra->window=window;
+	ra->quantum=volume->server->rx_quantum;
+	ra->end=~0ULL;
+	for (i=0;i<window;i++)
+		ra->slots[i].ra=ra;
+
+	/* Two reads on the same fork could both get here */
+	if (!__sync_bool_compare_and_swap(&fp->readahead,NULL,ra)) {
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->mutex);
+		free(ra);
+	}
+	return fp->readahead;
+}
+
+/* Returns the slot with the data at offset in it, or on its way */
+static struct readahead_slot * readahead_find(struct afp_readahead * ra,
+	uint64_t offset)
+{
+	struct readahead_slot * s;
+	unsigned int i;
+
+	for (i=0;i<ra->window;i++) {
+		s=&ra->slots[i];
+		if ((s->state==READAHEAD_FREE) || (s->stale) ||
+			(offset<s->offset))
+			continue;
+		if (offset<s->offset+((s->state==READAHEAD_READING) ?
+			s->rx.maxsize : s->rx.size))
+			return s;
+	}
+	return NULL;
+}
+
+/* This runs on the thread receiving for the session */
+static void readahead_done(void * context, int rc)
+{
+	struct readahead_slot * s = context;
+	struct afp_readahead * ra = s->ra;
+
+	pthread_mutex_lock(&ra->mutex);
+	s->rc=rc;
+	s->state=READAHEAD_DONE;
+	if (((rc==kFPNoErr) || (rc==kFPEOFErr)) &&
+		(s->rx.size<s->rx.maxsize) &&
+		(s->offset+s->rx.size<ra->end))
+		ra->end=s->offset+s->rx.size;
+	ra->reading--;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mutex);
+}
+
+/* Copies out whatever of the read we already have, or have asked for,
+ * from offset on.  Returns how much that was, and sets eof if it reached
+ * the end of the fork. */
+size_t readahead_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof)
+{
+	struct afp_readahead * ra = fp->readahead;
+	struct readahead_slot * s;
+	uint64_t o = offset;
+	size_t copied=0, len;
+
+	if (ra==NULL) return 0;
+
+	pthread_mutex_lock(&ra->mutex);
+	while (copied<size) {
+		/* With nothing to show for it, the server is asked again,
+		 * in case the fork has grown */
+		if (o>=ra->end) {
+			if (copied) *eof=1;
+			break;
+		}
+		if ((s=readahead_find(ra,o))==NULL)
+			break;
+		if (s->state==READAHEAD_READING) {
+			pthread_cond_wait(&ra->cond,&ra->mutex);
+			continue;
+		}
+		if ((s->rc!=kFPNoErr) && (s->rc!=kFPEOFErr)) {
+			/* Leave it to the caller to try again, and report */
+			s->state=READAHEAD_FREE;
+			break;
+		}
+		len=min(s->offset+s->rx.size-o,size-copied);
+		memcpy(buf+copied,s->rx.data+(o-s->offset),len);
+		copied+=len;
+		o+=len;
+	}
+	pthread_mutex_unlock(&ra->mutex);
+
+	__sync_fetch_and_add(&volume->server->stats.readahead_bytes,copied);
+	return copied;
+}
+
+/* Called after every read of the fork, with what was read.  If the reads
+ * are sequential, this fills the window ahead of the reader. */
+void readahead_advance(struct afp_volume * volume, struct afp_file_info * fp,
+	off_t offset, size_t size)
+{
+	struct afp_readahead * ra;
+	struct readahead_slot * s, * send[AFP_MAX_READAHEAD];
+	uint64_t limit, o;
+	unsigned int i, j, nsend=0;
+
+	if ((ra=readahead_get(volume,fp))==NULL)
+		return;
+
+	pthread_mutex_lock(&ra->mutex);
+	if ((uint64_t) offset==ra->next)
+		ra->sequential++;
+	else
+		ra->sequential=0;
+	ra->next=offset+size;
+	/* It has grown since */
+	if (ra->next>ra->end)
+		ra->end=~0ULL;
+	limit=ra->next+(uint64_t) ra->window*ra->quantum;
+
+	/* Whatever is behind the reader, or too far ahead, is done with */
+	for (i=0;i<ra->window;i++) {
+		s=&ra->slots[i];
+		if ((s->state==READAHEAD_DONE) && ((s->stale) ||
+			(s->offset+s->rx.size<=ra->next) ||
+			(s->offset>=limit)))
+			s->state=READAHEAD_FREE;
+	}
+
+	if (ra->sequential<READAHEAD_TRIGGER) {
+		pthread_mutex_unlock(&ra->mutex);
+		return;
+	}
+
+	/* Ask for whatever is missing from the window, in order */
+	o=ra->next;
+	for (i=0;(o<limit) && (o<ra->end);) {
+		if ((s=readahead_find(ra,o))) {
+			o=s->offset+((s->state==READAHEAD_READING) ?
+				s->rx.maxsize : s->rx.size);
+			if ((s->state==READAHEAD_DONE) &&
+				(s->rx.size<s->rx.maxsize))
+				break;
+			continue;
+		}
+		for (;i<ra->window;i++)
+			if (ra->slots[i].state==READAHEAD_FREE) break;
+		if (i==ra->window)
+			break;
+		s=&ra->slots[i];
+		if ((s->rx.data==NULL) &&
+			((s->rx.data=malloc(ra->quantum))==NULL))
+			break;
+		s->offset=o;
+		s->rx.maxsize=ra->quantum;
+		s->rx.size=0;
+		s->state=READAHEAD_READING;
+		s->stale=0;
+		s->rc=kFPNoErr;
+		ra->reading++;
+		send[nsend++]=s;
+		o+=ra->quantum;
+	}
+	pthread_mutex_unlock(&ra->mutex);
+
+	/* Sent without the lock, since the replies need it */
+	for (j=0;j<nsend;j++) {
+		s=send[j];
+		__sync_fetch_and_add(&volume->server->stats.readahead_requests,
+			1);
+		if (afp_readext_async(volume,fp->forkid,s->offset,
+			s->rx.maxsize,&s->rx,readahead_done,s))
+			readahead_done(s,-1);
+	}
+}
+
+/* Throws away anything a write through the fork goes over */
+void readahead_invalidate(struct afp_file_info * fp, off_t offset,
+	size_t size)
+{
+	struct afp_readahead * ra = fp->readahead;
+	struct readahead_slot * s;
+	uint64_t start=offset, stop=offset+size;
+	unsigned int i;
+
+	if (ra==NULL) return;
+
+	pthread_mutex_lock(&ra->mutex);
+	for (i=0;i<ra->window;i++) {
+		s=&ra->slots[i];
+		if ((s->state==READAHEAD_FREE) || (s->offset>=stop) ||
+			(s->offset+s->rx.maxsize<=start))
+			continue;
+		if (s->state==READAHEAD_DONE)
+			s->state=READAHEAD_FREE;
+		else
+			s->stale=1;
+	}
+	ra->end=~0ULL;
+	pthread_mutex_unlock(&ra->mutex);
+}
+
+/* Called as the fork is closed.  The buffers can't go until every
+ * request that reads into them is done. */
+void readahead_free(struct afp_file_info * fp)
+{
+	struct afp_readahead * ra = fp->readahead;
+	unsigned int i;
+
+	if (ra==NULL) return;
+
+	pthread_mutex_lock(&ra->mutex);
+	while (ra->reading>0)
+		pthread_cond_wait(&ra->cond,&ra->mutex);
+	pthread_mutex_unlock(&ra->mutex);
+
+	for (i=0;i<ra->window;i++)
+		free(ra->slots[i].rx.data);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->mutex);
+	free(ra);
+	fp->readahead=NULL;
+}
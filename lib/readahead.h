@@ -0,0 +1,19 @@
+#ifndef __READAHEAD_H_
+#define __READAHEAD_H_
+
+#include "afpfs-ng/afp.h"
+
+/* Reads in a row that start where the last one ended before we start
+ * reading ahead */
+#define READAHEAD_TRIGGER 2
+
+int readahead_wanted(struct afp_volume * volume, struct afp_file_info * fp);
+size_t readahead_read(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, int * eof);
+void readahead_advance(struct afp_volume * volume, struct afp_file_info * fp,
+	off_t offset, size_t size);
+void readahead_invalidate(struct afp_file_info * fp, off_t offset,
+	size_t size);
+void readahead_free(struct afp_file_info * fp);
+
+#endif
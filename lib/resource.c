@@ -187,6 +187,10 @@ int appledouble_close(struct afp_volume * volume, struct afp_file_info * fp)
 {
 	switch(fp->resource) {
 		case AFP_META_RESOURCE:
+			if (ll_wait_unlocks(fp)) {
+				afp_closefork(volume,fp->forkid);
+				return -EIO;
+			}
 			switch(afp_closefork(volume,fp->forkid)) {
 			case kFPNoErr:
 				break;
@@ -358,7 +362,7 @@ int appledouble_truncate(struct afp_volume * volume, const char * path, int offs
 
 			get_dirid(volume,newpath,basename,&dirid);
 
-			ret=afp_openfork(volume,1,dirid,O_WRONLY,
+			ret=afp_openfork(volume,1,dirid,O_WRONLY,0,
 				basename,&fp);
 
 			ret=ll_zero_file(volume,fp.forkid,0);
@@ -3,6 +3,8 @@
 #include "afpfs-ng/map_def.h"
 #include "afpfs-ng/dsi.h"
 #include "afpfs-ng/afp.h"
+#include "dsi_rtt.h"
+#include "afp_stats.h"
 
 int afp_status_header(char * text, int * len) 
 {
@@ -36,12 +38,48 @@ static void print_volume_status(struct afp_volume * v,
 	if (v->mounted==AFP_VOLUME_MOUNTED) {
 		pos+=snprintf(text+pos,*len-pos,
 		"        did cache stats: %llu miss, %llu hit, %llu expired, %llu force removal\n        uid/gid mapping: %s (%d/%d)\n",
-		v->did_cache_stats.misses, v->did_cache_stats.hits,
-		v->did_cache_stats.expired, 
-		v->did_cache_stats.force_removed,
+		(unsigned long long) v->did_cache_stats.misses,
+		(unsigned long long) v->did_cache_stats.hits,
+		(unsigned long long) v->did_cache_stats.expired,
+		(unsigned long long) v->did_cache_stats.force_removed,
 		get_mapping_name(v),
 		s->server_uid,s->server_gid);
 		pos+=snprintf(text+pos,*len-pos,
+		"        byte range locking: %s\n",
+		afp_locking_name(v->locking));
+		if (v->block_cache) {
+			uint64_t size, used;
+			unsigned int block_size;
+
+			afp_block_cache_usage(v->block_cache,&size,&used,
+				&block_size);
+			pos+=snprintf(text+pos,*len-pos,
+			"        block cache: %lluMB of %lluMB in %uK blocks, "
+			"%llu hit, %llu miss, %llu changed\n",
+			(unsigned long long) used>>20,
+			(unsigned long long) size>>20,block_size>>10,
+			(unsigned long long) v->block_cache_stats.hits,
+			(unsigned long long) v->block_cache_stats.misses,
+			(unsigned long long) v->block_cache_stats.invalidated);
+		}
+		if (v->disk_cache) {
+			uint64_t size, used;
+			unsigned int files;
+			const char * path;
+
+			afp_disk_cache_usage(v->disk_cache,&path,&size,&used,
+				&files);
+			pos+=snprintf(text+pos,*len-pos,
+			"        disk cache: %lluMB of %lluMB for %u forks in %s, "
+			"%llu hit, %llu miss, %llu changed, %llu evicted\n",
+			(unsigned long long) used>>20,
+			(unsigned long long) size>>20,files,path,
+			(unsigned long long) v->disk_cache_stats.hits,
+			(unsigned long long) v->disk_cache_stats.misses,
+			(unsigned long long) v->disk_cache_stats.invalidated,
+			(unsigned long long) v->disk_cache_stats.evicted);
+		}
+		pos+=snprintf(text+pos,*len-pos,
 		"        Unix permissions: %s",
 			(v->extra_flags&VOLUME_EXTRA_FLAGS_VOL_SUPPORTS_UNIX)?
 				"Yes":"No");
@@ -65,6 +103,48 @@ static void print_volume_status(struct afp_volume * v,
 	*pos_p=pos;
 }
 
+/* The counts for command on s, and on any stripe sessions it has */
+static int server_command_stats(struct afp_server * s, unsigned int command,
+	struct afp_command_stats * total)
+{
+	struct afp_command_stats part;
+	unsigned int i;
+
+	afp_stats_get(s->command_stats,command,total);
+	for (i=0;i<s->num_stripes;i++)
+		if ((s->stripes[i]) &&
+			(afp_stats_get(s->stripes[i]->command_stats,command,
+			&part)))
+			afp_stats_add(total,&part);
+	return total->count>0;
+}
+
+static void print_command_status(struct afp_server * s,
+	char * text, int * pos_p, int * len)
+{
+	struct afp_command_stats c;
+	unsigned int i;
+	int pos = *pos_p;
+
+	pos+=snprintf(text+pos,*len-pos,
+		"    commands:                       count   errors"
+		"    KB in   KB out  p50 ms  p99 ms  max ms\n");
+	for (i=0;(i<AFP_STATS_COMMANDS) && (pos<*len-128);i++) {
+		if (!server_command_stats(s,i,&c))
+			continue;
+		pos+=snprintf(text+pos,*len-pos,
+			"        %-24s %8llu %8llu %8llu %8llu %7.2f %7.2f %7.2f\n",
+			afp_get_command_name(i),(unsigned long long) c.count,
+			(unsigned long long) c.errors,
+			(unsigned long long) c.bytes_in/1024,
+			(unsigned long long) c.bytes_out/1024,
+			afp_stats_percentile(&c,500)/1000.0,
+			afp_stats_percentile(&c,990)/1000.0,
+			c.max_us/1000.0);
+	}
+	*pos_p=pos;
+}
+
 int afp_status_server(struct afp_server * s, char * text, int * len) 
 {
 	int j;
@@ -74,6 +154,7 @@ int afp_status_server(struct afp_server * s, char * text, int * len)
 	int firsttime=0;
 	struct dsi_request * request;
 	char ip_addr[64];
+	char keepalive[40];
 
 	memset(text,0,*len);
 
@@ -104,6 +185,14 @@ int afp_status_server(struct afp_server * s, char * text, int * len)
 			break;
 	}
 	ip_addr[63] = '\0';
+
+	if (s->socket_effective.keepalive_idle)
+		snprintf(keepalive,sizeof(keepalive),"%us/%us/%u",
+			s->socket_effective.keepalive_idle,
+			s->socket_effective.keepalive_interval,
+			s->socket_effective.keepalive_count);
+	else
+		snprintf(keepalive,sizeof(keepalive),"off");
 	
 	pos+=snprintf(text+pos,*len-pos,
 		"Server %s\n"
@@ -146,24 +235,90 @@ int afp_status_server(struct afp_server * s, char * text, int * len)
 		"\n"
 		"    signature: %s\n"
 		"    transmit delay: %ums\n"
+		"    round trip: %.2fms, deviation %.2fms, timeout %ums "
+		"(%llu samples)\n"
 		"    quantums: %u(tx) %u(rx)\n"
+		"    socket: nodelay %s, sndbuf %u, rcvbuf %u, keepalive %s, "
+		"busy poll %uus, bulk share %u%%\n"
+		"    read ahead: %u quantums, %llu requests, %llu bytes used\n"
 		"    last request id: %d in queue: %llu\n",
 	signature_string,
 	s->tx_delay,
+	s->rtt_srtt/1000.0, s->rtt_var/1000.0,
+	(s->stats.rtt_samples ? dsi_rtt_rto(s) : DSI_DEFAULT_TIMEOUT*1000),
+	(unsigned long long) s->stats.rtt_samples,
 	s->tx_quantum, s->rx_quantum,
-	s->lastrequestid,s->stats.requests_pending);
+	(s->socket_effective.nagle ? "off" : "on"),
+	s->socket_effective.sndbuf, s->socket_effective.rcvbuf,
+	keepalive, s->socket_effective.busy_poll,
+	s->socket_effective.bulk_share,
+	s->socket_effective.readahead,
+	(unsigned long long) s->stats.readahead_requests,
+	(unsigned long long) s->stats.readahead_bytes,
+	s->lastrequestid,(unsigned long long) s->stats.requests_pending);
 
-	for (request=s->command_requests;request;request=request->next) {
-		pos+=snprintf(text+pos,*len-pos,
-			"         request %d, %s\n",
-			request->requestid, afp_get_command_name(request->subcommand)); 
+	pthread_mutex_lock(&s->request_queue_mutex);
+	for (j=0;j<DSI_REQUEST_TABLE_SIZE;j++) {
+		for (request=s->request_table[j];
+			request && (pos<*len-64);request=request->next)
+			pos+=snprintf(text+pos,*len-pos,
+				"         request %d, %s\n",
+				request->requestid, 
+				afp_get_command_name(request->subcommand)); 
 	}
+	pthread_mutex_unlock(&s->request_queue_mutex);
 
 	pos+=snprintf(text+pos,*len-pos,
 		"    transfer: %llu(rx) %llu(tx)\n"
-		"    runt packets: %llu\n",
-	s->stats.rx_bytes,s->stats.tx_bytes,
-	s->stats.runt_packets);
+		"    runt packets: %llu\n"
+		"    request pool: %llu hits, %llu exhausted, %d preallocated\n"
+		"    receive: %s%s, %llu packets in %llu wakeups, %llu reads "
+		"(%.2f packets/wakeup, max %llu)\n"
+		"    send: %llu packets in %llu writes (%.2f packets/write)\n"
+		"    timeouts: %llu requests, %llu sent again, "
+		"%llu late replies thrown away\n"
+		"    events: %llu tickles and attentions, %llu tickles sent\n",
+	(unsigned long long) s->stats.rx_bytes,
+	(unsigned long long) s->stats.tx_bytes,
+	(unsigned long long) s->stats.runt_packets,
+	(unsigned long long) s->stats.request_pool_hits,
+	(unsigned long long) s->stats.request_pool_exhausted,
+	DSI_REQUEST_POOL_SIZE,
+	(s->rx_drain ? "drain" : "one read per wakeup"),
+	(s->rx_thread_running ? " in its own thread" : ""),
+	(unsigned long long) s->stats.rx_packets,
+	(unsigned long long) s->stats.rx_wakeups,
+	(unsigned long long) s->stats.rx_reads,
+	(s->stats.rx_wakeups ?
+		(double) s->stats.rx_packets/s->stats.rx_wakeups : 0.0),
+	(unsigned long long) s->stats.rx_max_packets_per_wakeup,
+	(unsigned long long) s->stats.tx_packets,
+	(unsigned long long) s->stats.tx_writes,
+	(s->stats.tx_writes ?
+		(double) s->stats.tx_packets/s->stats.tx_writes : 0.0),
+	(unsigned long long) s->stats.requests_timed_out,
+	(unsigned long long) s->stats.requests_retried,
+	(unsigned long long) s->stats.late_replies,
+	(unsigned long long) s->stats.events,
+	(unsigned long long) s->stats.tickles_sent);
+
+	for (j=0;j<s->num_stripes;j++) {
+		struct afp_server * stripe = s->stripes[j];
+
+		if (stripe==NULL) {
+			pos+=snprintf(text+pos,*len-pos,
+				"    stripe %d: (gone)\n",j+1);
+			continue;
+		}
+		pos+=snprintf(text+pos,*len-pos,
+			"    stripe %d: %llu(rx) %llu(tx)%s\n",j+1,
+			(unsigned long long) stripe->stats.rx_bytes,
+			(unsigned long long) stripe->stats.tx_bytes,
+			(stripe->connect_state==SERVER_STATE_DISCONNECTED ?
+			" (disconnected)" : ""));
+	}
+
+	print_command_status(s,text,&pos,len);
 
 	if (*len==0) goto out;
 
@@ -178,3 +333,63 @@ out:
 	return pos;
 
 }
+
+/* The same counts as the commands table of afp_status_server(), in a form
+ * that is easy to parse: a line for each command that has been sent, of
+ * tab separated key=value fields.  Latencies are in us.  buckets lists
+ * each histogram bucket that has anything in it, as the smallest latency
+ * that goes in it and how many replies did. */
+int afp_status_commands(struct afp_server * s, char * text, int * len)
+{
+	struct afp_command_stats c;
+	unsigned int i, b;
+	int pos=0, n;
+	char * sep;
+
+	memset(text,0,*len);
+	if (s==NULL) goto out;
+
+	for (i=0;i<AFP_STATS_COMMANDS;i++) {
+		if (!server_command_stats(s,i,&c))
+			continue;
+		n=snprintf(text+pos,*len-pos,
+			"server=%s\tcommand=%s\tcode=%u\tcount=%llu\t"
+			"errors=%llu\tbytes_in=%llu\tbytes_out=%llu\t"
+			"p50_us=%llu\tp90_us=%llu\tp99_us=%llu\tp999_us=%llu\t"
+			"max_us=%llu\tbuckets=",
+			s->server_name_printable,afp_get_command_name(i),i,
+			(unsigned long long) c.count,
+			(unsigned long long) c.errors,
+			(unsigned long long) c.bytes_in,
+			(unsigned long long) c.bytes_out,
+			(unsigned long long) afp_stats_percentile(&c,500),
+			(unsigned long long) afp_stats_percentile(&c,900),
+			(unsigned long long) afp_stats_percentile(&c,990),
+			(unsigned long long) afp_stats_percentile(&c,999),
+			(unsigned long long) c.max_us);
+		if (n>=*len-pos) goto full;
+		pos+=n;
+		sep="";
+		for (b=0;b<AFP_STATS_BUCKETS;b++) {
+			if (c.buckets[b]==0) continue;
+			n=snprintf(text+pos,*len-pos,"%s%llu:%llu",sep,
+				(unsigned long long) afp_stats_bucket_low(b),
+				(unsigned long long) c.buckets[b]);
+			if (n>=*len-pos) goto full;
+			pos+=n;
+			sep=",";
+		}
+		if (pos+1>=*len) goto full;
+		text[pos++]='\n';
+	}
+	goto out;
+
+full:
+	/* Don't leave half a line */
+	while ((pos>0) && (text[pos-1]!='\n'))
+		pos--;
+	text[pos]='\0';
+out:
+	*len-=pos;
+	return pos;
+}
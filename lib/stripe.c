@@ -0,0 +1,297 @@
+/*
+ *  stripe.c
+ *
+ *  Spreading big reads and writes over several sessions to one server.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "afpfs-ng/dsi.h"
+#include "afpfs-ng/utils.h"
+#include "afpfs-ng/libafpclient.h"
+#include "stripe.h"
+
+/*
+ * One DSI session is one TCP stream, with one congestion window, and a
+ * lot of servers handle the requests of a session one at a time.  So if
+ * a mount asks for stripes, we log in that many more times, and a read
+ * or write of several quantums sends its pieces round robin over all the
+ * sessions at once.
+ *
+ * Forks belong to the session that opened them.  The session token from
+ * afp_getsessiontoken() only lets a new session take over from an old
+ * one after a disconnect, it doesn't let two sessions share forks.  So
+ * each stripe session opens the volume and the fork for itself, the
+ * first time it is needed.  If a stripe session can't do its piece, the
+ * main session does it instead.
+ */
+
+struct stripe_transfer {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int outstanding;
+};
+
+struct stripe_piece {
+	struct stripe_transfer * transfer;
+	struct afp_rx_buffer rx;
+	uint64_t written;
+	unsigned int session;
+	int rc;
+};
+
+/* Opens the extra sessions the mount asked for, logged in the same way
+ * as the main one.  Returns how many there are. */
+int afp_server_open_stripes(void * priv, struct afp_server * server)
+{
+	struct afp_server * s;
+	unsigned int i;
+
+	for (i=0;i<server->socket_options.stripes;i++) {
+		if ((s=afp_server_init(server->address))==NULL)
+			break;
+		s->rx_threaded=server->rx_threaded;
+		s->max_quantum=server->max_quantum;
+		s->socket_options=server->socket_options;
+		s->socket_options.stripes=0;
+		/* So that nobody mounting finds it and uses it */
+		s->stripe_parent=server;
+
+		if (afp_server_connect(s,0)) {
+			log_for_client(priv,AFPFSD,LOG_WARNING,
+				"Could not open stripe session %u\n",i+1);
+			afp_free_server(&s);
+			break;
+		}
+		if (afp_server_complete_connection(priv,s,server->address,
+			server->versions,server->supported_uams,
+			server->username,server->password,
+			server->requested_version,server->using_uam)==NULL) {
+			log_for_client(priv,AFPFSD,LOG_WARNING,
+				"Could not log in stripe session %u\n",i+1);
+			break;
+		}
+		s->server_type=server->server_type;
+		memcpy(s->server_name_printable,server->server_name_printable,
+			AFP_SERVER_NAME_UTF8_LEN);
+		stripe_attach(server,s);
+	}
+	return server->num_stripes;
+}
+
+/* Makes an open session a stripe of server */
+int stripe_attach(struct afp_server * server, struct afp_server * stripe)
+{
+	if (server->num_stripes>=AFP_MAX_STRIPES)
+		return -1;
+	stripe->stripe_parent=server;
+	server->stripes[server->num_stripes++]=stripe;
+	return 0;
+}
+
+/* Called as a stripe session goes away.  Its slot stays, but empty. */
+void stripe_detach(struct afp_server * stripe)
+{
+	struct afp_server * server = stripe->stripe_parent;
+	unsigned int i;
+	int j;
+
+	if (server==NULL) return;
+	for (i=0;i<server->num_stripes;i++) {
+		if (server->stripes[i]!=stripe) continue;
+		server->stripes[i]=NULL;
+		for (j=0;j<server->num_volumes;j++)
+			server->volumes[j].stripe_volumes[i]=NULL;
+	}
+	stripe->stripe_parent=NULL;
+}
+
+/* Striping only pays for a transfer of more than one piece.  Byte range
+ * locks belong to the fork that took them, so a volume that uses them
+ * can't be striped.  Nor can the resource forks we show as files. */
+int stripe_wanted(struct afp_volume * volume, struct afp_file_info * fp,
+	size_t size, unsigned int quantum)
+{
+	return ((volume->server->num_stripes>0) &&
+		(volume->server->using_version->av_number>=30) &&
+		(volume->extra_flags & VOLUME_EXTRA_FLAGS_NO_LOCKING) &&
+		(fp->resource==0) && (size>quantum));
+}
+
+/* Both of these are called with stripe_mutex held */
+static struct afp_volume * stripe_volume(struct afp_volume * volume,
+	unsigned int i)
+{
+	struct afp_server * s = volume->server->stripes[i];
+	struct afp_volume * v;
+	char mesg[1024];
+	unsigned int l=0;
+
+	if (s==NULL) return NULL;
+	if ((v=volume->stripe_volumes[i]))
+		return v;
+	if ((v=find_volume_by_name(s,volume->volume_name_printable))==NULL)
+		return NULL;
+	if (v->mounted!=AFP_VOLUME_MOUNTED) {
+		memcpy(v->volpassword,volume->volpassword,AFP_VOLPASS_LEN);
+		if (afp_connect_volume(v,s,mesg,&l,sizeof(mesg))) {
+			log_for_client(NULL,AFPFSD,LOG_WARNING,
+				"Could not open %s on stripe session %u: %s",
+				volume->volume_name_printable,i+1,mesg);
+			return NULL;
+		}
+	}
+	v->extra_flags=volume->extra_flags;
+	volume->stripe_volumes[i]=v;
+	return v;
+}
+
+static unsigned short stripe_fork(struct afp_volume * v,
+	struct afp_file_info * fp, unsigned int i)
+{
+	struct afp_file_info stripe_fp;
+
+	if (fp->stripe_forkid[i])
+		return fp->stripe_forkid[i];
+	memset(&stripe_fp,0,sizeof(stripe_fp));
+	if (afp_openfork(v,fp->resource ? 1 : 0,fp->did,fp->accessmode,0,
+		fp->basename,&stripe_fp)!=kFPNoErr)
+		return 0;
+	fp->stripe_forkid[i]=stripe_fp.forkid;
+	return stripe_fp.forkid;
+}
+
+void stripe_close_forks(struct afp_volume * volume,
+	struct afp_file_info * fp)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&volume->stripe_mutex);
+	for (i=0;i<AFP_MAX_STRIPES;i++) {
+		if ((fp->stripe_forkid[i]) && (volume->stripe_volumes[i]))
+			afp_closefork(volume->stripe_volumes[i],
+				fp->stripe_forkid[i]);
+		fp->stripe_forkid[i]=0;
+	}
+	pthread_mutex_unlock(&volume->stripe_mutex);
+}
+
+/* This runs on the thread receiving for the session, so it only counts */
+static void stripe_piece_done(void * context, int rc)
+{
+	struct stripe_piece * p = context;
+	struct stripe_transfer * t = p->transfer;
+
+	pthread_mutex_lock(&t->mutex);
+	p->rc=rc;
+	if (--t->outstanding==0)
+		pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static int stripe_piece_send(struct afp_volume * volume,
+	unsigned short forkid, struct stripe_piece * p, uint64_t offset,
+	int writing)
+{
+	if (writing)
+		return afp_writeext_async(volume,forkid,offset,p->rx.maxsize,
+			p->rx.data,&p->written,stripe_piece_done,p);
+	return afp_readext_async(volume,forkid,offset,p->rx.maxsize,&p->rx,
+		stripe_piece_done,p);
+}
+
+/* Reads or writes size bytes at offset, in pieces of quantum bytes that
+ * all go out at once over the main session and the stripes.  Returns the
+ * AFP result of the first piece that didn't get done in full, and in done
+ * how many bytes were transferred before it. */
+int stripe_transfer(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, unsigned int quantum,
+	int writing, size_t * done)
+{
+	struct afp_volume * volumes[AFP_MAX_STRIPES+1], * v;
+	unsigned short forks[AFP_MAX_STRIPES+1];
+	unsigned int sessions=1, npieces, i;
+	struct stripe_piece * pieces, * p;
+	struct stripe_transfer t;
+	int rc=kFPNoErr;
+
+	*done=0;
+	volumes[0]=volume;
+	forks[0]=fp->forkid;
+	pthread_mutex_lock(&volume->stripe_mutex);
+	for (i=0;i<volume->server->num_stripes;i++) {
+		if (((v=stripe_volume(volume,i))==NULL) ||
+			(stripe_fork(v,fp,i)==0))
+			continue;
+		volumes[sessions]=v;
+		forks[sessions]=fp->stripe_forkid[i];
+		sessions++;
+	}
+	pthread_mutex_unlock(&volume->stripe_mutex);
+
+	npieces=(size+quantum-1)/quantum;
+	if ((pieces=calloc(npieces,sizeof(*pieces)))==NULL)
+		return -1;
+	pthread_mutex_init(&t.mutex,NULL);
+	pthread_cond_init(&t.cond,NULL);
+	t.outstanding=npieces;
+
+	for (i=0;i<npieces;i++) {
+		p=&pieces[i];
+		p->transfer=&t;
+		p->session=i%sessions;
+		p->rx.data=buf+(size_t) i*quantum;
+		p->rx.maxsize=min(quantum,size-(size_t) i*quantum);
+		if (stripe_piece_send(volumes[p->session],forks[p->session],p,
+			offset+(uint64_t) i*quantum,writing))
+			stripe_piece_done(p,-1);
+	}
+
+	pthread_mutex_lock(&t.mutex);
+	while (t.outstanding>0)
+		pthread_cond_wait(&t.cond,&t.mutex);
+	pthread_mutex_unlock(&t.mutex);
+	pthread_cond_destroy(&t.cond);
+	pthread_mutex_destroy(&t.mutex);
+
+	/* Whatever a stripe session couldn't do, the main one tries */
+	for (i=0;i<npieces;i++) {
+		p=&pieces[i];
+		if ((p->session==0) || (p->rc==kFPNoErr) ||
+			(p->rc==kFPEOFErr))
+			continue;
+		p->rx.size=0;
+		if (writing)
+			p->rc=afp_writeext(volume,fp->forkid,
+				offset+(uint64_t) i*quantum,p->rx.maxsize,
+				p->rx.data,&p->written);
+		else
+			p->rc=afp_readext(volume,fp->forkid,
+				offset+(uint64_t) i*quantum,p->rx.maxsize,
+				&p->rx);
+	}
+
+	for (i=0;i<npieces;i++) {
+		p=&pieces[i];
+		if (writing) {
+			if (p->rc!=kFPNoErr) {
+				rc=p->rc;
+				break;
+			}
+			*done+=p->rx.maxsize;
+			continue;
+		}
+		*done+=p->rx.size;
+		if ((p->rc!=kFPNoErr) || (p->rx.size<p->rx.maxsize)) {
+			rc=p->rc;
+			break;
+		}
+	}
+	free(pieces);
+	return rc;
+}
@@ -0,0 +1,18 @@
+#ifndef __STRIPE_H_
+#define __STRIPE_H_
+
+#include "afpfs-ng/afp.h"
+
+int afp_server_open_stripes(void * priv, struct afp_server * server);
+int stripe_attach(struct afp_server * server, struct afp_server * stripe);
+void stripe_detach(struct afp_server * stripe);
+
+int stripe_wanted(struct afp_volume * volume, struct afp_file_info * fp,
+	size_t size, unsigned int quantum);
+int stripe_transfer(struct afp_volume * volume, struct afp_file_info * fp,
+	char * buf, size_t size, off_t offset, unsigned int quantum,
+	int writing, size_t * done);
+void stripe_close_forks(struct afp_volume * volume,
+	struct afp_file_info * fp);
+
+#endif
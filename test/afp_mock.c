@@ -0,0 +1,89 @@
+/*
+ *  afp_mock.c
+ *
+ *  Serves a directory over AFP on the loopback interface, with the mock
+ *  server in mock_server.c, for testing mount_afp and friends against.
+ *
+ *  Usage: afp_mock [-p port] [-v volume] [-u user:password]
+ *                  [-l latency_us] [-b KB/s] [-q quantum] directory
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "mock_server.h"
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: afp_mock [-p port] [-v volume] [-u user:password]\n"
+		"                [-l latency_us] [-b KB/s] [-q quantum] "
+		"directory\n");
+	exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+	struct mock_server_options options;
+	struct mock_server * s;
+	sigset_t signals;
+	char * colon;
+	int c, sig;
+
+	memset(&options,0,sizeof(options));
+	options.port=548;
+
+	while ((c=getopt(argc,argv,"p:v:u:l:b:q:"))!=-1) {
+		switch (c) {
+		case 'p':
+			options.port=atoi(optarg);
+			break;
+		case 'v':
+			options.volume_name=optarg;
+			break;
+		case 'u':
+			options.username=optarg;
+			if ((colon=strchr(optarg,':'))) {
+				*colon='\0';
+				options.password=colon+1;
+			}
+			break;
+		case 'l':
+			options.latency_us=atoi(optarg);
+			break;
+		case 'b':
+			options.bandwidth=strtoull(optarg,NULL,10)*1024;
+			break;
+		case 'q':
+			options.quantum=atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind!=argc-1)
+		usage();
+	options.root=argv[optind];
+
+	/* Wait for a signal to stop, rather than have it kill us */
+	sigemptyset(&signals);
+	sigaddset(&signals,SIGINT);
+	sigaddset(&signals,SIGTERM);
+	pthread_sigmask(SIG_BLOCK,&signals,NULL);
+
+	if ((s=mock_server_start(&options))==NULL) {
+		perror("Could not start the server");
+		return 1;
+	}
+	printf("Serving %s on 127.0.0.1:%u\n",options.root,
+		mock_server_port(s));
+	fflush(stdout);
+
+	sigwait(&signals,&sig);
+	mock_server_stop(s);
+	return 0;
+}
@@ -0,0 +1,2630 @@
+/*
+ *  dsi_bench.c
+ *
+ *  Micro-benchmarks for the DSI layer.  These don't need a real AFP
+ *  server; everything runs against sockets on the loopback interface.
+ *
+ *  Usage: dsi_bench [dispatch|write|replies|isolation|async|
+ *                   coalesce|timeout|quantum|socket|priority|stripe|
+ *                   rtt|stress|events|cmdstats|capture|mock|
+ *                   readahead|cache|diskcache|locking]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/dsi.h"
+#include "afpfs-ng/utils.h"
+#include "afpfs-ng/libafpclient.h"
+#include "afpfs-ng/midlevel.h"
+#include "afpfs-ng/map_def.h"
+#include "dsi_protocol.h"
+#include "lowlevel.h"
+#include "stripe.h"
+#include "dsi_rtt.h"
+#include "afp_stats.h"
+#include "readahead.h"
+#include "mock_server.h"
+
+#define DISPATCH_ITERATIONS 1000000
+#define WRITE_TOTAL (256*1024*1024)
+#define REPLY_ITERATIONS 200000
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((unsigned long long) ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+}
+
+/* Opens a listening socket on an ephemeral loopback port, and returns the
+ * port number through port_p */
+/* If set, connections to the responder get a receive buffer this small */
+static int responder_rcvbuf;
+
+static int listen_loopback(unsigned int * port_p)
+{
+	struct sockaddr_in sa;
+	socklen_t len=sizeof(sa);
+	int fd;
+
+	if ((fd=socket(AF_INET,SOCK_STREAM,0))<0) return -1;
+	if (responder_rcvbuf)
+		setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&responder_rcvbuf,
+			sizeof(responder_rcvbuf));
+	memset(&sa,0,sizeof(sa));
+	sa.sin_family=AF_INET;
+	sa.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	if ((bind(fd,(struct sockaddr *) &sa,sizeof(sa))<0) ||
+		(listen(fd,16)<0) ||
+		(getsockname(fd,(struct sockaddr *) &sa,&len)<0)) {
+		close(fd);
+		return -1;
+	}
+	*port_p=ntohs(sa.sin_port);
+	return fd;
+}
+
+/*
+ * The responder is the smallest thing that looks like a DSI server from
+ * the client's side: it answers every DSICommand and DSIWrite with a
+ * successful reply carrying the same request id.  ReadExt gets as many
+ * bytes as were asked for, writes are acknowledged in full, and everything
+ * else gets an empty reply.  Each connection is served by one thread, in
+ * order, like a server that handles a session serially.
+ */
+
+static int read_all(int fd, void * buf, size_t len)
+{
+	ssize_t ret;
+	char * p = buf;
+
+	while (len>0) {
+		if ((ret=read(fd,p,len))<=0) {
+			if ((ret<0) && (errno==EINTR)) continue;
+			return -1;
+		}
+		p+=ret;
+		len-=ret;
+	}
+	return 0;
+}
+
+static int writev_all(int fd, struct iovec * iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg,0,sizeof(msg));
+	while (iovcnt>0) {
+		msg.msg_iov=iov;
+		msg.msg_iovlen=iovcnt;
+		if ((ret=sendmsg(fd,&msg,MSG_NOSIGNAL))<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		while ((iovcnt>0) && (ret>=(ssize_t) iov->iov_len)) {
+			ret-=iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt>0) {
+			iov->iov_base=(char *) iov->iov_base+ret;
+			iov->iov_len-=ret;
+		}
+	}
+	return 0;
+}
+
+static char zeroes[1024*1024];
+
+/* If set, the responder holds back each reply for this long */
+static volatile unsigned int responder_delay_ms;
+
+/* The responder doesn't answer this many of the requests to come */
+static volatile unsigned int responder_drop;
+
+/* If set, the responder fills each afpReadExt reply of up to 1MB with the
+ * offset that was asked for, over and over, instead of zeroes */
+static volatile int responder_echo;
+
+/* Before its next reply, the responder sends this many tickles, each with
+ * an attention behind it, and it counts the tickles it gets */
+static volatile unsigned int responder_burst;
+static volatile unsigned int responder_tickles;
+
+/* If set, the responder answers the next tickle with a CloseSession */
+static volatile int responder_close;
+
+/* If set, the responder sends half of the next afpReadExt reply's data
+ * and holds the rest back until it is cleared */
+static volatile int responder_stall;
+
+static int responder_send_burst(int fd, unsigned int count)
+{
+	struct {
+		struct dsi_header header;
+		uint16_t flags;
+	} __attribute__((__packed__)) attention;
+	struct dsi_header tickle;
+	struct iovec iov[2];
+	unsigned int i;
+
+	for (i=0;i<count;i++) {
+		memset(&tickle,0,sizeof(tickle));
+		tickle.command=DSI_DSITickle;
+		memset(&attention,0,sizeof(attention));
+		attention.header.command=DSI_DSIAttention;
+		attention.header.length=htonl(sizeof(attention.flags));
+		/* Every so often, one that has us fetch the message */
+		attention.flags=htons((i%4==0) ? AFPATTN_MESG :
+			AFPATTN_VOLCHANGED);
+		iov[0].iov_base=&tickle;
+		iov[0].iov_len=sizeof(tickle);
+		iov[1].iov_base=&attention;
+		iov[1].iov_len=sizeof(attention);
+		if (writev_all(fd,iov,2)) return -1;
+	}
+	return 0;
+}
+
+static void * responder_connection(void * other)
+{
+	int fd = (long) other;
+	struct dsi_header header;
+	char * payload=NULL;
+	unsigned int payload_max=0, len, i;
+	uint64_t reply_len, written;
+	struct iovec iov[2];
+	char * fill;
+	int iovcnt, ret, stall;
+
+	while (read_all(fd,&header,sizeof(header))==0) {
+		len=ntohl(header.length);
+		if (len>payload_max) {
+			payload_max=len;
+			payload=realloc(payload,payload_max);
+		}
+		if (read_all(fd,payload,len)) break;
+
+		if (header.command==DSI_DSITickle)
+			__sync_fetch_and_add(&responder_tickles,1);
+		if ((header.command==DSI_DSITickle) &&
+			(__sync_lock_test_and_set(&responder_close,0))) {
+			header.command=DSI_DSICloseSession;
+			header.length=0;
+			iov[0].iov_base=&header;
+			iov[0].iov_len=sizeof(header);
+			if (writev_all(fd,iov,1)) break;
+		}
+		if ((header.command!=DSI_DSICommand) &&
+			(header.command!=DSI_DSIWrite))
+			continue;
+
+		reply_len=0;
+		iovcnt=1;
+		fill=zeroes;
+		stall=0;
+		if ((header.command==DSI_DSIWrite) && (len>=20)) {
+			memcpy(&written,payload+12,sizeof(written));
+			reply_len=sizeof(written);
+			iov[1].iov_base=&written;
+			iov[1].iov_len=sizeof(written);
+			iovcnt++;
+		} else if ((len>=20) && (payload[0]==afpReadExt)) {
+			memcpy(&reply_len,payload+12,sizeof(reply_len));
+			reply_len=ntoh64(reply_len);
+			stall=__sync_bool_compare_and_swap(&responder_stall,
+				1,2);
+			if ((responder_echo) && (reply_len<=sizeof(zeroes))) {
+				fill=malloc(reply_len+sizeof(uint64_t));
+				for (i=0;i<reply_len;i+=sizeof(uint64_t))
+					memcpy(fill+i,payload+4,
+						sizeof(uint64_t));
+			}
+		} else if ((len>=1) && (payload[0]==afpGetSrvrMsg)) {
+			/* No message: type, bitmap and an empty string */
+			reply_len=5;
+		}
+
+		if (responder_drop) {
+			responder_drop--;
+			continue;
+		}
+		if ((responder_burst) && (header.command==DSI_DSICommand) &&
+			(responder_send_burst(fd,
+			__sync_lock_test_and_set(&responder_burst,0))))
+			break;
+		if (responder_delay_ms)
+			usleep(responder_delay_ms*1000);
+		header.flags=DSI_REPLY;
+		header.return_code.error_code=0;
+		header.length=htonl(reply_len);
+		header.reserved=0;
+		iov[0].iov_base=&header;
+		iov[0].iov_len=sizeof(header);
+		if ((header.command==DSI_DSICommand) && (reply_len>0)) {
+			/* Send the first of the data with the header, so that
+			 * Nagle doesn't hold it back */
+			iov[1].iov_base=fill;
+			iov[1].iov_len=min(reply_len,sizeof(zeroes));
+			if (stall) iov[1].iov_len/=2;
+			reply_len-=iov[1].iov_len;
+			iovcnt++;
+		}
+		ret=writev_all(fd,iov,iovcnt);
+		if (fill!=zeroes) free(fill);
+		if (ret) break;
+		while ((stall) && (responder_stall))
+			usleep(1000);
+
+		while ((header.command==DSI_DSICommand) && (reply_len>0)) {
+			iov[0].iov_base=zeroes;
+			iov[0].iov_len=min(reply_len,sizeof(zeroes));
+			reply_len-=iov[0].iov_len;
+			if (writev_all(fd,iov,1)) goto out;
+		}
+	}
+out:
+	free(payload);
+	close(fd);
+	return NULL;
+}
+
+/* Each server only connects the once, so the listener goes as soon as it
+ * has, and the thread with the connection, so nothing is left behind */
+static void * responder_accept(void * other)
+{
+	int listen_fd = (long) other;
+	int fd, one=1;
+
+	fd=accept(listen_fd,NULL,NULL);
+	close(listen_fd);
+	if (fd<0) return NULL;
+	/* Like a real server, so that pipelined replies aren't held back
+	 * waiting for an ACK */
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+	return responder_connection((void *) (long) fd);
+}
+
+/* Creates a server that is registered with the library and connected to
+ * a loopback listener.  If respond is set, the listener answers DSI
+ * requests, otherwise it stays silent.  If threaded is set, the server
+ * gets its own receive thread.  The socket is set up with options, if
+ * there are any. */
+static struct afp_server * bench_server_options(int respond, int threaded,
+	struct afp_socket_options * options)
+{
+	struct afp_server * s;
+	unsigned int port;
+	int listen_fd;
+	pthread_t thread;
+
+	if ((listen_fd=listen_loopback(&port))<0) return NULL;
+	if (respond) {
+		pthread_create(&thread,NULL,responder_accept,
+			(void *) (long) listen_fd);
+		pthread_detach(thread);
+	}
+	if ((s=afp_server_init(afp_get_address(NULL,"127.0.0.1",port)))==NULL)
+		return NULL;
+	s->rx_threaded=threaded;
+	if (options) s->socket_options=*options;
+	if (afp_server_connect(s,0)) return NULL;
+	return s;
+}
+
+static struct afp_server * bench_server_threaded(int respond, int threaded)
+{
+	return bench_server_options(respond,threaded,NULL);
+}
+
+static struct afp_server * bench_server(int respond)
+{
+	return bench_server_threaded(respond,0);
+}
+
+static struct dsi_request * new_request(struct afp_server * s,
+	unsigned short id)
+{
+	struct dsi_request * r = dsi_get_request(s);
+
+	r->requestid=id;
+	r->subcommand=afpGetFileDirParms;
+	return r;
+}
+
+/* Keeps 'inflight' requests outstanding, and then measures what it costs
+ * to dispatch the oldest reply: find it, retire it and issue a new one. */
+static void bench_dispatch(struct afp_server * s, unsigned int inflight)
+{
+	unsigned short oldest=0, next=0;
+	struct dsi_request * r;
+	unsigned long long start, end;
+	unsigned int i, misses=0;
+
+	for (i=0;i<inflight;i++)
+		dsi_add_to_request_queue(s,new_request(s,next++));
+
+	start=now_ns();
+	for (i=0;i<DISPATCH_ITERATIONS;i++) {
+		if ((r=dsi_find_request(s,oldest++))==NULL) {
+			misses++;
+			continue;
+		}
+		dsi_remove_from_request_queue(s,r);
+		dsi_add_to_request_queue(s,new_request(s,next++));
+	}
+	end=now_ns();
+
+	for (i=0;i<inflight;i++)
+		if ((r=dsi_find_request(s,oldest++)))
+			dsi_remove_from_request_queue(s,r);
+
+	printf("%8u %14.1f %8u\n",inflight,
+		(double) (end-start)/DISPATCH_ITERATIONS, misses);
+}
+
+static void run_dispatch(void)
+{
+	struct afp_server * s;
+	unsigned int inflight;
+
+	if ((s=bench_server(0))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+
+	printf("Reply dispatch cost by requests in flight\n");
+	printf("%8s %14s %8s\n","inflight","ns/dispatch","misses");
+	for (inflight=1;inflight<=1024;inflight<<=1)
+		bench_dispatch(s,inflight);
+}
+
+/* This is how afp_writeext() used to build its packets: copy the header
+ * and the data into one freshly allocated buffer. */
+static int copying_writeext(struct afp_volume * volume, unsigned short forkid,
+	uint64_t offset, uint64_t reqcount, char * data, uint64_t * written)
+{
+	struct {
+		struct dsi_header dsi_header __attribute__((__packed__));
+		uint8_t command;
+		uint8_t flag;
+		uint16_t forkid;
+		uint64_t offset;
+		uint64_t reqcount;
+	}  __attribute__((__packed__)) * request_packet;
+	struct afp_server * server = volume->server;
+	unsigned int len = sizeof(*request_packet)+reqcount;
+	char * msg;
+	int ret;
+
+	if ((msg = malloc(len))==NULL)
+		return -1;
+	request_packet =(void *) msg;
+	memcpy(msg+sizeof(*request_packet),data,reqcount);
+	dsi_setup_header(server,&request_packet->dsi_header,DSI_DSIWrite);
+	request_packet->dsi_header.return_code.data_offset=htonl(sizeof(*request_packet)-sizeof(struct dsi_header));
+	request_packet->command=afpWriteExt;
+	request_packet->flag=0;
+	request_packet->forkid=htons(forkid);
+	request_packet->offset=hton64(offset);
+	request_packet->reqcount=hton64(reqcount);
+	ret=dsi_send(server, (char *) request_packet,len,DSI_DEFAULT_TIMEOUT,
+		afpWriteExt,(void *) written);
+	free(msg);
+	return ret;
+}
+
+static double bench_write_one(struct afp_volume * volume, char * data,
+	unsigned int chunk, int copying)
+{
+	unsigned long long start, end;
+	uint64_t offset, written;
+
+	start=now_ns();
+	for (offset=0;offset<WRITE_TOTAL;offset+=chunk) {
+		if (copying)
+			copying_writeext(volume,1,offset,chunk,data,&written);
+		else
+			afp_writeext(volume,1,offset,chunk,data,&written);
+	}
+	end=now_ns();
+	return ((double) WRITE_TOTAL/(1024*1024)) /
+		((double) (end-start)/1000000000.0);
+}
+
+static void run_write(void)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	unsigned int chunk;
+	char * data;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	data=malloc(8*1024*1024);
+	memset(data,0x5a,8*1024*1024);
+
+	printf("afp_writeext throughput to a loopback responder, MB/s\n");
+	printf("%8s %12s %12s\n","chunk","copy+write","writev");
+	for (chunk=64*1024;chunk<=8*1024*1024;chunk<<=1)
+		printf("%7uK %12.0f %12.0f\n",chunk/1024,
+			bench_write_one(&volume,data,chunk,1),
+			bench_write_one(&volume,data,chunk,0));
+	free(data);
+}
+
+/* Small replies one after the other, like a stat storm seen from one
+ * thread, and then afpReadExt replies.  Each is run with the server
+ * reading one packet per wakeup and with it draining the socket. */
+static void bench_replies_one(struct afp_server * s,
+	struct afp_volume * volume, int drain, unsigned int readsize)
+{
+	unsigned long long start, end;
+	unsigned int i, iterations, errors=0;
+	struct afp_rx_buffer rx;
+
+	iterations=readsize ? (REPLY_ITERATIONS/10) : REPLY_ITERATIONS;
+	rx.data=malloc(readsize+1);
+	rx.maxsize=readsize;
+
+	s->rx_drain=drain;
+	memset(&s->stats,0,sizeof(s->stats));
+	start=now_ns();
+	for (i=0;i<iterations;i++) {
+		if (readsize) {
+			rx.size=0;
+			if ((afp_readext(volume,1,0,readsize,&rx)) ||
+				(rx.size!=readsize))
+				errors++;
+		} else if (afp_flushfork(volume,1))
+			errors++;
+	}
+	end=now_ns();
+	free(rx.data);
+
+	printf("%8u %8s %10.0f %12.2f %12.2f %8u\n",readsize,
+		drain ? "drain" : "one",(double) (end-start)/iterations,
+		(double) s->stats.rx_reads/iterations,
+		s->stats.rx_wakeups ?
+		(double) s->stats.rx_packets/s->stats.rx_wakeups : 0.0,
+		errors);
+}
+
+static void run_replies(void)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	unsigned int readsize;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+
+	printf("Reply round trips to a loopback responder "
+		"(size 0 is afpFlushFork, others are afpReadExt)\n");
+	printf("%8s %8s %10s %12s %12s %8s\n","size","receive","ns/reply",
+		"reads/reply","pkts/wakeup","errors");
+	for (readsize=0;readsize<=1024*1024;
+		readsize=(readsize ? readsize*16 : 4096)) {
+		bench_replies_one(s,&volume,0,readsize);
+		bench_replies_one(s,&volume,1,readsize);
+	}
+}
+
+/* One server streams 1MB afpReadExt replies as fast as it can, while
+ * another answers small requests.  The latency of the small ones shows
+ * whether the stream holds them up. */
+
+#define STAT_ITERATIONS 20000
+#define STREAM_READ_SIZE (1024*1024)
+
+static volatile int stream_stop;
+
+static void * stream_thread(void * other)
+{
+	struct afp_volume * volume = other;
+	struct afp_rx_buffer rx;
+
+	rx.data=malloc(STREAM_READ_SIZE);
+	rx.maxsize=STREAM_READ_SIZE;
+	while (!stream_stop) {
+		rx.size=0;
+		afp_readext(volume,1,0,STREAM_READ_SIZE,&rx);
+	}
+	free(rx.data);
+	return NULL;
+}
+
+static int compare_ull(const void * a, const void * b)
+{
+	const unsigned long long * x = a, * y = b;
+	return (*x>*y) - (*x<*y);
+}
+
+static void bench_isolation_one(int threaded, int streaming)
+{
+	struct afp_server * stat_server, * stream_server;
+	struct afp_volume stat_volume, stream_volume;
+	unsigned long long * latencies, start;
+	pthread_t thread;
+	uint64_t streamed;
+	unsigned int i;
+
+	if (((stat_server=bench_server_threaded(1,threaded))==NULL) ||
+		((stream_server=bench_server_threaded(1,threaded))==NULL)) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&stat_volume,0,sizeof(stat_volume));
+	stat_volume.server=stat_server;
+	memset(&stream_volume,0,sizeof(stream_volume));
+	stream_volume.server=stream_server;
+	latencies=malloc(STAT_ITERATIONS*sizeof(*latencies));
+
+	stream_stop=0;
+	if (streaming)
+		pthread_create(&thread,NULL,stream_thread,&stream_volume);
+
+	start=now_ns();
+	for (i=0;i<STAT_ITERATIONS;i++) {
+		latencies[i]=now_ns();
+		afp_flushfork(&stat_volume,1);
+		latencies[i]=now_ns()-latencies[i];
+	}
+	streamed=stream_server->stats.rx_bytes;
+	start=now_ns()-start;
+
+	if (streaming) {
+		stream_stop=1;
+		pthread_join(thread,NULL);
+	}
+
+	qsort(latencies,STAT_ITERATIONS,sizeof(*latencies),compare_ull);
+	printf("%10s %8s %10.1f %10.1f %10.1f %12.0f\n",
+		threaded ? "threads" : "main loop",
+		streaming ? "yes" : "no",
+		latencies[STAT_ITERATIONS/2]/1000.0,
+		latencies[STAT_ITERATIONS*99/100]/1000.0,
+		latencies[STAT_ITERATIONS-1]/1000.0,
+		((double) streamed/(1024*1024))/((double) start/1000000000.0));
+	free(latencies);
+	afp_server_remove(stat_server);
+	afp_server_remove(stream_server);
+}
+
+static void run_isolation(void)
+{
+	printf("Small request latency on one server while another streams, us\n");
+	printf("%10s %8s %10s %10s %10s %12s\n","receive","stream",
+		"p50","p99","max","stream MB/s");
+	bench_isolation_one(0,0);
+	bench_isolation_one(0,1);
+	bench_isolation_one(1,0);
+	bench_isolation_one(1,1);
+}
+
+/* afpReadExt of the same size from one thread, first waiting for each
+ * reply and then keeping several outstanding with afp_readext_async(). */
+
+#define ASYNC_READ_SIZE (64*1024)
+#define ASYNC_ITERATIONS 20000
+#define ASYNC_MAX_DEPTH 16
+
+struct async_slot {
+	struct afp_rx_buffer rx;
+	unsigned int errors;
+};
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int async_outstanding;
+static unsigned int async_errors;
+
+static void async_done(void * context, int rc)
+{
+	struct async_slot * slot = context;
+
+	pthread_mutex_lock(&async_mutex);
+	if ((rc) || (slot->rx.size!=ASYNC_READ_SIZE))
+		async_errors++;
+	async_outstanding--;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+static void bench_async_one(struct afp_volume * volume, unsigned int depth)
+{
+	struct async_slot slots[ASYNC_MAX_DEPTH];
+	unsigned long long start, end;
+	unsigned int i, errors=0;
+
+	for (i=0;i<ASYNC_MAX_DEPTH;i++) {
+		slots[i].rx.data=malloc(ASYNC_READ_SIZE);
+		slots[i].rx.maxsize=ASYNC_READ_SIZE;
+	}
+	async_outstanding=0;
+	async_errors=0;
+
+	start=now_ns();
+	for (i=0;i<ASYNC_ITERATIONS;i++) {
+		struct async_slot * slot = &slots[i%ASYNC_MAX_DEPTH];
+
+		if (depth==0) {
+			slot->rx.size=0;
+			if ((afp_readext(volume,1,0,ASYNC_READ_SIZE,&slot->rx)) ||
+				(slot->rx.size!=ASYNC_READ_SIZE))
+				errors++;
+			continue;
+		}
+		/* Slots are reused in order, so once fewer than depth are
+		 * outstanding the oldest one is free again */
+		pthread_mutex_lock(&async_mutex);
+		while (async_outstanding>=depth)
+			pthread_cond_wait(&async_cond,&async_mutex);
+		async_outstanding++;
+		pthread_mutex_unlock(&async_mutex);
+
+		slot=&slots[i%depth];
+		slot->rx.size=0;
+		if (afp_readext_async(volume,1,0,ASYNC_READ_SIZE,&slot->rx,
+			async_done,slot)) {
+			pthread_mutex_lock(&async_mutex);
+			async_outstanding--;
+			async_errors++;
+			pthread_mutex_unlock(&async_mutex);
+		}
+	}
+	pthread_mutex_lock(&async_mutex);
+	while (async_outstanding>0)
+		pthread_cond_wait(&async_cond,&async_mutex);
+	errors+=async_errors;
+	pthread_mutex_unlock(&async_mutex);
+	end=now_ns();
+
+	for (i=0;i<ASYNC_MAX_DEPTH;i++)
+		free(slots[i].rx.data);
+
+	printf("%8s %6u %10.1f %10.1f %8u\n",depth ? "async" : "sync",
+		depth ? depth : 1,(double) (end-start)/ASYNC_ITERATIONS/1000.0,
+		((double) ASYNC_ITERATIONS*ASYNC_READ_SIZE/(1024*1024))/
+		((double) (end-start)/1000000000.0),errors);
+}
+
+static void run_async(void)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+
+	printf("%uK afpReadExt from one thread\n",ASYNC_READ_SIZE/1024);
+	printf("%8s %6s %10s %10s %8s\n","api","depth","us/read","MB/s",
+		"errors");
+	bench_async_one(&volume,0);
+	bench_async_one(&volume,1);
+	bench_async_one(&volume,4);
+	bench_async_one(&volume,16);
+	afp_server_remove(s);
+}
+
+/* Writes 1MB at a time to one fork until upload_stop is set, counting
+ * the writes as it goes */
+
+#define UPLOAD_WRITE_SIZE (1024*1024)
+
+static volatile int upload_stop;
+static volatile unsigned int upload_count;
+
+static void * upload_thread(void * other)
+{
+	struct afp_volume * volume = other;
+	char * data = calloc(1,UPLOAD_WRITE_SIZE);
+	uint64_t written;
+
+	while (!upload_stop) {
+		afp_writeext(volume,1,0,UPLOAD_WRITE_SIZE,data,&written);
+		__sync_fetch_and_add(&upload_count,1);
+	}
+	free(data);
+	return NULL;
+}
+
+/* Several threads sending afpFlushFork on the same server, like a stat
+ * storm from many processes.  Shows how many of them share each write.
+ * Packets can only share a write if their senders overlap, which on one
+ * CPU means one of them is blocked writing, so this is done again with
+ * an upload filling the socket.  The upload's own writes aren't counted. */
+
+#define COALESCE_ITERATIONS 100000
+#define COALESCE_MAX_THREADS 16
+
+struct coalesce_thread {
+	pthread_t thread;
+	struct afp_volume * volume;
+	unsigned int iterations;
+	unsigned int errors;
+};
+
+static void * coalesce_thread(void * other)
+{
+	struct coalesce_thread * t = other;
+	unsigned int i;
+
+	for (i=0;i<t->iterations;i++)
+		if (afp_flushfork(t->volume,1)) t->errors++;
+	return NULL;
+}
+
+static void bench_coalesce_one(struct afp_server * s,
+	struct afp_volume * volume, unsigned int nthreads, int upload)
+{
+	struct coalesce_thread threads[COALESCE_MAX_THREADS];
+	unsigned long long start, end;
+	unsigned int i, errors=0, uploads;
+	pthread_t uploader;
+
+	upload_stop=0;
+	if (upload) {
+		pthread_create(&uploader,NULL,upload_thread,volume);
+		usleep(100000);
+	}
+	memset(&s->stats,0,sizeof(s->stats));
+	upload_count=0;
+	start=now_ns();
+	for (i=0;i<nthreads;i++) {
+		threads[i].volume=volume;
+		threads[i].iterations=COALESCE_ITERATIONS/nthreads;
+		threads[i].errors=0;
+		pthread_create(&threads[i].thread,NULL,coalesce_thread,
+			&threads[i]);
+	}
+	for (i=0;i<nthreads;i++) {
+		pthread_join(threads[i].thread,NULL);
+		errors+=threads[i].errors;
+	}
+	end=now_ns();
+	upload_stop=1;
+	if (upload) pthread_join(uploader,NULL);
+
+	uploads=upload_count;
+	printf("%8u %8s %12.0f %14.2f %8u\n",nthreads,upload ? "yes" : "no",
+		(double) COALESCE_ITERATIONS/((double) (end-start)/1000000000.0),
+		s->stats.tx_writes>uploads ?
+		(double) (s->stats.tx_packets-uploads)/
+		(s->stats.tx_writes-uploads) : 0.0,
+		errors);
+}
+
+static void run_coalesce(void)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	unsigned int nthreads;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+
+	printf("afpFlushFork from several threads on one server\n");
+	printf("%8s %8s %12s %14s %8s\n","threads","upload","requests/s",
+		"flushes/write","errors");
+	for (nthreads=1;nthreads<=COALESCE_MAX_THREADS;nthreads*=4)
+		bench_coalesce_one(s,&volume,nthreads,0);
+	s->tx_quantum=UPLOAD_WRITE_SIZE;
+	for (nthreads=1;nthreads<=COALESCE_MAX_THREADS;nthreads*=4)
+		bench_coalesce_one(s,&volume,nthreads,1);
+	afp_server_remove(s);
+}
+
+/* A request that gets no reply should fail after DSI_DEFAULT_TIMEOUT, and
+ * a reply that turns up after that mustn't land in the caller's buffer,
+ * which by then may well be gone. */
+
+#define TIMEOUT_READ_SIZE (64*1024)
+#define TIMEOUT_DELAY (DSI_DEFAULT_TIMEOUT+1)
+#define TIMEOUT_SAMPLES 20
+
+static volatile int timeout_rc;
+static volatile unsigned long long timeout_done;
+
+static void timeout_completion(void * context, int rc)
+{
+	struct afp_rx_buffer * rx = context;
+
+	/* The buffer is ours again, so scribble on it */
+	memset(rx->data,0xaa,rx->maxsize);
+	timeout_rc=rc;
+	timeout_done=now_ns();
+}
+
+/* The thread that receives can get stuck, here in a completion, with a
+ * reply half way into the buffer of a caller that gives up on it.  The
+ * rest of that reply has to be thrown away, not put in the buffer. */
+
+static struct afp_server * stuck_server;
+static struct afp_rx_buffer * stuck_rx;
+static volatile int stuck_detached;
+
+static void stuck_completion(void * context, int rc)
+{
+	struct afp_server * s = stuck_server;
+	uint64_t timed_out = s->stats.requests_timed_out;
+	unsigned int i;
+
+	for (i=0;(i<3*DSI_DEFAULT_TIMEOUT*100) &&
+		(s->stats.requests_timed_out==timed_out);i++)
+		usleep(10000);
+	stuck_detached=(s->incoming_request==NULL);
+	responder_stall=0;
+}
+
+static void * stuck_read(void * other)
+{
+	struct afp_volume * volume = other;
+
+	timeout_rc=afp_readext(volume,1,0,stuck_rx->maxsize,stuck_rx);
+	timeout_done=now_ns();
+	return NULL;
+}
+
+static void bench_timeout_stuck(struct afp_server * s,
+	struct afp_volume * volume, struct afp_rx_buffer * rx)
+{
+	struct afp_server * other;
+	struct afp_volume other_volume;
+	struct afp_rx_buffer other_rx;
+	unsigned long long start;
+	pthread_t thread;
+	char c;
+
+	if ((other=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&other_volume,0,sizeof(other_volume));
+	other_volume.server=other;
+	other_rx.data=&c;
+	other_rx.maxsize=1;
+	other_rx.size=0;
+
+	stuck_server=s;
+	stuck_detached=0;
+	responder_stall=1;
+	stuck_rx=rx;
+	rx->size=0;
+	timeout_done=0;
+	start=now_ns();
+	pthread_create(&thread,NULL,stuck_read,volume);
+	while ((s->incoming_request==NULL) && (responder_stall))
+		usleep(1000);
+	/* Both servers are received for by the main loop */
+	afp_readext_async(&other_volume,1,0,1,&other_rx,
+		stuck_completion,NULL);
+	pthread_join(thread,NULL);
+	printf("%8s: gave up after %.2fs, reply detached: %s, "
+		"read returned %d, %u bytes\n","stuck",
+		(timeout_done-start)/1000000000.0,
+		stuck_detached ? "yes" : "no",timeout_rc,rx->size);
+	responder_stall=0;
+	afp_server_remove(other);
+}
+
+static void run_timeout(void)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	struct afp_rx_buffer rx;
+	unsigned long long start;
+	unsigned int i;
+	int rc, clean=1;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	rx.data=malloc(TIMEOUT_READ_SIZE);
+	rx.maxsize=TIMEOUT_READ_SIZE;
+
+	/* Give it a round trip time to go by */
+	for (i=0;i<TIMEOUT_SAMPLES;i++)
+		afp_flushfork(&volume,1);
+
+	printf("Replies held back for %ds, with a %ums timeout\n",
+		TIMEOUT_DELAY,dsi_rtt_timeout(s,afpReadExt,DSI_DEFAULT_TIMEOUT,
+		TIMEOUT_READ_SIZE,0));
+	responder_delay_ms=TIMEOUT_DELAY*1000;
+
+	rx.size=0;
+	start=now_ns();
+	rc=afp_readext(&volume,1,0,TIMEOUT_READ_SIZE,&rx);
+	printf("%8s: returned %d after %.2fs, sent %llu more times\n","sync",
+		rc,(now_ns()-start)/1000000000.0,
+		(unsigned long long) s->stats.requests_retried);
+
+	rx.size=0;
+	timeout_done=0;
+	start=now_ns();
+	afp_readext_async(&volume,1,0,TIMEOUT_READ_SIZE,&rx,
+		timeout_completion,&rx);
+	while (!timeout_done) usleep(10000);
+	printf("%8s: completed with %d after %.2fs\n","async",timeout_rc,
+		(timeout_done-start)/1000000000.0);
+
+	/* Let all the late replies come in, then check they went nowhere.
+	 * The responder takes TIMEOUT_DELAY over each of them in turn. */
+	sleep(TIMEOUT_DELAY*(DSI_RTT_RETRIES+2)-TIMEOUT_DELAY);
+	responder_delay_ms=0;
+	sleep(1);
+	for (i=0;i<TIMEOUT_READ_SIZE;i++)
+		if ((unsigned char) rx.data[i]!=0xaa) clean=0;
+	rx.size=0;
+	rc=afp_readext(&volume,1,0,TIMEOUT_READ_SIZE,&rx);
+	printf("late replies thrown away: %llu, buffer untouched: %s, "
+		"next read: %d, %u bytes\n",
+		(unsigned long long) s->stats.late_replies,
+		clean ? "yes" : "no",rc,rx.size);
+
+	bench_timeout_stuck(s,&volume,&rx);
+	free(rx.data);
+	afp_server_remove(s);
+}
+
+/* Moves 8MB at a time through ll_read() and ll_write(), which split it
+ * into requests of one quantum each.  The responder holds every reply
+ * back for a millisecond, like a real network would. */
+
+#define QUANTUM_TRANSFER (8*1024*1024)
+#define QUANTUM_TOTAL (128*1024*1024)
+
+static struct afp_versions quantum_version = { "AFP3.2", 32 };
+
+static void bench_quantum_one(struct afp_volume * volume,
+	struct afp_file_info * fp, char * data, unsigned int quantum)
+{
+	unsigned long long start, read_ns, write_ns;
+	unsigned int i, errors=0;
+	size_t written;
+	int eof;
+
+	volume->server->rx_quantum=quantum;
+	volume->server->tx_quantum=quantum;
+
+	start=now_ns();
+	for (i=0;i<QUANTUM_TOTAL/QUANTUM_TRANSFER;i++)
+		if (ll_read(volume,data,QUANTUM_TRANSFER,
+			(off_t) i*QUANTUM_TRANSFER,fp,&eof)!=QUANTUM_TRANSFER)
+			errors++;
+	read_ns=now_ns()-start;
+
+	start=now_ns();
+	for (i=0;i<QUANTUM_TOTAL/QUANTUM_TRANSFER;i++)
+		if (ll_write(volume,data,QUANTUM_TRANSFER,
+			(off_t) i*QUANTUM_TRANSFER,fp,&written))
+			errors++;
+	write_ns=now_ns()-start;
+
+	printf("%8uK %10.0f %10.0f %8u\n",quantum/1024,
+		((double) QUANTUM_TOTAL/(1024*1024))/(read_ns/1000000000.0),
+		((double) QUANTUM_TOTAL/(1024*1024))/(write_ns/1000000000.0),
+		errors);
+}
+
+static void run_quantum(void)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	struct afp_file_info fp;
+	unsigned int quantum;
+	char * data;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	volume.extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	memset(&fp,0,sizeof(fp));
+	fp.forkid=1;
+	data=calloc(1,QUANTUM_TRANSFER);
+
+	responder_delay_ms=1;
+	printf("ll_read and ll_write with 1ms per reply, MB/s\n");
+	printf("%9s %10s %10s %8s\n","quantum","read","write","errors");
+	for (quantum=128*1024;quantum<=8*1024*1024;quantum*=4)
+		bench_quantum_one(&volume,&fp,data,quantum);
+	responder_delay_ms=0;
+
+	free(data);
+	afp_server_remove(s);
+}
+
+/* Small requests one at a time, then a stream of 1MB reads, with the
+ * socket set up in different ways.  Prints what the socket really ended
+ * up with, since the kernel may round or cap what was asked for. */
+
+#define SOCKET_ITERATIONS 20000
+
+static void bench_socket_one(const char * name, const char * options)
+{
+	struct afp_socket_options o;
+	struct afp_server * s;
+	struct afp_volume volume;
+	struct afp_file_info fp;
+	unsigned long long start, * latency;
+	unsigned long long read_ns;
+	unsigned int i, errors=0;
+	char * data;
+	int eof;
+
+	memset(&o,0,sizeof(o));
+	if ((options) && (afp_parse_socket_options(&o,options))) {
+		printf("Could not parse %s\n",options);
+		return;
+	}
+	if ((s=bench_server_options(1,0,&o))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	s->rx_quantum=s->tx_quantum=1024*1024;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	volume.extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	memset(&fp,0,sizeof(fp));
+	fp.forkid=1;
+	latency=calloc(SOCKET_ITERATIONS,sizeof(*latency));
+	data=calloc(1,QUANTUM_TRANSFER);
+
+	for (i=0;i<SOCKET_ITERATIONS;i++) {
+		start=now_ns();
+		if (afp_flushfork(&volume,1)) errors++;
+		latency[i]=now_ns()-start;
+	}
+	qsort(latency,SOCKET_ITERATIONS,sizeof(*latency),compare_ull);
+
+	start=now_ns();
+	for (i=0;i<QUANTUM_TOTAL/QUANTUM_TRANSFER;i++)
+		if (ll_read(&volume,data,QUANTUM_TRANSFER,
+			(off_t) i*QUANTUM_TRANSFER,&fp,&eof)!=QUANTUM_TRANSFER)
+			errors++;
+	read_ns=now_ns()-start;
+
+	printf("%-16s %8.1f %8.1f %8.0f   nodelay %s, sndbuf %u, rcvbuf %u, "
+		"errors %u\n",name,
+		latency[SOCKET_ITERATIONS/2]/1000.0,
+		latency[SOCKET_ITERATIONS*99/100]/1000.0,
+		((double) QUANTUM_TOTAL/(1024*1024))/(read_ns/1000000000.0),
+		s->socket_effective.nagle ? "off" : "on",
+		s->socket_effective.sndbuf,s->socket_effective.rcvbuf,errors);
+
+	/* As closing the fork would, so nothing is still reading ahead */
+	readahead_free(&fp);
+	free(data);
+	free(latency);
+	afp_server_remove(s);
+}
+
+static void run_socket(void)
+{
+	printf("%-16s %8s %8s %8s\n","socket","p50(us)","p99(us)","MB/s");
+	bench_socket_one("default",NULL);
+	bench_socket_one("nagle","nodelay=0");
+	bench_socket_one("64K buffers","sndbuf=64K,rcvbuf=64K");
+	bench_socket_one("keepalive","keepalive=60:10:5");
+}
+
+/* Small requests from one thread while several others upload through the
+ * same connection in 1MB writes, with bulk_share at 100 (everything in
+ * order, as it used to be) and lower.  The responder takes 1ms over each
+ * reply and keeps a small receive buffer, like a server that can only
+ * take data as fast as it can store it, so the writes back up on our
+ * side.  Since every small request costs the responder 1ms as well, the
+ * upload slows down as more of them get through. */
+
+#define PRIORITY_ITERATIONS 1000
+#define PRIORITY_UPLOADERS 8
+static void bench_priority_one(unsigned int uploaders, const char * options)
+{
+	struct afp_socket_options o;
+	struct afp_server * s;
+	struct afp_volume volume;
+	pthread_t threads[PRIORITY_UPLOADERS];
+	unsigned long long * latencies, start;
+	unsigned int i;
+
+	memset(&o,0,sizeof(o));
+	afp_parse_socket_options(&o,options);
+	if ((s=bench_server_options(1,0,&o))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	s->tx_quantum=UPLOAD_WRITE_SIZE;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	latencies=malloc(PRIORITY_ITERATIONS*sizeof(*latencies));
+
+	responder_delay_ms=1;
+	upload_stop=0;
+	for (i=0;i<uploaders;i++)
+		pthread_create(&threads[i],NULL,upload_thread,&volume);
+	usleep(100000);
+
+	s->stats.tx_bytes=0;
+	start=now_ns();
+	for (i=0;i<PRIORITY_ITERATIONS;i++) {
+		latencies[i]=now_ns();
+		afp_flushfork(&volume,1);
+		latencies[i]=now_ns()-latencies[i];
+	}
+	start=now_ns()-start;
+
+	upload_stop=1;
+	for (i=0;i<uploaders;i++)
+		pthread_join(threads[i],NULL);
+	responder_delay_ms=0;
+
+	qsort(latencies,PRIORITY_ITERATIONS,sizeof(*latencies),compare_ull);
+	printf("%10u %10u %10.1f %10.1f %10.1f %12.0f\n",uploaders,
+		s->socket_effective.bulk_share,
+		latencies[PRIORITY_ITERATIONS/2]/1000.0,
+		latencies[PRIORITY_ITERATIONS*99/100]/1000.0,
+		latencies[PRIORITY_ITERATIONS-1]/1000.0,
+		((double) s->stats.tx_bytes/(1024*1024))/
+		((double) start/1000000000.0));
+	free(latencies);
+	afp_server_remove(s);
+}
+
+static void run_priority(void)
+{
+	printf("Small request latency during an upload on the same "
+		"connection, us\n");
+	printf("%10s %10s %10s %10s %10s %12s\n","uploaders","bulk share",
+		"p50","p99","max","upload MB/s");
+	responder_rcvbuf=256*1024;
+	bench_priority_one(0,"bulkshare=100");
+	bench_priority_one(PRIORITY_UPLOADERS,"bulkshare=100");
+	bench_priority_one(PRIORITY_UPLOADERS,"bulkshare=90");
+	bench_priority_one(PRIORITY_UPLOADERS,"bulkshare=75");
+	bench_priority_one(PRIORITY_UPLOADERS,"bulkshare=50");
+	responder_rcvbuf=0;
+}
+
+/* 8MB ll_read and ll_write calls spread over extra sessions, each to its
+ * own responder thread that takes 1ms over every reply, like a server
+ * that handles the requests of a session one at a time.  The stripes'
+ * volumes and forks are filled in up front, as if they had been opened
+ * already. */
+
+#define STRIPE_TOTAL (64*1024*1024)
+
+static void bench_stripe_one(unsigned int stripes, unsigned int quantum)
+{
+	struct afp_server * s, * stripe;
+	struct afp_volume volume, stripe_volumes[AFP_MAX_STRIPES];
+	struct afp_file_info fp;
+	unsigned long long start, read_ns, write_ns;
+	unsigned int i, errors=0;
+	size_t written;
+	char * data;
+	int eof;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	s->rx_quantum=s->tx_quantum=quantum;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	volume.extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	memset(&fp,0,sizeof(fp));
+	fp.forkid=1;
+	for (i=0;i<stripes;i++) {
+		if ((stripe=bench_server(1))==NULL) {
+			printf("Could not set up a loopback server\n");
+			break;
+		}
+		stripe->using_version=&quantum_version;
+		stripe->rx_quantum=stripe->tx_quantum=quantum;
+		stripe_attach(s,stripe);
+		memset(&stripe_volumes[i],0,sizeof(stripe_volumes[i]));
+		stripe_volumes[i].server=stripe;
+		stripe_volumes[i].extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+		volume.stripe_volumes[i]=&stripe_volumes[i];
+		fp.stripe_forkid[i]=1;
+	}
+	data=calloc(1,QUANTUM_TRANSFER);
+
+	start=now_ns();
+	for (i=0;i<STRIPE_TOTAL/QUANTUM_TRANSFER;i++)
+		if (ll_read(&volume,data,QUANTUM_TRANSFER,
+			(off_t) i*QUANTUM_TRANSFER,&fp,&eof)!=QUANTUM_TRANSFER)
+			errors++;
+	read_ns=now_ns()-start;
+
+	start=now_ns();
+	for (i=0;i<STRIPE_TOTAL/QUANTUM_TRANSFER;i++)
+		if (ll_write(&volume,data,QUANTUM_TRANSFER,
+			(off_t) i*QUANTUM_TRANSFER,&fp,&written))
+			errors++;
+	write_ns=now_ns()-start;
+
+	printf("%8u %8uK %10.0f %10.0f %8u\n",s->num_stripes,quantum/1024,
+		((double) STRIPE_TOTAL/(1024*1024))/(read_ns/1000000000.0),
+		((double) STRIPE_TOTAL/(1024*1024))/(write_ns/1000000000.0),
+		errors);
+
+	free(data);
+	afp_server_remove(s);
+}
+
+static void run_stripe(void)
+{
+	unsigned int quantum, stripes;
+
+	responder_delay_ms=1;
+	printf("ll_read and ll_write over extra sessions with 1ms per reply, "
+		"MB/s\n");
+	printf("%8s %9s %10s %10s %8s\n","stripes","quantum","read","write",
+		"errors");
+	for (quantum=128*1024;quantum<=1024*1024;quantum*=8)
+		for (stripes=0;stripes<AFP_MAX_STRIPES;stripes=stripes*2+1)
+			bench_stripe_one(stripes,quantum);
+	responder_delay_ms=0;
+}
+
+/* The round trip time, and the timeout that comes of it, with replies
+ * held back for a while, and then how long it takes to get over a reply
+ * that never comes, with and without a round trip time to go by. */
+
+#define RTT_SAMPLES 50
+
+static void bench_rtt_one(unsigned int delay_ms)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	unsigned int i, errors=0;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+
+	responder_delay_ms=delay_ms;
+	for (i=0;i<RTT_SAMPLES;i++)
+		if (afp_flushfork(&volume,1)) errors++;
+	responder_delay_ms=0;
+
+	printf("%10u %10.2f %10.2f %10u %10u %10u\n",delay_ms,
+		s->rtt_srtt/1000.0,s->rtt_var/1000.0,dsi_rtt_rto(s),
+		dsi_rtt_timeout(s,afpReadExt,DSI_DEFAULT_TIMEOUT,1024*1024,0),
+		errors);
+	afp_server_remove(s);
+}
+
+static void bench_rtt_lost(int estimate)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	unsigned long long start;
+	unsigned int i;
+	int rc;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	if (estimate)
+		for (i=0;i<RTT_SAMPLES;i++)
+			afp_flushfork(&volume,1);
+
+	responder_drop=1;
+	start=now_ns();
+	rc=afp_flushfork(&volume,1);
+	printf("%10s %10.2f %10d %10llu\n",estimate ? "yes" : "no",
+		(now_ns()-start)/1000000000.0,rc,
+		(unsigned long long) s->stats.requests_retried);
+	afp_server_remove(s);
+}
+
+static void run_rtt(void)
+{
+	printf("afpFlushFork with replies held back, times in ms\n");
+	printf("%10s %10s %10s %10s %10s %10s\n","delay","srtt","deviation",
+		"timeout","1MB read","errors");
+	bench_rtt_one(0);
+	bench_rtt_one(5);
+	bench_rtt_one(50);
+	bench_rtt_one(200);
+	bench_rtt_one(500);
+
+	printf("afpFlushFork with its first reply lost\n");
+	printf("%10s %10s %10s %10s\n","estimate","seconds","returned",
+		"sent again");
+	bench_rtt_lost(0);
+	bench_rtt_lost(1);
+}
+
+/* Many threads sending requests on one connection at once, to shake out
+ * request ids handed out twice or replies given to the wrong caller.
+ * Each read gets its own offset back as its data, and each write its own
+ * length back as what was written, so a reply that went astray shows. */
+
+#define STRESS_THREADS 32
+#define STRESS_ITERATIONS 3000
+#define STRESS_READ_SIZE 4096
+
+struct stress_thread {
+	struct afp_volume * volume;
+	pthread_t thread;
+	unsigned int id;
+	unsigned int errors;
+	unsigned int mismatches;
+};
+
+static void * stress_thread(void * other)
+{
+	struct stress_thread * t = other;
+	struct afp_rx_buffer rx;
+	char data[STRESS_READ_SIZE];
+	uint64_t offset, expected, written;
+	unsigned int i, j, len;
+
+	rx.data=data;
+	rx.maxsize=STRESS_READ_SIZE;
+	for (i=0;i<STRESS_ITERATIONS;i++) {
+		offset=((uint64_t) t->id<<32)|i;
+		switch (i%3) {
+		case 0:
+			rx.size=0;
+			if (afp_readext(t->volume,1,offset,STRESS_READ_SIZE,
+				&rx)) {
+				t->errors++;
+				break;
+			}
+			expected=hton64(offset);
+			for (j=0;j<STRESS_READ_SIZE;j+=sizeof(expected))
+				if (memcmp(data+j,&expected,sizeof(expected))) {
+					t->mismatches++;
+					break;
+				}
+			break;
+		case 1:
+			len=t->id*STRESS_ITERATIONS+i;
+			len=len%STRESS_READ_SIZE+1;
+			if (afp_writeext(t->volume,1,offset,len,data,&written))
+				t->errors++;
+			else if (written!=len)
+				t->mismatches++;
+			break;
+		case 2:
+			if (afp_flushfork(t->volume,1)) t->errors++;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void bench_stress_one(int threaded)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	struct stress_thread threads[STRESS_THREADS];
+	unsigned long long start;
+	unsigned int i, errors=0, mismatches=0;
+
+	if ((s=bench_server_threaded(1,threaded))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+
+	start=now_ns();
+	for (i=0;i<STRESS_THREADS;i++) {
+		threads[i].volume=&volume;
+		threads[i].id=i;
+		threads[i].errors=0;
+		threads[i].mismatches=0;
+		pthread_create(&threads[i].thread,NULL,stress_thread,
+			&threads[i]);
+	}
+	for (i=0;i<STRESS_THREADS;i++) {
+		pthread_join(threads[i].thread,NULL);
+		errors+=threads[i].errors;
+		mismatches+=threads[i].mismatches;
+	}
+	start=now_ns()-start;
+
+	printf("%10s %10.0f %10u %10u %10llu %10llu\n",
+		threaded ? "own thread" : "shared",
+		(double) STRESS_THREADS*STRESS_ITERATIONS/
+		(start/1000000000.0),errors,mismatches,
+		(unsigned long long) s->stats.late_replies,
+		(unsigned long long) s->stats.requests_pending);
+	afp_server_remove(s);
+}
+
+static void run_stress(void)
+{
+	printf("%u threads sending reads, writes and flushes on one "
+		"connection\n",STRESS_THREADS);
+	printf("%10s %10s %10s %10s %10s %10s\n","receive","requests/s",
+		"errors","mismatches","unmatched","pending");
+	responder_echo=1;
+	bench_stress_one(0);
+	bench_stress_one(1);
+	responder_echo=0;
+}
+
+/* Bursts of tickles and attentions from the server, each quarter of the
+ * attentions asking us to fetch its message, all ahead of the reply to an
+ * afpFlushFork.  Shows how long that reply takes to get through, how
+ * many tickles got answered (a few at once only need the one answer), and
+ * how many threads the process ends up with. */
+
+static unsigned int count_threads(void)
+{
+	FILE * f;
+	char line[128];
+	unsigned int threads=0;
+
+	if ((f=fopen("/proc/self/status","r"))==NULL) return 0;
+	while (fgets(line,sizeof(line),f))
+		if (sscanf(line,"Threads: %u",&threads)==1) break;
+	fclose(f);
+	return threads;
+}
+
+static void bench_events_one(unsigned int burst)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	unsigned long long start, latency;
+	unsigned int i;
+	int rc;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+
+	responder_tickles=0;
+	responder_burst=burst;
+	start=now_ns();
+	rc=afp_flushfork(&volume,1);
+	latency=now_ns()-start;
+	/* Give the workers time to get through them all */
+	for (i=0;(i<100) && (s->stats.events<burst);i++)
+		usleep(10000);
+	usleep(100000);
+
+	printf("%10u %10.1f %10d %10llu %10u %10u\n",burst,latency/1000.0,rc,
+		(unsigned long long) s->stats.events,responder_tickles,
+		count_threads());
+	afp_server_remove(s);
+}
+
+/* A CloseSession has us unmount every volume of the server, which takes
+ * a few requests of its own.  Meanwhile, other servers on the main loop
+ * have to be answered as usual. */
+static void bench_events_closesession(void)
+{
+	struct afp_server * s, * other;
+	struct afp_volume volume;
+	unsigned long long start, latency;
+	unsigned int i;
+	int rc;
+
+	if (((s=bench_server(1))==NULL) || ((other=bench_server(1))==NULL)) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	if ((s->volumes=calloc(1,sizeof(struct afp_volume)))==NULL)
+		return;
+	s->num_volumes=1;
+	s->volumes[0].server=s;
+	s->volumes[0].mounted=AFP_VOLUME_MOUNTED;
+	memset(&volume,0,sizeof(volume));
+	volume.server=other;
+
+	/* Nothing waits on a tickle, and s isn't ours after this */
+	responder_close=1;
+	dsi_sendtickle(s);
+	start=now_ns();
+	rc=afp_flushfork(&volume,1);
+	latency=now_ns()-start;
+	for (i=0;(i<500) && (server_still_valid(s));i++)
+		usleep(10000);
+
+	printf("CloseSession: another server answered in %.1fus, returning %d;"
+		" unmounted: %s\n",latency/1000.0,rc,
+		server_still_valid(s) ? "no" : "yes");
+	afp_server_remove(other);
+}
+
+static void run_events(void)
+{
+	printf("Tickles and attentions ahead of an afpFlushFork reply\n");
+	printf("%10s %10s %10s %10s %10s %10s\n","burst","reply(us)",
+		"returned","events","answered","threads");
+	bench_events_one(0);
+	bench_events_one(1);
+	bench_events_one(10);
+	bench_events_one(30);
+	bench_events_one(30);
+	bench_events_closesession();
+}
+
+/* Per command counts, and what keeping them costs */
+
+#define CMDSTATS_REQUESTS 200
+#define CMDSTATS_RECORDS 2000000
+
+struct cmdstats_thread {
+	struct afp_stats * stats;
+	pthread_t thread;
+	unsigned int records;
+};
+
+static void * cmdstats_thread(void * other)
+{
+	struct cmdstats_thread * t = other;
+	unsigned int i;
+
+	for (i=0;i<t->records;i++)
+		afp_stats_record(t->stats,afpReadExt,0,64,4096,i&1023);
+	return NULL;
+}
+
+static void bench_cmdstats_record(unsigned int threads)
+{
+	struct cmdstats_thread t[16];
+	struct afp_command_stats total;
+	unsigned long long start, elapsed;
+	unsigned int i;
+
+	t[0].stats=afp_stats_new();
+	start=now_ns();
+	for (i=0;i<threads;i++) {
+		t[i].stats=t[0].stats;
+		t[i].records=CMDSTATS_RECORDS/threads;
+		pthread_create(&t[i].thread,NULL,cmdstats_thread,&t[i]);
+	}
+	for (i=0;i<threads;i++)
+		pthread_join(t[i].thread,NULL);
+	elapsed=now_ns()-start;
+	afp_stats_get(t[0].stats,afpReadExt,&total);
+	printf("%10u %10.1f %10llu %10llu %10llu\n",threads,
+		(double) elapsed/CMDSTATS_RECORDS,
+		(unsigned long long) total.count,
+		(unsigned long long) afp_stats_percentile(&total,500),
+		(unsigned long long) afp_stats_percentile(&total,999));
+	afp_stats_free(t[0].stats);
+}
+
+static void run_cmdstats(void)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	struct afp_rx_buffer rx;
+	char data[4096], * text, * commands;
+	int len;
+	unsigned int i;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+
+	/* Half the flushes are answered straight away, the rest after
+	 * 5ms, so p50 and p99 should land either side */
+	for (i=0;i<CMDSTATS_REQUESTS;i++) {
+		responder_delay_ms=(i%2) ? 5 : 0;
+		afp_flushfork(&volume,1);
+	}
+	responder_delay_ms=0;
+	rx.data=data;
+	rx.maxsize=sizeof(data);
+	for (i=0;i<CMDSTATS_REQUESTS;i++) {
+		rx.size=0;
+		afp_readext(&volume,1,0,sizeof(data),&rx);
+	}
+
+	text=malloc(65536);
+	len=65536;
+	afp_status_server(s,text,&len);
+	if ((commands=strstr(text,"    commands:")))
+		printf("%s",commands);
+	len=65536;
+	afp_status_commands(s,text,&len);
+	printf("%s",text);
+	free(text);
+	afp_server_remove(s);
+
+	printf("afp_stats_record, %u records over all threads\n",
+		CMDSTATS_RECORDS);
+	printf("%10s %10s %10s %10s %10s\n","threads","ns/record","count",
+		"p50(us)","p99.9(us)");
+	bench_cmdstats_record(1);
+	bench_cmdstats_record(4);
+	bench_cmdstats_record(16);
+}
+
+/* What capturing costs a stream of small requests, and a capture saved
+ * for afpcapstat to read */
+
+#define CAPTURE_REQUESTS 20000
+#define CAPTURE_FILE "/tmp/dsi_bench.pcapng"
+
+static void bench_capture_one(const char * name, int capture,
+	unsigned int snaplen)
+{
+	struct afp_server * s;
+	struct afp_volume volume;
+	struct afp_rx_buffer rx;
+	char data[4096];
+	unsigned long long start, elapsed;
+	unsigned int i, errors=0;
+	int saved=0;
+
+	if ((s=bench_server(1))==NULL) {
+		printf("Could not set up a loopback server\n");
+		return;
+	}
+	s->using_version=&quantum_version;
+	memset(&volume,0,sizeof(volume));
+	volume.server=s;
+	if (capture) afp_capture_start(s,snaplen);
+
+	rx.data=data;
+	rx.maxsize=sizeof(data);
+	start=now_ns();
+	for (i=0;i<CAPTURE_REQUESTS;i++) {
+		if (i%4==3) {
+			rx.size=0;
+			if (afp_readext(&volume,1,0,sizeof(data),&rx)) errors++;
+		} else if (afp_flushfork(&volume,1)) errors++;
+	}
+	elapsed=now_ns()-start;
+
+	/* A few slow ones, to show up in the distribution */
+	if (capture) {
+		responder_delay_ms=20;
+		for (i=0;i<10;i++)
+			afp_flushfork(&volume,1);
+		responder_delay_ms=0;
+		saved=afp_capture_save(s,CAPTURE_FILE);
+	}
+	printf("%-12s %10.0f %10d %10u\n",name,
+		CAPTURE_REQUESTS/(elapsed/1000000000.0),saved,errors);
+	afp_server_remove(s);
+}
+
+static void run_capture(void)
+{
+	printf("afpFlushFork and 4K afpReadExt, one at a time\n");
+	printf("%-12s %10s %10s %10s\n","capture","requests/s","saved",
+		"errors");
+	bench_capture_one("off",0,0);
+	bench_capture_one("headers",1,0);
+	bench_capture_one("4K",1,4096);
+	printf("Last capture saved to %s\n",CAPTURE_FILE);
+}
+
+/* A whole session against the mock server, through the midlevel calls
+ * that fuse uses: connecting, listing, looking things up, and reading and
+ * writing, with more and more latency on the link */
+
+#define MOCK_FILES 200
+#define MOCK_BIG_FILE (32*1024*1024)
+#define MOCK_WRITE_TOTAL (8*1024*1024)
+#define MOCK_CHUNK (128*1024)
+#define MOCK_RANDOM_READS 500
+#define MOCK_META_ITERATIONS 50
+
+static unsigned char mock_pattern(uint64_t offset)
+{
+	return (offset*7+(offset>>12))&0xff;
+}
+
+static int mock_populate(const char * root)
+{
+	char path[PATH_MAX];
+	char * buf;
+	unsigned int i, j;
+	FILE * f;
+
+	if ((buf=malloc(MOCK_CHUNK))==NULL) return -1;
+	snprintf(path,sizeof(path),"%s/big",root);
+	if ((f=fopen(path,"w"))==NULL) goto error;
+	for (i=0;i<MOCK_BIG_FILE;i+=MOCK_CHUNK) {
+		for (j=0;j<MOCK_CHUNK;j++)
+			buf[j]=mock_pattern(i+j);
+		fwrite(buf,MOCK_CHUNK,1,f);
+	}
+	if (fclose(f)) goto error;
+
+	snprintf(path,sizeof(path),"%s/dir",root);
+	mkdir(path,0755);
+	memset(buf,'x',4096);
+	for (i=0;i<MOCK_FILES;i++) {
+		snprintf(path,sizeof(path),"%s/dir/file%03u",root,i);
+		if ((f=fopen(path,"w"))==NULL) goto error;
+		fwrite(buf,4096,1,f);
+		fclose(f);
+	}
+	free(buf);
+	return 0;
+error:
+	free(buf);
+	return -1;
+}
+
+static void mock_cleanup(const char * root)
+{
+	char path[PATH_MAX];
+	unsigned int i;
+
+	for (i=0;i<MOCK_FILES;i++) {
+		snprintf(path,sizeof(path),"%s/dir/file%03u",root,i);
+		unlink(path);
+	}
+	snprintf(path,sizeof(path),"%s/dir",root);
+	rmdir(path);
+	snprintf(path,sizeof(path),"%s/big",root);
+	unlink(path);
+	snprintf(path,sizeof(path),"%s/out",root);
+	unlink(path);
+	rmdir(root);
+}
+
+static struct afp_volume * mock_connect(struct mock_server * m,
+	const char * options)
+{
+	struct afp_connection_request req;
+	struct afp_server * s;
+	struct afp_volume * v;
+	char mesg[1024];
+	unsigned int len=0;
+
+	memset(&req,0,sizeof(req));
+	afp_default_url(&req.url);
+	snprintf(req.url.servername,sizeof(req.url.servername),"127.0.0.1");
+	req.url.port=mock_server_port(m);
+	req.url.requested_version=32;
+	req.uam_mask=default_uams_mask();
+	if ((options) &&
+		(afp_parse_socket_options(&req.url.socket_options,options)))
+		return NULL;
+	if ((s=afp_server_full_connect(NULL,&req))==NULL)
+		return NULL;
+	if ((v=find_volume_by_name(s,"Mock"))==NULL) {
+		afp_server_remove(s);
+		return NULL;
+	}
+	v->mapping=AFP_MAPPING_LOGINIDS;
+	if (afp_connect_volume(v,s,mesg,&len,sizeof(mesg))) {
+		afp_server_remove(s);
+		return NULL;
+	}
+	return v;
+}
+
+static void bench_mock_one(struct mock_server * m, unsigned int latency_us)
+{
+	struct afp_volume * v;
+	struct afp_file_info * fp, * fb, * p;
+	struct stat st;
+	char path[64], * buf;
+	unsigned long long start, connect_ns, readdir_ns, getattr_ns, read_ns,
+		random_ns, write_ns, meta_ns;
+	unsigned int i, j, errors=0, entries=0;
+	int eof, n;
+
+	mock_server_set_link(m,latency_us,0);
+	if ((buf=malloc(MOCK_CHUNK))==NULL) return;
+
+	start=now_ns();
+	if ((v=mock_connect(m,NULL))==NULL) {
+		printf("Could not connect to the mock server\n");
+		free(buf);
+		return;
+	}
+	connect_ns=now_ns()-start;
+
+	start=now_ns();
+	if (ml_readdir(v,"/dir",&fb)) errors++;
+	else {
+		for (p=fb;p;p=p->next) entries++;
+		afp_ml_filebase_free(&fb);
+	}
+	if (entries!=MOCK_FILES) errors++;
+	readdir_ns=now_ns()-start;
+
+	start=now_ns();
+	for (i=0;i<MOCK_FILES;i++) {
+		snprintf(path,sizeof(path),"/dir/file%03u",i);
+		if ((ml_getattr(v,path,&st)) || (st.st_size!=4096)) errors++;
+	}
+	getattr_ns=now_ns()-start;
+
+	/* Reading the big file the way fuse does, a chunk at a time */
+	start=now_ns();
+	if (ml_open(v,"/big",O_RDONLY,&fp)) {
+		errors++;
+		read_ns=random_ns=1;
+	} else {
+		for (i=0;i<MOCK_BIG_FILE;i+=MOCK_CHUNK) {
+			n=ml_read(v,"/big",buf,MOCK_CHUNK,i,fp,&eof);
+			if (n!=MOCK_CHUNK) {
+				errors++;
+				break;
+			}
+			for (j=0;j<MOCK_CHUNK;j+=4093)
+				if ((unsigned char) buf[j]!=mock_pattern(i+j))
+					errors++;
+		}
+		read_ns=now_ns()-start;
+
+		srandom(1);
+		start=now_ns();
+		for (i=0;i<MOCK_RANDOM_READS;i++) {
+			uint64_t offset = (random()%(MOCK_BIG_FILE/4096))*4096;
+			n=ml_read(v,"/big",buf,4096,offset,fp,&eof);
+			if ((n!=4096) ||
+				((unsigned char) buf[0]!=mock_pattern(offset)))
+				errors++;
+		}
+		random_ns=now_ns()-start;
+		ml_close(v,"/big",fp);
+	}
+
+	start=now_ns();
+	if (ml_open(v,"/out",O_RDWR|O_CREAT|O_TRUNC,&fp)) {
+		errors++;
+		write_ns=1;
+	} else {
+		memset(buf,'w',MOCK_CHUNK);
+		for (i=0;i<MOCK_WRITE_TOTAL;i+=MOCK_CHUNK)
+			if (ml_write(v,"/out",buf,MOCK_CHUNK,i,fp,
+				getuid(),getgid())!=MOCK_CHUNK)
+				errors++;
+		ml_close(v,"/out",fp);
+		write_ns=now_ns()-start;
+		if ((ml_getattr(v,"/out",&st)) ||
+			(st.st_size!=MOCK_WRITE_TOTAL))
+			errors++;
+	}
+
+	/* Five calls each time around */
+	start=now_ns();
+	for (i=0;i<MOCK_META_ITERATIONS;i++) {
+		if (ml_mkdir(v,"/newdir",0755)) errors++;
+		if (ml_creat(v,"/newdir/a",0644)) errors++;
+		if (ml_rename(v,"/newdir/a","/newdir/b")) errors++;
+		if (ml_unlink(v,"/newdir/b")) errors++;
+		if (ml_rmdir(v,"/newdir")) errors++;
+	}
+	meta_ns=now_ns()-start;
+
+	afp_unmount_volume(v);
+	free(buf);
+
+	printf("%8uus %9.1f %9.2f %9.0f %9.1f %9.0f %9.1f %9.0f %7u\n",
+		latency_us,connect_ns/1000000.0,readdir_ns/1000000.0,
+		getattr_ns/1000.0/MOCK_FILES,
+		MOCK_BIG_FILE/(read_ns/1000000000.0)/(1024*1024),
+		random_ns/1000.0/MOCK_RANDOM_READS,
+		MOCK_WRITE_TOTAL/(write_ns/1000000000.0)/(1024*1024),
+		meta_ns/1000.0/(MOCK_META_ITERATIONS*5),errors);
+}
+
+static void run_mock(void)
+{
+	struct mock_server_options options;
+	struct mock_server * m;
+	char root[] = "/tmp/dsi_bench.XXXXXX";
+
+	if ((mkdtemp(root)==NULL) || (mock_populate(root))) {
+		printf("Could not set up files for the mock server\n");
+		return;
+	}
+	init_uams();
+	memset(&options,0,sizeof(options));
+	options.root=root;
+	if ((m=mock_server_start(&options))==NULL) {
+		printf("Could not start the mock server\n");
+		mock_cleanup(root);
+		return;
+	}
+	printf("Midlevel calls against the mock server, serving %s\n",root);
+	printf("%10s %9s %9s %9s %9s %9s %9s %9s %7s\n","latency",
+		"connect","readdir","getattr","read","4K read","write",
+		"meta","errors");
+	printf("%10s %9s %9s %9s %9s %9s %9s %9s\n","","ms","ms","us","MB/s",
+		"us","MB/s","us");
+	bench_mock_one(m,0);
+	bench_mock_one(m,200);
+	bench_mock_one(m,1000);
+	mock_server_stop(m);
+	mock_cleanup(root);
+}
+
+/* Reading the big file from the mock server a chunk at a time, as fuse
+ * does, with more and more reads going ahead of us.  Every so often the
+ * reader goes back a chunk, to make sure what was read ahead isn't
+ * handed out for the wrong place. */
+
+static void bench_readahead_one(struct mock_server * m,
+	unsigned int latency_us, unsigned int window)
+{
+	struct afp_volume * v;
+	struct afp_file_info * fp;
+	char options[32], * buf;
+	unsigned long long start, ns, requests;
+	unsigned int i, j, errors=0;
+	uint64_t offset;
+	int eof, n;
+
+	mock_server_set_link(m,latency_us,0);
+	snprintf(options,sizeof(options),"readahead=%u",window);
+	if ((buf=malloc(MOCK_CHUNK))==NULL) return;
+	if ((v=mock_connect(m,options))==NULL) {
+		printf("Could not connect to the mock server\n");
+		free(buf);
+		return;
+	}
+	/* As fuse mounts by default */
+	v->extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	if (ml_open(v,"/big",O_RDONLY,&fp)) {
+		printf("Could not open the big file\n");
+		afp_unmount_volume(v);
+		free(buf);
+		return;
+	}
+
+	mock_server_reset_counts(m);
+	start=now_ns();
+	for (i=0;i<MOCK_BIG_FILE/MOCK_CHUNK;i++) {
+		offset=(uint64_t) i*MOCK_CHUNK;
+		if (i%64==63) offset-=MOCK_CHUNK;
+		n=ml_read(v,"/big",buf,MOCK_CHUNK,offset,fp,&eof);
+		if (n!=MOCK_CHUNK) {
+			errors++;
+			break;
+		}
+		for (j=0;j<MOCK_CHUNK;j+=4093)
+			if ((unsigned char) buf[j]!=mock_pattern(offset+j))
+				errors++;
+	}
+	/* And past the end */
+	n=ml_read(v,"/big",buf,MOCK_CHUNK,MOCK_BIG_FILE,fp,&eof);
+	if ((n!=0) || (!eof)) errors++;
+	ns=now_ns()-start;
+	requests=mock_server_count(m,afpReadExt);
+
+	ml_close(v,"/big",fp);
+	afp_unmount_volume(v);
+	free(buf);
+
+	printf("%8uus %8u %9.1f %9llu %7u\n",latency_us,window,
+		MOCK_BIG_FILE/(ns/1000000000.0)/(1024*1024),requests,errors);
+}
+
+static void run_readahead(void)
+{
+	struct mock_server_options options;
+	struct mock_server * m;
+	char root[] = "/tmp/dsi_bench.XXXXXX";
+	unsigned int windows[] = { 0, 2, 8, 32 };
+	unsigned int latencies[] = { 200, 1000 };
+	unsigned int i, j;
+
+	if ((mkdtemp(root)==NULL) || (mock_populate(root))) {
+		printf("Could not set up files for the mock server\n");
+		return;
+	}
+	init_uams();
+	memset(&options,0,sizeof(options));
+	options.root=root;
+	if ((m=mock_server_start(&options))==NULL) {
+		printf("Could not start the mock server\n");
+		mock_cleanup(root);
+		return;
+	}
+	printf("Sequential %uK reads of a %uMB file from the mock server\n",
+		MOCK_CHUNK/1024,MOCK_BIG_FILE/(1024*1024));
+	printf("%10s %8s %9s %9s %7s\n","latency","window","MB/s",
+		"ReadExts","errors");
+	for (i=0;i<sizeof(latencies)/sizeof(latencies[0]);i++)
+		for (j=0;j<sizeof(windows)/sizeof(windows[0]);j++)
+			bench_readahead_one(m,latencies[i],windows[j]);
+	mock_server_stop(m);
+	mock_cleanup(root);
+}
+
+/* Reading everything on the mock server twice over, as a scan of an asset
+ * library would, with and without the block cache, at 1ms of latency.
+ * Then the big file is changed behind our back, and the third time
+ * round has to see that. */
+
+#define CACHE_SIZE (64*1024*1024)
+#define CACHE_LATENCY_US 1000
+
+static void cache_change_big(const char * root, int changed)
+{
+	char path[PATH_MAX];
+	struct timeval tv[2];
+	unsigned int j;
+	char * buf;
+	int fd;
+
+	if ((buf=malloc(MOCK_CHUNK))==NULL) return;
+	for (j=0;j<MOCK_CHUNK;j++)
+		buf[j]=mock_pattern(j)^(changed ? 0x55 : 0);
+	snprintf(path,sizeof(path),"%s/big",root);
+	if ((fd=open(path,O_WRONLY))>=0) {
+		if (pwrite(fd,buf,MOCK_CHUNK,0)!=MOCK_CHUNK)
+			perror("pwrite");
+		close(fd);
+	}
+	/* Dates only go to the second */
+	gettimeofday(&tv[0],NULL);
+	tv[0].tv_sec+=changed ? 60 : 120;
+	tv[1]=tv[0];
+	utimes(path,tv);
+	free(buf);
+}
+
+static unsigned int cache_scan(struct afp_volume * v, char * buf,
+	int changed, uint64_t * bytes)
+{
+	struct afp_file_info * fp;
+	char path[64];
+	unsigned int i, j, errors=0;
+	unsigned char expect;
+	int eof, n;
+
+	for (i=0;i<MOCK_FILES;i++) {
+		snprintf(path,sizeof(path),"/dir/file%03u",i);
+		if (ml_open(v,path,O_RDONLY,&fp)) {
+			errors++;
+			continue;
+		}
+		n=ml_read(v,path,buf,MOCK_CHUNK,0,fp,&eof);
+		if ((n!=4096) || (buf[0]!='x') || (buf[4095]!='x'))
+			errors++;
+		*bytes+=n>0 ? n : 0;
+		ml_close(v,path,fp);
+		free(fp);
+	}
+
+	if (ml_open(v,"/big",O_RDONLY,&fp))
+		return errors+1;
+	for (i=0;i<MOCK_BIG_FILE;i+=MOCK_CHUNK) {
+		n=ml_read(v,"/big",buf,MOCK_CHUNK,i,fp,&eof);
+		if (n!=MOCK_CHUNK) {
+			errors++;
+			break;
+		}
+		*bytes+=n;
+		for (j=0;j<MOCK_CHUNK;j+=4093) {
+			expect=mock_pattern(i+j)^((changed && (i==0)) ? 0x55 : 0);
+			if ((unsigned char) buf[j]!=expect)
+				errors++;
+		}
+	}
+	ml_close(v,"/big",fp);
+	free(fp);
+	return errors;
+}
+
+static void bench_cache_one(struct mock_server * m, const char * root,
+	int cache)
+{
+	const char * passes[] = { "cold", "warm", "changed" };
+	struct afp_volume * v;
+	unsigned long long start, ns;
+	uint64_t bytes;
+	unsigned int i, errors;
+	char * buf;
+
+	mock_server_set_link(m,CACHE_LATENCY_US,0);
+	if ((buf=malloc(MOCK_CHUNK))==NULL) return;
+	if ((v=mock_connect(m,"readahead=0"))==NULL) {
+		printf("Could not connect to the mock server\n");
+		free(buf);
+		return;
+	}
+	/* As fuse mounts by default */
+	v->extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	if (cache)
+		v->block_cache=afp_block_cache_get(CACHE_SIZE,0);
+
+	for (i=0;i<3;i++) {
+		if (i==2) cache_change_big(root,1);
+		mock_server_reset_counts(m);
+		bytes=0;
+		start=now_ns();
+		errors=cache_scan(v,buf,i==2,&bytes);
+		ns=now_ns()-start;
+		printf("%-8s %-8s %9.1f %9llu %9llu %7u\n",
+			cache ? "cache" : "none",passes[i],
+			bytes/(ns/1000000000.0)/(1024*1024),
+			mock_server_count(m,afpReadExt),
+			mock_server_count(m,afpOpenFork),errors);
+	}
+	if (cache)
+		printf("         %llu hits, %llu misses, %llu blocks changed\n",
+			(unsigned long long) v->block_cache_stats.hits,
+			(unsigned long long) v->block_cache_stats.misses,
+			(unsigned long long) v->block_cache_stats.invalidated);
+	cache_change_big(root,0);
+
+	afp_unmount_volume(v);
+	free(buf);
+}
+
+static void run_cache(void)
+{
+	struct mock_server_options options;
+	struct mock_server * m;
+	char root[] = "/tmp/dsi_bench.XXXXXX";
+
+	if ((mkdtemp(root)==NULL) || (mock_populate(root))) {
+		printf("Could not set up files for the mock server\n");
+		return;
+	}
+	init_uams();
+	memset(&options,0,sizeof(options));
+	options.root=root;
+	if ((m=mock_server_start(&options))==NULL) {
+		printf("Could not start the mock server\n");
+		mock_cleanup(root);
+		return;
+	}
+	printf("Reading %u 4K files and a %uMB file from the mock server, "
+		"%uus latency\n",MOCK_FILES,MOCK_BIG_FILE/(1024*1024),
+		CACHE_LATENCY_US);
+	printf("%-8s %-8s %9s %9s %9s %7s\n","cache","pass","MB/s",
+		"ReadExts","OpenForks","errors");
+	bench_cache_one(m,root,0);
+	bench_cache_one(m,root,1);
+	mock_server_stop(m);
+	mock_cleanup(root);
+}
+
+/* The same scan through a cache directory, mounting again each time, with
+ * the big file changed before the third, and then with less room than
+ * the big file needs */
+
+#define DISK_CACHE_SIZE (64*1024*1024)
+#define DISK_CACHE_SMALL (16*1024*1024)
+
+static void disk_cache_remove_all(const char * path)
+{
+	char child[PATH_MAX];
+	struct dirent * d;
+	struct stat st;
+	DIR * dir;
+
+	if ((lstat(path,&st)==0) && (S_ISDIR(st.st_mode)) &&
+		((dir=opendir(path)))) {
+		while ((d=readdir(dir))) {
+			if ((strcmp(d->d_name,".")==0) ||
+				(strcmp(d->d_name,"..")==0))
+				continue;
+			snprintf(child,sizeof(child),"%s/%s",path,d->d_name);
+			disk_cache_remove_all(child);
+		}
+		closedir(dir);
+	}
+	remove(path);
+}
+
+static void bench_disk_cache_one(struct mock_server * m, const char * root,
+	const char * dir, const char * pass, uint64_t size, int changed)
+{
+	struct afp_volume * v;
+	unsigned long long start, ns;
+	uint64_t bytes=0;
+	unsigned int errors;
+	char * buf;
+
+	if ((buf=malloc(MOCK_CHUNK))==NULL) return;
+	if ((v=mock_connect(m,"readahead=0"))==NULL) {
+		printf("Could not connect to the mock server\n");
+		free(buf);
+		return;
+	}
+	v->extra_flags|=VOLUME_EXTRA_FLAGS_NO_LOCKING;
+	if ((v->disk_cache=afp_disk_cache_open(v,dir,size))==NULL)
+		printf("Could not set up the disk cache in %s\n",dir);
+
+	mock_server_reset_counts(m);
+	start=now_ns();
+	errors=cache_scan(v,buf,changed,&bytes);
+	ns=now_ns()-start;
+	printf("%-8s %5lluMB %9.1f %9llu %6llu %6llu %7llu %7llu %6u\n",pass,
+		(unsigned long long) size>>20,
+		bytes/(ns/1000000000.0)/(1024*1024),
+		mock_server_count(m,afpReadExt),
+		(unsigned long long) v->disk_cache_stats.hits,
+		(unsigned long long) v->disk_cache_stats.misses,
+		(unsigned long long) v->disk_cache_stats.invalidated,
+		(unsigned long long) v->disk_cache_stats.evicted,errors);
+
+	afp_unmount_volume(v);
+	free(buf);
+}
+
+/* A cache directory with no room under it for the volume's own */
+static void bench_disk_cache_long_path(struct mock_server * m)
+{
+	struct afp_volume * v;
+	struct afp_disk_cache * c;
+	char dir[PATH_MAX];
+
+	if ((v=mock_connect(m,"readahead=0"))==NULL) {
+		printf("Could not connect to the mock server\n");
+		return;
+	}
+	memset(dir,'a',sizeof(dir)-8);
+	memcpy(dir,"/tmp/",5);
+	dir[sizeof(dir)-8]='\0';
+	c=afp_disk_cache_open(v,dir,DISK_CACHE_SIZE);
+	printf("A %u character cache directory: %s\n",
+		(unsigned int) strlen(dir),c ? "taken" : "refused");
+	v->disk_cache=c;
+	afp_unmount_volume(v);
+}
+
+static void run_disk_cache(void)
+{
+	struct mock_server_options options;
+	struct mock_server * m;
+	char root[] = "/tmp/dsi_bench.XXXXXX";
+	char dir[] = "/tmp/dsi_bench.XXXXXX";
+
+	if ((mkdtemp(root)==NULL) || (mock_populate(root))) {
+		printf("Could not set up files for the mock server\n");
+		return;
+	}
+	if (mkdtemp(dir)==NULL) {
+		mock_cleanup(root);
+		return;
+	}
+	init_uams();
+	memset(&options,0,sizeof(options));
+	options.root=root;
+	if ((m=mock_server_start(&options))==NULL) {
+		printf("Could not start the mock server\n");
+		goto out;
+	}
+	mock_server_set_link(m,CACHE_LATENCY_US,0);
+	printf("Reading %u 4K files and a %uMB file from the mock server, "
+		"%uus latency, mounting each time\n",MOCK_FILES,
+		MOCK_BIG_FILE/(1024*1024),CACHE_LATENCY_US);
+	printf("%-8s %7s %9s %9s %6s %6s %7s %7s %6s\n","pass","size","MB/s",
+		"ReadExts","hits","misses","changed","evicted","errors");
+	bench_disk_cache_one(m,root,dir,"first",DISK_CACHE_SIZE,0);
+	bench_disk_cache_one(m,root,dir,"again",DISK_CACHE_SIZE,0);
+	cache_change_big(root,1);
+	bench_disk_cache_one(m,root,dir,"changed",DISK_CACHE_SIZE,1);
+	bench_disk_cache_one(m,root,dir,"again",DISK_CACHE_SIZE,1);
+	bench_disk_cache_one(m,root,dir,"smaller",DISK_CACHE_SMALL,1);
+	bench_disk_cache_one(m,root,dir,"again",DISK_CACHE_SMALL,1);
+	cache_change_big(root,0);
+	bench_disk_cache_long_path(m);
+	mock_server_stop(m);
+out:
+	disk_cache_remove_all(dir);
+	mock_cleanup(root);
+}
+
+/* Small random reads of the big file with each way of locking, and with a
+ * lease that can't be had because the file is open for writing.  Then
+ * unlocks that fail, and advisory locks between two forks of the same
+ * file. */
+
+#define LOCKING_LATENCY_US 200
+
+static void bench_locking_one(struct mock_server * m, struct afp_volume * v,
+	const char * name, unsigned int locking, int writer)
+{
+	struct afp_file_info * fp, * wp=NULL;
+	unsigned long long start, ns;
+	unsigned int i, errors=0;
+	uint64_t offset;
+	char buf[4096];
+	int eof, n, lease;
+
+	if (writer) {
+		afp_set_locking(v,AFP_LOCKING_IO);
+		if (ml_open(v,"/big",O_RDWR,&wp)) {
+			printf("Could not open /big for writing\n");
+			return;
+		}
+	}
+	afp_set_locking(v,locking);
+	if (ml_open(v,"/big",O_RDONLY,&fp)) {
+		printf("Could not open /big\n");
+		goto out;
+	}
+
+	srandom(1);
+	mock_server_reset_counts(m);
+	start=now_ns();
+	for (i=0;i<MOCK_RANDOM_READS;i++) {
+		offset=(random()%(MOCK_BIG_FILE/4096))*4096;
+		n=ml_read(v,"/big",buf,sizeof(buf),offset,fp,&eof);
+		if ((n!=sizeof(buf)) ||
+			((unsigned char) buf[0]!=mock_pattern(offset)))
+			errors++;
+	}
+	ns=now_ns()-start;
+	lease=fp->lease;
+	/* The last unlock may not be in until the fork is closed */
+	ml_close(v,"/big",fp);
+	free(fp);
+	printf("%-14s %5s %9.0f %9llu %9llu %7u\n",name,
+		lease ? "yes" : "no",ns/1000.0/MOCK_RANDOM_READS,
+		mock_server_count(m,afpReadExt),
+		mock_server_count(m,afpByteRangeLockExt),errors);
+out:
+	if (wp) {
+		ml_close(v,"/big",wp);
+		free(wp);
+	}
+}
+
+/* Unlocks aren't waited for, so one that fails has to be heard of on
+ * the next read, or on close */
+static void bench_locking_unlock_errors(struct afp_volume * v)
+{
+	struct afp_file_info * fp;
+	unsigned int checks=0, passed=0;
+	char buf[4096];
+	int eof;
+
+#define UNLOCK_CHECK(what,expect) do { checks++; \
+		if ((what)==(expect)) passed++; \
+		else printf("  %s gave %d, not %d\n",#what,(what),(expect)); \
+	} while (0)
+
+	afp_set_locking(v,AFP_LOCKING_IO);
+	if (ml_open(v,"/big",O_RDONLY,&fp)) {
+		printf("Could not open /big\n");
+		return;
+	}
+	UNLOCK_CHECK(ml_read(v,"/big",buf,sizeof(buf),0,fp,&eof),
+		(int) sizeof(buf));
+	/* Nothing is locked there, so the server says no */
+	UNLOCK_CHECK(ll_handle_unlocking_async(v,fp,8192,4096),0);
+	UNLOCK_CHECK(ll_wait_unlocks(fp),-1);
+	UNLOCK_CHECK(ll_handle_unlocking_async(v,fp,8192,4096),0);
+	/* The server answers in order, so once a lock after it is back,
+	 * so is the unlock */
+	UNLOCK_CHECK(ll_handle_locking(v,fp->forkid,16384,4096),0);
+	UNLOCK_CHECK(ll_handle_unlocking(v,fp->forkid,16384,4096),0);
+	UNLOCK_CHECK(ml_read(v,"/big",buf,sizeof(buf),0,fp,&eof),-EIO);
+	UNLOCK_CHECK(ml_read(v,"/big",buf,sizeof(buf),0,fp,&eof),
+		(int) sizeof(buf));
+	UNLOCK_CHECK(ll_handle_unlocking_async(v,fp,8192,4096),0);
+	UNLOCK_CHECK(ml_close(v,"/big",fp),EIO);
+	free(fp);
+
+	printf("Failed unlocks: %u of %u checks passed\n",passed,checks);
+#undef UNLOCK_CHECK
+}
+
+/* A write to a range another fork has locked gives up, and says so */
+static void bench_locking_contended(struct afp_volume * v)
+{
+	struct afp_file_info * a, * b;
+	char buf[4096];
+	int eof, ret;
+
+	afp_set_locking(v,AFP_LOCKING_IO);
+	if ((ml_open(v,"/big",O_RDWR,&a)) || (ml_open(v,"/big",O_RDONLY,&b))) {
+		printf("Could not open /big twice\n");
+		return;
+	}
+	ml_read(v,"/big",buf,sizeof(buf),0,a,&eof);
+	ll_handle_locking(v,b->forkid,0,sizeof(buf));
+	ret=ml_write(v,"/big",buf,sizeof(buf),0,a,getuid(),getgid());
+	printf("Write to a locked range: %d, ",ret);
+	ll_handle_unlocking(v,b->forkid,0,sizeof(buf));
+	ret=ml_write(v,"/big",buf,sizeof(buf),0,a,getuid(),getgid());
+	printf("once unlocked: %d\n",ret);
+	ml_close(v,"/big",b);
+	free(b);
+	ml_close(v,"/big",a);
+	free(a);
+}
+
+static void bench_locking_advisory(struct afp_volume * v)
+{
+	struct afp_file_info * a, * b;
+	unsigned int checks=0, passed=0;
+	struct flock l;
+
+#define LOCK_CHECK(what,expect) do { checks++; \
+		if ((what)==(expect)) passed++; \
+		else printf("  %s gave %d, not %d\n",#what,(what),(expect)); \
+	} while (0)
+#define LOCK_RANGE(type,s,n) (memset(&l,0,sizeof(l)),l.l_type=(type), \
+	l.l_whence=SEEK_SET,l.l_start=(s),l.l_len=(n),&l)
+
+	afp_set_locking(v,AFP_LOCKING_ADVISORY);
+	if ((ml_open(v,"/big",O_RDONLY,&a)) ||
+		(ml_open(v,"/big",O_RDONLY,&b))) {
+		printf("Could not open /big twice\n");
+		return;
+	}
+
+	LOCK_CHECK(ml_lock(v,"/big",a,F_SETLK,LOCK_RANGE(F_WRLCK,0,4096)),0);
+	LOCK_CHECK(ml_lock(v,"/big",b,F_SETLK,LOCK_RANGE(F_RDLCK,1024,1)),
+		-EAGAIN);
+	LOCK_CHECK(ml_lock(v,"/big",b,F_GETLK,LOCK_RANGE(F_WRLCK,0,10)),0);
+	LOCK_CHECK(l.l_type,F_WRLCK);
+	/* Taking more of it, over what it has already */
+	LOCK_CHECK(ml_lock(v,"/big",a,F_SETLK,LOCK_RANGE(F_WRLCK,0,8192)),0);
+	/* Letting go of the middle of it */
+	LOCK_CHECK(ml_lock(v,"/big",a,F_SETLK,LOCK_RANGE(F_UNLCK,2048,2048)),
+		0);
+	LOCK_CHECK(ml_lock(v,"/big",b,F_SETLK,LOCK_RANGE(F_WRLCK,2048,2048)),
+		0);
+	LOCK_CHECK(ml_lock(v,"/big",b,F_SETLK,LOCK_RANGE(F_WRLCK,0,4096)),
+		-EAGAIN);
+	LOCK_CHECK(ml_lock(v,"/big",b,F_GETLK,LOCK_RANGE(F_WRLCK,2048,10)),
+		0);
+	LOCK_CHECK(l.l_type,F_UNLCK);
+	LOCK_CHECK(ml_flock(v,"/big",b,LOCK_EX|LOCK_NB),-EAGAIN);
+	LOCK_CHECK(ml_flock(v,"/big",a,LOCK_UN),0);
+	LOCK_CHECK(ml_flock(v,"/big",b,LOCK_EX|LOCK_NB),0);
+	LOCK_CHECK(ml_lock(v,"/big",a,F_SETLK,LOCK_RANGE(F_WRLCK,1<<20,0)),
+		-EAGAIN);
+	/* A blocking one gives up in the end, rather than hold FUSE up */
+	LOCK_CHECK(ml_flock(v,"/big",a,LOCK_EX),-EINTR);
+	/* Closing a fork lets go of its locks */
+	ml_close(v,"/big",b);
+	free(b);
+	LOCK_CHECK(ml_lock(v,"/big",a,F_SETLK,LOCK_RANGE(F_WRLCK,1<<20,0)),0);
+	ml_close(v,"/big",a);
+	free(a);
+
+	printf("Advisory locks between two forks: %u of %u checks passed\n",
+		passed,checks);
+#undef LOCK_CHECK
+#undef LOCK_RANGE
+}
+
+static void run_locking(void)
+{
+	struct mock_server_options options;
+	struct mock_server * m;
+	struct afp_volume * v;
+	char root[] = "/tmp/dsi_bench.XXXXXX";
+
+	if ((mkdtemp(root)==NULL) || (mock_populate(root))) {
+		printf("Could not set up files for the mock server\n");
+		return;
+	}
+	init_uams();
+	memset(&options,0,sizeof(options));
+	options.root=root;
+	if ((m=mock_server_start(&options))==NULL) {
+		printf("Could not start the mock server\n");
+		mock_cleanup(root);
+		return;
+	}
+	mock_server_set_link(m,LOCKING_LATENCY_US,0);
+	if ((v=mock_connect(m,NULL))==NULL) {
+		printf("Could not connect to the mock server\n");
+		goto out;
+	}
+	printf("%u random 4K reads of a %uMB file from the mock server, "
+		"%uus latency\n",MOCK_RANDOM_READS,MOCK_BIG_FILE/(1024*1024),
+		LOCKING_LATENCY_US);
+	printf("%-14s %5s %9s %9s %9s %7s\n","locking","lease","us/read",
+		"ReadExts","Locks","errors");
+	bench_locking_one(m,v,"none",AFP_LOCKING_NONE,0);
+	bench_locking_one(m,v,"advisory",AFP_LOCKING_ADVISORY,0);
+	bench_locking_one(m,v,"io",AFP_LOCKING_IO,0);
+	bench_locking_one(m,v,"lease",AFP_LOCKING_LEASE,0);
+	bench_locking_one(m,v,"lease, writer",AFP_LOCKING_LEASE,1);
+	bench_locking_unlock_errors(v);
+	bench_locking_contended(v);
+	bench_locking_advisory(v);
+	afp_unmount_volume(v);
+out:
+	mock_server_stop(m);
+	mock_cleanup(root);
+}
+
+int main(int argc, char ** argv)
+{
+	char * mode = (argc>1) ? argv[1] : NULL;
+
+	libafpclient_register(NULL);
+	afp_main_quick_startup(NULL);
+	afp_wait_for_started_loop();
+
+	if ((!mode) || (strcmp(mode,"dispatch")==0)) run_dispatch();
+	if ((!mode) || (strcmp(mode,"write")==0)) run_write();
+	if ((!mode) || (strcmp(mode,"replies")==0)) run_replies();
+	if ((!mode) || (strcmp(mode,"isolation")==0)) run_isolation();
+	if ((!mode) || (strcmp(mode,"async")==0)) run_async();
+	if ((!mode) || (strcmp(mode,"coalesce")==0)) run_coalesce();
+	if ((!mode) || (strcmp(mode,"timeout")==0)) run_timeout();
+	if ((!mode) || (strcmp(mode,"quantum")==0)) run_quantum();
+	if ((!mode) || (strcmp(mode,"socket")==0)) run_socket();
+	if ((!mode) || (strcmp(mode,"priority")==0)) run_priority();
+	if ((!mode) || (strcmp(mode,"stripe")==0)) run_stripe();
+	if ((!mode) || (strcmp(mode,"rtt")==0)) run_rtt();
+	if ((!mode) || (strcmp(mode,"stress")==0)) run_stress();
+	if ((!mode) || (strcmp(mode,"events")==0)) run_events();
+	if ((!mode) || (strcmp(mode,"cmdstats")==0)) run_cmdstats();
+	if ((!mode) || (strcmp(mode,"capture")==0)) run_capture();
+	if ((!mode) || (strcmp(mode,"mock")==0)) run_mock();
+	if ((!mode) || (strcmp(mode,"readahead")==0)) run_readahead();
+	if ((!mode) || (strcmp(mode,"cache")==0)) run_cache();
+	if ((!mode) || (strcmp(mode,"diskcache")==0)) run_disk_cache();
+	if ((!mode) || (strcmp(mode,"locking")==0)) run_locking();
+
+	return 0;
+}
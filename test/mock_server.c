@@ -0,0 +1,1626 @@
+/*
+ *  mock_server.c
+ *
+ *  A small AFP server, enough of one to test and benchmark the client
+ *  against without a Mac or netatalk around.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "afpfs-ng/afp.h"
+#include "afpfs-ng/afp_protocol.h"
+#include "dsi_protocol.h"
+#include "mock_server.h"
+
+/*
+ * The server serves one directory as one volume, over DSI on the loopback
+ * interface.  It speaks AFP 3.x with UTF8 names, and only the calls the
+ * library makes: logging in, opening the volume, looking things up,
+ * listing directories, reading and writing forks, locking, and creating,
+ * deleting and renaming.  Everything else gets kFPCallNotSupported.
+ *
+ * Each connection has a thread reading and handling requests in order,
+ * and a thread sending the replies.  If there's a latency or a bandwidth
+ * set, replies are held back until they would have got to the client
+ * over a link like that, so requests the client keeps in flight overlap
+ * the way they would on a real network.  Otherwise they're sent straight
+ * away.
+ *
+ * Files and directories get their CNIDs the first time they're seen, and
+ * keep them across renames until they're deleted.
+ */
+
+#define MOCK_DEFAULT_VOLUME "Mock"
+#define MOCK_DEFAULT_QUANTUM (1024*1024)
+#define MOCK_SERVER_NAME "afpmock"
+#define MOCK_VOLID 1
+#define MOCK_FIRST_CNID 17
+#define MOCK_MAX_FORKS 1024
+/* The most a request or a reply can be, whatever the client asks for */
+#define MOCK_MAX_PACKET (16*1024*1024)
+/* Room for the parameters of one file or directory, with its names */
+#define MOCK_MAX_PARAMS 1024
+/* The hint that goes before UTF8 names, which is what the client uses */
+#define MOCK_UTF8_HINT 0x08000103
+
+struct mock_lock {
+	uint64_t start;
+	uint64_t len;
+};
+
+struct mock_connection;
+
+struct mock_fork {
+	struct mock_connection * owner;
+	/* -1 for a resource fork, which is always empty */
+	int fd;
+	unsigned int cnid;
+	unsigned short access;
+	struct mock_lock * locks;
+	unsigned int num_locks;
+};
+
+struct mock_reply {
+	struct mock_reply * next;
+	uint64_t due;
+	unsigned int len;
+	char data[];
+};
+
+struct mock_connection {
+	struct mock_server * server;
+	int fd;
+	pthread_t sender;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* Replies that are waiting to go out.  The one being sent stays at
+	 * the head until it is gone. */
+	struct mock_reply * head, * tail;
+	int closing;
+	/* When the link each way is next free, in ns */
+	uint64_t in_busy, out_busy;
+	char * in;
+	unsigned int in_size;
+	/* Replies are built here, after room for the DSI header */
+	char * out;
+	unsigned int out_size;
+	struct mock_connection * next;
+};
+
+struct mock_server {
+	char root[PATH_MAX];
+	char volume_name[AFP_VOLUME_NAME_LEN];
+	char username[AFP_MAX_USERNAME_LEN];
+	char password[AFP_MAX_PASSWORD_LEN];
+	int check_password;
+	unsigned int quantum;
+	volatile unsigned int latency_us;
+	volatile uint64_t bandwidth;
+	char signature[AFP_SIGNATURE_LEN];
+
+	int listen_fd;
+	unsigned int port;
+	pthread_t acceptor;
+	volatile int stopping;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct mock_connection * connections;
+	/* CNID MOCK_FIRST_CNID+i is at paths[i], relative to the root.
+	 * Deleted ones are NULL. */
+	char ** paths;
+	unsigned int num_paths;
+	unsigned int max_paths;
+	struct mock_fork forks[MOCK_MAX_FORKS];
+
+	unsigned long long counts[256];
+};
+
+static uint64_t mock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((uint64_t) ts.tv_sec)*1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int get16(unsigned char * p)
+{
+	return (p[0]<<8)|p[1];
+}
+
+static unsigned int get32(unsigned char * p)
+{
+	return ((unsigned int) p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+static uint64_t get64(unsigned char * p)
+{
+	return ((uint64_t) get32(p)<<32)|get32(p+4);
+}
+
+static unsigned char * put16(unsigned char * p, unsigned int v)
+{
+	p[0]=v>>8;
+	p[1]=v;
+	return p+2;
+}
+
+static unsigned char * put32(unsigned char * p, unsigned int v)
+{
+	p[0]=v>>24;
+	p[1]=v>>16;
+	p[2]=v>>8;
+	p[3]=v;
+	return p+4;
+}
+
+static unsigned char * put64(unsigned char * p, uint64_t v)
+{
+	put32(p,v>>32);
+	return put32(p+4,v);
+}
+
+static unsigned char * put_pascal(unsigned char * p, const char * s)
+{
+	unsigned int len=strlen(s);
+
+	if (len>255) len=255;
+	p[0]=len;
+	memcpy(p+1,s,len);
+	return p+1+len;
+}
+
+static unsigned int mock_date(time_t t)
+{
+	return t-946684800;
+}
+
+static int mock_errno(int err)
+{
+	switch (err) {
+	case ENOENT:
+	case ENOTDIR:
+		return kFPObjectNotFound;
+	case EACCES:
+	case EPERM:
+	case EROFS:
+		return kFPAccessDenied;
+	case EEXIST:
+		return kFPObjectExists;
+	case ENOTEMPTY:
+		return kFPDirNotEmpty;
+	case ENOSPC:
+		return kFPDiskFull;
+	}
+	return kFPMiscErr;
+}
+
+/* CNIDs.  These are all called with the server's mutex held. */
+
+static const char * mock_cnid_path(struct mock_server * s, unsigned int cnid)
+{
+	if (cnid==AFP_ROOT_DID) return "";
+	if ((cnid<MOCK_FIRST_CNID) || (cnid-MOCK_FIRST_CNID>=s->num_paths))
+		return NULL;
+	return s->paths[cnid-MOCK_FIRST_CNID];
+}
+
+static unsigned int mock_cnid(struct mock_server * s, const char * rel)
+{
+	unsigned int i;
+	char ** paths;
+
+	if (rel[0]=='\0') return AFP_ROOT_DID;
+	for (i=0;i<s->num_paths;i++)
+		if ((s->paths[i]) && (strcmp(s->paths[i],rel)==0))
+			return MOCK_FIRST_CNID+i;
+	if (s->num_paths==s->max_paths) {
+		i=s->max_paths ? s->max_paths*2 : 256;
+		if ((paths=realloc(s->paths,i*sizeof(char *)))==NULL)
+			return 0;
+		s->paths=paths;
+		s->max_paths=i;
+	}
+	if ((s->paths[s->num_paths]=strdup(rel))==NULL)
+		return 0;
+	return MOCK_FIRST_CNID+s->num_paths++;
+}
+
+static void mock_cnid_forget(struct mock_server * s, const char * rel)
+{
+	unsigned int i;
+
+	for (i=0;i<s->num_paths;i++)
+		if ((s->paths[i]) && (strcmp(s->paths[i],rel)==0)) {
+			free(s->paths[i]);
+			s->paths[i]=NULL;
+		}
+}
+
+/* Moves from, and everything under it, to to */
+static void mock_cnid_rename(struct mock_server * s, const char * from,
+	const char * to)
+{
+	unsigned int i, len=strlen(from);
+	char * path;
+
+	mock_cnid_forget(s,to);
+	for (i=0;i<s->num_paths;i++) {
+		if ((s->paths[i]==NULL) || (strncmp(s->paths[i],from,len)) ||
+			((s->paths[i][len]!='\0') && (s->paths[i][len]!='/')))
+			continue;
+		if ((path=malloc(strlen(to)+strlen(s->paths[i]+len)+1))==NULL)
+			continue;
+		sprintf(path,"%s%s",to,s->paths[i]+len);
+		free(s->paths[i]);
+		s->paths[i]=path;
+	}
+}
+
+/* Paths */
+
+/* Reads the AFP path at *p into name, with its parts joined by '/', and
+ * moves *p past it. */
+static int mock_get_path(unsigned char ** p, unsigned char * end,
+	char * name, unsigned int size)
+{
+	unsigned char * q = *p, * part;
+	unsigned int len, i, j, n=0;
+
+	name[0]='\0';
+	if (q>=end) return 0;
+	switch (q[0]) {
+	case kFPUTF8Name:
+		if (q+7>end) return kFPParamErr;
+		len=get16(q+5);
+		q+=7;
+		break;
+	case kFPLongName:
+		if (q+2>end) return kFPParamErr;
+		len=q[1];
+		q+=2;
+		break;
+	default:
+		return kFPParamErr;
+	}
+	if (q+len>end) return kFPParamErr;
+	*p=q+len;
+
+	for (i=0;i<len;i=j+1) {
+		part=q+i;
+		for (j=i;(j<len) && (q[j]!='\0');j++)
+			if (q[j]=='/') return kFPParamErr;
+		if (j==i) continue;
+		if (((j-i==1) && (part[0]=='.')) ||
+			((j-i==2) && (part[0]=='.') && (part[1]=='.')))
+			return kFPParamErr;
+		if (n+(j-i)+2>size) return kFPParamErr;
+		if (n) name[n++]='/';
+		memcpy(name+n,part,j-i);
+		n+=j-i;
+		name[n]='\0';
+	}
+	return 0;
+}
+
+static int mock_join(char * rel, const char * base, const char * name)
+{
+	int n;
+
+	if (base[0]=='\0')
+		n=snprintf(rel,PATH_MAX,"%s",name);
+	else if (name[0]=='\0')
+		n=snprintf(rel,PATH_MAX,"%s",base);
+	else
+		n=snprintf(rel,PATH_MAX,"%s/%s",base,name);
+	return (n>=PATH_MAX) ? kFPParamErr : 0;
+}
+
+/* Works out where the path at *p from the directory did is, relative to
+ * the root */
+static int mock_resolve(struct mock_server * s, unsigned int did,
+	unsigned char ** p, unsigned char * end, char * rel)
+{
+	char name[PATH_MAX];
+	const char * base;
+	int rc;
+
+	if ((base=mock_cnid_path(s,did))==NULL)
+		return kFPObjectNotFound;
+	if ((rc=mock_get_path(p,end,name,sizeof(name))))
+		return rc;
+	return mock_join(rel,base,name);
+}
+
+static void mock_disk(struct mock_server * s, const char * rel, char * path)
+{
+	if (rel[0]=='\0')
+		snprintf(path,PATH_MAX,"%s",s->root);
+	else
+		snprintf(path,PATH_MAX,"%s/%s",s->root,rel);
+}
+
+static int mock_stat(struct mock_server * s, const char * rel,
+	struct stat * st)
+{
+	char path[PATH_MAX];
+
+	mock_disk(s,rel,path);
+	if (stat(path,st)<0)
+		return mock_errno(errno);
+	return 0;
+}
+
+static unsigned int mock_parent(struct mock_server * s, const char * rel)
+{
+	char parent[PATH_MAX];
+	char * slash;
+
+	if (rel[0]=='\0') return 1;
+	snprintf(parent,sizeof(parent),"%s",rel);
+	if ((slash=strrchr(parent,'/'))==NULL)
+		return AFP_ROOT_DID;
+	*slash='\0';
+	return mock_cnid(s,parent);
+}
+
+static unsigned int mock_offspring(struct mock_server * s, const char * rel)
+{
+	char path[PATH_MAX];
+	struct dirent * de;
+	unsigned int n=0;
+	DIR * dir;
+
+	mock_disk(s,rel,path);
+	if ((dir=opendir(path))==NULL) return 0;
+	while ((de=readdir(dir)))
+		if ((strcmp(de->d_name,".")) && (strcmp(de->d_name,"..")))
+			n++;
+	closedir(dir);
+	return n;
+}
+
+/* Packs the parameters in bitmap for the file or directory at rel, the
+ * way parse_reply_block() reads them.  Returns how long they are. */
+static unsigned int mock_pack_params(struct mock_server * s,
+	const char * rel, struct stat * st, unsigned short bitmap,
+	unsigned char * buf)
+{
+	int isdir = S_ISDIR(st->st_mode);
+	unsigned char * p = buf, * longname=NULL, * utf8name=NULL, * q;
+	const char * name;
+	unsigned int len;
+
+	if (rel[0]=='\0')
+		name=s->volume_name;
+	else if ((name=strrchr(rel,'/')))
+		name++;
+	else
+		name=rel;
+
+	if (bitmap & kFPAttributeBit) p=put16(p,0);
+	if (bitmap & kFPParentDirIDBit) p=put32(p,mock_parent(s,rel));
+	if (bitmap & kFPCreateDateBit) p=put32(p,mock_date(st->st_ctime));
+	if (bitmap & kFPModDateBit) p=put32(p,mock_date(st->st_mtime));
+	if (bitmap & kFPBackupDateBit) p=put32(p,0x80000000);
+	if (bitmap & kFPFinderInfoBit) {
+		memset(p,0,32);
+		p+=32;
+	}
+	if (bitmap & kFPLongNameBit) {
+		longname=p;
+		p+=2;
+	}
+	if (bitmap & kFPShortNameBit) p=put16(p,0);
+	if (bitmap & kFPNodeIDBit) p=put32(p,mock_cnid(s,rel));
+	if (isdir) {
+		if (bitmap & kFPOffspringCountBit)
+			p=put16(p,mock_offspring(s,rel));
+		if (bitmap & kFPOwnerIDBit) p=put32(p,st->st_uid);
+		if (bitmap & kFPGroupIDBit) p=put32(p,st->st_gid);
+		if (bitmap & kFPAccessRightsBit) p=put32(p,0x87070707);
+	} else {
+		if (bitmap & kFPDataForkLenBit)
+			p=put32(p,(st->st_size>0xffffffffLL) ?
+				0xffffffff : st->st_size);
+		if (bitmap & kFPRsrcForkLenBit) p=put32(p,0);
+		if (bitmap & kFPExtDataForkLenBit) p=put64(p,st->st_size);
+		if (bitmap & kFPLaunchLimitBit) p=put16(p,0);
+	}
+	if (bitmap & kFPUTF8NameBit) {
+		utf8name=p;
+		p=put32(p+2,0);
+	}
+	if (bitmap & kFPExtRsrcForkLenBit) p=put64(p,0);
+	if (bitmap & kFPUnixPrivsBit) {
+		p=put32(p,st->st_uid);
+		p=put32(p,st->st_gid);
+		p=put32(p,st->st_mode);
+		p=put32(p,0x87);
+	}
+
+	/* The names go after the fixed part */
+	if (longname) {
+		put16(longname,p-buf);
+		p=put_pascal(p,name);
+	}
+	if (utf8name) {
+		put16(utf8name,p-buf);
+		len=strlen(name);
+		if (len>255) len=255;
+		q=put32(p,MOCK_UTF8_HINT);
+		q=put16(q,len);
+		memcpy(q,name,len);
+		p=q+len;
+	}
+	return p-buf;
+}
+
+/* The replies to each call.  They each get the request, and build what
+ * goes back after the DSI header in out, and set *len to its length.
+ * They return the AFP result. */
+
+struct mock_request {
+	struct mock_connection * c;
+	unsigned char * in;
+	unsigned int in_len;
+	/* Where the data starts, for DSIWrite */
+	unsigned int data_offset;
+	unsigned char * out;
+	unsigned int len;
+};
+
+static unsigned char * mock_pack_volume(struct mock_server * s,
+	unsigned short bitmap, unsigned char * p)
+{
+	unsigned char * start = p, * name=NULL;
+	struct statvfs sv;
+	struct stat st;
+	uint64_t free_bytes=0, total_bytes=0;
+	unsigned int block_size=4096;
+
+	if (statvfs(s->root,&sv)==0) {
+		block_size=sv.f_bsize;
+		free_bytes=(uint64_t) sv.f_bavail*sv.f_frsize;
+		total_bytes=(uint64_t) sv.f_blocks*sv.f_frsize;
+	}
+	if (stat(s->root,&st)<0)
+		memset(&st,0,sizeof(st));
+
+	if (bitmap & kFPVolAttributeBit)
+		p=put16(p,kSupportsFileIDs|kSupportsUnixPrivs|
+			kSupportsUTF8Names|kNoNetworkUserIDs);
+	if (bitmap & kFPVolSignatureBit) p=put16(p,AFP_VOL_FIXED);
+	if (bitmap & kFPVolCreateDateBit) p=put32(p,mock_date(st.st_ctime));
+	if (bitmap & kFPVolModDateBit) p=put32(p,mock_date(st.st_mtime));
+	if (bitmap & kFPVolBackupDateBit) p=put32(p,0x80000000);
+	if (bitmap & kFPVolIDBit) p=put16(p,MOCK_VOLID);
+	if (bitmap & kFPVolBytesFreeBit)
+		p=put32(p,(free_bytes>0xffffffffULL) ? 0xffffffff : free_bytes);
+	if (bitmap & kFPVolBytesTotalBit)
+		p=put32(p,(total_bytes>0xffffffffULL) ?
+			0xffffffff : total_bytes);
+	if (bitmap & kFPVolNameBit) {
+		name=p;
+		p+=2;
+	}
+	if (bitmap & kFPVolExtBytesFreeBit) p=put64(p,free_bytes);
+	if (bitmap & kFPVolExtBytesTotalBit) p=put64(p,total_bytes);
+	if (bitmap & kFPVolBlockSizeBit) p=put32(p,block_size);
+	if (name) {
+		put16(name,p-start);
+		p=put_pascal(p,s->volume_name);
+	}
+	return p;
+}
+
+static int mock_login(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+1, * end = r->in+r->in_len;
+	char uam[256], username[256];
+	unsigned int len;
+
+	/* The version, which we don't care about */
+	if ((p>=end) || (p+1+p[0]>end)) return kFPParamErr;
+	p+=1+p[0];
+	if ((p>=end) || (p+1+p[0]>end)) return kFPParamErr;
+	len=p[0];
+	memcpy(uam,p+1,len);
+	uam[len]='\0';
+	p+=1+len;
+
+	if (strcmp(uam,"No User Authent")==0)
+		return kFPNoErr;
+	if (strcmp(uam,"Cleartxt Passwrd"))
+		return kFPBadUAM;
+
+	/* A username, padding to get to an even offset, and then 8 bytes of
+	 * password, so the password is always the last 8 bytes */
+	if ((p>=end) || (p+1+p[0]+8>end)) return kFPParamErr;
+	len=p[0];
+	memcpy(username,p+1,len);
+	username[len]='\0';
+	if (!s->check_password)
+		return kFPNoErr;
+	if ((strcmp(username,s->username)) ||
+		(strncmp((char *) end-8,s->password,8)))
+		return kFPUserNotAuth;
+	return kFPNoErr;
+}
+
+static int mock_getsrvrparms(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->out;
+
+	p=put32(p,mock_date(time(NULL)));
+	*p++=1;
+	*p++=0;
+	p=put_pascal(p,s->volume_name);
+	r->len=p-r->out;
+	return kFPNoErr;
+}
+
+static int mock_getsrvrmsg(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->out;
+	unsigned int bitmap;
+
+	if (r->in_len<6) return kFPParamErr;
+	bitmap=get16(r->in+4);
+	p=put16(p,get16(r->in+2));
+	p=put16(p,bitmap);
+	/* No message */
+	if (bitmap & AFP_GETSRVRMSG_UTF8)
+		p=put16(p,0);
+	else
+		*p++=0;
+	r->len=p-r->out;
+	return kFPNoErr;
+}
+
+static int mock_getuserinfo(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->out;
+	unsigned int bitmap;
+
+	if (r->in_len<8) return kFPParamErr;
+	bitmap=get16(r->in+6);
+	p=put16(p,bitmap);
+	if (bitmap & kFPGetUserInfo_USER_ID) p=put32(p,getuid());
+	if (bitmap & kFPGetUserInfo_PRI_GROUPID) p=put32(p,getgid());
+	r->len=p-r->out;
+	return kFPNoErr;
+}
+
+static int mock_openvol(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+4;
+	unsigned int bitmap;
+
+	if ((r->in_len<5) || (p+1+p[0]>r->in+r->in_len))
+		return kFPParamErr;
+	if ((p[0]!=strlen(s->volume_name)) ||
+		(memcmp(p+1,s->volume_name,p[0])))
+		return kFPObjectNotFound;
+	bitmap=get16(r->in+2);
+	put16(r->out,bitmap);
+	r->len=mock_pack_volume(s,bitmap,r->out+2)-r->out;
+	return kFPNoErr;
+}
+
+static int mock_getvolparms(struct mock_server * s, struct mock_request * r)
+{
+	unsigned int bitmap;
+
+	if (r->in_len<6) return kFPParamErr;
+	if (get16(r->in+2)!=MOCK_VOLID) return kFPParamErr;
+	bitmap=get16(r->in+4);
+	put16(r->out,bitmap);
+	r->len=mock_pack_volume(s,bitmap,r->out+2)-r->out;
+	return kFPNoErr;
+}
+
+static int mock_getfiledirparms(struct mock_server * s,
+	struct mock_request * r)
+{
+	unsigned char * p = r->in+12;
+	char rel[PATH_MAX];
+	struct stat st;
+	unsigned int filebitmap, dirbitmap;
+	int rc;
+
+	if (r->in_len<12) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,r->in+r->in_len,rel)))
+		return rc;
+	if ((rc=mock_stat(s,rel,&st)))
+		return rc;
+	filebitmap=get16(r->in+8);
+	dirbitmap=get16(r->in+10);
+	put16(r->out,filebitmap);
+	put16(r->out+2,dirbitmap);
+	r->out[4]=S_ISDIR(st.st_mode) ? 0x80 : 0;
+	r->out[5]=0;
+	r->len=6+mock_pack_params(s,rel,&st,
+		S_ISDIR(st.st_mode) ? dirbitmap : filebitmap,r->out+6);
+	return kFPNoErr;
+}
+
+/* SetFileParms, SetDirParms and SetFileDirParms.  Only the modification
+ * date and the permissions actually change anything. */
+static int mock_setparms(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+10, * end = r->in+r->in_len;
+	char rel[PATH_MAX], path[PATH_MAX];
+	unsigned int bitmap;
+	struct timeval tv[2];
+	struct stat st;
+	int rc;
+
+	if (r->in_len<10) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,end,rel)))
+		return rc;
+	if ((rc=mock_stat(s,rel,&st)))
+		return rc;
+	mock_disk(s,rel,path);
+	bitmap=get16(r->in+8);
+	if (bitmap & ~(kFPAttributeBit|kFPCreateDateBit|kFPModDateBit|
+		kFPBackupDateBit|kFPFinderInfoBit|kFPUnixPrivsBit))
+		return kFPBitmapErr;
+	if ((p-r->in) & 1) p++;
+
+	if (bitmap & kFPAttributeBit) p+=2;
+	if (bitmap & kFPCreateDateBit) p+=4;
+	if (bitmap & kFPModDateBit) {
+		if (p+4>end) return kFPParamErr;
+		tv[0].tv_sec=st.st_atime;
+		tv[0].tv_usec=0;
+		tv[1].tv_sec=(time_t) get32(p)+946684800;
+		tv[1].tv_usec=0;
+		if (utimes(path,tv)<0)
+			return mock_errno(errno);
+		p+=4;
+	}
+	if (bitmap & kFPBackupDateBit) p+=4;
+	if (bitmap & kFPFinderInfoBit) p+=32;
+	if (bitmap & kFPUnixPrivsBit) {
+		if (p+16>end) return kFPParamErr;
+		if (chmod(path,get32(p+8) & 07777)<0)
+			return mock_errno(errno);
+	}
+	return kFPNoErr;
+}
+
+static int mock_enumerate(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+22, * entry;
+	char rel[PATH_MAX], child[PATH_MAX];
+	unsigned int filebitmap, dirbitmap, want, start, max, count=0, i;
+	unsigned char params[MOCK_MAX_PARAMS];
+	struct dirent ** names=NULL;
+	struct stat st;
+	int n, rc, len;
+
+	if (r->in_len<22) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,r->in+r->in_len,rel)))
+		return rc;
+	if ((rc=mock_stat(s,rel,&st)))
+		return rc;
+	if (!S_ISDIR(st.st_mode))
+		return kFPObjectTypeErr;
+	filebitmap=get16(r->in+8);
+	dirbitmap=get16(r->in+10);
+	want=get16(r->in+12);
+	start=get32(r->in+14);
+	max=get32(r->in+18);
+	if (max>r->c->out_size-16) max=r->c->out_size-16;
+
+	mock_disk(s,rel,child);
+	if ((n=scandir(child,&names,NULL,alphasort))<0)
+		return mock_errno(errno);
+
+	put16(r->out,filebitmap);
+	put16(r->out+2,dirbitmap);
+	entry=r->out+6;
+	for (i=0;i<(unsigned int) n;i++) {
+		if ((strcmp(names[i]->d_name,".")==0) ||
+			(strcmp(names[i]->d_name,"..")==0))
+			continue;
+		if (start>1) {
+			start--;
+			continue;
+		}
+		if (count>=want)
+			break;
+		if ((mock_join(child,rel,names[i]->d_name)) ||
+			(mock_stat(s,child,&st)))
+			continue;
+		len=mock_pack_params(s,child,&st,
+			S_ISDIR(st.st_mode) ? dirbitmap : filebitmap,params);
+		len=(len+4+1)&~1;
+		if ((entry+len)-r->out>max)
+			break;
+		put16(entry,len);
+		entry[2]=S_ISDIR(st.st_mode) ? 0x80 : 0;
+		entry[3]=0;
+		memcpy(entry+4,params,len-4);
+		entry+=len;
+		count++;
+	}
+	for (i=0;i<(unsigned int) n;i++)
+		free(names[i]);
+	free(names);
+
+	if (count==0)
+		return kFPObjectNotFound;
+	put16(r->out+4,count);
+	r->len=entry-r->out;
+	return kFPNoErr;
+}
+
+static int mock_createfile(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+8;
+	char rel[PATH_MAX], path[PATH_MAX];
+	int rc, fd;
+
+	if (r->in_len<8) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,r->in+r->in_len,rel)))
+		return rc;
+	mock_disk(s,rel,path);
+	fd=open(path,O_WRONLY|O_CREAT|
+		((r->in[1] & kFPHardCreate) ? O_TRUNC : O_EXCL),0644);
+	if (fd<0)
+		return mock_errno(errno);
+	close(fd);
+	mock_cnid(s,rel);
+	return kFPNoErr;
+}
+
+static int mock_createdir(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+8;
+	char rel[PATH_MAX], path[PATH_MAX];
+	int rc;
+
+	if (r->in_len<8) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,r->in+r->in_len,rel)))
+		return rc;
+	mock_disk(s,rel,path);
+	if (mkdir(path,0755)<0)
+		return mock_errno(errno);
+	put32(r->out,mock_cnid(s,rel));
+	r->len=4;
+	return kFPNoErr;
+}
+
+static int mock_delete(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+8;
+	char rel[PATH_MAX], path[PATH_MAX];
+	struct stat st;
+	int rc;
+
+	if (r->in_len<8) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,r->in+r->in_len,rel)))
+		return rc;
+	if (rel[0]=='\0')
+		return kFPAccessDenied;
+	mock_disk(s,rel,path);
+	if (lstat(path,&st)<0)
+		return mock_errno(errno);
+	if (S_ISDIR(st.st_mode)) {
+		if (rmdir(path)<0)
+			return (errno==EEXIST) ? kFPDirNotEmpty :
+				mock_errno(errno);
+	} else if (unlink(path)<0)
+		return mock_errno(errno);
+	mock_cnid_forget(s,rel);
+	return kFPNoErr;
+}
+
+static int mock_moveandrename(struct mock_server * s,
+	struct mock_request * r)
+{
+	unsigned char * p = r->in+12, * end = r->in+r->in_len;
+	char from[PATH_MAX], dest[PATH_MAX], name[PATH_MAX], to[PATH_MAX];
+	char from_path[PATH_MAX], to_path[PATH_MAX];
+	const char * base;
+	struct stat st;
+	int rc;
+
+	if (r->in_len<12) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,end,from)) ||
+		(rc=mock_resolve(s,get32(r->in+8),&p,end,dest)) ||
+		(rc=mock_get_path(&p,end,name,sizeof(name))))
+		return rc;
+	if (from[0]=='\0')
+		return kFPCantRename;
+	if ((rc=mock_stat(s,dest,&st)))
+		return rc;
+	if (!S_ISDIR(st.st_mode))
+		return kFPObjectTypeErr;
+	/* No new name means it keeps the one it has */
+	if (name[0]=='\0') {
+		base=strrchr(from,'/');
+		snprintf(name,sizeof(name),"%s",base ? base+1 : from);
+	}
+	if (strchr(name,'/'))
+		return kFPParamErr;
+	if ((rc=mock_join(to,dest,name)))
+		return rc;
+	if (mock_stat(s,to,&st)==0)
+		return kFPObjectExists;
+	mock_disk(s,from,from_path);
+	mock_disk(s,to,to_path);
+	if (rename(from_path,to_path)<0)
+		return mock_errno(errno);
+	mock_cnid_rename(s,from,to);
+	return kFPNoErr;
+}
+
+/* Forks */
+
+static struct mock_fork * mock_get_fork(struct mock_server * s,
+	unsigned int forkid)
+{
+	if ((forkid==0) || (forkid>MOCK_MAX_FORKS) ||
+		(s->forks[forkid-1].owner==NULL))
+		return NULL;
+	return &s->forks[forkid-1];
+}
+
+static void mock_close_fork(struct mock_fork * f)
+{
+	if (f->fd>=0) close(f->fd);
+	free(f->locks);
+	memset(f,0,sizeof(*f));
+}
+
+/* If opening cnid with access would go against a deny mode of a fork
+ * that's already open, or the other way around */
+static int mock_deny_conflict(struct mock_server * s, unsigned int cnid,
+	unsigned short access)
+{
+	struct mock_fork * f;
+	unsigned int i;
+
+	for (i=0;i<MOCK_MAX_FORKS;i++) {
+		f=&s->forks[i];
+		if ((f->owner==NULL) || (f->cnid!=cnid)) continue;
+		if (((access & AFP_OPENFORK_ALLOWREAD) &&
+			(f->access & AFP_OPENFORK_DENYREAD)) ||
+			((access & AFP_OPENFORK_ALLOWWRITE) &&
+			(f->access & AFP_OPENFORK_DENYWRITE)) ||
+			((access & AFP_OPENFORK_DENYREAD) &&
+			(f->access & AFP_OPENFORK_ALLOWREAD)) ||
+			((access & AFP_OPENFORK_DENYWRITE) &&
+			(f->access & AFP_OPENFORK_ALLOWWRITE)))
+			return 1;
+	}
+	return 0;
+}
+
+static int mock_openfork(struct mock_server * s, struct mock_request * r)
+{
+	unsigned char * p = r->in+12;
+	char rel[PATH_MAX], path[PATH_MAX];
+	unsigned short access;
+	unsigned int cnid, i;
+	struct mock_fork * f;
+	struct stat st;
+	int rc, fd=-1;
+
+	if (r->in_len<12) return kFPParamErr;
+	if ((rc=mock_resolve(s,get32(r->in+4),&p,r->in+r->in_len,rel)))
+		return rc;
+	if ((rc=mock_stat(s,rel,&st)))
+		return rc;
+	if (S_ISDIR(st.st_mode))
+		return kFPObjectTypeErr;
+	access=get16(r->in+10);
+	cnid=mock_cnid(s,rel);
+	if (mock_deny_conflict(s,cnid,access))
+		return kFPDenyConflict;
+	for (i=0;(i<MOCK_MAX_FORKS) && (s->forks[i].owner);i++);
+	if (i==MOCK_MAX_FORKS)
+		return kFPTooManyFilesOpen;
+
+	if (!(r->in[1] & AFP_FORKTYPE_RESOURCE)) {
+		mock_disk(s,rel,path);
+		if ((fd=open(path,(access & AFP_OPENFORK_ALLOWWRITE) ?
+			O_RDWR : O_RDONLY))<0)
+			return mock_errno(errno);
+	}
+	f=&s->forks[i];
+	f->owner=r->c;
+	f->fd=fd;
+	f->cnid=cnid;
+	f->access=access;
+	put16(r->out,get16(r->in+8));
+	put16(r->out+2,i+1);
+	r->len=4+mock_pack_params(s,rel,&st,get16(r->in+8),r->out+4);
+	return kFPNoErr;
+}
+
+static int mock_closefork(struct mock_server * s, struct mock_request * r)
+{
+	struct mock_fork * f;
+
+	if (r->in_len<4) return kFPParamErr;
+	if ((f=mock_get_fork(s,get16(r->in+2)))==NULL)
+		return kFPParamErr;
+	mock_close_fork(f);
+	return kFPNoErr;
+}
+
+static int mock_setforkparms(struct mock_server * s, struct mock_request * r)
+{
+	struct mock_fork * f;
+	unsigned int bitmap;
+	uint64_t len;
+
+	if (r->in_len<10) return kFPParamErr;
+	if ((f=mock_get_fork(s,get16(r->in+2)))==NULL)
+		return kFPParamErr;
+	bitmap=get16(r->in+4);
+	if (bitmap & (kFPExtDataForkLenBit|kFPExtRsrcForkLenBit)) {
+		if (r->in_len<14) return kFPParamErr;
+		len=get64(r->in+6);
+	} else
+		len=get32(r->in+6);
+	if (!(f->access & AFP_OPENFORK_ALLOWWRITE))
+		return kFPAccessDenied;
+	if ((f->fd>=0) && (ftruncate(f->fd,len)<0))
+		return mock_errno(errno);
+	return kFPNoErr;
+}
+
+static int mock_overlaps(struct mock_lock * l, uint64_t start, uint64_t len)
+{
+	return (start<l->start+l->len) && (l->start<start+len);
+}
+
+static int mock_byterangelock(struct mock_server * s,
+	struct mock_request * r)
+{
+	struct mock_fork * f, * other;
+	struct mock_lock * locks;
+	unsigned int i, j;
+	uint64_t start, len;
+	struct stat st;
+
+	if (r->in_len<20) return kFPParamErr;
+	if ((f=mock_get_fork(s,get16(r->in+2)))==NULL)
+		return kFPParamErr;
+	start=get64(r->in+4);
+	len=get64(r->in+12);
+	if (r->in[1] & 0x80) {
+		if ((f->fd>=0) && (fstat(f->fd,&st)==0))
+			start+=st.st_size;
+	}
+	if ((int64_t) len==-1) len=INT64_MAX-start;
+	if (len==0) return kFPParamErr;
+
+	if (r->in[1] & ByteRangeLock_Unlock) {
+		for (i=0;i<f->num_locks;i++)
+			if ((f->locks[i].start==start) &&
+				(f->locks[i].len==len))
+				break;
+		if (i==f->num_locks)
+			return kFPRangeNotLocked;
+		f->locks[i]=f->locks[--f->num_locks];
+	} else {
+		for (i=0;i<MOCK_MAX_FORKS;i++) {
+			other=&s->forks[i];
+			if ((other->owner==NULL) || (other->cnid!=f->cnid))
+				continue;
+			for (j=0;j<other->num_locks;j++)
+				if (mock_overlaps(&other->locks[j],start,len))
+					return (other==f) ? kFPRangeOverlap :
+						kFPLockErr;
+		}
+		if ((locks=realloc(f->locks,
+			(f->num_locks+1)*sizeof(*locks)))==NULL)
+			return kFPNoMoreLocks;
+		f->locks=locks;
+		f->locks[f->num_locks].start=start;
+		f->locks[f->num_locks].len=len;
+		f->num_locks++;
+	}
+	put64(r->out,start);
+	r->len=8;
+	return kFPNoErr;
+}
+
+/* Reads and writes do their I/O without the server's mutex, so sessions
+ * don't wait on each other */
+
+static int mock_readext(struct mock_server * s, struct mock_request * r)
+{
+	struct mock_fork * f;
+	uint64_t offset, count;
+	unsigned short access=0;
+	int fd=-1;
+	ssize_t n;
+
+	if (r->in_len<20) return kFPParamErr;
+	pthread_mutex_lock(&s->mutex);
+	if ((f=mock_get_fork(s,get16(r->in+2)))) {
+		fd=f->fd;
+		access=f->access;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	if (f==NULL) return kFPParamErr;
+	if (!(access & AFP_OPENFORK_ALLOWREAD)) return kFPAccessDenied;
+
+	offset=get64(r->in+4);
+	count=get64(r->in+12);
+	if (count>MOCK_MAX_PACKET) count=MOCK_MAX_PACKET;
+	if (count>r->c->out_size-16) {
+		char * out;
+		if ((out=realloc(r->c->out,count+16))==NULL)
+			return kFPMiscErr;
+		r->c->out=out;
+		r->c->out_size=count+16;
+		r->out=(unsigned char *) out+16;
+	}
+	if (fd<0) return kFPEOFErr;
+	if ((n=pread(fd,r->out,count,offset))<0)
+		return mock_errno(errno);
+	r->len=n;
+	return ((uint64_t) n<count) ? kFPEOFErr : kFPNoErr;
+}
+
+static int mock_writeext(struct mock_server * s, struct mock_request * r)
+{
+	struct mock_fork * f;
+	uint64_t offset, count;
+	unsigned short access=0;
+	struct stat st;
+	int fd=-1;
+	ssize_t n;
+
+	if ((r->in_len<20) || (r->data_offset>r->in_len))
+		return kFPParamErr;
+	pthread_mutex_lock(&s->mutex);
+	if ((f=mock_get_fork(s,get16(r->in+2)))) {
+		fd=f->fd;
+		access=f->access;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	if (f==NULL) return kFPParamErr;
+	if ((!(access & AFP_OPENFORK_ALLOWWRITE)) || (fd<0))
+		return kFPAccessDenied;
+
+	offset=get64(r->in+4);
+	count=get64(r->in+12);
+	if (count>r->in_len-r->data_offset)
+		count=r->in_len-r->data_offset;
+	if ((r->in[1] & 0x80) && (fstat(fd,&st)==0))
+		offset+=st.st_size;
+	if ((n=pwrite(fd,r->in+r->data_offset,count,offset))<0)
+		return mock_errno(errno);
+	put64(r->out,offset+n);
+	r->len=8;
+	return kFPNoErr;
+}
+
+static int mock_afp(struct mock_server * s, struct mock_request * r)
+{
+	int rc;
+
+	if (r->in_len<1) return kFPParamErr;
+	__sync_fetch_and_add(&s->counts[r->in[0]],1);
+
+	switch (r->in[0]) {
+	case afpReadExt:
+		return mock_readext(s,r);
+	case afpWriteExt:
+		return mock_writeext(s,r);
+	}
+
+	pthread_mutex_lock(&s->mutex);
+	switch (r->in[0]) {
+	case afpLogin:
+		rc=mock_login(s,r);
+		break;
+	case afpLogout:
+	case afpCloseVol:
+	case afpFlush:
+	case afpFlushFork:
+		rc=kFPNoErr;
+		break;
+	case afpGetSrvrParms:
+		rc=mock_getsrvrparms(s,r);
+		break;
+	case afpGetSrvrMsg:
+		rc=mock_getsrvrmsg(s,r);
+		break;
+	case afpGetUserInfo:
+		rc=mock_getuserinfo(s,r);
+		break;
+	case afpOpenVol:
+		rc=mock_openvol(s,r);
+		break;
+	case afpGetVolParms:
+		rc=mock_getvolparms(s,r);
+		break;
+	case afpGetFileDirParms:
+		rc=mock_getfiledirparms(s,r);
+		break;
+	case afpSetFileParms:
+	case afpSetDirParms:
+	case afpSetFileDirParms:
+		rc=mock_setparms(s,r);
+		break;
+	case afpEnumerateExt2:
+		rc=mock_enumerate(s,r);
+		break;
+	case afpCreateFile:
+		rc=mock_createfile(s,r);
+		break;
+	case afpCreateDir:
+		rc=mock_createdir(s,r);
+		break;
+	case afpDelete:
+		rc=mock_delete(s,r);
+		break;
+	case afpMoveAndRename:
+		rc=mock_moveandrename(s,r);
+		break;
+	case afpOpenFork:
+		rc=mock_openfork(s,r);
+		break;
+	case afpCloseFork:
+		rc=mock_closefork(s,r);
+		break;
+	case afpSetForkParms:
+		rc=mock_setforkparms(s,r);
+		break;
+	case afpByteRangeLockExt:
+		rc=mock_byterangelock(s,r);
+		break;
+	default:
+		rc=kFPCallNotSupported;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return rc;
+}
+
+/* DSI */
+
+static unsigned int mock_getstatus(struct mock_server * s, unsigned char * out)
+{
+	unsigned char * p;
+	unsigned char * signature_offset, * utf8_offset;
+
+	/* Filled in below, apart from the icon, which we don't have */
+	memset(out,0,8);
+	put16(out+8,kSupportsSrvrMsg|kSupportsUTF8SrvrName);
+	p=put_pascal(out+10,MOCK_SERVER_NAME);
+	if ((p-out) & 1) p++;
+	signature_offset=p;
+	utf8_offset=p+2;
+	p+=4;
+
+	put16(out,p-out);
+	p=put_pascal(p,MOCK_SERVER_NAME);
+	put16(out+2,p-out);
+	*p++=3;
+	p=put_pascal(p,"AFPX03");
+	p=put_pascal(p,"AFP3.1");
+	p=put_pascal(p,"AFP3.2");
+	put16(out+4,p-out);
+	*p++=2;
+	p=put_pascal(p,"No User Authent");
+	p=put_pascal(p,"Cleartxt Passwrd");
+	put16(signature_offset,p-out);
+	memcpy(p,s->signature,AFP_SIGNATURE_LEN);
+	p+=AFP_SIGNATURE_LEN;
+	put16(utf8_offset,p-out);
+	*p++=0;
+	p=put_pascal(p,MOCK_SERVER_NAME);
+	return p-out;
+}
+
+static int mock_send_all(int fd, char * buf, unsigned int len)
+{
+	ssize_t n;
+
+	while (len>0) {
+		if ((n=send(fd,buf,len,MSG_NOSIGNAL))<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		buf+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+static int mock_read_all(int fd, void * buf, unsigned int len)
+{
+	char * p = buf;
+	ssize_t n;
+
+	while (len>0) {
+		if ((n=read(fd,p,len))<=0) {
+			if ((n<0) && (errno==EINTR)) continue;
+			return -1;
+		}
+		p+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+/* Sends the reply in c->out, which has len bytes after the header.  With
+ * a latency or a bandwidth set, it is queued for the sender thread
+ * instead. */
+static void mock_reply(struct mock_connection * c, struct dsi_header * request,
+	unsigned int request_len, int rc, unsigned int len)
+{
+	struct mock_server * s = c->server;
+	struct dsi_header * header = (void *) c->out;
+	unsigned int latency_us = s->latency_us;
+	uint64_t bandwidth = s->bandwidth, now, due;
+	struct mock_reply * r;
+
+	header->flags=DSI_REPLY;
+	header->command=request->command;
+	header->requestid=request->requestid;
+	header->return_code.error_code=htonl(rc);
+	header->length=htonl(len);
+	header->reserved=0;
+	len+=sizeof(*header);
+
+	pthread_mutex_lock(&c->mutex);
+	if ((latency_us==0) && (bandwidth==0) && (c->head==NULL)) {
+		pthread_mutex_unlock(&c->mutex);
+		mock_send_all(c->fd,c->out,len);
+		return;
+	}
+
+	/* The request has to finish arriving, then there's the latency,
+	 * then the reply has to wait for the link and go over it */
+	now=mock_now();
+	due=now;
+	if (bandwidth) {
+		if (c->in_busy<now) c->in_busy=now;
+		c->in_busy+=request_len*1000000000ULL/bandwidth;
+		due=c->in_busy;
+	}
+	due+=latency_us*1000ULL;
+	if (bandwidth) {
+		if (c->out_busy>due) due=c->out_busy;
+		due+=len*1000000000ULL/bandwidth;
+		c->out_busy=due;
+	}
+	if ((r=malloc(sizeof(*r)+len))==NULL) {
+		pthread_mutex_unlock(&c->mutex);
+		return;
+	}
+	r->next=NULL;
+	r->due=due;
+	r->len=len;
+	memcpy(r->data,c->out,len);
+	if (c->tail) c->tail->next=r;
+	else c->head=r;
+	c->tail=r;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+static void * mock_sender(void * other)
+{
+	struct mock_connection * c = other;
+	struct mock_reply * r;
+	struct timespec ts;
+
+	pthread_mutex_lock(&c->mutex);
+	for (;;) {
+		while ((c->head==NULL) && (!c->closing))
+			pthread_cond_wait(&c->cond,&c->mutex);
+		if (c->head==NULL) break;
+		r=c->head;
+		pthread_mutex_unlock(&c->mutex);
+
+		ts.tv_sec=r->due/1000000000ULL;
+		ts.tv_nsec=r->due%1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,
+			NULL)==EINTR);
+		mock_send_all(c->fd,r->data,r->len);
+
+		pthread_mutex_lock(&c->mutex);
+		c->head=r->next;
+		if (c->head==NULL) c->tail=NULL;
+		free(r);
+	}
+	pthread_mutex_unlock(&c->mutex);
+	return NULL;
+}
+
+static void mock_connection_done(struct mock_connection * c)
+{
+	struct mock_server * s = c->server;
+	struct mock_connection ** p;
+	struct mock_reply * r;
+	unsigned int i;
+
+	pthread_mutex_lock(&c->mutex);
+	c->closing=1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+	pthread_join(c->sender,NULL);
+	while ((r=c->head)) {
+		c->head=r->next;
+		free(r);
+	}
+
+	pthread_mutex_lock(&s->mutex);
+	for (i=0;i<MOCK_MAX_FORKS;i++)
+		if (s->forks[i].owner==c)
+			mock_close_fork(&s->forks[i]);
+	for (p=&s->connections;*p;p=&(*p)->next)
+		if (*p==c) {
+			*p=c->next;
+			break;
+		}
+	close(c->fd);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+
+	pthread_mutex_destroy(&c->mutex);
+	pthread_cond_destroy(&c->cond);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+static void * mock_connection(void * other)
+{
+	struct mock_connection * c = other;
+	struct mock_server * s = c->server;
+	struct dsi_header header;
+	struct mock_request r;
+	unsigned int len;
+	char * in;
+	int rc;
+
+	while (mock_read_all(c->fd,&header,sizeof(header))==0) {
+		len=ntohl(header.length);
+		if (len>MOCK_MAX_PACKET) break;
+		if (len>c->in_size) {
+			if ((in=realloc(c->in,len))==NULL) break;
+			c->in=in;
+			c->in_size=len;
+		}
+		if (mock_read_all(c->fd,c->in,len)) break;
+		/* Replies from the client, to attentions we never send */
+		if (header.flags!=DSI_REQUEST) continue;
+
+		memset(&r,0,sizeof(r));
+		r.c=c;
+		r.in=(unsigned char *) c->in;
+		r.in_len=len;
+		r.out=(unsigned char *) c->out+sizeof(struct dsi_header);
+
+		switch (header.command) {
+		case DSI_DSIGetStatus:
+			r.len=mock_getstatus(s,r.out);
+			rc=kFPNoErr;
+			break;
+		case DSI_DSIOpenSession:
+			r.out[0]=DSI_OPTION_SERVER_QUANTUM;
+			r.out[1]=4;
+			put32(r.out+2,s->quantum);
+			r.len=6;
+			rc=kFPNoErr;
+			break;
+		case DSI_DSICloseSession:
+			goto out;
+		case DSI_DSITickle:
+			continue;
+		case DSI_DSIWrite:
+			r.data_offset=ntohl(header.return_code.data_offset);
+			/* Fall through */
+		case DSI_DSICommand:
+			rc=mock_afp(s,&r);
+			break;
+		default:
+			continue;
+		}
+		mock_reply(c,&header,sizeof(header)+len,rc,r.len);
+	}
+out:
+	mock_connection_done(c);
+	return NULL;
+}
+
+static void * mock_acceptor(void * other)
+{
+	struct mock_server * s = other;
+	struct mock_connection * c;
+	pthread_t thread;
+	int fd, on=1;
+
+	while (!s->stopping) {
+		if ((fd=accept(s->listen_fd,NULL,NULL))<0) {
+			if (errno==EINTR) continue;
+			break;
+		}
+		if (s->stopping) {
+			close(fd);
+			break;
+		}
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+		if ((c=calloc(1,sizeof(*c)))==NULL) {
+			close(fd);
+			continue;
+		}
+		c->server=s;
+		c->fd=fd;
+		c->out_size=s->quantum+MOCK_MAX_PARAMS*64;
+		if ((c->out=malloc(c->out_size))==NULL) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		pthread_mutex_init(&c->mutex,NULL);
+		pthread_cond_init(&c->cond,NULL);
+		pthread_mutex_lock(&s->mutex);
+		c->next=s->connections;
+		s->connections=c;
+		pthread_mutex_unlock(&s->mutex);
+		pthread_create(&c->sender,NULL,mock_sender,c);
+		pthread_create(&thread,NULL,mock_connection,c);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/* Something to tell servers apart by, which stays the same for the same
+ * directory and volume */
+static void mock_signature(struct mock_server * s)
+{
+	uint64_t h1=14695981039346656037ULL, h2=1099511628211ULL;
+	const char * p;
+
+	for (p=s->root;*p;p++) {
+		h1=(h1^(unsigned char) *p)*1099511628211ULL;
+		h2=(h2^(unsigned char) *p)*14695981039346656037ULL;
+	}
+	for (p=s->volume_name;*p;p++) {
+		h1=(h1^(unsigned char) *p)*1099511628211ULL;
+		h2=(h2^(unsigned char) *p)*14695981039346656037ULL;
+	}
+	put64((unsigned char *) s->signature,h1);
+	put64((unsigned char *) s->signature+8,h2);
+}
+
+struct mock_server * mock_server_start(struct mock_server_options * options)
+{
+	struct mock_server * s;
+	struct sockaddr_in sa;
+	socklen_t len=sizeof(sa);
+	int on=1;
+
+	if ((s=calloc(1,sizeof(*s)))==NULL)
+		return NULL;
+	if (realpath(options->root ? options->root : ".",s->root)==NULL) {
+		free(s);
+		return NULL;
+	}
+	snprintf(s->volume_name,sizeof(s->volume_name),"%s",
+		options->volume_name ? options->volume_name :
+		MOCK_DEFAULT_VOLUME);
+	if (options->username) {
+		s->check_password=1;
+		snprintf(s->username,sizeof(s->username),"%s",
+			options->username);
+		snprintf(s->password,sizeof(s->password),"%s",
+			options->password ? options->password : "");
+	}
+	s->quantum=options->quantum ? options->quantum : MOCK_DEFAULT_QUANTUM;
+	s->latency_us=options->latency_us;
+	s->bandwidth=options->bandwidth;
+	mock_signature(s);
+	pthread_mutex_init(&s->mutex,NULL);
+	pthread_cond_init(&s->cond,NULL);
+
+	if ((s->listen_fd=socket(AF_INET,SOCK_STREAM,0))<0)
+		goto error;
+	setsockopt(s->listen_fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+	memset(&sa,0,sizeof(sa));
+	sa.sin_family=AF_INET;
+	sa.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	sa.sin_port=htons(options->port);
+	if ((bind(s->listen_fd,(struct sockaddr *) &sa,sizeof(sa))<0) ||
+		(listen(s->listen_fd,16)<0) ||
+		(getsockname(s->listen_fd,(struct sockaddr *) &sa,&len)<0)) {
+		close(s->listen_fd);
+		goto error;
+	}
+	s->port=ntohs(sa.sin_port);
+	if (pthread_create(&s->acceptor,NULL,mock_acceptor,s)) {
+		close(s->listen_fd);
+		goto error;
+	}
+	return s;
+
+error:
+	pthread_mutex_destroy(&s->mutex);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+	return NULL;
+}
+
+void mock_server_stop(struct mock_server * s)
+{
+	struct mock_connection * c;
+	unsigned int i;
+
+	if (!s) return;
+	s->stopping=1;
+	shutdown(s->listen_fd,SHUT_RDWR);
+	pthread_join(s->acceptor,NULL);
+	close(s->listen_fd);
+
+	/* Each connection takes itself off the list as it goes */
+	pthread_mutex_lock(&s->mutex);
+	for (c=s->connections;c;c=c->next)
+		shutdown(c->fd,SHUT_RDWR);
+	while (s->connections)
+		pthread_cond_wait(&s->cond,&s->mutex);
+	pthread_mutex_unlock(&s->mutex);
+
+	for (i=0;i<s->num_paths;i++)
+		free(s->paths[i]);
+	free(s->paths);
+	pthread_mutex_destroy(&s->mutex);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
+
+unsigned int mock_server_port(struct mock_server * s)
+{
+	return s->port;
+}
+
+void mock_server_set_link(struct mock_server * s, unsigned int latency_us,
+	uint64_t bandwidth)
+{
+	s->latency_us=latency_us;
+	s->bandwidth=bandwidth;
+}
+
+unsigned long long mock_server_count(struct mock_server * s,
+	unsigned char command)
+{
+	return s->counts[command];
+}
+
+void mock_server_reset_counts(struct mock_server * s)
+{
+	unsigned int i;
+
+	for (i=0;i<256;i++)
+		s->counts[i]=0;
+}
@@ -0,0 +1,40 @@
+#ifndef __MOCK_SERVER_H_
+#define __MOCK_SERVER_H_
+
+#include <stdint.h>
+
+/* How a mock server is set up.  Anything left as 0 or NULL gets a
+ * default. */
+struct mock_server_options {
+	/* The directory served as the only volume */
+	const char * root;
+	const char * volume_name;
+	/* If set, cleartext logins have to use these */
+	const char * username;
+	const char * password;
+	/* 0 for any free port on the loopback interface */
+	unsigned int port;
+	/* What we tell the client it can send us at once */
+	unsigned int quantum;
+	/* Added to every reply, in us */
+	unsigned int latency_us;
+	/* Bytes per second each way, or 0 for as fast as loopback goes */
+	uint64_t bandwidth;
+};
+
+struct mock_server;
+
+struct mock_server * mock_server_start(struct mock_server_options * options);
+void mock_server_stop(struct mock_server * s);
+unsigned int mock_server_port(struct mock_server * s);
+
+/* Changes the latency and bandwidth for everything from here on */
+void mock_server_set_link(struct mock_server * s, unsigned int latency_us,
+	uint64_t bandwidth);
+
+/* How many of an AFP command the server has been sent */
+unsigned long long mock_server_count(struct mock_server * s,
+	unsigned char command);
+void mock_server_reset_counts(struct mock_server * s);
+
+#endif